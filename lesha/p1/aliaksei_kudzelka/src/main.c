@@ -14,8 +14,31 @@
 #include <sys/inotify.h>
 #include <stdbool.h>
 #include <limits.h>
-#define FNV_OFFSET 14695981039346656037UL
-#define FNV_PRIME 1099511628211UL
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define MAX_PENDING_MOVES 128
+#define MOVE_PAIR_TIMEOUT_MS 500
+/* a file going to several targets is read in chunks of FANOUT_CHUNK into a
+ * ring of FANOUT_SLOTS; the slowest target may fall that far behind before
+ * reading waits for it */
+#define FANOUT_CHUNK (128 * 1024)
+#define FANOUT_SLOTS 16
+/* a directory deleted from a target is renamed into its TRASH_NAME at once,
+ * however big; a reclaimer forked off the worker empties the trashes in the
+ * background, at most TRASH_RATE entries a second */
+#define TRASH_NAME ".sop-trash"
+#define TRASH_RATE 20000
+#define TRASH_POLL_MS 1000
+#define TRASH_RETRY_MS 5000
+/* a worker that fails is forked again after 1, 2, 4 ... s, at most a minute;
+ * one that stayed up for a minute starts over at 1 s */
+#define RESTART_BACKOFF_MIN_MS 1000
+#define RESTART_BACKOFF_MAX_MS 60000
+#define RESTART_STABLE_MS 60000
 
 static volatile sig_atomic_t exit_requested = 0;
 
@@ -24,30 +47,24 @@ static struct BackupSource *backups = NULL;
 static size_t  backup_count = 0;
 static size_t  backup_capacity = 0;
 
-/*Code from this website : https://benhoyt.com/writings/hash-table-in-c/#:~:text=%23define%20FNV_OFFSET%2014695981039346656037UL,hash%3B%0A%7D
- where guy implemented his hashmap in c  */
-
-// Return 64-bit FNV-1a hash for key (NUL-terminated). See description:
-// https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
-static uint64_t hash_key(const char* key) {
-    uint64_t hash = FNV_OFFSET;
-    for (const char* p = key; *p; p++) {
-        hash ^= (uint64_t)(unsigned char)(*p);
-        hash *= FNV_PRIME;
-    }
-    return hash;
-}
-
-
 struct BackupTarget {
     char *target_path;
-    pid_t worker_pid;
     int inotify_fd;
     int active;   // 1 = running, 0 = stopped
 };
 
 struct BackupSource {
     char *source_path;
+    pid_t worker_pid;   // serves every active target, 0 if none
+    int restore_req;    // the worker reads restore requests here, -1 if none
+    int restore_rep;    // and answers them here
+    char *restoring;    // target of a restore the worker did not answer yet, NULL if none
+    int pidfd;          // readable once the worker exits, -1 if none
+    long long started_ms;     // when the worker was forked
+    long long restart_at_ms;  // when a failed worker is forked again, 0 if none
+    int backoff_ms;           // wait before the next restart
+    int restarts;
+    int stopping;             // "end" took the last target, the worker is not reaped yet
 
     struct BackupTarget *targets;
     size_t target_count;
@@ -124,8 +141,9 @@ static void msg_restore_started(const char *src, const char *target) {
     log_printf("       Backup : %s\n", target);
 }
 
-static void msg_restore_finished() {
-    log_printf("[OK] Restore completed successfully.\n");
+static void msg_restore_finished(const char *src, size_t copied, size_t skipped) {
+    log_printf("[OK] Restore of %s completed successfully (%zu files copied, %zu unchanged).\n", src, copied,
+               skipped);
 }
 
 /* ---------- List output ---------- */
@@ -216,15 +234,29 @@ static void msg_exit(void) {
     log_printf("Goodbye.\n\n");
 }
 
+static void close_restore_pipes(struct BackupSource *bs) {
+    if (bs->restore_req >= 0)
+        close(bs->restore_req);
+    if (bs->restore_rep >= 0)
+        close(bs->restore_rep);
+    bs->restore_req = -1;
+    bs->restore_rep = -1;
+}
+
 static void cleanup(void) {
     for (size_t i = 0; i < backup_count; i++) {
         struct BackupSource *bs = &backups[i];
+        if (bs->worker_pid > 0) {
+            kill(bs->worker_pid, SIGTERM);
+            waitpid(bs->worker_pid, NULL, 0);
+            bs->worker_pid = 0;
+        }
+        if (bs->pidfd >= 0)
+            close(bs->pidfd);
+        close_restore_pipes(bs);
+        free(bs->restoring);
         for (size_t j = 0; j < bs->target_count; j++) {
-            if (bs->targets[j].active) {
-                kill(bs->targets[j].worker_pid, SIGTERM);
-                waitpid(bs->targets[j].worker_pid, NULL, 0);
-                bs->targets[j].active = 0;
-            }
+            bs->targets[j].active = 0;
             free(bs->targets[j].target_path);
         }
         free(bs->targets);
@@ -378,10 +410,174 @@ static int is_subpath(const char *parent, const char *child) {
     return child[len] == '/' || child[len] == '\0';
 }
 
+/* the size + mtime quick check used by restore and reconciliation: copies
+ * carry the source mtime, so an equal size and nanosecond mtime means the file
+ * did not change since it was copied */
+static int same_file_quick(const struct stat *a, const struct stat *b) {
+    return a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* One directory of two trees compared in a single pass, under restore, the
+ * pruning of targets and the refresh of renamed copies. Both listings are read
+ * in full, sorted by name and merged, so every entry is looked at once with
+ * fstatat on the open directories instead of an lstat per side and path, and
+ * the callback may change either directory while the diff runs. */
+enum DiffKind {
+    DIFF_ADDED,   /* only in from */
+    DIFF_REMOVED, /* only in to */
+    DIFF_CHANGED, /* in both, of another type or, not a directory, failing the quick check */
+    DIFF_SAME,    /* in both; a directory is the same whatever is in it */
+};
+
+struct DiffEntry {
+    const char *name;
+    enum DiffKind kind;
+    struct stat from; /* unless DIFF_REMOVED */
+    struct stat to;   /* unless DIFF_ADDED */
+};
+
+/* a negative return stops the diff, which then returns it */
+typedef int (*diff_fn)(const struct DiffEntry *e, void *arg);
+
+struct Listing {
+    char **names; /* sorted once the listing is read */
+    size_t count;
+    size_t cap;
+};
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void listing_free(struct Listing *l) {
+    for (size_t i = 0; i < l->count; i++)
+        free(l->names[i]);
+    free(l->names);
+}
+
+static int listing_read(DIR *d, struct Listing *l) {
+    struct dirent *de;
+    errno = 0;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (l->count == l->cap) {
+            size_t cap = l->cap ? l->cap * 2 : 64;
+            char **grown = realloc(l->names, cap * sizeof(*grown));
+            if (!grown) {
+                perror("realloc");
+                return -1;
+            }
+            l->names = grown;
+            l->cap = cap;
+        }
+        if (!(l->names[l->count] = strdup(de->d_name))) {
+            perror("strdup");
+            return -1;
+        }
+        l->count++;
+        errno = 0;
+    }
+    if (errno != 0) {
+        perror("readdir");
+        return -1;
+    }
+    if (l->count > 1)
+        qsort(l->names, l->count, sizeof(*l->names), name_cmp);
+    return 0;
+}
+
+/* 1 if name is in d, 0 if not (or d is NULL), -1 on errors */
+static int diff_stat(DIR *d, const char *name, struct stat *st) {
+    if (!d)
+        return 0;
+    if (fstatat(dirfd(d), name, st, AT_SYMLINK_NOFOLLOW) == 0)
+        return 1;
+    if (errno == ENOENT)
+        return 0;
+    perror("fstatat");
+    return -1;
+}
+
+/* reports every entry of from_dir and to_dir once, in name order; a to_dir
+ * that does not exist is empty and entries gone by the time they are looked
+ * at are skipped */
+static int dir_diff(const char *from_dir, const char *to_dir, diff_fn fn, void *arg) {
+    DIR *from = opendir(from_dir);
+    if (!from)
+        return -1;
+    DIR *to = opendir(to_dir);
+    if (!to && errno != ENOENT) {
+        closedir(from);
+        return -1;
+    }
+
+    struct Listing fl = {0}, tl = {0};
+    int rc = listing_read(from, &fl);
+    if (rc == 0 && to)
+        rc = listing_read(to, &tl);
+
+    size_t i = 0, j = 0;
+    while (rc == 0 && (i < fl.count || j < tl.count)) {
+        int c = i == fl.count ? 1 : j == tl.count ? -1 : strcmp(fl.names[i], tl.names[j]);
+        struct DiffEntry e;
+        e.name = c <= 0 ? fl.names[i] : tl.names[j];
+        int has_from = c <= 0 ? diff_stat(from, e.name, &e.from) : 0;
+        int has_to = c >= 0 ? diff_stat(to, e.name, &e.to) : 0;
+        i += c <= 0;
+        j += c >= 0;
+        if (has_from < 0 || has_to < 0) {
+            rc = -1;
+            break;
+        }
+        if (has_from && has_to) {
+            int same = (e.from.st_mode & S_IFMT) == (e.to.st_mode & S_IFMT) &&
+                       (S_ISDIR(e.from.st_mode) || same_file_quick(&e.from, &e.to));
+            e.kind = same ? DIFF_SAME : DIFF_CHANGED;
+        } else if (has_from) {
+            e.kind = DIFF_ADDED;
+        } else if (has_to) {
+            e.kind = DIFF_REMOVED;
+        } else {
+            continue;
+        }
+        int r = fn(&e, arg);
+        if (r < 0)
+            rc = r;
+    }
+
+    listing_free(&fl);
+    listing_free(&tl);
+    closedir(from);
+    if (to)
+        closedir(to);
+    return rc;
+}
+
+/* gives a copy the mode, atime/mtime and, when running as root, the owner of
+ * the original */
+static void copy_metadata(int fd, const struct stat *st) {
+    if (geteuid() == 0 && fchown(fd, st->st_uid, st->st_gid) == -1)
+        perror("fchown");
+    if (fchmod(fd, st->st_mode & 07777) == -1)
+        perror("fchmod");
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    if (futimens(fd, times) == -1)
+        perror("futimens");
+}
+
 static int copy_file_contents(const char *src, const char *dst, mode_t mode) {
     int in_fd = open(src, O_RDONLY);
     if (in_fd < 0)
         return -1;
+    /* taken before reading, so a change made during the copy shows up as a
+     * different mtime */
+    struct stat st;
+    if (fstat(in_fd, &st) == -1) {
+        close(in_fd);
+        return -1;
+    }
 
     int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode);
     if (out_fd < 0) {
@@ -403,6 +599,8 @@ static int copy_file_contents(const char *src, const char *dst, mode_t mode) {
             off += w;
         }
     }
+    if (r == 0)
+        copy_metadata(out_fd, &st);
 
     close(in_fd);
     close(out_fd);
@@ -442,7 +640,17 @@ static int copy_symlink(const char *source_root, const char *target_root,
         return -1;
 
     unlink(dst_path);
-    return symlink(adjusted, dst_path);
+    if (symlink(adjusted, dst_path) == -1)
+        return -1;
+
+    struct stat st;
+    if (lstat(src_path, &st) == 0) {
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        utimensat(AT_FDCWD, dst_path, times, AT_SYMLINK_NOFOLLOW);
+        if (geteuid() == 0)
+            lchown(dst_path, st.st_uid, st.st_gid);
+    }
+    return 0;
 }
 
 static int copy_directory(const char *source_root, const char *target_root,
@@ -484,336 +692,2139 @@ static int copy_entry(const char *source_root, const char *target_root,
         return copy_symlink(source_root, target_root, src_path, dst_path);
     else if (S_ISDIR(st.st_mode))
         return copy_directory(source_root, target_root, src_path, dst_path);
-    else if (S_ISREG(st.st_mode))
+    else if (S_ISREG(st.st_mode)) {
+        /* a resumed backup finds most of its files already in place */
+        struct stat dst_st;
+        if (lstat(dst_path, &dst_st) == 0 && S_ISREG(dst_st.st_mode) && same_file_quick(&st, &dst_st))
+            return 0;
         return copy_file_contents(src_path, dst_path, st.st_mode);
+    }
     return 0;
 }
 
-struct WatchEntry {
-    int wd;
-    char path[4096];
-    struct WatchEntry *next;
-};
+/* ---------- Fan-out copy ---------- */
 
-static struct WatchEntry *watch_list_append(struct WatchEntry **head, int wd, const char *path) {
-    struct WatchEntry *node = malloc(sizeof(struct WatchEntry));
-    if (!node)
-        return NULL;
-    node->wd = wd;
-    snprintf(node->path, sizeof(node->path), "%s", path);
-    node->next = *head;
-    *head = node;
-    return node;
+/* path of rel under root; -1 if it does not fit */
+static int join_rel(char *out, size_t out_sz, const char *root, const char *rel) {
+    int n;
+    if (rel[0])
+        n = snprintf(out, out_sz, "%s/%s", root, rel);
+    else
+        n = snprintf(out, out_sz, "%s", root);
+    return (n < 0 || (size_t)n >= out_sz) ? -1 : 0;
 }
 
-static void watch_list_free(struct WatchEntry *head) {
-    while (head) {
-        struct WatchEntry *tmp = head->next;
-        free(head);
-        head = tmp;
-    }
+/* whether rel is a target's trash or inside it; no backup includes it */
+static int is_trash_rel(const char *rel) {
+    size_t len = strlen(TRASH_NAME);
+    return strncmp(rel, TRASH_NAME, len) == 0 && (rel[len] == '\0' || rel[len] == '/');
 }
 
-static const char *watch_list_find(struct WatchEntry *head, int wd) {
-    for (struct WatchEntry *n = head; n; n = n->next) {
-        if (n->wd == wd)
-            return n->path;
-    }
-    return NULL;
+/* A source entry named like a target's trash is never mirrored: "add" refuses
+ * such sources, and one that shows up later is reported when it is skipped. */
+static void report_reserved(const char *source_root, const char *rel) {
+    if (strcmp(rel, TRASH_NAME) == 0)
+        fprintf(stderr, "%s/%s has the name of a target's trash, not mirrored\n", source_root, rel);
 }
 
-static int remove_path_recursive(const char *path) {
-    struct stat st;
-    if (lstat(path, &st) == -1)
-        return (errno == ENOENT) ? 0 : -1;
-
-    if (S_ISDIR(st.st_mode)) {
-        DIR *d = opendir(path);
-        if (!d)
-            return -1;
-        struct dirent *de;
-        while ((de = readdir(d)) != NULL) {
-            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+static int write_all(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t w = write(fd, buf + off, len - off);
+        if (w < 0) {
+            if (errno == EINTR)
                 continue;
-            char child[4096];
-            snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
-            if (remove_path_recursive(child) != 0) {
-                closedir(d);
-                return -1;
-            }
-        }
-        closedir(d);
-        if (rmdir(path) != 0)
-            return -1;
-    } else {
-        if (unlink(path) != 0)
             return -1;
+        }
+        off += (size_t)w;
     }
     return 0;
 }
 
-static int watch_directory_tree(int fd, const char *path, struct WatchEntry **list) {
-    int wd = inotify_add_watch(fd, path,
-                               IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM |
-                                   IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_CLOSE_WRITE |
-                                   IN_MOVE_SELF);
-    if (wd < 0)
-        return -1;
-    if (!watch_list_append(list, wd, path))
-        return -1;
+/* chunks read from the source; slot i % FANOUT_SLOTS holds chunk i until every
+ * writer is past it */
+struct FanoutRing {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;  /* a chunk was read, or reading ended */
+    pthread_cond_t drained; /* a writer finished a chunk */
+    char *data;
+    size_t len[FANOUT_SLOTS];
+    size_t produced;
+    int done;
+};
 
-    DIR *d = opendir(path);
-    if (!d)
-        return -1;
-    struct dirent *de;
-    while ((de = readdir(d)) != NULL) {
-        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
-            continue;
-        char child[4096];
-        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
-        if (de->d_type == DT_DIR) {
-            watch_directory_tree(fd, child, list);
-        }
-    }
-    closedir(d);
-    return 0;
-}
+struct FanoutWriter {
+    struct FanoutRing *ring;
+    pthread_t thread;
+    int fd;
+    int running;
+    int failed;
+    size_t consumed;
+};
 
-static int sync_directories(const char *source_root, const char *target_root) {
-    struct stat st;
-    if (stat(source_root, &st) == -1)
-        return -1;
-    if (!S_ISDIR(st.st_mode))
-        return -1;
-    if (mkdir(target_root, 0755) == -1 && errno != EEXIST)
-        return -1;
-    return copy_directory(source_root, target_root, source_root, target_root);
+/* a failed writer keeps consuming without writing, so it never holds the
+ * reader back */
+static void *fanout_writer(void *arg) {
+    struct FanoutWriter *w = arg;
+    struct FanoutRing *ring = w->ring;
+    pthread_mutex_lock(&ring->lock);
+    while (1) {
+        while (w->consumed == ring->produced && !ring->done)
+            pthread_cond_wait(&ring->filled, &ring->lock);
+        if (w->consumed == ring->produced)
+            break;
+        size_t slot = w->consumed % FANOUT_SLOTS;
+        size_t len = ring->len[slot];
+        pthread_mutex_unlock(&ring->lock);
+
+        if (!w->failed && write_all(w->fd, ring->data + slot * FANOUT_CHUNK, len) != 0)
+            w->failed = 1;
+
+        pthread_mutex_lock(&ring->lock);
+        w->consumed++;
+        pthread_cond_signal(&ring->drained);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
 }
 
-static void relative_from_root(const char *root, const char *path, char *out, size_t out_sz) {
-    size_t root_len = strlen(root);
-    if (strncmp(root, path, root_len) == 0) {
-        const char *p = path + root_len;
-        if (*p == '/')
-            p++;
-        snprintf(out, out_sz, "%s", p);
-    } else {
-        snprintf(out, out_sz, "%s", path);
+/* chunk count of the writer furthest behind; called with the lock held */
+static size_t fanout_slowest(const struct FanoutWriter *writers, size_t n, size_t produced) {
+    size_t slowest = produced;
+    for (size_t i = 0; i < n; i++) {
+        if (writers[i].running && writers[i].consumed < slowest)
+            slowest = writers[i].consumed;
     }
+    return slowest;
 }
 
-static void mirror_event_loop(const char *source_root, const char *target_root) {
-    int fd = inotify_init();
-    if (fd < 0)
-        _exit(1);
+/* one writer thread per copy; returns -1 if reading the source failed */
+static int fanout_ring_copy(int in_fd, struct FanoutWriter *writers, size_t n) {
+    struct FanoutRing ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.data = malloc((size_t)FANOUT_SLOTS * FANOUT_CHUNK);
+    if (!ring.data)
+        return -1;
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.filled, NULL);
+    pthread_cond_init(&ring.drained, NULL);
 
-    struct WatchEntry *watchers = NULL;
-    if (watch_directory_tree(fd, source_root, &watchers) != 0) {
-        watch_list_free(watchers);
-        close(fd);
-        _exit(1);
+    for (size_t i = 0; i < n; i++) {
+        writers[i].ring = &ring;
+        if (writers[i].failed)
+            continue;
+        if (pthread_create(&writers[i].thread, NULL, fanout_writer, &writers[i]) != 0) {
+            perror("pthread_create");
+            writers[i].failed = 1;
+            continue;
+        }
+        writers[i].running = 1;
     }
 
-    char buf[4096];
+    ssize_t r;
     while (1) {
-        if (exit_requested>0) {
-            watch_list_free(watchers);
-            close(fd);
-            exit(0);
+        pthread_mutex_lock(&ring.lock);
+        while (ring.produced - fanout_slowest(writers, n, ring.produced) == FANOUT_SLOTS)
+            pthread_cond_wait(&ring.drained, &ring.lock);
+        size_t slot = ring.produced % FANOUT_SLOTS;
+        pthread_mutex_unlock(&ring.lock);
+
+        /* every writer is past this slot, so it can be filled unlocked */
+        r = read(in_fd, ring.data + slot * FANOUT_CHUNK, FANOUT_CHUNK);
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        pthread_mutex_lock(&ring.lock);
+        if (r > 0) {
+            ring.len[slot] = (size_t)r;
+            ring.produced++;
+        } else {
+            ring.done = 1;
         }
-        ssize_t len = read(fd, buf, sizeof(buf));
-        if (len < 0) {
-            if (errno == EINTR) {
-                errno=0;
-                continue;
-            }
+        pthread_cond_broadcast(&ring.filled);
+        pthread_mutex_unlock(&ring.lock);
+        if (r <= 0)
             break;
-        }
+    }
 
-        ssize_t offset = 0;
-        while (offset < len) {
-            if (exit_requested>0) {
-                watch_list_free(watchers);
-                close(fd);
-                exit(0);
-            }
-            struct inotify_event *ev = (struct inotify_event *)(buf + offset);
-            const char *base = watch_list_find(watchers, ev->wd);
-            if (!base) {
-                offset += sizeof(struct inotify_event) + ev->len;
-                continue;
-            }
+    for (size_t i = 0; i < n; i++) {
+        if (writers[i].running)
+            pthread_join(writers[i].thread, NULL);
+        writers[i].running = 0;
+    }
+    pthread_cond_destroy(&ring.drained);
+    pthread_cond_destroy(&ring.filled);
+    pthread_mutex_destroy(&ring.lock);
+    free(ring.data);
+    return (r < 0) ? -1 : 0;
+}
 
-            char src_path[4096];
-            if (ev->len && ev->name[0])
-                snprintf(src_path, sizeof(src_path), "%s/%s", base, ev->name);
-            else
-                snprintf(src_path, sizeof(src_path), "%s", base);
+/* copies src to every path in dsts, reading it once. Small files, or a single
+ * copy, go through one buffer; larger ones through the ring so a slow target
+ * only stalls the others once it is a full ring behind. Returns the number of
+ * copies that failed, or -1 if the source could not be read. */
+static int fanout_copy_file(const char *src, char **dsts, size_t n) {
+    int in_fd = open(src, O_RDONLY);
+    if (in_fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(in_fd, &st) == -1) {
+        close(in_fd);
+        return -1;
+    }
 
-            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
-                /* source removed; stop worker */
-                watch_list_free(watchers);
-                close(fd);
-                _exit(0);
-            }
+    struct FanoutWriter *writers = calloc(n, sizeof(*writers));
+    if (!writers) {
+        close(in_fd);
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        writers[i].fd = open(dsts[i], O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+        writers[i].failed = writers[i].fd < 0;
+    }
 
-            char rel[4096];
-            relative_from_root(source_root, src_path, rel, sizeof(rel));
-            char dst_path[4096];
-            int n;
-            if (strlen(rel) > 0)
-                n = snprintf(dst_path, sizeof(dst_path), "%s/%s", target_root, rel);
-            else
-                n = snprintf(dst_path, sizeof(dst_path), "%s", target_root);
-            if (n < 0 || (size_t)n >= sizeof(dst_path)) {
-                offset += sizeof(struct inotify_event) + ev->len;
-                continue;
+    int rc = 0;
+    if (n > 1 && st.st_size > FANOUT_CHUNK) {
+        rc = fanout_ring_copy(in_fd, writers, n);
+    } else {
+        char *buf = malloc(FANOUT_CHUNK);
+        ssize_t r = -1;
+        while (buf && (r = read(in_fd, buf, FANOUT_CHUNK)) != 0) {
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
             }
-
-            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
-                remove_path_recursive(dst_path);
-            } else {
-                char *slash = strrchr(dst_path, '/');
-                if (slash) {
-                    *slash = '\0';
-                    make_dir_recursive(dst_path, 0755);
-                    *slash = '/';
-                }
-
-                if (ev->mask & IN_ISDIR) {
-                    copy_directory(source_root, target_root, src_path, dst_path);
-                    watch_directory_tree(fd, src_path, &watchers);
-                } else {
-                    copy_entry(source_root, target_root, src_path, dst_path);
-                }
+            for (size_t i = 0; i < n; i++) {
+                if (!writers[i].failed && write_all(writers[i].fd, buf, (size_t)r) != 0)
+                    writers[i].failed = 1;
             }
-
-            offset += sizeof(struct inotify_event) + ev->len;
         }
+        free(buf);
+        rc = (r < 0) ? -1 : 0;
     }
 
-    watch_list_free(watchers);
-    close(fd);
-    _exit(1);
+    int failed = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (writers[i].fd < 0) {
+            failed++;
+            continue;
+        }
+        if (rc == 0 && !writers[i].failed)
+            copy_metadata(writers[i].fd, &st);
+        else
+            failed++;
+        close(writers[i].fd);
+    }
+    free(writers);
+    close(in_fd);
+    return (rc < 0) ? -1 : failed;
 }
 
-static int remove_if_missing(const char *source_root, const char *target_root,
-                             const char *src_path, const char *rel_path) {
-    char target_path[4096];
-    snprintf(target_path, sizeof(target_path), "%s/%s", target_root, rel_path);
-
+/* copies an entry of the source into every target, walking and reading the
+ * source once; files that pass the quick check in a target are left alone
+ * there */
+static int fanout_entry(const char *source_root, char **target_roots, size_t n,
+                        const char *src_path, const char *rel) {
     struct stat st;
-    if (lstat(target_path, &st) == -1) {
-        /* target side missing => remove from source */
-        if (lstat(src_path, &st) == -1)
-            return 0;
+    if (lstat(src_path, &st) == -1)
+        return -1;
 
-        if (S_ISDIR(st.st_mode)) {
-            DIR *d = opendir(src_path);
-            if (d) {
-                struct dirent *de;
-                while ((de = readdir(d)) != NULL) {
-                    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
-                        continue;
-                    char child_src[4096];
-                    char child_rel[4096];
-                    snprintf(child_src, sizeof(child_src), "%s/%s", src_path, de->d_name);
-                    snprintf(child_rel, sizeof(child_rel), "%s/%s", rel_path, de->d_name);
-                    remove_if_missing(source_root, target_root, child_src, child_rel);
-                }
-                closedir(d);
-            }
-            rmdir(src_path);
-        } else {
-            unlink(src_path);
-        }
-        return 0;
+    char (*dst)[4096] = malloc(n * sizeof(*dst));
+    char **stale = malloc(n * sizeof(*stale));
+    if (!dst || !stale) {
+        free(dst);
+        free(stale);
+        return -1;
+    }
+    size_t stale_count = 0;
+    int rc = 0;
+    for (size_t i = 0; i < n && rc == 0; i++) {
+        if (join_rel(dst[i], sizeof(dst[i]), target_roots[i], rel) != 0)
+            rc = -1;
     }
 
-    if (S_ISDIR(st.st_mode)) {
-        DIR *d = opendir(src_path);
+    if (rc != 0) {
+        /* name too long for a target */
+    } else if (S_ISLNK(st.st_mode)) {
+        for (size_t i = 0; i < n; i++) {
+            if (copy_symlink(source_root, target_roots[i], src_path, dst[i]) != 0)
+                rc = -1;
+        }
+    } else if (S_ISDIR(st.st_mode)) {
+        for (size_t i = 0; i < n; i++) {
+            if (mkdir(dst[i], 0755) == -1 && errno != EEXIST)
+                rc = -1;
+        }
+        DIR *d = rc == 0 ? opendir(src_path) : NULL;
         if (!d)
-            return -1;
+            rc = -1;
         struct dirent *de;
-        while ((de = readdir(d)) != NULL) {
+        while (rc == 0 && (de = readdir(d)) != NULL) {
             if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
                 continue;
+            if (!rel[0] && is_trash_rel(de->d_name)) {
+                report_reserved(source_root, de->d_name);
+                continue;
+            }
             char child_src[4096];
             char child_rel[4096];
             snprintf(child_src, sizeof(child_src), "%s/%s", src_path, de->d_name);
-            snprintf(child_rel, sizeof(child_rel), "%s/%s", rel_path, de->d_name);
-            if (remove_if_missing(source_root, target_root, child_src, child_rel) != 0) {
-                closedir(d);
-                return -1;
-            }
+            if (rel[0])
+                snprintf(child_rel, sizeof(child_rel), "%s/%s", rel, de->d_name);
+            else
+                snprintf(child_rel, sizeof(child_rel), "%s", de->d_name);
+            rc = fanout_entry(source_root, target_roots, n, child_src, child_rel);
         }
-        closedir(d);
+        if (d)
+            closedir(d);
+    } else if (S_ISREG(st.st_mode)) {
+        for (size_t i = 0; i < n; i++) {
+            struct stat dst_st;
+            if (lstat(dst[i], &dst_st) == 0 && S_ISREG(dst_st.st_mode) && same_file_quick(&st, &dst_st))
+                continue;
+            stale[stale_count++] = dst[i];
+        }
+        if (stale_count > 0 && fanout_copy_file(src_path, stale, stale_count) != 0)
+            rc = -1;
     }
-    return 0;
+
+    free(stale);
+    free(dst);
+    return rc;
 }
 
-static unsigned long file_hash(const char *path) {
-    int fd = open(path, O_RDONLY);
-    if (fd < 0)
-        return 0;
-    unsigned long hash = 0;
-    char buf[4096];
-    ssize_t r;
-    while ((r = read(fd, buf, sizeof(buf))) > 0) {
-        for (ssize_t i = 0; i < r; i++) {
-            hash += (long)hash_key(buf);
-            hash%=LONG_MAX;
-        }
-    }
+/* A watched directory is kept as its own name and the index of the directory
+ * it is in, so renaming a directory touches a single entry and full paths are
+ * only built when an event needs one. Entry 0 is the source root, named by
+ * its whole path. Names live once each in one arena. */
+struct WatchEntry {
+    int wd;        /* -1 for a free entry */
+    int parent;    /* -1 for the root; chains free entries */
+    uint32_t name; /* offset in names */
+};
+
+struct WatchTree {
+    struct WatchEntry *list;
+    int count; /* used so far, free entries included */
+    int capacity;
+    int free_head;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    size_t names_kept;    /* arena size after the last rebuild */
+    uint32_t *name_index; /* offset + 1 of every name, 0 = empty slot */
+    size_t index_cap;
+    size_t index_used;
+    /* entry + 1 of every live entry, 0 = empty slot, by (parent, name) and
+     * by wd; both have slots_cap slots */
+    int *child_slots;
+    int *wd_slots;
+    size_t slots_cap;
+    int live;
+};
+
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h;
+}
+
+/* offset of name in the arena, -1 if it was never interned */
+static long watch_name_find(const struct WatchTree *t, const char *name) {
+    if (t->index_cap == 0)
+        return -1;
+    size_t slot = name_hash(name) & (t->index_cap - 1);
+    while (t->name_index[slot] != 0) {
+        uint32_t off = t->name_index[slot] - 1;
+        if (strcmp(t->names + off, name) == 0)
+            return (long)off;
+        slot = (slot + 1) & (t->index_cap - 1);
+    }
+    return -1;
+}
+
+/* offset of name in the arena, added the first time it is seen */
+static long watch_name_intern(struct WatchTree *t, const char *name) {
+    long found = watch_name_find(t, name);
+    if (found >= 0)
+        return found;
+
+    /* at most half full, so probes stay short */
+    if ((t->index_used + 1) * 2 > t->index_cap) {
+        size_t cap = t->index_cap ? t->index_cap * 2 : 256;
+        uint32_t *index = calloc(cap, sizeof(*index));
+        if (!index)
+            return -1;
+        for (size_t i = 0; i < t->index_cap; i++) {
+            if (t->name_index[i] == 0)
+                continue;
+            size_t j = name_hash(t->names + t->name_index[i] - 1) & (cap - 1);
+            while (index[j] != 0)
+                j = (j + 1) & (cap - 1);
+            index[j] = t->name_index[i];
+        }
+        free(t->name_index);
+        t->name_index = index;
+        t->index_cap = cap;
+    }
+
+    size_t len = strlen(name);
+    if (t->names_len + len + 1 > t->names_cap) {
+        size_t cap = t->names_cap ? t->names_cap * 2 : 4096;
+        while (cap < t->names_len + len + 1)
+            cap *= 2;
+        char *names = cap <= UINT32_MAX ? realloc(t->names, cap) : NULL;
+        if (!names)
+            return -1;
+        t->names = names;
+        t->names_cap = cap;
+    }
+    uint32_t off = (uint32_t)t->names_len;
+    memcpy(t->names + off, name, len + 1);
+    t->names_len += len + 1;
+
+    size_t slot = name_hash(name) & (t->index_cap - 1);
+    while (t->name_index[slot] != 0)
+        slot = (slot + 1) & (t->index_cap - 1);
+    t->name_index[slot] = off + 1;
+    t->index_used++;
+    return (long)off;
+}
+
+static size_t child_hash(int parent, uint32_t name) {
+    uint64_t key = ((uint64_t)(uint32_t)parent << 32) | name;
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static size_t wd_hash(int wd) {
+    return (size_t)(((uint64_t)(uint32_t)wd * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static size_t slot_hash(const struct WatchTree *t, const int *slots, int i) {
+    const struct WatchEntry *e = &t->list[i];
+    return slots == t->wd_slots ? wd_hash(e->wd) : child_hash(e->parent, e->name);
+}
+
+static void slots_insert(struct WatchTree *t, int *slots, int i) {
+    size_t mask = t->slots_cap - 1;
+    size_t s = slot_hash(t, slots, i) & mask;
+    while (slots[s] != 0)
+        s = (s + 1) & mask;
+    slots[s] = i + 1;
+}
+
+/* takes entry i out while its key is still the one it went in with; what
+ * was probed past it moves back so no lookup stops short of it */
+static void slots_erase(struct WatchTree *t, int *slots, int i) {
+    size_t mask = t->slots_cap - 1;
+    size_t s = slot_hash(t, slots, i) & mask;
+    while (slots[s] != i + 1) {
+        if (slots[s] == 0)
+            return;
+        s = (s + 1) & mask;
+    }
+    for (size_t j = (s + 1) & mask; slots[j] != 0; j = (j + 1) & mask) {
+        size_t home = slot_hash(t, slots, slots[j] - 1) & mask;
+        /* stays unless its home is cyclically in (s, j] */
+        if (s <= j ? (home <= s || home > j) : (home <= s && home > j)) {
+            slots[s] = slots[j];
+            s = j;
+        }
+    }
+    slots[s] = 0;
+}
+
+/* both indexes again, with cap slots, from the live entries */
+static int slots_rebuild(struct WatchTree *t, size_t cap) {
+    int *child = calloc(cap, sizeof(*child));
+    int *wds = calloc(cap, sizeof(*wds));
+    if (!child || !wds) {
+        free(child);
+        free(wds);
+        return -1;
+    }
+    free(t->child_slots);
+    free(t->wd_slots);
+    t->child_slots = child;
+    t->wd_slots = wds;
+    t->slots_cap = cap;
+    for (int i = 0; i < t->count; i++) {
+        if (t->list[i].wd >= 0) {
+            slots_insert(t, child, i);
+            slots_insert(t, wds, i);
+        }
+    }
+    return 0;
+}
+
+/* names are not freed one by one: once the arena has doubled since it was
+ * last rebuilt, it is rebuilt from the live entries */
+static void watch_names_compact(struct WatchTree *t) {
+    if (t->names_len < 64 * 1024 || t->names_len < 2 * t->names_kept)
+        return;
+    struct WatchTree fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    uint32_t *moved = malloc((size_t)t->count * sizeof(*moved) + 1);
+    /* entries are found by their name offsets, which are about to change */
+    int *child = calloc(t->slots_cap, sizeof(*child));
+    if (!moved || !child) {
+        free(moved);
+        free(child);
+        return;
+    }
+    for (int i = 0; i < t->count; i++) {
+        if (t->list[i].wd < 0)
+            continue;
+        long off = watch_name_intern(&fresh, t->names + t->list[i].name);
+        if (off < 0) {
+            free(moved);
+            free(child);
+            free(fresh.names);
+            free(fresh.name_index);
+            return;
+        }
+        moved[i] = (uint32_t)off;
+    }
+    for (int i = 0; i < t->count; i++) {
+        if (t->list[i].wd >= 0)
+            t->list[i].name = moved[i];
+    }
+    free(moved);
+    free(t->names);
+    free(t->name_index);
+    t->names = fresh.names;
+    t->names_len = fresh.names_len;
+    t->names_cap = fresh.names_cap;
+    t->names_kept = fresh.names_len;
+    t->name_index = fresh.name_index;
+    t->index_cap = fresh.index_cap;
+    t->index_used = fresh.index_used;
+    free(t->child_slots);
+    t->child_slots = child;
+    for (int i = 0; i < t->count; i++) {
+        if (t->list[i].wd >= 0)
+            slots_insert(t, child, i);
+    }
+}
+
+static int watch_tree_child(const struct WatchTree *t, int parent, uint32_t name) {
+    if (t->slots_cap == 0)
+        return -1;
+    size_t mask = t->slots_cap - 1;
+    for (size_t s = child_hash(parent, name) & mask; t->child_slots[s] != 0; s = (s + 1) & mask) {
+        int i = t->child_slots[s] - 1;
+        if (t->list[i].parent == parent && t->list[i].name == name)
+            return i;
+    }
+    return -1;
+}
+
+/* entry watching path, or -1 */
+static int watch_tree_lookup(const struct WatchTree *t, const char *path) {
+    if (t->count == 0 || t->list[0].wd < 0)
+        return -1;
+    const char *root = t->names + t->list[0].name;
+    size_t root_len = strlen(root);
+    if (strncmp(path, root, root_len) != 0 || (path[root_len] != '\0' && path[root_len] != '/'))
+        return -1;
+
+    int cur = 0;
+    const char *p = path + root_len;
+    while (*p) {
+        while (*p == '/')
+            p++;
+        size_t len = strcspn(p, "/");
+        if (len == 0)
+            break;
+        char name[NAME_MAX + 1];
+        if (len > NAME_MAX)
+            return -1;
+        memcpy(name, p, len);
+        name[len] = '\0';
+        long off = watch_name_find(t, name);
+        if (off < 0)
+            return -1;
+        cur = watch_tree_child(t, cur, (uint32_t)off);
+        if (cur < 0)
+            return -1;
+        p += len;
+    }
+    return cur;
+}
+
+/* entry of the directory path is in, *name set to its last component */
+static int watch_tree_parent(const struct WatchTree *t, const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+    char dir[4096];
+    if (!slash || (size_t)(slash - path) >= sizeof(dir))
+        return -1;
+    memcpy(dir, path, (size_t)(slash - path));
+    dir[slash - path] = '\0';
+    *name = slash + 1;
+    return watch_tree_lookup(t, dir);
+}
+
+/* builds the path of entry i from the names up to the root */
+static int watch_tree_path(const struct WatchTree *t, int i, char *buf, size_t size) {
+    size_t len = 0;
+    for (int n = i; n >= 0; n = t->list[n].parent)
+        len += strlen(t->names + t->list[n].name) + (t->list[n].parent >= 0 ? 1 : 0);
+    if (len + 1 > size)
+        return -1;
+    buf[len] = '\0';
+    for (int n = i; n >= 0; n = t->list[n].parent) {
+        const char *name = t->names + t->list[n].name;
+        size_t name_len = strlen(name);
+        len -= name_len;
+        memcpy(buf + len, name, name_len);
+        if (t->list[n].parent >= 0)
+            buf[--len] = '/';
+    }
+    return 0;
+}
+
+static int watch_tree_find(const struct WatchTree *t, int wd) {
+    if (t->slots_cap == 0)
+        return -1;
+    size_t mask = t->slots_cap - 1;
+    for (size_t s = wd_hash(wd) & mask; t->wd_slots[s] != 0; s = (s + 1) & mask) {
+        int i = t->wd_slots[s] - 1;
+        if (t->list[i].wd == wd)
+            return i;
+    }
+    return -1;
+}
+
+static int watch_tree_is_under(const struct WatchTree *t, int i, int top) {
+    for (int n = i; n >= 0; n = t->list[n].parent) {
+        if (n == top)
+            return 1;
+    }
+    return 0;
+}
+
+/* stops watching entry top and everything below it; entries are marked
+ * first, since freeing one reuses its parent link */
+static void watch_tree_remove_at(int fd, struct WatchTree *t, int top) {
+    for (int i = 0; i < t->count; i++) {
+        if (t->list[i].wd >= 0 && watch_tree_is_under(t, i, top)) {
+            inotify_rm_watch(fd, t->list[i].wd);
+            slots_erase(t, t->child_slots, i);
+            slots_erase(t, t->wd_slots, i);
+            t->list[i].wd = -2;
+        }
+    }
+    for (int i = 0; i < t->count; i++) {
+        if (t->list[i].wd == -2) {
+            t->list[i].wd = -1;
+            t->list[i].parent = t->free_head;
+            t->free_head = i;
+            t->live--;
+        }
+    }
+    watch_names_compact(t);
+}
+
+static int watch_tree_add(int fd, struct WatchTree *t, int wd, int parent, const char *name) {
+    int i = watch_tree_find(t, wd);
+    /* something left at this name is a directory that was replaced; it goes
+     * before interning, which may move the names */
+    long off = watch_name_find(t, name);
+    int stale = off >= 0 ? watch_tree_child(t, parent, (uint32_t)off) : -1;
+    if (stale >= 0 && stale != i)
+        watch_tree_remove_at(fd, t, stale);
+    off = watch_name_intern(t, name);
+    if (off < 0)
+        return -1;
+
+    if (i >= 0) {
+        slots_erase(t, t->child_slots, i);
+        t->list[i].parent = parent;
+        t->list[i].name = (uint32_t)off;
+        slots_insert(t, t->child_slots, i);
+        return i;
+    }
+    /* at most half full, so probes stay short */
+    if ((size_t)(t->live + 1) * 2 > t->slots_cap &&
+        slots_rebuild(t, t->slots_cap ? t->slots_cap * 2 : 128) < 0)
+        return -1;
+    if (t->free_head >= 0) {
+        i = t->free_head;
+        t->free_head = t->list[i].parent;
+    } else {
+        if (t->count == t->capacity) {
+            int cap = t->capacity ? t->capacity * 2 : 64;
+            struct WatchEntry *list = realloc(t->list, (size_t)cap * sizeof(*list));
+            if (!list)
+                return -1;
+            t->list = list;
+            t->capacity = cap;
+        }
+        i = t->count++;
+    }
+    t->list[i].wd = wd;
+    t->list[i].parent = parent;
+    t->list[i].name = (uint32_t)off;
+    slots_insert(t, t->child_slots, i);
+    slots_insert(t, t->wd_slots, i);
+    t->live++;
+    return i;
+}
+
+static void watch_tree_free(struct WatchTree *t) {
+    free(t->list);
+    free(t->names);
+    free(t->name_index);
+    free(t->child_slots);
+    free(t->wd_slots);
+    memset(t, 0, sizeof(*t));
+    t->free_head = -1;
+}
+
+static int remove_path_recursive(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) == -1)
+        return (errno == ENOENT) ? 0 : -1;
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        if (!d)
+            return -1;
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+            if (remove_path_recursive(child) != 0) {
+                closedir(d);
+                return -1;
+            }
+        }
+        closedir(d);
+        if (rmdir(path) != 0)
+            return -1;
+    } else {
+        if (unlink(path) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int watch_directory_at(int fd, struct WatchTree *t, int parent, const char *name, const char *path) {
+    int wd = inotify_add_watch(fd, path,
+                               IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_CLOSE_WRITE |
+                                   IN_MOVE_SELF);
+    if (wd < 0)
+        return -1;
+    int self = watch_tree_add(fd, t, wd, parent, name);
+    if (self < 0)
+        return -1;
+
+    DIR *d = opendir(path);
+    if (!d)
+        return -1;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        if (de->d_type == DT_DIR) {
+            watch_directory_at(fd, t, self, de->d_name, child);
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+/* the source root first, later directories whose parent is watched already */
+static int watch_directory_tree(int fd, const char *path, struct WatchTree *t) {
+    if (t->count == 0)
+        return watch_directory_at(fd, t, -1, path, path);
+    const char *name;
+    int parent = watch_tree_parent(t, path, &name);
+    if (parent < 0)
+        return -1;
+    return watch_directory_at(fd, t, parent, name, path);
+}
+
+static int prune_missing(const char *root, const char *ref_root, const char *rel);
+static int restore_source(const char *src_real, const char *tgt_real);
+
+/* brings every target up to date in one pass over the source. A target may
+ * hold what was deleted from the source while nothing mirrored it (a daemon
+ * restart, an "end" and a later "add"); that is pruned first. */
+static int sync_directories(const char *source_root, char **target_roots, size_t n) {
+    struct stat st;
+    if (stat(source_root, &st) == -1)
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+        return -1;
+    for (size_t i = 0; i < n; i++) {
+        if (mkdir(target_roots[i], 0755) == -1 && errno != EEXIST)
+            return -1;
+        prune_missing(target_roots[i], source_root, "");
+    }
+    return fanout_entry(source_root, target_roots, n, source_root, "");
+}
+
+static void relative_from_root(const char *root, const char *path, char *out, size_t out_sz) {
+    size_t root_len = strlen(root);
+    if (strncmp(root, path, root_len) == 0) {
+        const char *p = path + root_len;
+        if (*p == '/')
+            p++;
+        snprintf(out, out_sz, "%s", p);
+    } else {
+        snprintf(out, out_sz, "%s", path);
+    }
+}
+
+/* An IN_MOVED_FROM waits here for the IN_MOVED_TO with the same cookie, which
+ * may only come with the next read. Without one after MOVE_PAIR_TIMEOUT_MS the
+ * entry was moved out of the source. */
+struct PendingMove {
+    uint32_t cookie;
+    int is_dir;
+    long long at_ms;
+    char src_path[4096];
+    char rel_path[4096];
+};
+
+struct PendingMoves {
+    struct PendingMove list[MAX_PENDING_MOVES]; /* oldest first */
+    size_t count;
+};
+
+/* set when an event named a source path that was already gone, usually because
+ * its directory was renamed right after; the next rename looks for what was
+ * missed */
+static int missed_sources = 0;
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ---------- Trash ---------- */
+
+/* worker only; the daemon and restore remove directories in place */
+static int trash_enabled = 0;
+static unsigned long trash_seq = 0;
+static int trash_pending = 0; /* put in a trash since the reclaimer last started */
+static pid_t trash_pid = 0;   /* the running reclaimer, 0 if none */
+static long long trash_retry_ms = 0;
+static unsigned long long trash_done = 0; /* reclaimer: entries removed so far */
+static long long trash_start_ms = 0;
+
+/* moves the directory at path, below target_root, into that target's trash;
+ * -1 if it is to be removed in place instead */
+static int trash_put(const char *target_root, const char *path) {
+    struct stat st;
+    char dir[4096];
+    char dst[4096];
+    if (!trash_enabled || lstat(path, &st) == -1 || !S_ISDIR(st.st_mode) ||
+        join_rel(dir, sizeof(dir), target_root, TRASH_NAME) != 0 || is_subpath(dir, path))
+        return -1;
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        return -1;
+    int n = snprintf(dst, sizeof(dst), "%s/%lld-%d-%lu", dir, (long long)time(NULL), (int)getpid(), trash_seq++);
+    if (n < 0 || (size_t)n >= sizeof(dst))
+        return -1;
+    /* EXDEV: something is mounted there, it is removed where it is */
+    if (rename(path, dst) != 0)
+        return -1;
+    trash_pending = 1;
+    return 0;
+}
+
+/* removes path from the target at target_root; a directory only has to be
+ * renamed */
+static int discard_path(const char *target_root, const char *path) {
+    if (trash_put(target_root, path) == 0)
+        return 0;
+    return remove_path_recursive(path);
+}
+
+/* keeps the reclaimer at TRASH_RATE */
+static void trash_pace(void) {
+    trash_done++;
+    long long ahead = (long long)(trash_done * 1000 / TRASH_RATE) - (monotonic_ms() - trash_start_ms);
+    if (ahead > 0) {
+        struct timespec ts = {ahead / 1000, (ahead % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* removes everything below the directory open at fd and closes it */
+static int trash_empty(int fd) {
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return -1;
+    }
+    int rc = 0;
+    struct dirent *de;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        trash_pace();
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            int sub = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            rc = sub < 0 ? -1 : trash_empty(sub);
+        }
+        if (rc == 0 && unlinkat(dirfd(d), de->d_name, is_dir ? AT_REMOVEDIR : 0) == -1 && errno != ENOENT)
+            rc = -1;
+    }
+    closedir(d);
+    return rc;
+}
+
+/* reaps the reclaimer once it is done and starts one when something was put
+ * in a trash meanwhile. It dies with the worker; what it did not get to is
+ * left for the next one. */
+static void trash_poll(char **target_roots, size_t n) {
+    if (trash_pid > 0) {
+        int status;
+        pid_t r = waitpid(trash_pid, &status, WNOHANG);
+        if (r == 0)
+            return;
+        trash_pid = 0;
+        if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            trash_pending = 1;
+            trash_retry_ms = monotonic_ms() + TRASH_RETRY_MS;
+        } else if (!trash_pending) {
+            for (size_t i = 0; i < n; i++) {
+                char dir[4096];
+                if (join_rel(dir, sizeof(dir), target_roots[i], TRASH_NAME) == 0)
+                    rmdir(dir); /* ENOTEMPTY: a put raced with the reclaimer's end */
+            }
+        }
+    }
+    if (!trash_pending || monotonic_ms() < trash_retry_ms)
+        return;
+
+    pid_t worker = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        trash_retry_ms = monotonic_ms() + TRASH_RETRY_MS;
+        return;
+    }
+    if (pid == 0) {
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1 || getppid() != worker)
+            _exit(1);
+        nice(19);
+        trash_start_ms = monotonic_ms();
+        int rc = 0;
+        for (size_t i = 0; i < n; i++) {
+            char dir[4096];
+            if (join_rel(dir, sizeof(dir), target_roots[i], TRASH_NAME) != 0)
+                continue;
+            int fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                if (errno != ENOENT)
+                    rc = -1;
+                continue;
+            }
+            if (trash_empty(fd) != 0)
+                rc = -1;
+        }
+        _exit(rc == 0 ? 0 : 1);
+    }
+    trash_pending = 0;
+    trash_pid = pid;
+}
+
+/* a watched directory was renamed: its entry is re-linked, the ones below it
+ * follow */
+static void watch_tree_rename(int fd, struct WatchTree *t, const char *old_path, const char *new_path) {
+    int i = watch_tree_lookup(t, old_path);
+    const char *name;
+    int parent = watch_tree_parent(t, new_path, &name);
+    if (i < 0 || parent < 0 || watch_tree_is_under(t, parent, i))
+        return;
+    long off = watch_name_find(t, name);
+    int stale = off >= 0 ? watch_tree_child(t, parent, (uint32_t)off) : -1;
+    if (stale >= 0 && stale != i)
+        watch_tree_remove_at(fd, t, stale);
+    off = watch_name_intern(t, name);
+    if (off < 0)
+        return;
+    slots_erase(t, t->child_slots, i);
+    t->list[i].parent = parent;
+    t->list[i].name = (uint32_t)off;
+    slots_insert(t, t->child_slots, i);
+}
+
+static void watch_tree_remove_under(int fd, struct WatchTree *t, const char *path) {
+    int top = watch_tree_lookup(t, path);
+    if (top >= 0)
+        watch_tree_remove_at(fd, t, top);
+}
+
+static void make_parent_dirs(char *path) {
+    char *slash = strrchr(path, '/');
+    if (slash) {
+        *slash = '\0';
+        make_dir_recursive(path, 0755);
+        *slash = '/';
+    }
+}
+
+static void remove_from_targets(char **target_roots, size_t n, const char *rel) {
+    for (size_t i = 0; i < n; i++) {
+        char dst_path[4096];
+        if (join_rel(dst_path, sizeof(dst_path), target_roots[i], rel) == 0)
+            discard_path(target_roots[i], dst_path);
+    }
+}
+
+/* new entry in the source: copy it to every target, and watch it if it is a
+ * directory */
+static void mirror_create(int fd, struct WatchTree *watchers, const char *source_root,
+                          char **target_roots, size_t n, const char *src_path, const char *rel, int is_dir) {
+    struct stat st;
+    if (lstat(src_path, &st) == -1) {
+        if (errno == ENOENT)
+            missed_sources = 1;
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        char dst_path[4096];
+        if (join_rel(dst_path, sizeof(dst_path), target_roots[i], rel) == 0)
+            make_parent_dirs(dst_path);
+    }
+
+    if (n > 0)
+        fanout_entry(source_root, target_roots, n, src_path, rel);
+    if (is_dir)
+        watch_directory_tree(fd, src_path, watchers);
+}
+
+/* brings a renamed copy up to date without copying it again: only entries
+ * that are missing or fail the quick check are copied, and what is no longer
+ * in the source is discarded. Every source directory it comes across that is
+ * not watched yet gets its watches. */
+static int refresh_entry(int fd, struct WatchTree *watchers, const char *source_root,
+                         const char *target_root, const char *src_path, const char *dst_path);
+
+struct RefreshWalk {
+    int fd;
+    struct WatchTree *watchers;
+    const char *source_root;
+    const char *target_root;
+    const char *src_path;
+    const char *dst_path;
+};
+
+static int refresh_diff_entry(const struct DiffEntry *e, void *arg) {
+    const struct RefreshWalk *w = arg;
+    char child_src[4096];
+    char child_dst[4096];
+    snprintf(child_src, sizeof(child_src), "%s/%s", w->src_path, e->name);
+    snprintf(child_dst, sizeof(child_dst), "%s/%s", w->dst_path, e->name);
+    switch (e->kind) {
+    case DIFF_REMOVED:
+        discard_path(w->target_root, child_dst);
+        return 0;
+    case DIFF_SAME:
+        return S_ISDIR(e->from.st_mode) ? refresh_entry(w->fd, w->watchers, w->source_root, w->target_root,
+                                                        child_src, child_dst)
+                                        : 0;
+    case DIFF_CHANGED:
+        if ((e->from.st_mode & S_IFMT) != (e->to.st_mode & S_IFMT))
+            discard_path(w->target_root, child_dst);
+        break;
+    case DIFF_ADDED:
+        break;
+    }
+    /* watched before it is copied, so what changes in it meanwhile is seen */
+    if (S_ISDIR(e->from.st_mode) && watch_tree_lookup(w->watchers, child_src) < 0 &&
+        watch_directory_tree(w->fd, child_src, w->watchers) != 0)
+        return -1;
+    return copy_entry(w->source_root, w->target_root, child_src, child_dst);
+}
+
+static int refresh_entry(int fd, struct WatchTree *watchers, const char *source_root,
+                         const char *target_root, const char *src_path, const char *dst_path) {
+    struct stat st, dst_buf;
+    if (lstat(src_path, &st) == -1)
+        return 0;
+    /* what dst_path is now, NULL if nothing of the same kind */
+    const struct stat *dst_st = lstat(dst_path, &dst_buf) == 0 ? &dst_buf : NULL;
+    if (dst_st && (st.st_mode & S_IFMT) != (dst_st->st_mode & S_IFMT)) {
+        discard_path(target_root, dst_path);
+        dst_st = NULL;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (S_ISREG(st.st_mode) && dst_st && same_file_quick(&st, dst_st))
+            return 0;
+        return copy_entry(source_root, target_root, src_path, dst_path);
+    }
+
+    if (watch_tree_lookup(watchers, src_path) < 0 && watch_directory_tree(fd, src_path, watchers) != 0)
+        return -1;
+    if (mkdir(dst_path, 0755) == -1 && errno != EEXIST)
+        return -1;
+    struct RefreshWalk w = {fd, watchers, source_root, target_root, src_path, dst_path};
+    return dir_diff(src_path, dst_path, refresh_diff_entry, &w);
+}
+
+/* the entry left the source, so its copies go too */
+static void drop_move(int fd, struct WatchTree *watchers, char **target_roots, size_t n,
+                      const struct PendingMove *mv) {
+    if (mv->is_dir)
+        watch_tree_remove_under(fd, watchers, mv->src_path);
+    remove_from_targets(target_roots, n, mv->rel_path);
+}
+
+/* drops the moves older than the pairing timeout, or all of them */
+static void expire_moves(int fd, struct WatchTree *watchers, char **target_roots, size_t n,
+                         struct PendingMoves *pm, int all) {
+    long long now = monotonic_ms();
+    size_t kept = 0;
+    for (size_t i = 0; i < pm->count; i++) {
+        if (all || now - pm->list[i].at_ms >= MOVE_PAIR_TIMEOUT_MS) {
+            drop_move(fd, watchers, target_roots, n, &pm->list[i]);
+        } else {
+            if (kept != i)
+                pm->list[kept] = pm->list[i];
+            kept++;
+        }
+    }
+    pm->count = kept;
+}
+
+static void remember_move(int fd, struct WatchTree *watchers, char **target_roots, size_t n,
+                          struct PendingMoves *pm, const struct inotify_event *ev, const char *src_path,
+                          const char *rel) {
+    if (pm->count == MAX_PENDING_MOVES) {
+        drop_move(fd, watchers, target_roots, n, &pm->list[0]);
+        memmove(&pm->list[0], &pm->list[1], (pm->count - 1) * sizeof(pm->list[0]));
+        pm->count--;
+    }
+    struct PendingMove *mv = &pm->list[pm->count++];
+    mv->cookie = ev->cookie;
+    mv->is_dir = (ev->mask & IN_ISDIR) != 0;
+    mv->at_ms = monotonic_ms();
+    snprintf(mv->src_path, sizeof(mv->src_path), "%s", src_path);
+    snprintf(mv->rel_path, sizeof(mv->rel_path), "%s", rel);
+}
+
+/* returns 1 and fills out if a move with this cookie is pending */
+static int take_move(struct PendingMoves *pm, uint32_t cookie, struct PendingMove *out) {
+    for (size_t i = 0; i < pm->count; i++) {
+        if (pm->list[i].cookie == cookie) {
+            *out = pm->list[i];
+            memmove(&pm->list[i], &pm->list[i + 1], (pm->count - i - 1) * sizeof(pm->list[0]));
+            pm->count--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* both halves of a rename inside the source: the copies are renamed the same
+ * way instead of being deleted and copied again */
+static void mirror_rename(int fd, struct WatchTree *watchers, const char *source_root,
+                          char **target_roots, size_t n, const struct PendingMove *mv, const char *src_path,
+                          const char *rel) {
+    int refresh = missed_sources;
+    missed_sources = 0;
+    if (mv->is_dir)
+        watch_tree_rename(fd, watchers, mv->src_path, src_path);
+
+    for (size_t i = 0; i < n; i++) {
+        char old_path[4096];
+        char dst_path[4096];
+        if (join_rel(old_path, sizeof(old_path), target_roots[i], mv->rel_path) != 0 ||
+            join_rel(dst_path, sizeof(dst_path), target_roots[i], rel) != 0)
+            continue;
+        make_parent_dirs(dst_path);
+
+        int ok = rename(old_path, dst_path) == 0;
+        if (!ok && (errno == ENOTEMPTY || errno == EEXIST || errno == EISDIR || errno == ENOTDIR)) {
+            /* something of another kind is in the way */
+            ok = discard_path(target_roots[i], dst_path) == 0 && rename(old_path, dst_path) == 0;
+        }
+        if (!ok)
+            discard_path(target_roots[i], old_path);
+        if (!ok || refresh)
+            refresh_entry(fd, watchers, source_root, target_roots[i], src_path, dst_path);
+    }
+}
+
+/* ---------- Restore echoes ---------- */
+
+/* what the last restore did, reported when it finishes */
+static size_t restore_copied = 0;
+static size_t restore_skipped = 0;
+
+/* The restore of an active target is run by the worker between two reads of
+ * events, so nothing is mirrored while the source is being written. What it
+ * wrote is remembered: an event on an entry that is still exactly as the
+ * restore left it is the restore's own echo, which the target it came from
+ * holds already, so it only goes to the other targets. Anything changed since
+ * goes everywhere as usual. The echoes are forgotten as soon as no event is
+ * queued any more; by then every one was read. */
+struct Echo {
+    dev_t dev;
+    ino_t ino;
+    mode_t type;
+    off_t size;
+    struct timespec mtime;
+};
+
+/* what a worker sends back once it ran the restore it was asked for */
+struct RestoreReply {
+    int ok;
+    size_t copied;
+    size_t skipped;
+};
+
+static struct Echo *echoes = NULL; /* sorted by dev and ino once the restore is done */
+static size_t echo_count = 0;
+static size_t echo_cap = 0;
+static int echo_recording = 0;     /* set in the worker while it restores */
+static char **echo_roots = NULL;   /* every target but the one restored from */
+
+static void echo_note(const char *path) {
+    struct stat st;
+    if (!echo_recording || lstat(path, &st) == -1)
+        return;
+    if (echo_count == echo_cap) {
+        size_t cap = echo_cap ? echo_cap * 2 : 256;
+        struct Echo *grown = realloc(echoes, cap * sizeof(*grown));
+        if (!grown)
+            return;
+        echoes = grown;
+        echo_cap = cap;
+    }
+    struct Echo *e = &echoes[echo_count++];
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->type = st.st_mode & S_IFMT;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+}
+
+static int echo_cmp(const void *a, const void *b) {
+    const struct Echo *x = a, *y = b;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return 0;
+}
+
+/* whether path is an entry exactly as the last restore left it; a directory
+ * only keeps its mtime until something is added, which has events of its own */
+static int echo_of(const char *path) {
+    struct stat st;
+    if (echo_count == 0 || lstat(path, &st) == -1)
+        return 0;
+    struct Echo key = {.dev = st.st_dev, .ino = st.st_ino};
+    const struct Echo *e = bsearch(&key, echoes, echo_count, sizeof(*echoes), echo_cmp);
+    if (!e || e->type != (st.st_mode & S_IFMT))
+        return 0;
+    return S_ISDIR(st.st_mode) || (e->size == st.st_size && e->mtime.tv_sec == st.st_mtim.tv_sec &&
+                                   e->mtime.tv_nsec == st.st_mtim.tv_nsec);
+}
+
+static void echo_forget(void) {
+    free(echoes);
+    free(echo_roots);
+    echoes = NULL;
+    echo_roots = NULL;
+    echo_count = echo_cap = 0;
+}
+
+/* What the daemon asks of a running worker over its request pipe: a header
+ * followed by len bytes of target path. Only a restore is answered, with a
+ * struct RestoreReply. */
+enum { REQ_RESTORE, REQ_ADD, REQ_END };
+
+struct WorkerRequest {
+    int op;
+    size_t len;
+};
+
+static int read_full(int fd, void *buf, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t r = read(fd, (char *)buf + got, size - got);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+
+/* runs the restore from the target target_roots[target] and answers it */
+static void restore_serve(int rep_fd, const char *source_root, char **target_roots, size_t n_targets,
+                          size_t target) {
+    struct RestoreReply reply = {0, 0, 0};
+    if (target < n_targets) {
+        echo_forget();
+        echo_roots = malloc(n_targets * sizeof(*echo_roots));
+        size_t n = 0;
+        for (size_t i = 0; echo_roots && i < n_targets; i++) {
+            if (i != target)
+                echo_roots[n++] = target_roots[i];
+        }
+        /* what has to go from the source is deleted in place, it has no trash */
+        trash_enabled = 0;
+        echo_recording = echo_roots != NULL;
+        restore_copied = 0;
+        restore_skipped = 0;
+        reply.ok = restore_source(source_root, target_roots[target]) == 0;
+        reply.copied = restore_copied;
+        reply.skipped = restore_skipped;
+        echo_recording = 0;
+        trash_enabled = 1;
+        qsort(echoes, echo_count, sizeof(*echoes), echo_cmp);
+    }
+    if (write(rep_fd, &reply, sizeof(reply)) != (ssize_t)sizeof(reply))
+        perror("write");
+}
+
+/* Serves one request of the daemon. Targets are added and ended here instead
+ * of restarting the worker, so the watches stay up and nothing the source does
+ * meanwhile is missed: a new target is synced while its events queue, and
+ * gets them afterwards like the others. -1 once the daemon is gone. */
+static int worker_serve(int req_fd, int rep_fd, const char *source_root, char ***target_roots,
+                        size_t *n_targets) {
+    struct WorkerRequest req;
+    char path[4096];
+    if (read_full(req_fd, &req, sizeof(req)) != 0 || req.len >= sizeof(path) ||
+        read_full(req_fd, path, req.len) != 0)
+        return -1;
+    path[req.len] = '\0';
+
+    size_t i = 0;
+    while (i < *n_targets && strcmp((*target_roots)[i], path) != 0)
+        i++;
+    switch (req.op) {
+    case REQ_RESTORE:
+        restore_serve(rep_fd, source_root, *target_roots, *n_targets, i);
+        break;
+    case REQ_ADD:
+        if (i < *n_targets)
+            break;
+        /* the echoes of a restore name the targets by position */
+        echo_forget();
+        *target_roots = xrealloc(*target_roots, (*n_targets + 1) * sizeof(**target_roots));
+        (*target_roots)[*n_targets] = xstrdup(path);
+        if (sync_directories(source_root, *target_roots + *n_targets, 1) != 0)
+            perror("copy");
+        (*n_targets)++;
+        char trash[4096];
+        struct stat st;
+        if (join_rel(trash, sizeof(trash), path, TRASH_NAME) == 0 && lstat(trash, &st) == 0)
+            trash_pending = 1;
+        break;
+    case REQ_END:
+        if (i == *n_targets)
+            break;
+        echo_forget();
+        free((*target_roots)[i]);
+        memmove(*target_roots + i, *target_roots + i + 1, (*n_targets - i - 1) * sizeof(**target_roots));
+        (*n_targets)--;
+        break;
+    }
+    return 0;
+}
+
+/* the worker: watches the source, brings the targets up to date and mirrors
+ * every change until terminated; it owns target_roots */
+static void mirror_event_loop(const char *source_root, char **target_roots, size_t n_targets,
+                              int req_fd, int rep_fd) {
+    long long started_ms = monotonic_ms();
+    int fd = inotify_init();
+    if (fd < 0)
+        _exit(1);
+
+    /* watches go up before the sync, so what changes while it runs is queued
+     * and applied afterwards instead of being missed */
+    struct WatchTree watchers;
+    memset(&watchers, 0, sizeof(watchers));
+    watchers.free_head = -1;
+    if (watch_directory_tree(fd, source_root, &watchers) != 0) {
+        watch_tree_free(&watchers);
+        close(fd);
+        _exit(1);
+    }
+    if (sync_directories(source_root, target_roots, n_targets) != 0) {
+        perror("copy");
+        _exit(1);
+    }
+    /* how long the targets were behind, a restart's time to protected */
+    if (logger) {
+        fprintf(logger, "[INFO] %s in sync after %lld ms\n", source_root, monotonic_ms() - started_ms);
+        fflush(logger);
+    }
+
+    struct PendingMoves *moves = calloc(1, sizeof(*moves));
+    if (!moves) {
+        watch_tree_free(&watchers);
+        close(fd);
+        _exit(1);
+    }
+
+    /* what an earlier worker left in a trash is reclaimed first */
+    for (size_t i = 0; i < n_targets; i++) {
+        char dir[4096];
+        struct stat st;
+        if (join_rel(dir, sizeof(dir), target_roots[i], TRASH_NAME) == 0 && lstat(dir, &st) == 0)
+            trash_pending = 1;
+    }
+
+    char buf[4096];
+    while (1) {
+        trash_poll(target_roots, n_targets);
+        if (exit_requested>0) {
+            expire_moves(fd, &watchers, target_roots, n_targets, moves, 1);
+            free(moves);
+            watch_tree_free(&watchers);
+            close(fd);
+            exit(0);
+        }
+        /* both halves of a rename are queued together, so if nothing else
+         * arrives the IN_MOVED_FROMs left were moves out of the source; a
+         * running reclaimer is checked on every so often as well */
+        int timeout = -1;
+        if (moves->count > 0)
+            timeout = MOVE_PAIR_TIMEOUT_MS;
+        else if (trash_pid > 0 || trash_pending)
+            timeout = TRASH_POLL_MS;
+        struct pollfd pfd[2] = {{fd, POLLIN, 0}, {req_fd, POLLIN, 0}};
+        int ready = poll(pfd, 2, timeout);
+        if (ready == 0) {
+            expire_moves(fd, &watchers, target_roots, n_targets, moves, 1);
+            continue;
+        }
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        /* a request waits for no event: those queued meanwhile see its result */
+        if (pfd[1].revents && worker_serve(req_fd, rep_fd, source_root, &target_roots, &n_targets) != 0) {
+            close(req_fd);
+            req_fd = -1;
+        }
+        if (!(pfd[0].revents & POLLIN))
+            continue;
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR) {
+                errno=0;
+                continue;
+            }
+            break;
+        }
+
+        ssize_t offset = 0;
+        while (offset < len) {
+            if (exit_requested>0) {
+                expire_moves(fd, &watchers, target_roots, n_targets, moves, 1);
+                free(moves);
+                watch_tree_free(&watchers);
+                close(fd);
+                exit(0);
+            }
+            struct inotify_event *ev = (struct inotify_event *)(buf + offset);
+            int w = watch_tree_find(&watchers, ev->wd);
+            char src_path[4096];
+            if (w < 0 || watch_tree_path(&watchers, w, src_path, sizeof(src_path)) != 0) {
+                offset += sizeof(struct inotify_event) + ev->len;
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                /* the directory is gone, and so is its watch */
+                watch_tree_remove_at(fd, &watchers, w);
+                offset += sizeof(struct inotify_event) + ev->len;
+                continue;
+            }
+
+            size_t dir_len = strlen(src_path);
+            if (ev->len && ev->name[0] &&
+                snprintf(src_path + dir_len, sizeof(src_path) - dir_len, "/%s", ev->name) >=
+                    (int)(sizeof(src_path) - dir_len)) {
+                offset += sizeof(struct inotify_event) + ev->len;
+                continue;
+            }
+
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                /* a renamed subdirectory reports IN_MOVE_SELF as well; only the
+                 * source root going away stops the worker */
+                if (watchers.list[w].parent < 0) {
+                    free(moves);
+                    watch_tree_free(&watchers);
+                    close(fd);
+                    _exit(0);
+                }
+                offset += sizeof(struct inotify_event) + ev->len;
+                continue;
+            }
+
+            char rel[4096];
+            relative_from_root(source_root, src_path, rel, sizeof(rel));
+            if (is_trash_rel(rel)) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                    report_reserved(source_root, rel);
+                offset += sizeof(struct inotify_event) + ev->len;
+                continue;
+            }
+
+            struct PendingMove mv;
+            if (ev->mask & IN_MOVED_FROM) {
+                remember_move(fd, &watchers, target_roots, n_targets, moves, ev, src_path, rel);
+            } else if ((ev->mask & IN_MOVED_TO) && take_move(moves, ev->cookie, &mv)) {
+                mirror_rename(fd, &watchers, source_root, target_roots, n_targets, &mv, src_path, rel);
+            } else if (echo_of(src_path)) {
+                /* the restore's own write, or what it put in the place of an
+                 * entry of another type: only the other targets lack it */
+                if (ev->mask & IN_DELETE)
+                    remove_from_targets(echo_roots, n_targets - 1, rel);
+                else
+                    mirror_create(fd, &watchers, source_root, echo_roots, n_targets - 1, src_path, rel,
+                                  (ev->mask & IN_ISDIR) != 0);
+            } else if (ev->mask & IN_DELETE) {
+                remove_from_targets(target_roots, n_targets, rel);
+            } else {
+                mirror_create(fd, &watchers, source_root, target_roots, n_targets, src_path, rel,
+                              (ev->mask & IN_ISDIR) != 0);
+            }
+
+            offset += sizeof(struct inotify_event) + ev->len;
+        }
+        expire_moves(fd, &watchers, target_roots, n_targets, moves, 0);
+        int queued = 0;
+        if (echo_count > 0 && ioctl(fd, FIONREAD, &queued) == 0 && queued == 0)
+            echo_forget();
+    }
+
+    free(moves);
+    watch_tree_free(&watchers);
     close(fd);
-    return hash;
+    _exit(1);
 }
 
-static int restore_entry(const char *source_root, const char *target_root,
-                         const char *src_path, const char *dst_path) {
-    struct stat st;
-    if (lstat(src_path, &st) == -1)
+struct PruneWalk {
+    const char *root;
+    const char *ref_root;
+    const char *rel;
+};
+
+static int prune_diff_entry(const struct DiffEntry *e, void *arg) {
+    const struct PruneWalk *w = arg;
+    /* the reclaimer empties the trash */
+    if (!w->rel[0] && is_trash_rel(e->name))
+        return 0;
+    if (e->kind == DIFF_ADDED)
+        return 0;
+    char child_rel[4096];
+    char path[4096];
+    int n = w->rel[0] ? snprintf(child_rel, sizeof(child_rel), "%s/%s", w->rel, e->name)
+                      : snprintf(child_rel, sizeof(child_rel), "%s", e->name);
+    if (n < 0 || (size_t)n >= sizeof(child_rel) || join_rel(path, sizeof(path), w->root, child_rel) != 0)
+        return 0;
+    if (e->kind == DIFF_REMOVED || (e->from.st_mode & S_IFMT) != (e->to.st_mode & S_IFMT)) {
+        discard_path(w->root, path);
+        return 0;
+    }
+    if (S_ISDIR(e->to.st_mode))
+        return prune_missing(w->root, w->ref_root, child_rel);
+    return 0;
+}
+
+/* removes from the tree at root, below rel, whatever the tree at ref_root does
+ * not have there or has as another type of entry */
+static int prune_missing(const char *root, const char *ref_root, const char *rel) {
+    char dir[4096];
+    char ref_dir[4096];
+    if (join_rel(dir, sizeof(dir), root, rel) != 0 || join_rel(ref_dir, sizeof(ref_dir), ref_root, rel) != 0)
         return -1;
+    struct PruneWalk w = {root, ref_root, rel};
+    return dir_diff(ref_dir, dir, prune_diff_entry, &w);
+}
 
-    if (S_ISDIR(st.st_mode)) {
+static int restore_entry(const char *source_root, const char *target_root, const char *src_path,
+                         const char *dst_path, const struct stat *st, const struct stat *dst_st);
+
+struct RestoreWalk {
+    const char *source_root;
+    const char *target_root;
+    const char *src_path;
+    const char *dst_path;
+};
+
+static int restore_diff_entry(const struct DiffEntry *e, void *arg) {
+    const struct RestoreWalk *w = arg;
+    /* the trash of the backup is no part of it */
+    if (strcmp(w->src_path, w->source_root) == 0 && is_trash_rel(e->name))
+        return 0;
+    char child_src[4096];
+    char child_dst[4096];
+    snprintf(child_src, sizeof(child_src), "%s/%s", w->src_path, e->name);
+    snprintf(child_dst, sizeof(child_dst), "%s/%s", w->dst_path, e->name);
+    if (e->kind == DIFF_REMOVED) {
+        discard_path(w->target_root, child_dst);
+        return 0;
+    }
+    return restore_entry(w->source_root, w->target_root, child_src, child_dst, &e->from,
+                         e->kind == DIFF_ADDED ? NULL : &e->to);
+}
+
+/* makes dst_path what src_path, described by st, is in the backup; dst_st
+ * describes what dst_path is now, NULL if nothing */
+static int restore_entry(const char *source_root, const char *target_root, const char *src_path,
+                         const char *dst_path, const struct stat *st, const struct stat *dst_st) {
+    if (dst_st && (dst_st->st_mode & S_IFMT) != (st->st_mode & S_IFMT)) {
+        discard_path(target_root, dst_path);
+        dst_st = NULL;
+    }
+
+    if (S_ISDIR(st->st_mode)) {
         if (mkdir(dst_path, 0755) == -1 && errno != EEXIST)
             return -1;
-        DIR *d = opendir(src_path);
-        if (!d)
+        echo_note(dst_path);
+        struct RestoreWalk w = {source_root, target_root, src_path, dst_path};
+        return dir_diff(src_path, dst_path, restore_diff_entry, &w);
+    }
+
+    if (S_ISLNK(st->st_mode)) {
+        if (copy_symlink(source_root, target_root, src_path, dst_path) != 0)
             return -1;
-        struct dirent *de;
-        while ((de = readdir(d)) != NULL) {
-            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
-                continue;
-            char child_src[4096];
-            char child_dst[4096];
-            snprintf(child_src, sizeof(child_src), "%s/%s", src_path, de->d_name);
-            snprintf(child_dst, sizeof(child_dst), "%s/%s", dst_path, de->d_name);
-            if (restore_entry(source_root, target_root, child_src, child_dst) != 0) {
-                closedir(d);
-                return -1;
-            }
+        echo_note(dst_path);
+        return 0;
+    }
+
+    if (S_ISREG(st->st_mode)) {
+        if (dst_st && same_file_quick(st, dst_st)) {
+            restore_skipped++;
+            return 0; /* unchanged */
         }
-        closedir(d);
+        restore_copied++;
+        if (copy_file_contents(src_path, dst_path, st->st_mode) != 0)
+            return -1;
+        echo_note(dst_path);
         return 0;
     }
+    return 0;
+}
 
-    if (S_ISLNK(st.st_mode)) {
-        return copy_symlink(source_root, target_root, src_path, dst_path);
+/* copies the backup at tgt_real back to the source and deletes from the
+ * source what the backup does not have, in one pass over both */
+static int restore_source(const char *src_real, const char *tgt_real) {
+    struct stat st, dst_st;
+    if (lstat(tgt_real, &st) == -1)
+        return -1;
+    int dst_exists = lstat(src_real, &dst_st) == 0;
+    return restore_entry(tgt_real, src_real, tgt_real, src_real, &st, dst_exists ? &dst_st : NULL);
+}
+
+/* one worker serves all active targets of a source, so every change is read
+ * from the source once however many targets it goes to. It is started with
+ * the first target and told about later ones, see send_request; it is only
+ * replaced when it cannot be told, and then the quick check keeps the new
+ * worker's initial sync from copying again what the old one already did. */
+static void restore_answer(struct BackupSource *bs);
+
+static void restart_worker(struct BackupSource *bs) {
+    if (bs->worker_pid > 0) {
+        kill(bs->worker_pid, SIGTERM);
+        waitpid(bs->worker_pid, NULL, 0);
+        bs->worker_pid = 0;
+    }
+    if (bs->pidfd >= 0) {
+        close(bs->pidfd);
+        bs->pidfd = -1;
+    }
+    bs->restart_at_ms = 0;
+    bs->stopping = 0;
+    /* a restore it took is answered if it got that far, redone here if not */
+    if (bs->restoring)
+        restore_answer(bs);
+    close_restore_pipes(bs);
+
+    char **roots = xrealloc(NULL, (bs->target_count + 1) * sizeof(*roots));
+    size_t n = 0;
+    for (size_t j = 0; j < bs->target_count; j++) {
+        if (bs->targets[j].active)
+            roots[n++] = bs->targets[j].target_path;
+    }
+    if (n == 0) {
+        free(roots);
+        return;
+    }
+    /* the worker's own copy, which requests later change */
+    for (size_t j = 0; j < n; j++)
+        roots[j] = xstrdup(roots[j]);
+
+    int req[2], rep[2];
+    if (pipe(req) == -1) {
+        perror("pipe");
+        req[0] = req[1] = -1;
+    }
+    if (req[0] >= 0 && pipe(rep) == -1) {
+        perror("pipe");
+        close(req[0]);
+        close(req[1]);
+        req[0] = req[1] = -1;
+    }
+    if (req[0] < 0)
+        rep[0] = rep[1] = -1; /* the worker runs, restores are done in place */
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        for (size_t j = 0; j < bs->target_count; j++)
+            bs->targets[j].active = 0;
+        for (size_t j = 0; j < n; j++)
+            free(roots[j]);
+        free(roots);
+        if (req[0] >= 0) {
+            close(req[0]);
+            close(req[1]);
+            close(rep[0]);
+            close(rep[1]);
+        }
+        return;
     }
 
-    if (S_ISREG(st.st_mode)) {
-        unsigned long src_hash = file_hash(src_path);
-        unsigned long dst_hash = file_hash(dst_path);
-        if (src_hash == dst_hash && src_hash != 0)
-            return 0; /* unchanged */
-        return copy_file_contents(src_path, dst_path, st.st_mode);
+    if (pid == 0) {
+        /* child: perform initial copy then mirror changes until terminated */
+        signal(SIGTERM, SIG_DFL);
+        for (size_t i = 0; i < backup_count; i++) {
+            close_restore_pipes(&backups[i]);
+            if (backups[i].pidfd >= 0)
+                close(backups[i].pidfd);
+        }
+        if (req[0] >= 0) {
+            close(req[1]);
+            close(rep[0]);
+        }
+        trash_enabled = 1;
+        mirror_event_loop(bs->source_path, roots, n, req[0], rep[1]);
+    }
+
+    for (size_t j = 0; j < n; j++)
+        free(roots[j]);
+    free(roots);
+    bs->worker_pid = pid;
+    bs->started_ms = monotonic_ms();
+    /* its exit wakes up wait_input; without a pidfd it is reaped there */
+    bs->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (bs->pidfd < 0)
+        perror("pidfd_open");
+    if (req[0] >= 0) {
+        close(req[0]);
+        close(rep[1]);
+    }
+    bs->restore_req = req[1];
+    bs->restore_rep = rep[0];
+}
+
+/* reports how the restore of the source from tgt_real went; reply is NULL
+ * when no worker answered it, the restore is then done in place */
+static void restore_finish(const char *src_real, const char *tgt_real, struct RestoreReply *reply) {
+    struct RestoreReply local;
+    if (!reply) {
+        /* copy from target back to source */
+        restore_copied = 0;
+        restore_skipped = 0;
+        local.ok = restore_source(src_real, tgt_real) == 0;
+        local.copied = restore_copied;
+        local.skipped = restore_skipped;
+        reply = &local;
     }
+    if (!reply->ok) {
+        err_restore_blocked();
+        return;
+    }
+    msg_restore_finished(src_real, reply->copied, reply->skipped);
+}
+
+/* passes a REQ_* about the target tgt_real to the running worker; -1 if
+ * there is none to take it */
+static int send_request(struct BackupSource *bs, int op, const char *tgt_real) {
+    if (bs->worker_pid <= 0 || bs->restore_req < 0)
+        return -1;
+    char msg[sizeof(struct WorkerRequest) + 4096];
+    struct WorkerRequest req = {op, strlen(tgt_real)};
+    if (req.len >= 4096)
+        return -1;
+    memcpy(msg, &req, sizeof(req));
+    memcpy(msg + sizeof(req), tgt_real, req.len);
+    size_t size = sizeof(req) + req.len;
+    return write(bs->restore_req, msg, size) == (ssize_t)size ? 0 : -1;
+}
+
+/* Hands the restore from the target tgt_real to the worker; the worker goes on
+ * mirroring afterwards and its answer is picked up by wait_input. -1 if there
+ * is no worker to take it, the restore is then done in place. */
+static int request_restore(struct BackupSource *bs, const char *tgt_real) {
+    if (send_request(bs, REQ_RESTORE, tgt_real) != 0)
+        return -1;
+    bs->restoring = xstrdup(tgt_real);
     return 0;
 }
 
+/* reads the worker's answer to the restore it was handed, once its reply
+ * pipe is readable or the worker is gone */
+static void restore_answer(struct BackupSource *bs) {
+    struct RestoreReply reply;
+    ssize_t got;
+    do {
+        got = read(bs->restore_rep, &reply, sizeof(reply));
+    } while (got == -1 && errno == EINTR);
+    char *tgt_real = bs->restoring;
+    bs->restoring = NULL;
+    /* the reply is smaller than PIPE_BUF, so it is never split */
+    restore_finish(bs->source_path, tgt_real, got == (ssize_t)sizeof(reply) ? &reply : NULL);
+    free(tgt_real);
+}
+
+static void state_save(void);
+
+/* The worker of bs exited with status. One that exited cleanly saw the source
+ * go away, and its targets are only kept for restore; one that failed is
+ * forked again once its backoff elapsed, and its first sync catches up with
+ * what it missed. Returns 1 if that was reported, 0 for a worker "end"
+ * stopped. */
+static int worker_exited(struct BackupSource *bs, int status) {
+    if (bs->pidfd >= 0) {
+        close(bs->pidfd);
+        bs->pidfd = -1;
+    }
+    bs->worker_pid = 0;
+    if (bs->restoring)
+        restore_answer(bs);
+    close_restore_pipes(bs);
+    if (bs->stopping) {
+        bs->stopping = 0;
+        return 0;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        for (size_t j = 0; j < bs->target_count; j++) {
+            if (!bs->targets[j].active)
+                continue;
+            bs->targets[j].active = 0;
+            msg_backup_stopped(bs->source_path, bs->targets[j].target_path);
+        }
+        state_save();
+        return 1;
+    }
+    long long now = monotonic_ms();
+    if (now - bs->started_ms >= RESTART_STABLE_MS)
+        bs->backoff_ms = RESTART_BACKOFF_MIN_MS;
+    bs->restart_at_ms = now + bs->backoff_ms;
+    log_printf("[ERROR] Worker for %s died, restarting in %d s.\n", bs->source_path, bs->backoff_ms / 1000);
+    bs->backoff_ms = bs->backoff_ms * 2 > RESTART_BACKOFF_MAX_MS ? RESTART_BACKOFF_MAX_MS : bs->backoff_ms * 2;
+    return 1;
+}
+
+/* reaps the worker of bs if it exited; returns 1 if that was reported */
+static int reap_worker(struct BackupSource *bs) {
+    int status;
+    pid_t pid;
+    do {
+        pid = waitpid(bs->worker_pid, &status, WNOHANG);
+    } while (pid == -1 && errno == EINTR);
+    if (pid != bs->worker_pid)
+        return 0;
+    return worker_exited(bs, status);
+}
+
+/* forks the failed workers whose backoff elapsed; returns how long until the
+ * next one is due, -1 if none waits */
+static int restart_workers(void) {
+    long long now = monotonic_ms();
+    long long next = -1;
+    for (size_t i = 0; i < backup_count; i++) {
+        struct BackupSource *bs = &backups[i];
+        if (bs->worker_pid > 0 || bs->restart_at_ms == 0)
+            continue;
+        if (bs->restart_at_ms <= now) {
+            bs->restarts++;
+            restart_worker(bs);
+            continue;
+        }
+        if (next < 0 || bs->restart_at_ms - now < next)
+            next = bs->restart_at_ms - now;
+    }
+    return (int)next;
+}
+
+/* Waits until stdin has something to read, reporting the restores handed to
+ * workers as they are answered, so a restore never holds up the prompt. With
+ * stdin_open 0 it only waits for the restores still running. */
+static void wait_input(int stdin_open) {
+    /* stdin, a restore reply and a pidfd per source at most */
+    struct pollfd *pfd = xrealloc(NULL, (2 * backup_count + 1) * sizeof(*pfd));
+    size_t *owner = xrealloc(NULL, (2 * backup_count + 1) * sizeof(*owner));
+    while (!exit_requested) {
+        nfds_t n = 0;
+        if (stdin_open) {
+            pfd[n].fd = STDIN_FILENO;
+            pfd[n].events = POLLIN;
+            owner[n++] = backup_count;
+        }
+        for (size_t i = 0; i < backup_count; i++) {
+            if (!backups[i].restoring)
+                continue;
+            pfd[n].fd = backups[i].restore_rep;
+            pfd[n].events = POLLIN;
+            owner[n++] = i;
+        }
+        if (n == 0)
+            break;
+        /* workers are looked after for as long as the prompt runs */
+        int timeout = -1;
+        nfds_t first_pidfd = n;
+        if (stdin_open) {
+            int died = 0;
+            for (size_t i = 0; i < backup_count; i++) {
+                if (backups[i].worker_pid > 0 && backups[i].pidfd < 0)
+                    died |= reap_worker(&backups[i]);
+            }
+            if (died)
+                print_prompt();
+            timeout = restart_workers();
+            for (size_t i = 0; i < backup_count; i++) {
+                if (backups[i].pidfd < 0)
+                    continue;
+                pfd[n].fd = backups[i].pidfd;
+                pfd[n].events = POLLIN;
+                owner[n++] = i;
+            }
+        }
+        if (poll(pfd, n, timeout) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            continue;
+        }
+        int input = 0;
+        for (nfds_t i = 0; i < n && !exit_requested; i++) {
+            if (!pfd[i].revents)
+                continue;
+            if (owner[i] == backup_count) {
+                input = 1;
+                continue;
+            }
+            if (i >= first_pidfd) {
+                if (reap_worker(&backups[owner[i]]))
+                    print_prompt();
+                continue;
+            }
+            restore_answer(&backups[owner[i]]);
+            if (stdin_open)
+                print_prompt();
+        }
+        if (input)
+            break;
+    }
+    free(owner);
+    free(pfd);
+}
+
+/* ---------- State file ---------- */
+
+/* -f: the registry is kept in this file and resumed on the next start */
+static const char *state_path = NULL;
+
+/* a path of a state line, with backslash, tab and newline escaped */
+static void state_put_path(FILE *f, const char *path) {
+    for (const char *p = path; *p; p++) {
+        if (*p == '\\' || *p == '\t' || *p == '\n') {
+            fputc('\\', f);
+            fputc(*p == '\t' ? 't' : *p == '\n' ? 'n' : '\\', f);
+        } else {
+            fputc(*p, f);
+        }
+    }
+}
+
+/* reads one escaped field of a state line up to the tab or the end of line;
+ * returns where it stopped, NULL if it does not fit */
+static const char *state_get_path(const char *p, char *out, size_t out_sz) {
+    size_t len = 0;
+    while (*p && *p != '\t' && *p != '\n') {
+        char c = *p++;
+        if (c == '\\' && *p) {
+            c = *p == 't' ? '\t' : *p == 'n' ? '\n' : *p;
+            p++;
+        }
+        if (len + 1 >= out_sz)
+            return NULL;
+        out[len++] = c;
+    }
+    out[len] = '\0';
+    return p;
+}
+
+/* Writes every target, ended ones included, as "active<TAB>source<TAB>target"
+ * lines to state_path.tmp, syncs it, renames it over state_path and syncs the
+ * directory, so a crash leaves either the old or the new registry. */
+static void state_save(void) {
+    if (!state_path)
+        return;
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", state_path) >= (int)sizeof(tmp)) {
+        err_file_open(state_path);
+        return;
+    }
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        err_file_open(tmp);
+        return;
+    }
+    for (size_t i = 0; i < backup_count; i++) {
+        struct BackupSource *bs = &backups[i];
+        for (size_t j = 0; j < bs->target_count; j++) {
+            fprintf(f, "%d\t", bs->targets[j].active);
+            state_put_path(f, bs->source_path);
+            fputc('\t', f);
+            state_put_path(f, bs->targets[j].target_path);
+            fputc('\n', f);
+        }
+    }
+    int failed = fflush(f) != 0 || fsync(fileno(f)) == -1;
+    if (fclose(f) != 0)
+        failed = 1;
+    if (failed || rename(tmp, state_path) == -1) {
+        perror("state file");
+        unlink(tmp);
+        return;
+    }
+    /* the rename is only durable once the directory is */
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", state_path);
+    char *slash = strrchr(dir, '/');
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+}
+
+static struct BackupSource *add_source(const char *src_real);
+static struct BackupTarget *add_target(struct BackupSource *bs, const char *tgt_real);
+
+/* Registers every backup of the state file and starts a worker per source.
+ * The targets already hold a mirror, which the worker's first sync brings up
+ * to date: it prunes what is gone from the source and copies only what fails
+ * the quick check. A missing file is an empty registry; an active backup whose
+ * source or target is gone is reported and left out. */
+static void state_resume(void) {
+    FILE *f = fopen(state_path, "r");
+    if (!f) {
+        if (errno != ENOENT)
+            err_file_open(state_path);
+        return;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) > 0) {
+        char src[4096], tgt[4096];
+        const char *p = NULL;
+        if ((line[0] == '0' || line[0] == '1') && line[1] == '\t')
+            p = state_get_path(line + 2, src, sizeof(src));
+        if (!p || *p != '\t' || !state_get_path(p + 1, tgt, sizeof(tgt)) || !src[0] || !tgt[0]) {
+            log_printf("[ERROR] Bad line in state file %s\n", state_path);
+            continue;
+        }
+        int active = line[0] == '1';
+        struct stat st;
+        if (active && (stat(src, &st) != 0 || !S_ISDIR(st.st_mode) || stat(tgt, &st) != 0 ||
+                       !S_ISDIR(st.st_mode))) {
+            log_printf("[ERROR] Cannot resume backup %s -> %s\n", src, tgt);
+            continue;
+        }
+        if (backup_exists(src, tgt))
+            continue;
+        struct BackupSource *bs = find_backup(src);
+        if (!bs)
+            bs = add_source(src);
+        add_target(bs, tgt)->active = active;
+    }
+    free(line);
+    fclose(f);
+
+    for (size_t i = 0; i < backup_count; i++) {
+        struct BackupSource *bs = &backups[i];
+        int active = 0;
+        for (size_t j = 0; j < bs->target_count; j++)
+            active |= bs->targets[j].active;
+        if (!active)
+            continue;
+        log_printf("[OK] Backup resumed for source: %s\n", bs->source_path);
+        restart_worker(bs);
+    }
+}
+
 /* ---------- Handlers ---------- */
 
+static struct BackupSource *add_source(const char *src_real) {
+    ensure_backup_capacity();
+    struct BackupSource *bs = &backups[backup_count++];
+    bs->source_path = xstrdup(src_real);
+    bs->worker_pid = 0;
+    bs->restore_req = -1;
+    bs->restore_rep = -1;
+    bs->restoring = NULL;
+    bs->pidfd = -1;
+    bs->started_ms = 0;
+    bs->restart_at_ms = 0;
+    bs->stopping = 0;
+    bs->backoff_ms = RESTART_BACKOFF_MIN_MS;
+    bs->restarts = 0;
+    bs->targets = NULL;
+    bs->target_count = 0;
+    bs->target_capacity = 0;
+    return bs;
+}
+
+static struct BackupTarget *add_target(struct BackupSource *bs, const char *tgt_real) {
+    /* grow target array */
+    if (bs->target_count == bs->target_capacity) {
+        bs->target_capacity = bs->target_capacity ? bs->target_capacity * 2 : 2;
+        bs->targets = xrealloc(bs->targets,
+                                bs->target_capacity * sizeof(*bs->targets));
+    }
+
+    struct BackupTarget *bt = &bs->targets[bs->target_count++];
+    bt->target_path = xstrdup(tgt_real);
+    bt->active = 1;
+    bt->inotify_fd = -1;
+    return bt;
+}
+
 void handle_add(const char *source, const char **targets, size_t target_count) {
     char src_real[4096];
     if (canonical_path(source, src_real, sizeof(src_real)) != 0) {
@@ -826,18 +2837,20 @@ void handle_add(const char *source, const char **targets, size_t target_count) {
         err_directory_does_not_exist(src_real);
         return;
     }
+    /* it would never reach the targets, whose trash has that name */
+    char trash[4096];
+    if (join_rel(trash, sizeof(trash), src_real, TRASH_NAME) == 0 && lstat(trash, &temp_st) == 0) {
+        log_printf("[ERROR] Source holds %s, a name reserved for the targets' trash.\n", trash);
+        return;
+    }
 
     struct BackupSource *bs = find_backup(src_real);
     if (!bs) {
-        ensure_backup_capacity();
-        bs = &backups[backup_count++];
-        bs->source_path = xstrdup(src_real);
-        bs->targets = NULL;
-        bs->target_count = 0;
-        bs->target_capacity = 0;
+        bs = add_source(src_real);
         msg_backup_started(src_real);
     }
 
+    int restart = 0;
     for (size_t i = 0; i < target_count; i++) {
         char tgt_real[4096];
         if (canonical_path(targets[i], tgt_real, sizeof(tgt_real)) != 0) {
@@ -874,6 +2887,7 @@ void handle_add(const char *source, const char **targets, size_t target_count) {
 
             if (bt==NULL) {
                 fprintf(stderr,"[DEBUG] Error");
+                continue;
             }
         }
         else if (backup_state == 0)
@@ -901,40 +2915,19 @@ void handle_add(const char *source, const char **targets, size_t target_count) {
                 }
             }
 
-            /* grow target array */
-            if (bs->target_count == bs->target_capacity) {
-                bs->target_capacity = bs->target_capacity ? bs->target_capacity * 2 : 2;
-                bs->targets = xrealloc(bs->targets,
-                                        bs->target_capacity * sizeof(*bs->targets));
-            }
-
-            bt = &bs->targets[bs->target_count++];
-            bt->target_path = xstrdup(tgt_real);
-            bt->active = 1;
-            bt->inotify_fd = -1;
-        }
-
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
-            bt->active = 0;
-            continue;
-        }
-
-        if (pid == 0) {
-            /* child: perform initial copy then wait for termination */
-            if (sync_directories(src_real, tgt_real) != 0) {
-                perror("copy");
-                _exit(1);
-            }
-
-            signal(SIGTERM, SIG_DFL);
-            mirror_event_loop(src_real, tgt_real);
+            bt = add_target(bs, tgt_real);
         }
 
-        bt->worker_pid = pid;
+        /* the running worker syncs it and takes it on; one that is stopping
+         * is replaced */
+        if (bs->stopping || send_request(bs, REQ_ADD, bt->target_path) != 0)
+            restart = 1;
         msg_target_added(tgt_real);
     }
+
+    if (restart)
+        restart_worker(bs);
+    state_save();
 }
 
 
@@ -947,6 +2940,7 @@ void handle_end(const char *source, const char **targets, size_t target_count) {
     if (!bs)
         return;
 
+    int restart = 0;
     for (size_t i = 0; i < target_count; i++) {
         char tgt_real[4096];
         if (canonical_path(targets[i], tgt_real, sizeof(tgt_real)) != 0)
@@ -959,12 +2953,25 @@ void handle_end(const char *source, const char **targets, size_t target_count) {
             if (strcmp(bt->target_path, tgt_real) != 0)
                 continue;
 
-            kill(bt->worker_pid, SIGTERM);
-            waitpid(bt->worker_pid, NULL, 0);
             bt->active = 0;
+            if (send_request(bs, REQ_END, tgt_real) != 0)
+                restart = 1;
             msg_backup_stopped(src_real, tgt_real);
         }
     }
+
+    /* a worker without targets is stopped, and reaped by wait_input once it
+     * exited instead of being waited for here */
+    int active = 0;
+    for (size_t j = 0; j < bs->target_count; j++)
+        active |= bs->targets[j].active;
+    if (restart) {
+        restart_worker(bs);
+    } else if (!active && bs->worker_pid > 0 && !bs->stopping) {
+        kill(bs->worker_pid, SIGTERM);
+        bs->stopping = 1;
+    }
+    state_save();
 }
 
 void handle_restore(const char *source, const char *target) {
@@ -982,14 +2989,17 @@ void handle_restore(const char *source, const char *target) {
 
     msg_restore_started(src_real, tgt_real);
 
-    /* copy from target back to source */
-    if (restore_entry(tgt_real, src_real, tgt_real, src_real) != 0) {
-        err_restore_blocked();
+    /* an active target is restored by the worker, which keeps running */
+    struct BackupSource *bs = find_backup(src_real);
+    int active = 0;
+    for (size_t j = 0; bs && j < bs->target_count; j++)
+        active |= bs->targets[j].active && strcmp(bs->targets[j].target_path, tgt_real) == 0;
+    if (active && bs->restoring) {
+        log_printf("[ERROR] A restore of %s is already running.\n", src_real);
         return;
     }
-
-    remove_if_missing(src_real, tgt_real, src_real, "");
-    msg_restore_finished();
+    if (!active || request_restore(bs, tgt_real) != 0)
+        restore_finish(src_real, tgt_real, NULL);
 }
 
 /* ---------- Other ---------- */
@@ -1169,14 +3179,30 @@ static void dispatch_command(char *line) {
 }
 
 
-int main(void) {
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        if (opt != 'f') {
+            fprintf(stderr, "usage: %s [-f state_file]\n", argv[0]);
+            return 1;
+        }
+        state_path = optarg;
+    }
+
     struct sigaction sa = {0};
     sa.sa_handler = on_signal;
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    /* a worker gone before it read a restore request shows up as EPIPE */
+    signal(SIGPIPE, SIG_IGN);
+    /* stdin is polled before every command, so no input may wait in a stdio
+     * buffer where poll cannot see it */
+    setvbuf(stdin, NULL, _IONBF, 0);
 
     startup_message();
     print_banner();
+    if (state_path)
+        state_resume();
 
     char *buffer = NULL;
     size_t buffer_size = 0;
@@ -1184,8 +3210,16 @@ int main(void) {
     while (1) {
         print_prompt();
 
-        if (getline(&buffer, &buffer_size, stdin) == -1)
+        wait_input(1);
+        if (exit_requested) {
+            msg_exit();
+            break;
+        }
+        if (getline(&buffer, &buffer_size, stdin) == -1) {
+            /* what the workers are still restoring is reported before leaving */
+            wait_input(0);
             break;
+        }
 
         if (strcmp(buffer, "\n") == 0)
             continue;
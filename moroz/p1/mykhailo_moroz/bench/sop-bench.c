@@ -0,0 +1,1432 @@
+// End-to-end benchmark driver for sop-backup.
+//
+// Builds a synthetic source tree, starts the daemon with its stdin/stdout on
+// pipes, adds one backup and then replays scripted mutation workloads against
+// it. Every phase ends with an idle barrier (see wait_idle) so the reported
+// time is the time until the mirror caught up, not until the driver gave up.
+// Results are appended as CSV rows so runs on different commits can be diffed.
+//
+// With -F it instead compares the two worker runtimes: how long adding many
+// tiny backups takes until all of them are protected, and what each one costs
+// in memory, with a forked worker per backup and as tasks on shared threads.
+// With -C it measures how much of the page cache the initial sync leaves
+// behind with normal, drop-behind (-n) and O_DIRECT (-D) copies, and with
+// -P how much faster it gets over a fragmented tree in on-disk order (-L).
+// With -Y it prices the durability modes (-d): how long a burst of small
+// writes takes until the sync watermark says it is on disk in each.
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), exit(EXIT_FAILURE))
+
+#define OUT_MAX (4 << 20)
+#define FILES_PER_DIR 1000
+#define WRITE_CHUNK (1 << 20)
+
+typedef struct
+{
+    const char* daemon;
+    const char* workdir;
+    const char* csv;
+    const char* label;
+    long small_files;
+    int huge_files;
+    long huge_mib;
+    int depth;
+    const char* workloads;
+    int settle_ms;
+    int timeout_s;
+    int threads;  // -t for the daemon, 0 = a forked worker per backup
+    long fleet;   // backups of the runtime comparison, 0 = the workloads above
+    int cache;    // compare the page cache footprint of the copy modes instead
+    long layout;  // files of the fragmented tree for the copy order comparison, 0 = none
+    long durable;  // files of the burst for the durability comparison, 0 = none
+} Options;
+
+typedef struct
+{
+    pid_t pid;
+    int in_fd;   // daemon stdin
+    int out_fd;  // daemon stdout
+    char* out;   // output of the last command
+    size_t out_len;
+} Daemon;
+
+// sums over all active backups from "stats --json"
+typedef struct
+{
+    unsigned long long events_read;
+    unsigned long long events_applied;
+    unsigned long long queue_depth;
+    unsigned long long files_copied;
+    unsigned long long bytes_copied;
+    int busy;  // some worker is not idle
+    int active;
+    int workers;
+    pid_t pids[64];
+    long long synced_ns[64];  // sync watermark of each of them, CLOCK_REALTIME
+} Snapshot;
+
+#define MAX_PROCS 65
+
+// cpu time per process (daemon + workers) and the highest VmHWM among them
+typedef struct
+{
+    int count;
+    pid_t pids[MAX_PROCS];
+    double cpu_s[MAX_PROCS];
+    long peak_rss_kib;
+} Usage;
+
+static char g_src[PATH_MAX];
+static char g_dst[PATH_MAX];
+static char g_scratch[PATH_MAX];
+static char g_state[PATH_MAX];
+static char g_data[WRITE_CHUNK];
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "USAGE: %s [options]\n", name);
+    fprintf(stderr, "  -b path    sop-backup binary (default ./sop-backup-bench)\n");
+    fprintf(stderr, "  -d dir     scratch directory, wiped before the run (default ./bench-work)\n");
+    fprintf(stderr, "  -o file    CSV file results are appended to (default ./bench-results.csv)\n");
+    fprintf(stderr, "  -l label   label for the rows, e.g. a commit id (default \"local\")\n");
+    fprintf(stderr, "  -n count   number of small files (default 20000)\n");
+    fprintf(stderr, "  -H count   number of huge files (default 2)\n");
+    fprintf(stderr, "  -S MiB     size of every huge file (default 128)\n");
+    fprintf(stderr, "  -D depth   depth of the deep directory chain (default 64)\n");
+    fprintf(stderr, "  -w list    workloads: writes,appends,rename,deletes,checkout,warm,restore (default all)\n");
+    fprintf(stderr, "  -q ms      quiet time the barrier needs before the mirror counts as idle (default 300)\n");
+    fprintf(stderr, "  -t sec     barrier timeout (default 600)\n");
+    fprintf(stderr, "  -T count   run the daemon with -t count, backups as tasks on shared threads\n");
+    fprintf(stderr, "  -F count   instead of the workloads, add count tiny backups with a forked worker each and\n");
+    fprintf(stderr, "             as tasks (on -T threads, default 4), reporting time and memory per backup\n");
+    fprintf(stderr, "  -C         instead of the workloads, compare the page cache the initial sync leaves behind\n");
+    fprintf(stderr, "             with normal, drop-behind (-n) and O_DIRECT (-D) copies\n");
+    fprintf(stderr, "  -P count   instead of the workloads, time the initial sync of a fragmented tree of count\n");
+    fprintf(stderr, "             files in directory order and in on-disk order (-L)\n");
+    fprintf(stderr, "  -Y count   instead of the workloads, time a burst of count small writes until they are\n");
+    fprintf(stderr, "             durable on the target with each durability mode (-d)\n");
+    exit(EXIT_FAILURE);
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static long long realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    {
+    }
+}
+
+static void path_join(char* out, const char* dir, const char* fmt, ...)
+{
+    char name[PATH_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(name, sizeof(name), fmt, ap);
+    va_end(ap);
+    if (snprintf(out, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX)
+    {
+        fprintf(stderr, "path too long: %s/%s\n", dir, name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// ---------- synthetic data ----------
+
+static void fill_data(void)
+{
+    unsigned int x = 2463534242u;
+    for (size_t i = 0; i < sizeof(g_data); i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        g_data[i] = (char)x;
+    }
+}
+
+static void write_file(const char* path, long long size, int flags)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | flags, 0644);
+    if (fd < 0)
+        ERR("open");
+    long long off = 0;
+    while (off < size)
+    {
+        size_t n = (size - off) < (long long)sizeof(g_data) ? (size_t)(size - off) : sizeof(g_data);
+        ssize_t w = write(fd, g_data, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("write");
+        }
+        off += w;
+    }
+    if (close(fd) < 0)
+        ERR("close");
+}
+
+static void make_dir(const char* path)
+{
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        ERR("mkdir");
+}
+
+static int rm_entry(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+    if (remove(path) < 0 && errno != ENOENT)
+        perror(path);
+    return 0;
+}
+
+static void rm_rf(const char* path)
+{
+    if (nftw(path, rm_entry, 64, FTW_DEPTH | FTW_PHYS) < 0 && errno != ENOENT)
+        ERR("nftw");
+}
+
+// small files are spread over "small/dNNNN" directories of FILES_PER_DIR files
+static void small_file_path(char* out, long i)
+{
+    char dir[PATH_MAX];
+    path_join(dir, g_src, "small/d%04ld", i / FILES_PER_DIR);
+    path_join(out, dir, "f%06ld", i);
+}
+
+// returns number of bytes written
+static long long build_source(const Options* o, long* files)
+{
+    long long bytes = 0;
+    *files = 0;
+    char path[PATH_MAX];
+
+    make_dir(g_src);
+    path_join(path, g_src, "small");
+    make_dir(path);
+    for (long i = 0; i < o->small_files; i++)
+    {
+        if (i % FILES_PER_DIR == 0)
+        {
+            path_join(path, g_src, "small/d%04ld", i / FILES_PER_DIR);
+            make_dir(path);
+        }
+        small_file_path(path, i);
+        long long size = 512 + (i * 7919) % 3584;  // 0.5 - 4 KiB
+        write_file(path, size, O_TRUNC);
+        bytes += size;
+        (*files)++;
+    }
+
+    path_join(path, g_src, "huge");
+    make_dir(path);
+    for (int i = 0; i < o->huge_files; i++)
+    {
+        char file[PATH_MAX];
+        path_join(file, path, "blob%02d", i);
+        write_file(file, o->huge_mib << 20, O_TRUNC);
+        bytes += o->huge_mib << 20;
+        (*files)++;
+    }
+
+    path_join(path, g_src, "deep");
+    make_dir(path);
+    for (int i = 0; i < o->depth; i++)
+    {
+        char next[PATH_MAX];
+        path_join(next, path, "l%02d", i % 100);
+        make_dir(next);
+        char file[PATH_MAX];
+        path_join(file, next, "leaf");
+        write_file(file, 1024, O_TRUNC);
+        bytes += 1024;
+        (*files)++;
+        snprintf(path, PATH_MAX, "%s", next);
+    }
+    return bytes;
+}
+
+// ---------- talking to the daemon ----------
+
+static void daemon_read_until_prompt(Daemon* d)
+{
+    d->out_len = 0;
+    d->out[0] = '\0';
+    for (;;)
+    {
+        // the interactive loop flushes "> " right before it blocks on the next command
+        if (d->out_len >= 2 && d->out[d->out_len - 2] == '>' && d->out[d->out_len - 1] == ' ' &&
+            (d->out_len == 2 || d->out[d->out_len - 3] == '\n'))
+        {
+            d->out_len -= 2;
+            d->out[d->out_len] = '\0';
+            return;
+        }
+
+        struct pollfd pfd = {d->out_fd, POLLIN, 0};
+        int r = poll(&pfd, 1, 600000);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("poll");
+        }
+        if (r == 0)
+        {
+            fprintf(stderr, "daemon did not answer\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (d->out_len + 4096 >= OUT_MAX)
+        {
+            fprintf(stderr, "daemon output too long\n");
+            exit(EXIT_FAILURE);
+        }
+        ssize_t n = read(d->out_fd, d->out + d->out_len, OUT_MAX - d->out_len - 1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("read");
+        }
+        if (n == 0)
+        {
+            fprintf(stderr, "daemon exited unexpectedly\n");
+            exit(EXIT_FAILURE);
+        }
+        d->out_len += (size_t)n;
+        d->out[d->out_len] = '\0';
+    }
+}
+
+static void daemon_cmd(Daemon* d, const char* fmt, ...)
+{
+    char line[3 * PATH_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    line[n++] = '\n';
+
+    for (int off = 0; off < n;)
+    {
+        ssize_t w = write(d->in_fd, line + off, (size_t)(n - off));
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("write(daemon)");
+        }
+        off += (int)w;
+    }
+    daemon_read_until_prompt(d);
+}
+
+// state is the registry file, NULL for none; threads > 0 runs the daemon with -t;
+// extra are more options for it, NULL or NULL terminated
+static void daemon_start(Daemon* d, const Options* o, const char* state, int threads, const char* const* extra)
+{
+    int in[2], out[2];
+    if (pipe(in) < 0 || pipe(out) < 0)
+        ERR("pipe");
+
+    d->pid = fork();
+    if (d->pid < 0)
+        ERR("fork");
+    if (d->pid == 0)
+    {
+        if (dup2(in[0], STDIN_FILENO) < 0 || dup2(out[1], STDOUT_FILENO) < 0)
+            ERR("dup2");
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        char count[16];
+        snprintf(count, sizeof(count), "%d", threads);
+        const char* args[16];
+        int n = 0;
+        args[n++] = o->daemon;
+        if (state)
+        {
+            args[n++] = "-f";
+            args[n++] = state;
+        }
+        if (threads > 0)
+        {
+            args[n++] = "-t";
+            args[n++] = count;
+        }
+        for (; extra && *extra && n < 15; extra++)
+            args[n++] = *extra;
+        args[n] = NULL;
+        execv(o->daemon, (char* const*)args);
+        ERR("execv");
+    }
+
+    close(in[0]);
+    close(out[1]);
+    d->in_fd = in[1];
+    d->out_fd = out[0];
+    d->out = malloc(OUT_MAX);
+    if (!d->out)
+        ERR("malloc");
+    daemon_read_until_prompt(d);
+}
+
+static void daemon_stop(Daemon* d)
+{
+    // "exit" does not print another prompt, so just send it and wait
+    if (write(d->in_fd, "exit\n", 5) < 0)
+        ERR("write(daemon)");
+    close(d->in_fd);
+    close(d->out_fd);
+    if (waitpid(d->pid, NULL, 0) < 0)
+        ERR("waitpid");
+    free(d->out);
+}
+
+static unsigned long long json_u64(const char* obj, const char* key)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char* p = strstr(obj, pattern);
+    return p ? strtoull(p + strlen(pattern), NULL, 10) : 0;
+}
+
+static void snapshot(Daemon* d, Snapshot* s)
+{
+    memset(s, 0, sizeof(*s));
+    daemon_cmd(d, "stats --json");
+    for (char* line = strtok(d->out, "\n"); line; line = strtok(NULL, "\n"))
+    {
+        if (line[0] != '{' || !strstr(line, "\"active\":1"))
+            continue;
+        s->events_read += json_u64(line, "events_read");
+        s->events_applied += json_u64(line, "events_applied");
+        s->queue_depth += json_u64(line, "queue_depth");
+        s->files_copied += json_u64(line, "files_copied");
+        s->bytes_copied += json_u64(line, "bytes_copied");
+        if (!strstr(line, "\"phase\":\"idle\""))
+            s->busy = 1;
+        s->active++;
+        if (s->workers < (int)(sizeof(s->pids) / sizeof(s->pids[0])))
+        {
+            s->synced_ns[s->workers] = (long long)json_u64(line, "synced_ns");
+            s->pids[s->workers++] = (pid_t)json_u64(line, "pid");
+        }
+    }
+}
+
+static int same_progress(const Snapshot* a, const Snapshot* b)
+{
+    return a->events_read == b->events_read && a->events_applied == b->events_applied &&
+           a->files_copied == b->files_copied && a->bytes_copied == b->bytes_copied;
+}
+
+// Waits until every worker is idle with an empty queue and its counters have
+// not moved for settle_ms. base is a snapshot from before the phase started.
+// Returns when the mirror caught up, on the now_s() clock: a worker moves its
+// sync watermark to the current time whenever it finds its queue drained, so
+// the first watermark at or after t0 is the worker's own record of having
+// applied everything that happened before t0. The slowest worker's one ends
+// the phase. Only if a worker publishes no watermark (e.g. while it has
+// pending moves or polled subtrees the whole time) does the time of the last
+// observed progress stand in, which is later by up to a poll of the stats.
+static double wait_idle(Daemon* d, const Options* o, double t0, const Snapshot* base, Snapshot* last)
+{
+    Snapshot prev = *base, cur;
+    double last_progress = t0;
+    long long since_ns = realtime_ns() - (long long)((now_s() - t0) * 1e9);
+    long long caught_up_ns[64] = {0};
+    for (;;)
+    {
+        snapshot(d, &cur);
+        double t = now_s();
+        if (!same_progress(&prev, &cur) || cur.busy)
+            last_progress = t;
+        prev = cur;
+        for (int i = 0; i < cur.workers; i++)
+        {
+            if (caught_up_ns[i] == 0 && cur.synced_ns[i] >= since_ns)
+                caught_up_ns[i] = cur.synced_ns[i];
+        }
+
+        if (!cur.busy && cur.queue_depth == 0 && cur.events_read == cur.events_applied &&
+            (t - last_progress) * 1000.0 >= o->settle_ms)
+            break;
+        if (t - t0 > o->timeout_s)
+        {
+            fprintf(stderr, "mirror did not become idle in %d s\n", o->timeout_s);
+            exit(EXIT_FAILURE);
+        }
+        sleep_ms(5);
+    }
+    if (last)
+        *last = cur;
+    if (cur.workers == 0)
+        return last_progress;
+    long long done_ns = since_ns;
+    for (int i = 0; i < cur.workers; i++)
+    {
+        if (caught_up_ns[i] == 0)
+            return last_progress;
+        if (caught_up_ns[i] > done_ns)
+            done_ns = caught_up_ns[i];
+    }
+    return t0 + (double)(done_ns - since_ns) / 1e9;
+}
+
+// ---------- resource usage ----------
+
+// -1 when the process is already gone
+static double proc_cpu_s(pid_t pid)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    // fields after "(comm)": state is field 3, utime 14, stime 15
+    char* p = strrchr(buf, ')');
+    if (!p)
+        return -1;
+    unsigned long utime = 0, stime = 0;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static long proc_peak_rss_kib(pid_t pid)
+{
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return 0;
+    long kib = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "VmHWM: %ld kB", &kib) == 1)
+            break;
+    }
+    fclose(f);
+    return kib;
+}
+
+static void usage_sample(const Daemon* d, const Snapshot* s, Usage* u)
+{
+    u->count = 0;
+    u->peak_rss_kib = 0;
+    for (int i = -1; i < s->workers; i++)
+    {
+        pid_t pid = (i < 0) ? d->pid : s->pids[i];
+        double cpu = proc_cpu_s(pid);
+        if (cpu < 0)
+            continue;
+        u->pids[u->count] = pid;
+        u->cpu_s[u->count] = cpu;
+        u->count++;
+        long rss = proc_peak_rss_kib(pid);
+        if (rss > u->peak_rss_kib)
+            u->peak_rss_kib = rss;
+    }
+}
+
+// cpu used between two samples by the processes still alive in the second one;
+// a worker that exited in between takes its share with it
+static double usage_cpu_delta(const Usage* before, const Usage* after)
+{
+    double total = 0;
+    for (int i = 0; i < after->count; i++)
+    {
+        double start = 0;
+        for (int j = 0; j < before->count; j++)
+        {
+            if (before->pids[j] == after->pids[i])
+                start = before->cpu_s[j];
+        }
+        total += after->cpu_s[i] - start;
+    }
+    return total;
+}
+
+// proportional set size of the daemon and its workers in KiB; forked workers
+// share the daemon's pages until they write to them, Pss splits those fairly
+static long tree_pss_kib(pid_t root)
+{
+    DIR* proc = opendir("/proc");
+    if (!proc)
+        ERR("opendir(/proc)");
+    long total = 0;
+    struct dirent* entry;
+    while ((entry = readdir(proc)) != NULL)
+    {
+        char* end;
+        long pid = strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0)
+            continue;
+
+        char path[64], line[256];
+        if (pid != root)
+        {
+            snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+            FILE* f = fopen(path, "r");
+            if (!f)
+                continue;
+            int ppid = 0;
+            char* p = fgets(line, sizeof(line), f) ? strrchr(line, ')') : NULL;
+            fclose(f);
+            if (!p || sscanf(p + 2, "%*c %d", &ppid) != 1 || ppid != root)
+                continue;
+        }
+
+        snprintf(path, sizeof(path), "/proc/%ld/smaps_rollup", pid);
+        FILE* f = fopen(path, "r");
+        if (!f)
+            continue;
+        long kib;
+        while (fgets(line, sizeof(line), f))
+        {
+            if (sscanf(line, "Pss: %ld kB", &kib) == 1)
+            {
+                total += kib;
+                break;
+            }
+        }
+        fclose(f);
+    }
+    closedir(proc);
+    return total;
+}
+
+// ---------- results ----------
+
+static FILE* csv_open(const Options* o)
+{
+    struct stat st;
+    int fresh = stat(o->csv, &st) < 0 || st.st_size == 0;
+    FILE* f = fopen(o->csv, "a");
+    if (!f)
+        ERR("fopen(csv)");
+    if (fresh)
+        fprintf(f, "label,scenario,phase,files,bytes,seconds,mib_per_s,files_per_s,cpu_s,peak_rss_kib\n");
+    return f;
+}
+
+static void report(FILE* csv, const Options* o, const char* scenario, const char* phase, long files,
+                   long long bytes, double seconds, const Usage* before, const Usage* after)
+{
+    double mibs = seconds > 0 ? (double)bytes / (1 << 20) / seconds : 0;
+    double fps = seconds > 0 ? (double)files / seconds : 0;
+    double cpu = usage_cpu_delta(before, after);
+    fprintf(csv, "%s,%s,%s,%ld,%lld,%.6f,%.2f,%.1f,%.3f,%ld\n", o->label, scenario, phase, files, bytes, seconds, mibs,
+            fps, cpu, after->peak_rss_kib);
+    fflush(csv);
+    printf("%-12s files=%-8ld bytes=%-12lld %9.3fs %9.2f MiB/s %10.1f files/s cpu=%.3fs rss=%ldKiB\n", phase, files,
+           bytes, seconds, mibs, fps, cpu, after->peak_rss_kib);
+}
+
+static int workload_enabled(const Options* o, const char* name)
+{
+    size_t len = strlen(name);
+    for (const char* p = o->workloads; (p = strstr(p, name)) != NULL; p += len)
+    {
+        if ((p == o->workloads || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))
+            return 1;
+    }
+    return 0;
+}
+
+// ---------- workloads ----------
+// each returns the number of files it touched and stores the bytes written
+
+static long wl_writes(const Options* o, long long* bytes)
+{
+    char path[PATH_MAX];
+    long n = o->small_files / 10 + 1;
+    *bytes = 0;
+    for (long i = 0; i < n && i < o->small_files; i++)
+    {
+        small_file_path(path, (i * 7) % o->small_files);
+        write_file(path, 2048, O_TRUNC);
+        *bytes += 2048;
+    }
+    return n < o->small_files ? n : o->small_files;
+}
+
+static long wl_appends(const Options* o, long long* bytes)
+{
+    char path[PATH_MAX];
+    long n = 0;
+    *bytes = 0;
+    for (int round = 0; round < 20; round++)
+    {
+        for (long i = 0; i < 50 && i < o->small_files; i++)
+        {
+            small_file_path(path, i);
+            write_file(path, 256, O_APPEND);
+            *bytes += 256;
+            n++;
+        }
+    }
+    for (int i = 0; i < o->huge_files; i++)
+    {
+        path_join(path, g_src, "huge/blob%02d", i);
+        write_file(path, 1 << 20, O_APPEND);
+        *bytes += 1 << 20;
+        n++;
+    }
+    return n;
+}
+
+static long wl_rename(const Options* o, long long* bytes)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    path_join(from, g_src, "small");
+    path_join(to, g_src, "small-renamed");
+    if (rename(from, to) < 0)
+        ERR("rename");
+    *bytes = 0;
+    return o->small_files;
+}
+
+static long wl_deletes(const Options* o, long long* bytes)
+{
+    char path[PATH_MAX];
+    path_join(path, g_src, "deep");
+    rm_rf(path);
+    *bytes = 0;
+    return o->depth;
+}
+
+// git checkout style: many files replaced through a temp file + rename, some
+// deleted and recreated, spread over many directories in a short burst
+static long wl_checkout(const Options* o, long long* bytes)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    long n = o->small_files / 5 + 1;
+    *bytes = 0;
+    for (long i = 0; i < n && i < o->small_files; i++)
+    {
+        long idx = (i * 13) % o->small_files;
+        char dir[PATH_MAX];
+        path_join(dir, g_src, "small-renamed/d%04ld", idx / FILES_PER_DIR);
+        path_join(path, dir, "f%06ld", idx);
+        if (i % 4 == 0)
+        {
+            if (unlink(path) < 0 && errno != ENOENT)
+                ERR("unlink");
+        }
+        path_join(tmp, dir, ".f%06ld.tmp", idx);
+        write_file(tmp, 1536, O_TRUNC);
+        if (rename(tmp, path) < 0)
+            ERR("rename");
+        *bytes += 1536;
+    }
+    return n < o->small_files ? n : o->small_files;
+}
+
+// run while the daemon is down: new files the restarted daemon has to catch up on
+static long wl_warm(const Options* o, long long* bytes)
+{
+    char path[PATH_MAX];
+    path_join(path, g_src, "warm");
+    make_dir(path);
+    long n = o->small_files / 100 + 1;
+    *bytes = 0;
+    for (long i = 0; i < n; i++)
+    {
+        path_join(path, g_src, "warm/w%06ld", i);
+        write_file(path, 1024, O_TRUNC);
+        *bytes += 1024;
+    }
+    return n;
+}
+
+// damages the source, then times "restore" bringing it back from the target
+static long wl_restore(const Options* o, Daemon* d, double* seconds)
+{
+    char path[PATH_MAX];
+    long n = 0;
+    for (long i = 0; i < o->small_files; i += 10)
+    {
+        path_join(path, g_src, "small-renamed/d%04ld/f%06ld", i / FILES_PER_DIR, i);
+        if (i % 20 == 0)
+            unlink(path);
+        else
+            write_file(path, 100, O_TRUNC);
+        n++;
+    }
+
+    double t0 = now_s();
+    daemon_cmd(d, "restore \"%s\" \"%s\"", g_src, g_dst);
+    *seconds = now_s() - t0;
+    return n;
+}
+
+// ---------- runtime comparison ----------
+
+static long inotify_instance_limit(void)
+{
+    FILE* f = fopen("/proc/sys/fs/inotify/max_user_instances", "r");
+    long limit = -1;
+    if (f)
+    {
+        if (fscanf(f, "%ld", &limit) != 1)
+            limit = -1;
+        fclose(f);
+    }
+    return limit;
+}
+
+// Adds o->fleet backups of one-file sources, one "add" each, and waits until
+// every one of them is idle, i.e. synced and watched. The row's bytes are the
+// growth of the daemon's (and its workers') Pss over the idle daemon; cpu comes
+// from the daemon's rusage, which includes its reaped workers.
+static void fleet_run(const Options* o, FILE* csv, const char* scenario, int threads)
+{
+    const char* runtime = threads > 0 ? "threads" : "fork";
+    char phase[64];
+    snprintf(phase, sizeof(phase), "fleet-%s", runtime);
+    long limit = inotify_instance_limit();
+    if (threads == 0 && limit >= 0 && o->fleet >= limit)
+    {
+        // a forked worker needs an inotify instance of its own, the tasks share one
+        printf("%-12s skipped: %ld backups need as many inotify instances, the limit is %ld "
+               "(sysctl fs.inotify.max_user_instances)\n",
+               phase, o->fleet, limit);
+        return;
+    }
+
+    char dst[PATH_MAX];
+    path_join(dst, g_scratch, "fleet-dst");
+    rm_rf(dst);
+    make_dir(dst);
+
+    struct rusage ru_before, ru_after;
+    getrusage(RUSAGE_CHILDREN, &ru_before);
+    Daemon d;
+    daemon_start(&d, o, NULL, threads, NULL);
+    long base_kib = tree_pss_kib(d.pid);
+
+    double t0 = now_s();
+    for (long i = 0; i < o->fleet; i++)
+        daemon_cmd(&d, "add \"%s/s%06ld\" \"%s/d%06ld\"", g_src, i, dst, i);
+    Snapshot base = {0}, s;
+    double t1 = wait_idle(&d, o, t0, &base, &s);
+    if (s.active != o->fleet)
+    {
+        fprintf(stderr, "%s: only %d of %ld backups came up\n", phase, s.active, o->fleet);
+        exit(EXIT_FAILURE);
+    }
+    long kib = tree_pss_kib(d.pid) - base_kib;
+    long peak_kib = proc_peak_rss_kib(d.pid);
+
+    daemon_stop(&d);
+    getrusage(RUSAGE_CHILDREN, &ru_after);
+    Usage before = {0}, after = {1, {d.pid}, {0}, peak_kib};
+    after.cpu_s[0] = (double)(ru_after.ru_utime.tv_sec - ru_before.ru_utime.tv_sec) +
+                     (double)(ru_after.ru_stime.tv_sec - ru_before.ru_stime.tv_sec) +
+                     (double)(ru_after.ru_utime.tv_usec - ru_before.ru_utime.tv_usec) / 1e6 +
+                     (double)(ru_after.ru_stime.tv_usec - ru_before.ru_stime.tv_usec) / 1e6;
+    report(csv, o, scenario, phase, o->fleet, (long long)kib * 1024, t1 - t0, &before, &after);
+    printf("%-12s %.1f KiB per backup, %.3f ms per add\n", phase, (double)kib / (double)o->fleet,
+           (t1 - t0) * 1000.0 / (double)o->fleet);
+    rm_rf(dst);
+}
+
+static void fleet_main(const Options* o, FILE* csv)
+{
+    char scenario[64];
+    snprintf(scenario, sizeof(scenario), "fleet%ld", o->fleet);
+    printf("building %ld sources\n", o->fleet);
+    make_dir(g_src);
+    for (long i = 0; i < o->fleet; i++)
+    {
+        char dir[PATH_MAX], file[PATH_MAX];
+        path_join(dir, g_src, "s%06ld", i);
+        make_dir(dir);
+        path_join(file, dir, "f");
+        write_file(file, 1024, O_TRUNC);
+    }
+    sync();
+
+    fleet_run(o, csv, scenario, 0);
+    fleet_run(o, csv, scenario, o->threads > 0 ? o->threads : 4);
+}
+
+// ---------- page cache footprint ----------
+
+static int g_cache_evict;           // cache_entry drops the file's pages instead of counting them
+static long long g_cache_resident;  // bytes of the walked files in the page cache
+static long long g_cache_size;
+
+static int cache_entry(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+    if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0)
+        return 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        ERR("open");
+    if (g_cache_evict)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        return 0;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = ((size_t)st->st_size + (size_t)page - 1) / (size_t)page;
+    void* map = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char* vec = malloc(pages);
+    if (map == MAP_FAILED || !vec)
+        ERR("mmap");
+    if (mincore(map, (size_t)st->st_size, vec) < 0)
+        ERR("mincore");
+    for (size_t i = 0; i < pages; i++)
+        g_cache_resident += (vec[i] & 1) ? page : 0;
+    g_cache_size += (long long)pages * page;
+    free(vec);
+    munmap(map, (size_t)st->st_size);
+    close(fd);
+    return 0;
+}
+
+// page cache bytes held by the files under path; total gets their size in pages
+static long long cache_resident(const char* path, long long* total)
+{
+    g_cache_evict = 0;
+    g_cache_resident = 0;
+    g_cache_size = 0;
+    if (nftw(path, cache_entry, 64, FTW_PHYS) < 0)
+        ERR("nftw");
+    if (total)
+        *total = g_cache_size;
+    return g_cache_resident;
+}
+
+static void cache_evict(const char* path)
+{
+    sync();
+    g_cache_evict = 1;
+    if (nftw(path, cache_entry, 64, FTW_PHYS) < 0)
+        ERR("nftw");
+}
+
+static void read_tree(const char* path)
+{
+    char file[PATH_MAX];
+    DIR* dir = opendir(path);
+    if (!dir)
+        ERR("opendir");
+    struct dirent* e;
+    while ((e = readdir(dir)) != NULL)
+    {
+        if (e->d_name[0] == '.')
+            continue;
+        path_join(file, path, "%s", e->d_name);
+        struct stat st;
+        if (lstat(file, &st) < 0)
+            ERR("lstat");
+        if (S_ISDIR(st.st_mode))
+        {
+            read_tree(file);
+            continue;
+        }
+        int fd = open(file, O_RDONLY);
+        if (fd < 0)
+            ERR("open");
+        while (read(fd, g_data, sizeof(g_data)) > 0)
+        {
+        }
+        close(fd);
+    }
+    closedir(dir);
+}
+
+// One initial sync per copy mode, each from a source that is out of the cache
+// except for the small files, read just before as a stand-in for what the
+// applications on the machine are working with. The row's bytes are what the
+// source and target still hold in the page cache once the sync is done and
+// written back; the small files should stay, the rest should not.
+static void cache_main(const Options* o, FILE* csv, const char* scenario, long files)
+{
+    // O_DIRECT for the huge files only
+    char direct_mib[32];
+    snprintf(direct_mib, sizeof(direct_mib), "%ld", o->huge_mib > 1 ? o->huge_mib / 2 : 1);
+    const char* drop[] = {"-n", NULL};
+    const char* direct[] = {"-n", "-D", direct_mib, NULL};
+    struct
+    {
+        const char* phase;
+        const char* const* flags;
+    } modes[] = {{"cache-normal", NULL}, {"cache-drop", drop}, {"cache-direct", direct}};
+
+    char small[PATH_MAX];
+    path_join(small, g_src, "small");
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        rm_rf(g_dst);
+        cache_evict(g_src);
+        read_tree(small);
+        long long ws_total;
+        long long ws_before = cache_resident(small, &ws_total);
+
+        Daemon d;
+        daemon_start(&d, o, NULL, o->threads, modes[i].flags);
+        Snapshot s = {0};
+        Usage before, after;
+        usage_sample(&d, &s, &before);
+        double t0 = now_s();
+        daemon_cmd(&d, "add \"%s\" \"%s\"", g_src, g_dst);
+        double t1 = wait_idle(&d, o, t0, &s, &s);
+        usage_sample(&d, &s, &after);
+        daemon_stop(&d);
+        sync();
+
+        long long src_total, dst_total;
+        long long src_kept = cache_resident(g_src, &src_total);
+        long long dst_kept = cache_resident(g_dst, &dst_total);
+        long long ws_kept = cache_resident(small, NULL);
+        report(csv, o, scenario, modes[i].phase, files, src_kept + dst_kept, t1 - t0, &before, &after);
+        printf("%-12s cached after sync: src %.1f of %.1f MiB, dst %.1f of %.1f MiB, "
+               "working set %.1f of %.1f MiB (%.1f before)\n",
+               modes[i].phase, (double)src_kept / (1 << 20), (double)src_total / (1 << 20),
+               (double)dst_kept / (1 << 20), (double)dst_total / (1 << 20), (double)ws_kept / (1 << 20),
+               (double)ws_total / (1 << 20), (double)ws_before / (1 << 20));
+    }
+}
+
+// ---------- copy order ----------
+
+#define FRAG_FILE_SIZE (128 << 10)
+#define FRAG_PIECE (16 << 10)
+#define FRAG_GROUP 64  // files written piece by piece side by side
+#define FRAG_DIRS 32
+
+// Writes count files so that their pieces interleave on disk, and so that
+// where a file lies has nothing to do with its name or directory: files are
+// written in groups, a piece of each in turn with an fsync after every one,
+// which keeps delayed allocation from putting each file back in one piece.
+static long long build_fragmented(long count)
+{
+    make_dir(g_src);
+    for (int i = 0; i < FRAG_DIRS; i++)
+    {
+        char dir[PATH_MAX];
+        path_join(dir, g_src, "d%02d", i);
+        make_dir(dir);
+    }
+
+    long* order = malloc((size_t)count * sizeof(*order));
+    if (!order)
+        ERR("malloc");
+    for (long i = 0; i < count; i++)
+        order[i] = i;
+    unsigned int x = 88172645u;
+    for (long i = count - 1; i > 0; i--)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        long j = (long)(x % (unsigned int)(i + 1));
+        long t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    int fds[FRAG_GROUP];
+    for (long g = 0; g < count; g += FRAG_GROUP)
+    {
+        int n = count - g < FRAG_GROUP ? (int)(count - g) : FRAG_GROUP;
+        for (int k = 0; k < n; k++)
+        {
+            char path[PATH_MAX];
+            long id = order[g + k];
+            path_join(path, g_src, "d%02ld/f%06ld", id % FRAG_DIRS, id);
+            fds[k] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fds[k] < 0)
+                ERR("open");
+        }
+        for (int off = 0; off < FRAG_FILE_SIZE; off += FRAG_PIECE)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                if (write(fds[k], g_data + off, FRAG_PIECE) != FRAG_PIECE)
+                    ERR("write");
+                if (fsync(fds[k]) < 0)
+                    ERR("fsync");
+            }
+        }
+        for (int k = 0; k < n; k++)
+            close(fds[k]);
+    }
+    free(order);
+    return (long long)count * FRAG_FILE_SIZE;
+}
+
+// The initial sync of the fragmented tree from a cold cache, once in
+// directory order and once in on-disk order; the gain is the ratio of the two.
+static void layout_main(const Options* o, FILE* csv)
+{
+    char scenario[64];
+    snprintf(scenario, sizeof(scenario), "frag%ld", o->layout);
+    printf("building fragmented tree %s\n", scenario);
+    long long bytes = build_fragmented(o->layout);
+    sync();
+
+    const char* ordered[] = {"-L", NULL};
+    struct
+    {
+        const char* phase;
+        const char* const* flags;
+    } modes[] = {{"order-readdir", NULL}, {"order-disk", ordered}};
+    double seconds[2];
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        rm_rf(g_dst);
+        sync();
+        cache_evict(g_src);
+
+        Daemon d;
+        daemon_start(&d, o, NULL, o->threads, modes[i].flags);
+        Snapshot s = {0};
+        Usage before, after;
+        usage_sample(&d, &s, &before);
+        double t0 = now_s();
+        daemon_cmd(&d, "add \"%s\" \"%s\"", g_src, g_dst);
+        double t1 = wait_idle(&d, o, t0, &s, &s);
+        usage_sample(&d, &s, &after);
+        daemon_stop(&d);
+        seconds[i] = t1 - t0;
+        report(csv, o, scenario, modes[i].phase, o->layout, bytes, seconds[i], &before, &after);
+    }
+    printf("on-disk order: %.2fx the throughput of directory order\n", seconds[1] > 0 ? seconds[0] / seconds[1] : 0);
+}
+
+// ---------- durability ----------
+
+#define DURABLE_FILE_SIZE 4096
+// few enough per directory that no directory gets hot and rescanned instead (polled.h)
+#define DURABLE_FILES_PER_DIR 100
+
+// Waits until the backup's sync watermark reaches since_ns, i.e. the target
+// holds, durably with -d, everything written before then. Returns when it did.
+static double wait_synced(Daemon* d, const Options* o, double t0, long long since_ns)
+{
+    for (;;)
+    {
+        daemon_cmd(d, "stats --json");
+        double t = now_s();
+        const char* line = strstr(d->out, "{\"pid\"");
+        if (line && (long long)json_u64(line, "synced_ns") >= since_ns)
+            return t;
+        if (t - t0 > o->timeout_s)
+        {
+            fprintf(stderr, "the mirror did not sync in %d s\n", o->timeout_s);
+            exit(EXIT_FAILURE);
+        }
+        sleep_ms(2);
+    }
+}
+
+// The same burst of small writes with every durability mode: the time from its
+// first write until the watermark covers its last one is what the mode costs
+// in throughput, next to the syncs it took.
+static void durable_main(const Options* o, FILE* csv)
+{
+    char scenario[64];
+    snprintf(scenario, sizeof(scenario), "burst%ld", o->durable);
+    long dirs = (o->durable + DURABLE_FILES_PER_DIR - 1) / DURABLE_FILES_PER_DIR;
+
+    const char* periodic[] = {"-d", "periodic", NULL};
+    const char* group[] = {"-d", "group", NULL};
+    const char* each[] = {"-d", "group", "-G", "1", NULL};
+    struct
+    {
+        const char* phase;
+        const char* const* flags;
+    } modes[] = {{"durable-none", NULL},
+                 {"durable-periodic", periodic},
+                 {"durable-group", group},
+                 {"durable-each", each}};
+    double seconds[4];
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        rm_rf(g_src);
+        rm_rf(g_dst);
+        make_dir(g_src);
+        for (long k = 0; k < dirs; k++)
+        {
+            char dir[PATH_MAX];
+            path_join(dir, g_src, "d%04ld", k);
+            make_dir(dir);
+        }
+        sync();
+
+        Daemon d;
+        daemon_start(&d, o, NULL, o->threads, modes[i].flags);
+        Snapshot s = {0};
+        daemon_cmd(&d, "add \"%s\" \"%s\"", g_src, g_dst);
+        wait_idle(&d, o, now_s(), &s, &s);
+        Usage before, after;
+        usage_sample(&d, &s, &before);
+
+        double t0 = now_s();
+        for (long k = 0; k < o->durable; k++)
+        {
+            char path[PATH_MAX];
+            path_join(path, g_src, "d%04ld/f%06ld", k / DURABLE_FILES_PER_DIR, k);
+            write_file(path, DURABLE_FILE_SIZE, O_TRUNC);
+        }
+        double t1 = wait_synced(&d, o, t0, realtime_ns());
+        snapshot(&d, &s);
+        usage_sample(&d, &s, &after);
+        const char* line = strstr(d.out, "{\"pid\"");
+        unsigned long long syncs = line ? json_u64(line, "durable_syncs") : 0;
+        daemon_stop(&d);
+        seconds[i] = t1 - t0;
+        report(csv, o, scenario, modes[i].phase, o->durable, (long long)o->durable * DURABLE_FILE_SIZE, seconds[i],
+               &before, &after);
+        printf("%-12s syncs=%llu\n", "", syncs);
+    }
+    for (size_t i = 1; i < sizeof(modes) / sizeof(modes[0]); i++)
+        printf("%s: %.2fx the time of durable-none\n", modes[i].phase, seconds[0] > 0 ? seconds[i] / seconds[0] : 0);
+}
+
+int main(int argc, char** argv)
+{
+    Options o = {"./sop-backup-bench", "./bench-work", "./bench-results.csv", "local", 20000, 2, 128, 64,
+                 "writes,appends,rename,deletes,checkout,warm,restore", 300, 600, 0, 0, 0, 0, 0};
+    int c;
+    while ((c = getopt(argc, argv, "b:d:o:l:n:H:S:D:w:q:t:T:F:CP:Y:")) != -1)
+    {
+        switch (c)
+        {
+            case 'b':
+                o.daemon = optarg;
+                break;
+            case 'd':
+                o.workdir = optarg;
+                break;
+            case 'o':
+                o.csv = optarg;
+                break;
+            case 'l':
+                o.label = optarg;
+                break;
+            case 'n':
+                o.small_files = atol(optarg);
+                break;
+            case 'H':
+                o.huge_files = atoi(optarg);
+                break;
+            case 'S':
+                o.huge_mib = atol(optarg);
+                break;
+            case 'D':
+                o.depth = atoi(optarg);
+                break;
+            case 'w':
+                o.workloads = optarg;
+                break;
+            case 'q':
+                o.settle_ms = atoi(optarg);
+                break;
+            case 't':
+                o.timeout_s = atoi(optarg);
+                break;
+            case 'T':
+                o.threads = atoi(optarg);
+                break;
+            case 'F':
+                o.fleet = atol(optarg);
+                break;
+            case 'C':
+                o.cache = 1;
+                break;
+            case 'P':
+                o.layout = atol(optarg);
+                break;
+            case 'Y':
+                o.durable = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc || o.small_files < 1 || o.huge_files < 0 || o.huge_mib < 0 || o.depth < 0 ||
+        o.settle_ms < 0 || o.timeout_s < 1 || o.threads < 0 || o.fleet < 0 || o.layout < 0 ||
+        o.durable < 0)
+        usage(argv[0]);
+
+    char daemon_abs[PATH_MAX];
+    if (!realpath(o.daemon, daemon_abs))
+        ERR("realpath(daemon)");
+    o.daemon = daemon_abs;
+
+    rm_rf(o.workdir);
+    make_dir(o.workdir);
+    if (!realpath(o.workdir, g_scratch))
+        ERR("realpath(workdir)");
+    path_join(g_src, g_scratch, "src");
+    path_join(g_dst, g_scratch, "dst");
+    path_join(g_state, g_scratch, "state");
+    fill_data();
+
+    if (o.fleet > 0)
+    {
+        FILE* csv = csv_open(&o);
+        fleet_main(&o, csv);
+        fclose(csv);
+        rm_rf(o.workdir);
+        return EXIT_SUCCESS;
+    }
+    if (o.layout > 0)
+    {
+        FILE* csv = csv_open(&o);
+        layout_main(&o, csv);
+        fclose(csv);
+        rm_rf(o.workdir);
+        return EXIT_SUCCESS;
+    }
+    if (o.durable > 0)
+    {
+        FILE* csv = csv_open(&o);
+        durable_main(&o, csv);
+        fclose(csv);
+        rm_rf(o.workdir);
+        return EXIT_SUCCESS;
+    }
+
+    char scenario[128];
+    int len = snprintf(scenario, sizeof(scenario), "n%ld-h%dx%ldM-d%d", o.small_files, o.huge_files, o.huge_mib,
+                       o.depth);
+    if (o.threads > 0)
+        snprintf(scenario + len, sizeof(scenario) - (size_t)len, "-t%d", o.threads);
+    FILE* csv = csv_open(&o);
+
+    printf("building source tree %s\n", scenario);
+    long files;
+    long long bytes = build_source(&o, &files);
+    sync();
+
+    if (o.cache)
+    {
+        cache_main(&o, csv, scenario, files);
+        fclose(csv);
+        rm_rf(o.workdir);
+        return EXIT_SUCCESS;
+    }
+
+    Daemon d;
+    daemon_start(&d, &o, g_state, o.threads, NULL);
+
+    Snapshot s = {0};
+    Usage before, after;
+    usage_sample(&d, &s, &before);
+
+    double t0 = now_s();
+    daemon_cmd(&d, "add \"%s\" \"%s\"", g_src, g_dst);
+    double t1 = wait_idle(&d, &o, t0, &s, &s);
+    usage_sample(&d, &s, &after);
+    report(csv, &o, scenario, "initial-sync", files, bytes, t1 - t0, &before, &after);
+
+    struct
+    {
+        const char* name;
+        long (*run)(const Options*, long long*);
+    } steady[] = {{"writes", wl_writes},
+                  {"appends", wl_appends},
+                  {"rename", wl_rename},
+                  {"deletes", wl_deletes},
+                  {"checkout", wl_checkout}};
+
+    for (size_t i = 0; i < sizeof(steady) / sizeof(steady[0]); i++)
+    {
+        if (!workload_enabled(&o, steady[i].name))
+            continue;
+        // checkout works on the renamed tree
+        if (strcmp(steady[i].name, "checkout") == 0 && !workload_enabled(&o, "rename"))
+            continue;
+
+        Snapshot base;
+        snapshot(&d, &base);
+        usage_sample(&d, &base, &before);
+        long long wl_bytes;
+        long wl_files = steady[i].run(&o, &wl_bytes);
+        // lag is measured from the end of the mutation burst
+        double start = now_s();
+        double done = wait_idle(&d, &o, start, &base, &s);
+        usage_sample(&d, &s, &after);
+        report(csv, &o, scenario, steady[i].name, wl_files, wl_bytes, done - start, &before, &after);
+    }
+
+    if (workload_enabled(&o, "warm"))
+    {
+        // time-to-protected: from starting a daemon on the saved registry until
+        // the resumed worker has caught up with what changed while it was down
+        daemon_stop(&d);
+        long long wl_bytes;
+        long wl_files = wl_warm(&o, &wl_bytes);
+        Usage none = {0};
+        Snapshot base = {0};
+        double start = now_s();
+        daemon_start(&d, &o, g_state, o.threads, NULL);
+        double done = wait_idle(&d, &o, start, &base, &s);
+        usage_sample(&d, &s, &after);
+        report(csv, &o, scenario, "warm-restart", wl_files, wl_bytes, done - start, &none, &after);
+    }
+
+    if (workload_enabled(&o, "restore") && workload_enabled(&o, "rename"))
+    {
+        usage_sample(&d, &s, &before);
+        double seconds;
+        long restored = wl_restore(&o, &d, &seconds);
+        usage_sample(&d, &s, &after);
+        report(csv, &o, scenario, "restore", restored, 0, seconds, &before, &after);
+    }
+
+    daemon_stop(&d);
+    fclose(csv);
+    rm_rf(o.workdir);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,692 @@
+#define _GNU_SOURCE
+#include "control.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+#define LINE_MAX_LEN 65536
+// a client whose unsent replies grow beyond this is not read from until it catches up
+#define OUT_HIGH_WATER (1 << 20)
+
+typedef struct
+{
+    int fd;
+    int interactive;  // the stdin/stdout operator: prompt, blocking writes to stdout
+    int closing;      // peer hung up, close once replies are flushed
+    int unpolled;     // stdin epoll refuses (a regular file): read on every loop turn
+    unsigned parked;  // control_park() id of the command still running, 0 if none
+    char* in;
+    size_t in_len;
+    size_t in_cap;
+    char* out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+} Client;
+
+// any other descriptor the owner wants to hear about, e.g. a worker's pidfd
+typedef struct
+{
+    void (*ready)(int fd, void* arg);
+    void* arg;
+} FdWatch;
+
+typedef struct
+{
+    int epoll_fd;
+    int signal_fd;
+    int timer_fd;
+    int listen_fd;
+    const char* socket_path;
+    Client** by_fd;  // indexed by descriptor, NULL for non-clients
+    size_t by_fd_cap;
+    FdWatch* watches;  // indexed by descriptor, ready == NULL if not watched
+    size_t watches_cap;
+    int stop;
+    int draining;          // console EOF with no socket: stop once no command is parked
+    const ControlHooks* hooks;
+    Client* current;       // the client whose command is being executed
+    Client* unpolled;      // the console when it cannot be polled, NULL otherwise
+    unsigned park_seq;
+    size_t parked;         // clients waiting for control_resume()
+} ControlLoop;
+
+static ControlLoop g_loop = {-1, -1, -1, -1, NULL, NULL, 0, NULL, 0, 0, 0, NULL, NULL, NULL, 0, 0};
+
+static int append(char** buf, size_t* len, size_t* cap, const char* data, size_t n)
+{
+    if (n == 0)
+        return 0;
+    if (*len + n > *cap)
+    {
+        size_t new_cap = (*cap == 0) ? 4096 : *cap;
+        while (new_cap < *len + n)
+            new_cap *= 2;
+        char* tmp = realloc(*buf, new_cap);
+        if (!tmp)
+        {
+            perror("realloc(client buffer)");
+            return -1;
+        }
+        *buf = tmp;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+static int epoll_set(int fd, uint32_t events, int op)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(g_loop.epoll_fd, op, fd, &ev);
+}
+
+static Client* client_add(int fd, int interactive)
+{
+    if ((size_t)fd >= g_loop.by_fd_cap)
+    {
+        size_t new_cap = g_loop.by_fd_cap ? g_loop.by_fd_cap : 16;
+        while (new_cap <= (size_t)fd)
+            new_cap *= 2;
+        Client** tmp = realloc(g_loop.by_fd, new_cap * sizeof(*tmp));
+        if (!tmp)
+        {
+            perror("realloc(clients)");
+            return NULL;
+        }
+        memset(tmp + g_loop.by_fd_cap, 0, (new_cap - g_loop.by_fd_cap) * sizeof(*tmp));
+        g_loop.by_fd = tmp;
+        g_loop.by_fd_cap = new_cap;
+    }
+
+    Client* c = calloc(1, sizeof(*c));
+    if (!c)
+    {
+        perror("calloc(client)");
+        return NULL;
+    }
+    c->fd = fd;
+    c->interactive = interactive;
+    if (epoll_set(fd, EPOLLIN, EPOLL_CTL_ADD) < 0)
+    {
+        // a stdin that is a regular file cannot be polled; it is always
+        // readable, so the loop reads it on every turn instead
+        if (!interactive || errno != EPERM)
+        {
+            perror("epoll_ctl(client)");
+            free(c);
+            return NULL;
+        }
+        c->unpolled = 1;
+        g_loop.unpolled = c;
+    }
+    g_loop.by_fd[fd] = c;
+    return c;
+}
+
+static void client_close(Client* c)
+{
+    if (c->unpolled)
+        g_loop.unpolled = NULL;
+    else
+        epoll_ctl(g_loop.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->parked)
+        g_loop.parked--;
+    g_loop.by_fd[c->fd] = NULL;
+    if (!c->interactive && close(c->fd) < 0)
+        perror("close(client)");
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+// tries to push pending replies; returns -1 if the client is gone
+static int client_flush(Client* c)
+{
+    if (c->interactive)
+    {
+        // stdout may be a terminal or a pipe, a blocking write keeps it simple
+        if (c->out_len == 0)
+            return 0;
+        fwrite(c->out, 1, c->out_len, stdout);
+        fflush(stdout);
+        c->out_len = 0;
+        return 0;
+    }
+
+    while (c->out_off < c->out_len)
+    {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        c->out_off += (size_t)n;
+    }
+    if (c->out_off == c->out_len)
+    {
+        c->out_off = 0;
+        c->out_len = 0;
+    }
+    if (c->unpolled)
+        return 0;
+
+    int want_read = !c->closing && !c->parked && c->out_len - c->out_off < OUT_HIGH_WATER;
+    uint32_t events = (want_read ? EPOLLIN : 0) | (c->out_len ? EPOLLOUT : 0);
+    if (epoll_set(c->fd, events, EPOLL_CTL_MOD) < 0)
+    {
+        perror("epoll_ctl(client)");
+        return -1;
+    }
+    return 0;
+}
+
+static void client_end_reply(Client* c);
+
+static void client_execute(Client* c, char* line, const ControlHooks* hooks)
+{
+    char* reply = NULL;
+    size_t reply_len = 0;
+    FILE* out = open_memstream(&reply, &reply_len);
+    if (!out)
+    {
+        perror("open_memstream");
+        return;
+    }
+
+    g_loop.current = c;
+    if (hooks->execute(line, out))
+        g_loop.stop = 1;
+    g_loop.current = NULL;
+    if (fclose(out) != 0)
+        perror("fclose(reply)");
+
+    append(&c->out, &c->out_len, &c->out_cap, reply, reply_len);
+    free(reply);
+    // a parked command ends its reply in control_resume()
+    if (!c->parked)
+        client_end_reply(c);
+}
+
+static void client_end_reply(Client* c)
+{
+    // the interactive operator gets a prompt, socket clients an end-of-reply marker
+    // so that pipelined replies can be told apart
+    if (c->interactive)
+    {
+        if (!g_loop.stop)
+            append(&c->out, &c->out_len, &c->out_cap, "> ", 2);
+    }
+    else
+    {
+        append(&c->out, &c->out_len, &c->out_cap, ".\n", 2);
+    }
+}
+
+// executes every complete line buffered for the client
+static void client_process_lines(Client* c, const ControlHooks* hooks)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < c->in_len && !g_loop.stop && !c->parked; i++)
+    {
+        if (c->in[i] != '\n')
+            continue;
+        c->in[i] = '\0';
+        client_execute(c, c->in + start, hooks);
+        start = i + 1;
+        // stop taking lines from a client that does not read its replies
+        if (!c->interactive && c->out_len - c->out_off >= OUT_HIGH_WATER)
+            break;
+    }
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+}
+
+static void client_readable(Client* c, const ControlHooks* hooks)
+{
+    char buf[4096];
+    ssize_t n = read(c->fd, buf, sizeof(buf));
+    if (n < 0)
+    {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        perror("read(client)");
+        n = 0;
+    }
+
+    if (n == 0)
+    {
+        // a last command without a newline still counts
+        if (c->in_len > 0)
+        {
+            append(&c->in, &c->in_len, &c->in_cap, "\n", 1);
+            client_process_lines(c, hooks);
+        }
+        c->closing = 1;
+        // nobody else can reach the daemon; commands still running get to reply
+        if (c->interactive && g_loop.listen_fd < 0)
+            g_loop.draining = 1;
+        return;
+    }
+
+    if (append(&c->in, &c->in_len, &c->in_cap, buf, (size_t)n) < 0)
+        return;
+    if (c->in_len > LINE_MAX_LEN && !memchr(c->in, '\n', c->in_len))
+    {
+        static const char msg[] = "line too long\n.\n";
+        append(&c->out, &c->out_len, &c->out_cap, msg, sizeof(msg) - 1);
+        c->in_len = 0;
+        c->closing = 1;
+        return;
+    }
+    client_process_lines(c, hooks);
+}
+
+// services one client after epoll reported it; returns -1 once it should be closed
+static int client_service(Client* c, uint32_t events, const ControlHooks* hooks)
+{
+    // a parked client is not read from: its lines wait for the reply before them
+    if (c->parked && !c->interactive && (events & (EPOLLHUP | EPOLLERR)))
+        return -1;
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->parked)
+        client_readable(c, hooks);
+    if (client_flush(c) < 0)
+        return -1;
+
+    // lines held back while the client was not reading its replies
+    while (!g_loop.stop && !c->parked && c->out_len == 0 && c->in_len > 0 && memchr(c->in, '\n', c->in_len))
+    {
+        client_process_lines(c, hooks);
+        if (client_flush(c) < 0)
+            return -1;
+    }
+    // the operator still sees the reply of a parked command after its EOF; a
+    // socket client that hung up has nobody to send it to
+    if (c->parked && c->interactive)
+        return 0;
+    return (c->closing && c->out_len == 0) ? -1 : 0;
+}
+
+static void accept_clients(void)
+{
+    while (1)
+    {
+        int fd = accept4(g_loop.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4");
+            return;
+        }
+        if (!client_add(fd, 0))
+            close(fd);
+    }
+}
+
+static int open_control_socket(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "control socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    // a leftover socket file is replaced, a live daemon behind it is not
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0)
+    {
+        if (connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+        {
+            fprintf(stderr, "another daemon is listening on %s\n", path);
+            close(probe);
+            close(fd);
+            return -1;
+        }
+        close(probe);
+    }
+    if (unlink(path) < 0 && errno != ENOENT)
+    {
+        perror("unlink(control socket)");
+        close(fd);
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        perror("bind/listen(control socket)");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int open_signal_fd(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+    {
+        perror("sigprocmask");
+        return -1;
+    }
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        perror("signalfd");
+    return fd;
+}
+
+static int open_timer_fd(void)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("timerfd_create");
+        return -1;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = CONTROL_TICK_MS / 1000;
+    its.it_interval.tv_nsec = (long)(CONTROL_TICK_MS % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, NULL) < 0)
+    {
+        perror("timerfd_settime");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int control_watch_fd(int fd, void (*ready)(int fd, void* arg), void* arg)
+{
+    if (g_loop.epoll_fd < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if ((size_t)fd >= g_loop.watches_cap)
+    {
+        size_t new_cap = g_loop.watches_cap ? g_loop.watches_cap : 16;
+        while (new_cap <= (size_t)fd)
+            new_cap *= 2;
+        FdWatch* tmp = realloc(g_loop.watches, new_cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        memset(tmp + g_loop.watches_cap, 0, (new_cap - g_loop.watches_cap) * sizeof(*tmp));
+        g_loop.watches = tmp;
+        g_loop.watches_cap = new_cap;
+    }
+    if (epoll_set(fd, EPOLLIN, EPOLL_CTL_ADD) < 0)
+        return -1;
+    g_loop.watches[fd].ready = ready;
+    g_loop.watches[fd].arg = arg;
+    return 0;
+}
+
+void control_unwatch_fd(int fd)
+{
+    if ((size_t)fd >= g_loop.watches_cap || !g_loop.watches[fd].ready)
+        return;
+    if (g_loop.epoll_fd >= 0)
+        epoll_ctl(g_loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    g_loop.watches[fd].ready = NULL;
+    g_loop.watches[fd].arg = NULL;
+}
+
+static void handle_signals(const ControlHooks* hooks)
+{
+    struct signalfd_siginfo si;
+    int got_child = 0;
+    while (read(g_loop.signal_fd, &si, sizeof(si)) == (ssize_t)sizeof(si))
+    {
+        if (si.ssi_signo == SIGCHLD)
+            got_child = 1;
+        else
+            g_loop.stop = 1;
+    }
+    // several SIGCHLDs collapse into one, the hook reaps in a loop anyway
+    if (got_child)
+        hooks->child_exited();
+}
+
+unsigned control_park(void)
+{
+    Client* c = g_loop.current;
+    if (!c || c->parked)
+        return 0;
+    if (++g_loop.park_seq == 0)
+        g_loop.park_seq = 1;
+    c->parked = g_loop.park_seq;
+    g_loop.parked++;
+    // stdin stays readable (or hung up) while nothing takes its lines
+    if (c->interactive && !c->unpolled)
+        epoll_ctl(g_loop.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    return c->parked;
+}
+
+void control_resume(unsigned id, const char* reply)
+{
+    if (id == 0)
+        return;
+    for (size_t fd = 0; fd < g_loop.by_fd_cap; fd++)
+    {
+        Client* c = g_loop.by_fd[fd];
+        if (!c || c->parked != id)
+            continue;
+        c->parked = 0;
+        g_loop.parked--;
+        if (c->interactive && !c->unpolled && !c->closing && epoll_set(c->fd, EPOLLIN, EPOLL_CTL_ADD) < 0)
+            perror("epoll_ctl(client)");
+        append(&c->out, &c->out_len, &c->out_cap, reply, strlen(reply));
+        client_end_reply(c);
+        // flushes the reply and runs the lines that arrived meanwhile
+        if (client_service(c, 0, g_loop.hooks) < 0)
+            client_close(c);
+        return;
+    }
+}
+
+static void control_cleanup(void)
+{
+    for (size_t fd = 0; fd < g_loop.by_fd_cap; fd++)
+    {
+        if (g_loop.by_fd[fd])
+        {
+            client_flush(g_loop.by_fd[fd]);
+            client_close(g_loop.by_fd[fd]);
+        }
+    }
+    free(g_loop.by_fd);
+    g_loop.by_fd = NULL;
+    g_loop.by_fd_cap = 0;
+    g_loop.unpolled = NULL;
+    g_loop.parked = 0;
+    // watched descriptors belong to whoever registered them
+    free(g_loop.watches);
+    g_loop.watches = NULL;
+    g_loop.watches_cap = 0;
+
+    if (g_loop.listen_fd >= 0)
+    {
+        close(g_loop.listen_fd);
+        unlink(g_loop.socket_path);
+    }
+    if (g_loop.timer_fd >= 0)
+        close(g_loop.timer_fd);
+    if (g_loop.signal_fd >= 0)
+        close(g_loop.signal_fd);
+    if (g_loop.epoll_fd >= 0)
+        close(g_loop.epoll_fd);
+    g_loop.listen_fd = g_loop.timer_fd = g_loop.signal_fd = g_loop.epoll_fd = -1;
+}
+
+int control_run(const char* socket_path, const ControlHooks* hooks)
+{
+    g_loop.socket_path = socket_path;
+    g_loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_loop.epoll_fd < 0)
+    {
+        perror("epoll_create1");
+        return -1;
+    }
+    if ((g_loop.signal_fd = open_signal_fd()) < 0 || (g_loop.timer_fd = open_timer_fd()) < 0 ||
+        epoll_set(g_loop.signal_fd, EPOLLIN, EPOLL_CTL_ADD) < 0 ||
+        epoll_set(g_loop.timer_fd, EPOLLIN, EPOLL_CTL_ADD) < 0)
+    {
+        control_cleanup();
+        return -1;
+    }
+    if (socket_path)
+    {
+        if ((g_loop.listen_fd = open_control_socket(socket_path)) < 0 ||
+            epoll_set(g_loop.listen_fd, EPOLLIN, EPOLL_CTL_ADD) < 0)
+        {
+            control_cleanup();
+            return -1;
+        }
+        printf("listening on %s\n", socket_path);
+    }
+
+    if (hooks->started && hooks->started() < 0)
+    {
+        control_cleanup();
+        return -1;
+    }
+
+    // the interactive prompt is just one more client
+    printf("> ");
+    fflush(stdout);
+    g_loop.hooks = hooks;
+    client_add(STDIN_FILENO, 1);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!g_loop.stop && !(g_loop.draining && g_loop.parked == 0))
+    {
+        // an unpolled console with input left is served between the events
+        Client* u = g_loop.unpolled;
+        int busy = u && !u->parked && !u->closing;
+        int n = epoll_wait(g_loop.epoll_fd, events, MAX_EVENTS, busy ? 0 : -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n && !g_loop.stop; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == g_loop.signal_fd)
+            {
+                handle_signals(hooks);
+            }
+            else if (fd == g_loop.timer_fd)
+            {
+                unsigned long long expirations;
+                if (read(g_loop.timer_fd, &expirations, sizeof(expirations)) > 0)
+                    hooks->tick();
+            }
+            else if (fd == g_loop.listen_fd)
+            {
+                accept_clients();
+            }
+            else if ((size_t)fd < g_loop.watches_cap && g_loop.watches[fd].ready)
+            {
+                g_loop.watches[fd].ready(fd, g_loop.watches[fd].arg);
+            }
+            else if ((size_t)fd < g_loop.by_fd_cap && g_loop.by_fd[fd])
+            {
+                Client* c = g_loop.by_fd[fd];
+                if (client_service(c, events[i].events, hooks) < 0)
+                    client_close(c);
+            }
+        }
+        if (busy && !g_loop.stop && g_loop.unpolled == u && client_service(u, EPOLLIN, hooks) < 0)
+            client_close(u);
+    }
+
+    control_cleanup();
+    return 0;
+}
+
+void control_after_fork(void)
+{
+    for (size_t fd = 0; fd < g_loop.by_fd_cap; fd++)
+    {
+        Client* c = g_loop.by_fd[fd];
+        if (!c)
+            continue;
+        if (!c->interactive)
+            close(c->fd);
+        free(c->in);
+        free(c->out);
+        free(c);
+    }
+    free(g_loop.by_fd);
+    g_loop.by_fd = NULL;
+    g_loop.by_fd_cap = 0;
+    g_loop.unpolled = NULL;
+    g_loop.parked = 0;
+
+    // a worker has no business holding its siblings' pidfds
+    for (size_t fd = 0; fd < g_loop.watches_cap; fd++)
+    {
+        if (g_loop.watches[fd].ready)
+            close((int)fd);
+    }
+    free(g_loop.watches);
+    g_loop.watches = NULL;
+    g_loop.watches_cap = 0;
+
+    if (g_loop.listen_fd >= 0)
+        close(g_loop.listen_fd);
+    if (g_loop.timer_fd >= 0)
+        close(g_loop.timer_fd);
+    if (g_loop.signal_fd >= 0)
+        close(g_loop.signal_fd);
+    if (g_loop.epoll_fd >= 0)
+        close(g_loop.epoll_fd);
+    g_loop.listen_fd = g_loop.timer_fd = g_loop.signal_fd = g_loop.epoll_fd = -1;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
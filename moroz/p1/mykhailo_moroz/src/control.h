@@ -0,0 +1,48 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdio.h>
+
+// How the parent's event loop hands work back to the command layer.
+typedef struct
+{
+    // runs one command line, writing the reply to out; returns 1 when the
+    // daemon should shut down ("exit"), 0 otherwise
+    int (*execute)(char* line, FILE* out);
+    // SIGCHLD arrived, reap whatever exited
+    void (*child_exited)(void);
+    // called every CONTROL_TICK_MS for housekeeping
+    void (*tick)(void);
+    // called once the loop is set up, before the first command is read; a
+    // negative return aborts control_run
+    int (*started)(void);
+} ControlHooks;
+
+#define CONTROL_TICK_MS 500
+
+// Blocks SIGCHLD/SIGINT/SIGTERM (they are read from a signalfd instead), opens
+// the control socket if socket_path is not NULL and serves stdin plus every
+// socket client until "exit", SIGINT/SIGTERM, or EOF on stdin when there is no
+// socket to keep the daemon reachable. Returns 0 on a clean shutdown.
+int control_run(const char* socket_path, const ControlHooks* hooks);
+
+// Adds fd to the running loop; ready(fd, arg) is called whenever it is readable
+// until control_unwatch_fd(). The caller keeps ownership of the descriptor.
+int control_watch_fd(int fd, void (*ready)(int fd, void* arg), void* arg);
+void control_unwatch_fd(int fd);
+
+// Called from hooks->execute for a command that finishes later: its reply so
+// far is sent without the prompt or end-of-reply marker, and no further lines
+// are taken from its client until control_resume() with the returned id, so
+// other clients are served meanwhile. Returns 0 outside of execute.
+unsigned control_park(void);
+// Sends reply as the rest of the parked command's reply and ends it; does
+// nothing if the client went away meanwhile.
+void control_resume(unsigned id, const char* reply);
+
+// Called in a freshly forked worker: closes every descriptor the event loop owns
+// or watches and restores the signal mask, so the worker holds no client
+// connections.
+void control_after_fork(void);
+
+#endif
@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include "dirdiff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define DIRDIFF_BUF (64u << 10)  // one getdents64 batch
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct
+{
+    char* names;  // NUL-terminated, back to back
+    size_t len;
+    size_t cap;
+    char** sorted;  // into names, once the listing is complete
+    size_t count;
+} Listing;
+
+static int listing_add(Listing* l, const char* name)
+{
+    size_t n = strlen(name) + 1;
+    if (l->len + n > l->cap)
+    {
+        size_t cap = l->cap ? l->cap * 2 : 4096;
+        while (cap < l->len + n)
+            cap *= 2;
+        char* names = realloc(l->names, cap);
+        if (!names)
+        {
+            perror("realloc(dir_diff)");
+            return -1;
+        }
+        l->names = names;
+        l->cap = cap;
+    }
+    memcpy(l->names + l->len, name, n);
+    l->len += n;
+    l->count++;
+    return 0;
+}
+
+static int name_cmp(const void* a, const void* b) { return strcmp(*(char* const*)a, *(char* const*)b); }
+
+// reads the directory open at fd into l, sorted by name
+static int listing_read(int fd, Listing* l)
+{
+    char* buf = malloc(DIRDIFF_BUF);
+    if (!buf)
+    {
+        perror("malloc(dir_diff)");
+        return -1;
+    }
+    int ret = 0;
+    for (;;)
+    {
+        long n = syscall(SYS_getdents64, fd, buf, DIRDIFF_BUF);
+        if (n < 0)
+        {
+            perror("getdents64");
+            ret = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        for (long off = 0; ret == 0 && off < n;)
+        {
+            struct linux_dirent64* d = (struct linux_dirent64*)(buf + off);
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+                ret = listing_add(l, d->d_name);
+        }
+        if (ret < 0)
+            break;
+    }
+    free(buf);
+    if (ret < 0 || l->count == 0)
+        return ret;
+
+    l->sorted = malloc(l->count * sizeof(*l->sorted));
+    if (!l->sorted)
+    {
+        perror("malloc(dir_diff)");
+        return -1;
+    }
+    char* p = l->names;
+    for (size_t i = 0; i < l->count; i++)
+    {
+        l->sorted[i] = p;
+        p += strlen(p) + 1;
+    }
+    qsort(l->sorted, l->count, sizeof(*l->sorted), name_cmp);
+    return 0;
+}
+
+static void listing_free(Listing* l)
+{
+    free(l->names);
+    free(l->sorted);
+}
+
+// 1 if name is in the directory open at fd, 0 if not, -1 on errors
+static int entry_stat(int fd, const char* name, struct stat* st)
+{
+    if (fstatat(fd, name, st, AT_SYMLINK_NOFOLLOW) == 0)
+        return 1;
+    if (errno == ENOENT)
+        return 0;
+    perror("fstatat(dir_diff)");
+    return -1;
+}
+
+static int same_entry(const struct stat* a, const struct stat* b)
+{
+    if ((a->st_mode & S_IFMT) != (b->st_mode & S_IFMT))
+        return 0;
+    return S_ISDIR(a->st_mode) || (a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+                                   a->st_mtim.tv_nsec == b->st_mtim.tv_nsec);
+}
+
+int dir_diff(const char* from_dir, const char* to_dir, DiffFn fn, void* arg)
+{
+    int from_fd = open(from_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (from_fd < 0)
+    {
+        perror("open(dir_diff)");
+        return -1;
+    }
+    int to_fd = open(to_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (to_fd < 0 && errno != ENOENT)
+    {
+        perror("open(dir_diff)");
+        close(from_fd);
+        return -1;
+    }
+
+    Listing from = {0}, to = {0};
+    int ret = listing_read(from_fd, &from);
+    if (ret == 0 && to_fd >= 0)
+        ret = listing_read(to_fd, &to);
+
+    size_t i = 0, j = 0;
+    while (ret == 0 && (i < from.count || j < to.count))
+    {
+        int c = (i == from.count) ? 1 : (j == to.count) ? -1 : strcmp(from.sorted[i], to.sorted[j]);
+        DiffEntry e;
+        e.name = (c <= 0) ? from.sorted[i] : to.sorted[j];
+        int has_from = (c <= 0) ? entry_stat(from_fd, e.name, &e.from) : 0;
+        int has_to = (c >= 0) ? entry_stat(to_fd, e.name, &e.to) : 0;
+        if (c <= 0)
+            i++;
+        if (c >= 0)
+            j++;
+        if (has_from < 0 || has_to < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        if (has_from && has_to)
+            e.kind = same_entry(&e.from, &e.to) ? DIFF_SAME : DIFF_CHANGED;
+        else if (has_from)
+            e.kind = DIFF_ADDED;
+        else if (has_to)
+            e.kind = DIFF_REMOVED;
+        else
+            continue;
+        int r = fn(&e, arg);
+        if (r < 0)
+            ret = r;
+    }
+
+    listing_free(&from);
+    listing_free(&to);
+    close(from_fd);
+    if (to_fd >= 0)
+        close(to_fd);
+    return ret;
+}
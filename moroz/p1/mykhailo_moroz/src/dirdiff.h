@@ -0,0 +1,37 @@
+#ifndef DIRDIFF_H
+#define DIRDIFF_H
+
+#include <sys/stat.h>
+
+// One directory of two trees compared in a single pass, the primitive under
+// restore, resuming a mirror and the scrub. Both listings are read with
+// getdents64, sorted by name and merged, so an entry costs one fstatat on an
+// open directory per side instead of lstat calls on full paths, half of which
+// only find out that there is nothing. Both listings are read before the first
+// entry is reported, so the callback may change either directory.
+
+typedef enum
+{
+    DIFF_ADDED,    // only in from
+    DIFF_REMOVED,  // only in to
+    DIFF_CHANGED,  // in both, but of another type, or not a directory and of another size or mtime
+    DIFF_SAME,     // in both; a directory is the same whatever is in it
+} DiffKind;
+
+typedef struct
+{
+    const char* name;
+    DiffKind kind;
+    struct stat from;  // unless DIFF_REMOVED
+    struct stat to;    // unless DIFF_ADDED
+} DiffEntry;
+
+// a negative return stops the diff, which then returns it
+typedef int (*DiffFn)(const DiffEntry* e, void* arg);
+
+// Reports every entry of from_dir and to_dir once, in name order. A to_dir that
+// does not exist is empty; entries gone by the time they are looked at are
+// skipped. Returns 0, -1 if a listing cannot be read, or what stopped fn.
+int dir_diff(const char* from_dir, const char* to_dir, DiffFn fn, void* arg);
+
+#endif
@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include "durable.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+int g_durable_mode = DURABLE_NONE;
+long g_durable_batch = DURABLE_DEFAULT_BATCH;
+long long g_durable_window_ms = 0;
+
+static const char* const mode_names[] = {"none", "periodic", "group"};
+
+int durable_parse(const char* mode)
+{
+    for (int i = 0; i < (int)(sizeof(mode_names) / sizeof(mode_names[0])); i++)
+    {
+        if (strcmp(mode, mode_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char* durable_mode_name(int mode)
+{
+    if (mode < 0 || mode >= (int)(sizeof(mode_names) / sizeof(mode_names[0])))
+        return "unknown";
+    return mode_names[mode];
+}
+
+static long long window_ns(void)
+{
+    long long ms = g_durable_window_ms;
+    if (ms <= 0)
+        ms = g_durable_mode == DURABLE_GROUP ? DURABLE_DEFAULT_GROUP_WINDOW_MS : DURABLE_DEFAULT_PERIOD_MS;
+    return ms * 1000000LL;
+}
+
+// monotonic time the pending changes have to be synced by
+static long long due_ns(const Durable* d)
+{
+    if (g_durable_mode == DURABLE_PERIODIC)
+        return d->synced_ns + window_ns();
+    return d->first_ns + window_ns();
+}
+
+int durable_open(Durable* d, const char* dst_real)
+{
+    memset(d, 0, sizeof(*d));
+    d->fd = -1;
+    if (g_durable_mode == DURABLE_NONE)
+        return 0;
+    d->fd = open(dst_real, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d->fd < 0)
+    {
+        perror("open(durable)");
+        return -1;
+    }
+    d->synced_ns = stats_now_ns();
+    return 0;
+}
+
+void durable_close(Durable* d)
+{
+    if (d->fd < 0)
+        return;
+    durable_poll(d, 1);
+    close(d->fd);
+    d->fd = -1;
+}
+
+void durable_applied(Durable* d, unsigned long long changes)
+{
+    if (d->fd < 0 || changes == 0)
+        return;
+    if (d->pending == 0)
+        d->first_ns = stats_now_ns();
+    d->pending += changes;
+    stats_set(STAT_DURABLE_PENDING, d->pending);
+}
+
+long long durable_hold(Durable* d, long long realtime_ns)
+{
+    if (d->fd < 0 || d->pending == 0)
+        return realtime_ns;
+    if (realtime_ns > d->held_ns)
+        d->held_ns = realtime_ns;
+    return 0;
+}
+
+long long durable_poll(Durable* d, int force)
+{
+    if (d->fd < 0 || d->pending == 0 || d->failed)
+        return 0;
+    long long now = stats_now_ns();
+    int full = g_durable_mode == DURABLE_GROUP && d->pending >= (unsigned long long)g_durable_batch;
+    if (!force && !full && now < due_ns(d))
+        return 0;
+
+    // whatever is held was applied before this, so the sync covers it
+    long long held = d->held_ns;
+    if (syncfs(d->fd) < 0)
+    {
+        // the changes stay pending and the watermark held, see durable_resynced
+        perror("syncfs");
+        d->failed = 1;
+        stats_add(STAT_DURABLE_FAILURES, 1);
+        return 0;
+    }
+    long long done = stats_now_ns();
+    stats_add(STAT_DURABLE_SYNCS, 1);
+    stats_add(STAT_DURABLE_CHANGES, d->pending);
+    stats_add(STAT_DURABLE_WAIT_NS, (unsigned long long)(done - now));
+    stats_set(STAT_DURABLE_PENDING, 0);
+    d->pending = 0;
+    d->held_ns = 0;
+    d->synced_ns = done;
+    return held;
+}
+
+long long durable_resynced(Durable* d)
+{
+    d->failed = 0;
+    return durable_poll(d, 1);
+}
+
+int durable_timeout_ms(const Durable* d, int max_ms)
+{
+    if (d->fd < 0 || d->pending == 0)
+        return max_ms;
+    long long left = due_ns(d) - stats_now_ns();
+    if (left <= 0)
+        return 0;
+    long long ms = (left + 999999) / 1000000;
+    return ms < max_ms ? (int)ms : max_ms;
+}
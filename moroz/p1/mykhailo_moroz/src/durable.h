@@ -0,0 +1,72 @@
+#ifndef DURABLE_H
+#define DURABLE_H
+
+// When what a worker applied to its target is on stable storage (-d). Copies
+// go through the page cache and nothing syncs them, so after a power loss a
+// target can hold empty or torn files the mirror reported as done; an fsync
+// per file would make every small change wait for the disk.
+//
+//   none      the kernel writes back whenever it does (the default)
+//   periodic  one syncfs of the target every -W ms in which anything changed
+//   group     applied changes are batched, and a batch is made durable with a
+//             single syncfs once it has -G changes or its first one has
+//             waited -W ms
+//
+// Either way the sync watermark (synced_ns, and what "stats" reports as lag)
+// only moves past a change once it is durable, so it never claims more than
+// survives a crash.
+//
+// A failed syncfs is not retried as is: the pages whose writeback failed are
+// clean again, and since Linux 5.8 the error is reported only once, so the
+// retry would succeed over the lost data. The target stays failed, holding
+// its watermark, until the caller copied again everything changed since the
+// last good sync and calls durable_resynced().
+
+#define DURABLE_DEFAULT_BATCH 256            // -G: changes per group commit
+#define DURABLE_DEFAULT_GROUP_WINDOW_MS 50   // -W in group mode
+#define DURABLE_DEFAULT_PERIOD_MS 1000       // -W in periodic mode
+
+typedef enum
+{
+    DURABLE_NONE = 0,
+    DURABLE_PERIODIC,
+    DURABLE_GROUP,
+} DurableMode;
+
+extern int g_durable_mode;             // -d
+extern long g_durable_batch;           // -G
+extern long long g_durable_window_ms;  // -W, 0: the mode's default
+
+typedef struct
+{
+    int fd;                      // the target root, for syncfs; -1 in mode none
+    unsigned long long pending;  // changes applied since the last sync
+    long long first_ns;          // monotonic time the oldest of them was applied
+    long long synced_ns;         // monotonic time of the last sync
+    long long held_ns;           // sync watermark waiting for the next sync, 0 if none
+    int failed;                  // a sync failed, nothing is synced before durable_resynced()
+} Durable;
+
+// DURABLE_* for "none", "periodic" or "group", -1 otherwise
+int durable_parse(const char* mode);
+const char* durable_mode_name(int mode);
+
+int durable_open(Durable* d, const char* dst_real);
+void durable_close(Durable* d);
+
+// count more changes applied to the target
+void durable_applied(Durable* d, unsigned long long changes);
+// The target matches the source as of realtime_ns. Returns the watermark that
+// may be published now: realtime_ns if every change is durable already, else
+// 0 and it is held until the next sync.
+long long durable_hold(Durable* d, long long realtime_ns);
+// Syncs if a batch is full or has waited long enough (force: if anything is
+// pending at all). Returns the held watermark the sync made good, 0 if none.
+long long durable_poll(Durable* d, int force);
+// The changes since the last good sync were written again after a failed
+// one: syncs right away and returns what durable_poll does.
+long long durable_resynced(Durable* d);
+// ms until durable_poll has a sync to do, at most max_ms
+int durable_timeout_ms(const Durable* d, int max_ms);
+
+#endif
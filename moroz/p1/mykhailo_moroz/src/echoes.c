@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include "echoes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t echo_slot(dev_t dev, ino_t ino, size_t capacity)
+{
+    unsigned long long h = ((unsigned long long)ino ^ ((unsigned long long)dev << 40)) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (capacity - 1);
+}
+
+static EchoEntry* echo_find(const Echoes* echoes, dev_t dev, ino_t ino)
+{
+    size_t s = echo_slot(dev, ino, echoes->capacity);
+    while (echoes->slots[s].ino != 0)
+    {
+        if (echoes->slots[s].ino == ino && echoes->slots[s].dev == dev)
+            return &echoes->slots[s];
+        s = (s + 1) & (echoes->capacity - 1);
+    }
+    return &echoes->slots[s];
+}
+
+static int echoes_grow(Echoes* echoes)
+{
+    size_t capacity = echoes->capacity ? echoes->capacity * 2 : 256;
+    EchoEntry* slots = calloc(capacity, sizeof(*slots));
+    if (!slots)
+    {
+        perror("calloc(echoes)");
+        return -1;
+    }
+    EchoEntry* old = echoes->slots;
+    size_t old_capacity = echoes->capacity;
+    echoes->slots = slots;
+    echoes->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i].ino != 0)
+            *echo_find(echoes, old[i].dev, old[i].ino) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+int echoes_put(Echoes* echoes, const struct stat* st)
+{
+    if (st->st_ino == 0)
+        return 0;
+    if ((echoes->used + 1) * 2 > echoes->capacity && echoes_grow(echoes) < 0)
+        return -1;
+    EchoEntry* e = echo_find(echoes, st->st_dev, st->st_ino);
+    if (e->ino == 0)
+        echoes->used++;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->type = st->st_mode & S_IFMT;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    return 0;
+}
+
+int echoes_has(const Echoes* echoes, const struct stat* st)
+{
+    if (echoes->used == 0 || st->st_ino == 0)
+        return 0;
+    const EchoEntry* e = echo_find(echoes, st->st_dev, st->st_ino);
+    // a directory keeps its mtime only until something is added to it, which
+    // the events of what was added account for
+    return e->ino != 0 && e->type == (st->st_mode & S_IFMT) &&
+           (S_ISDIR(st->st_mode) || (e->size == st->st_size && e->mtime.tv_sec == st->st_mtim.tv_sec &&
+                                     e->mtime.tv_nsec == st->st_mtim.tv_nsec));
+}
+
+void echoes_free(Echoes* echoes)
+{
+    free(echoes->slots);
+    memset(echoes, 0, sizeof(*echoes));
+}
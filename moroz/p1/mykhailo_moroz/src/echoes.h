@@ -0,0 +1,39 @@
+#ifndef ECHOES_H
+#define ECHOES_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// What a live restore (see cmd_restore) wrote into the source, so the worker
+// can tell the events it caused from real changes. The worker runs the restore
+// itself while it applies no events; everything the restore copies into the
+// source already is in the target, so an event on a source entry that is still
+// exactly as the restore left it is its echo and is dropped instead of being
+// copied back. Anything changed since (another size, mtime or inode) is a real
+// change and is applied as usual. The set is forgotten once every event queued
+// by the end of the restore has been applied.
+
+typedef struct
+{
+    dev_t dev;  // ino 0 marks an empty slot
+    ino_t ino;
+    mode_t type;  // S_IFMT bits
+    off_t size;
+    struct timespec mtime;
+} EchoEntry;
+
+typedef struct
+{
+    EchoEntry* slots;
+    size_t capacity;  // power of two
+    size_t used;
+} Echoes;
+
+// remembers the entry as st describes it right after the restore wrote it
+int echoes_put(Echoes* echoes, const struct stat* st);
+// whether st describes an entry exactly as the restore left it
+int echoes_has(const Echoes* echoes, const struct stat* st);
+void echoes_free(Echoes* echoes);
+
+#endif
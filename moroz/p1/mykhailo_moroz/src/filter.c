@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+#include "filter.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// deeper paths are not matched against anchored patterns
+#define FILTER_MAX_DEPTH 1024
+
+typedef enum
+{
+    TOK_LIT = 0,
+    TOK_ANY,    // ?
+    TOK_STAR,   // *
+    TOK_CLASS,  // [...]
+} TokenKind;
+
+typedef struct
+{
+    unsigned char kind;
+    unsigned char ch;
+    unsigned char bits[32];  // TOK_CLASS: accepted bytes, negation already applied
+} Token;
+
+// one path component of a pattern
+typedef struct
+{
+    Token* tokens;
+    size_t count;
+    int globstar;  // the component is "**"
+} Segment;
+
+typedef struct
+{
+    char* text;  // as added, with the sign
+    int include;
+    int dir_only;
+    int anchored;
+    Segment* segments;
+    size_t segment_count;
+} Rule;
+
+// open addressing string -> highest rule index, split by rules for any entry
+// and rules for directories only
+typedef struct
+{
+    char** keys;
+    size_t* key_lens;
+    long* any;
+    long* dir;
+    size_t capacity;  // power of two
+    size_t count;
+} NameIndex;
+
+struct Filter
+{
+    Rule* rules;
+    size_t count;
+    size_t capacity;
+    NameIndex names;  // "node_modules", "build/"
+    NameIndex exts;   // "*.tmp", keyed by "tmp"
+    size_t* generic;  // every other rule, in rule order
+    size_t generic_count;
+    Filter* polled;  // the "~pattern" rules, compiled as excludes
+};
+
+typedef struct
+{
+    const char* s;
+    size_t len;
+} Component;
+
+// ---------- name index ----------
+
+static size_t name_hash(const char* s, size_t len)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+static long index_slot(const NameIndex* idx, const char* s, size_t len)
+{
+    if (idx->capacity == 0)
+        return -1;
+    size_t i = name_hash(s, len) & (idx->capacity - 1);
+    while (idx->keys[i])
+    {
+        if (idx->key_lens[i] == len && memcmp(idx->keys[i], s, len) == 0)
+            return (long)i;
+        i = (i + 1) & (idx->capacity - 1);
+    }
+    return -1;
+}
+
+static int index_grow(NameIndex* idx)
+{
+    size_t capacity = idx->capacity ? idx->capacity * 2 : 16;
+    NameIndex bigger = {calloc(capacity, sizeof(char*)), calloc(capacity, sizeof(size_t)),
+                        calloc(capacity, sizeof(long)),  calloc(capacity, sizeof(long)),
+                        capacity,                        idx->count};
+    if (!bigger.keys || !bigger.key_lens || !bigger.any || !bigger.dir)
+    {
+        perror("calloc(filter)");
+        free(bigger.keys);
+        free(bigger.key_lens);
+        free(bigger.any);
+        free(bigger.dir);
+        return -1;
+    }
+    for (size_t i = 0; i < idx->capacity; i++)
+    {
+        if (!idx->keys[i])
+            continue;
+        size_t j = name_hash(idx->keys[i], idx->key_lens[i]) & (capacity - 1);
+        while (bigger.keys[j])
+            j = (j + 1) & (capacity - 1);
+        bigger.keys[j] = idx->keys[i];
+        bigger.key_lens[j] = idx->key_lens[i];
+        bigger.any[j] = idx->any[i];
+        bigger.dir[j] = idx->dir[i];
+    }
+    free(idx->keys);
+    free(idx->key_lens);
+    free(idx->any);
+    free(idx->dir);
+    *idx = bigger;
+    return 0;
+}
+
+static int index_put(NameIndex* idx, const char* s, size_t len, long rule, int dir_only)
+{
+    long slot = index_slot(idx, s, len);
+    if (slot < 0)
+    {
+        if ((idx->count + 1) * 2 > idx->capacity && index_grow(idx) < 0)
+            return -1;
+        size_t i = name_hash(s, len) & (idx->capacity - 1);
+        while (idx->keys[i])
+            i = (i + 1) & (idx->capacity - 1);
+        idx->keys[i] = strndup(s, len);
+        if (!idx->keys[i])
+            return -1;
+        idx->key_lens[i] = len;
+        idx->any[i] = -1;
+        idx->dir[i] = -1;
+        idx->count++;
+        slot = (long)i;
+    }
+    // rules are added in order, so the newest one is always the highest
+    if (dir_only)
+        idx->dir[slot] = rule;
+    else
+        idx->any[slot] = rule;
+    return 0;
+}
+
+static long index_get(const NameIndex* idx, const char* s, size_t len, int is_dir)
+{
+    long slot = index_slot(idx, s, len);
+    if (slot < 0)
+        return -1;
+    long best = idx->any[slot];
+    if (is_dir && idx->dir[slot] > best)
+        best = idx->dir[slot];
+    return best;
+}
+
+static void index_free(NameIndex* idx)
+{
+    for (size_t i = 0; i < idx->capacity; i++)
+        free(idx->keys[i]);
+    free(idx->keys);
+    free(idx->key_lens);
+    free(idx->any);
+    free(idx->dir);
+    memset(idx, 0, sizeof(*idx));
+}
+
+// ---------- compiling ----------
+
+static void class_set(Token* t, unsigned char c) { t->bits[c >> 3] |= (unsigned char)(1u << (c & 7)); }
+
+static int class_has(const Token* t, unsigned char c) { return (t->bits[c >> 3] >> (c & 7)) & 1; }
+
+// parses "[...]" starting at p[0] == '['; returns the length consumed, 0 if
+// there is no closing bracket (the '[' is then a literal)
+static size_t compile_class(const char* p, size_t len, Token* t)
+{
+    size_t i = 1;
+    int negate = 0;
+    if (i < len && (p[i] == '!' || p[i] == '^'))
+    {
+        negate = 1;
+        i++;
+    }
+    memset(t->bits, 0, sizeof(t->bits));
+    size_t first = i;
+    while (i < len && (p[i] != ']' || i == first))
+    {
+        unsigned char lo = (unsigned char)p[i];
+        if (lo == '\\' && i + 1 < len)
+            lo = (unsigned char)p[++i];
+        if (i + 2 < len && p[i + 1] == '-' && p[i + 2] != ']')
+        {
+            unsigned char hi = (unsigned char)p[i + 2];
+            for (unsigned c = lo; c <= hi; c++)
+                class_set(t, (unsigned char)c);
+            i += 3;
+            continue;
+        }
+        class_set(t, lo);
+        i++;
+    }
+    if (i >= len)
+        return 0;
+    if (negate)
+    {
+        for (size_t b = 0; b < sizeof(t->bits); b++)
+            t->bits[b] = (unsigned char)~t->bits[b];
+    }
+    t->kind = TOK_CLASS;
+    return i + 1;
+}
+
+static int compile_segment(const char* p, size_t len, Segment* seg)
+{
+    seg->globstar = (len == 2 && p[0] == '*' && p[1] == '*');
+    seg->count = 0;
+    seg->tokens = calloc(len ? len : 1, sizeof(Token));
+    if (!seg->tokens)
+        return -1;
+
+    for (size_t i = 0; i < len;)
+    {
+        Token* t = &seg->tokens[seg->count];
+        if (p[i] == '*')
+        {
+            // "a**b" inside one component is the same as "a*b"
+            if (seg->count == 0 || seg->tokens[seg->count - 1].kind != TOK_STAR)
+            {
+                t->kind = TOK_STAR;
+                seg->count++;
+            }
+            i++;
+            continue;
+        }
+        if (p[i] == '?')
+        {
+            t->kind = TOK_ANY;
+            seg->count++;
+            i++;
+            continue;
+        }
+        if (p[i] == '[')
+        {
+            size_t used = compile_class(p + i, len - i, t);
+            if (used > 0)
+            {
+                seg->count++;
+                i += used;
+                continue;
+            }
+        }
+        if (p[i] == '\\' && i + 1 < len)
+            i++;
+        t->kind = TOK_LIT;
+        t->ch = (unsigned char)p[i];
+        seg->count++;
+        i++;
+    }
+    return 0;
+}
+
+static void rule_free(Rule* r)
+{
+    for (size_t i = 0; i < r->segment_count; i++)
+        free(r->segments[i].tokens);
+    free(r->segments);
+    free(r->text);
+}
+
+static int is_literal(const Segment* seg, size_t from)
+{
+    for (size_t i = from; i < seg->count; i++)
+    {
+        if (seg->tokens[i].kind != TOK_LIT)
+            return 0;
+    }
+    return 1;
+}
+
+// rebuilds the literal text of tokens [from, count) into buf
+static size_t literal_text(const Segment* seg, size_t from, char* buf, size_t size)
+{
+    size_t n = 0;
+    for (size_t i = from; i < seg->count && n + 1 < size; i++)
+        buf[n++] = (char)seg->tokens[i].ch;
+    buf[n] = '\0';
+    return n;
+}
+
+static int compile_rule(const char* text, Rule* r)
+{
+    memset(r, 0, sizeof(*r));
+    if (text[0] != '+' && text[0] != '-')
+        return -1;
+    r->include = (text[0] == '+');
+
+    char pattern[4096];
+    if (snprintf(pattern, sizeof(pattern), "%s", text + 1) >= (int)sizeof(pattern))
+        return -1;
+    size_t len = strlen(pattern);
+    if (len > 0 && pattern[len - 1] == '/')
+    {
+        r->dir_only = 1;
+        pattern[--len] = '\0';
+    }
+    if (len == 0)
+        return -1;
+    r->anchored = (strchr(pattern, '/') != NULL);
+
+    const char* p = pattern;
+    while (*p == '/')
+        p++;
+    size_t max_segments = 1;
+    for (const char* q = p; *q; q++)
+        max_segments += (*q == '/');
+
+    r->segments = calloc(max_segments, sizeof(Segment));
+    r->text = strdup(text);
+    if (!r->segments || !r->text)
+    {
+        rule_free(r);
+        return -1;
+    }
+    while (*p)
+    {
+        const char* end = strchr(p, '/');
+        size_t seg_len = end ? (size_t)(end - p) : strlen(p);
+        if (seg_len > 0)
+        {
+            if (compile_segment(p, seg_len, &r->segments[r->segment_count]) < 0)
+            {
+                rule_free(r);
+                return -1;
+            }
+            r->segment_count++;
+        }
+        p += seg_len;
+        while (*p == '/')
+            p++;
+    }
+    if (r->segment_count == 0)
+    {
+        rule_free(r);
+        return -1;
+    }
+    return 0;
+}
+
+Filter* filter_new(void)
+{
+    Filter* f = calloc(1, sizeof(*f));
+    if (!f)
+        perror("calloc(filter)");
+    return f;
+}
+
+void filter_free(Filter* filter)
+{
+    if (!filter)
+        return;
+    for (size_t i = 0; i < filter->count; i++)
+        rule_free(&filter->rules[i]);
+    free(filter->rules);
+    free(filter->generic);
+    filter_free(filter->polled);
+    index_free(&filter->names);
+    index_free(&filter->exts);
+    free(filter);
+}
+
+int filter_add(Filter* filter, const char* rule)
+{
+    if (filter->count == filter->capacity)
+    {
+        size_t capacity = filter->capacity ? filter->capacity * 2 : 8;
+        Rule* rules = realloc(filter->rules, capacity * sizeof(*rules));
+        if (!rules)
+            return -1;
+        filter->rules = rules;
+        size_t* generic = realloc(filter->generic, capacity * sizeof(*generic));
+        if (!generic)
+            return -1;
+        filter->generic = generic;
+        filter->capacity = capacity;
+    }
+
+    Rule* r = &filter->rules[filter->count];
+    if (rule[0] == '~')
+    {
+        // kept in order with the others for filter_rule, matched on its own
+        if (!filter->polled && !(filter->polled = filter_new()))
+            return -1;
+        char exclude[4096];
+        if (snprintf(exclude, sizeof(exclude), "-%s", rule + 1) >= (int)sizeof(exclude) ||
+            filter_add(filter->polled, exclude) < 0 || compile_rule(exclude, r) < 0)
+            return -1;
+        r->text[0] = '~';
+        filter->count++;
+        return 0;
+    }
+    if (compile_rule(rule, r) < 0)
+        return -1;
+
+    // pick the cheapest way to find this rule again
+    long index = (long)filter->count;
+    const Segment* seg = &r->segments[0];
+    char key[4096];
+    int indexed = -1;
+    if (!r->anchored && !seg->globstar && is_literal(seg, 0))
+    {
+        size_t n = literal_text(seg, 0, key, sizeof(key));
+        indexed = index_put(&filter->names, key, n, index, r->dir_only);
+    }
+    else if (!r->anchored && seg->count >= 3 && seg->tokens[0].kind == TOK_STAR && is_literal(seg, 1) &&
+             seg->tokens[1].ch == '.')
+    {
+        size_t n = literal_text(seg, 2, key, sizeof(key));
+        if (!memchr(key, '.', n))
+            indexed = index_put(&filter->exts, key, n, index, r->dir_only);
+    }
+    if (indexed < 0)
+        filter->generic[filter->generic_count++] = filter->count;
+    filter->count++;
+    return 0;
+}
+
+size_t filter_count(const Filter* filter) { return filter ? filter->count : 0; }
+
+const char* filter_rule(const Filter* filter, size_t i) { return filter->rules[i].text; }
+
+// ---------- matching ----------
+
+static int token_matches(const Token* t, unsigned char c)
+{
+    switch (t->kind)
+    {
+        case TOK_LIT:
+            return t->ch == c;
+        case TOK_ANY:
+            return 1;
+        case TOK_CLASS:
+            return class_has(t, c);
+        default:
+            return 0;
+    }
+}
+
+// '*' never has to look past its own component, so the classic single
+// backtracking point is enough and the match stays linear in practice
+static int segment_matches(const Segment* seg, const char* s, size_t len)
+{
+    size_t ti = 0, si = 0;
+    size_t star_t = SIZE_MAX, star_s = 0;
+    while (si < len)
+    {
+        if (ti < seg->count && seg->tokens[ti].kind == TOK_STAR)
+        {
+            star_t = ti++;
+            star_s = si;
+            continue;
+        }
+        if (ti < seg->count && token_matches(&seg->tokens[ti], (unsigned char)s[si]))
+        {
+            ti++;
+            si++;
+            continue;
+        }
+        if (star_t == SIZE_MAX)
+            return 0;
+        ti = star_t + 1;
+        si = ++star_s;
+    }
+    while (ti < seg->count && seg->tokens[ti].kind == TOK_STAR)
+        ti++;
+    return ti == seg->count;
+}
+
+static int segments_match(const Segment* segs, size_t ns, const Component* comps, size_t nc)
+{
+    while (ns > 0)
+    {
+        if (segs[0].globstar)
+        {
+            // a trailing "**" means everything inside, but not the directory itself
+            if (ns == 1)
+                return nc >= 1;
+            for (size_t k = 0; k <= nc; k++)
+            {
+                if (segments_match(segs + 1, ns - 1, comps + k, nc - k))
+                    return 1;
+            }
+            return 0;
+        }
+        if (nc == 0 || !segment_matches(&segs[0], comps[0].s, comps[0].len))
+            return 0;
+        segs++;
+        ns--;
+        comps++;
+        nc--;
+    }
+    return nc == 0;
+}
+
+static size_t split_path(const char* path, Component* comps, size_t max)
+{
+    size_t n = 0;
+    const char* p = path;
+    while (*p)
+    {
+        const char* end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > 0)
+        {
+            if (n == max)
+                return SIZE_MAX;
+            comps[n].s = p;
+            comps[n].len = len;
+            n++;
+        }
+        p += len;
+        while (*p == '/')
+            p++;
+    }
+    return n;
+}
+
+int filter_excluded(const Filter* filter, const char* rel_path, int is_dir)
+{
+    if (!filter || filter->count == 0)
+        return 0;
+
+    const char* base = strrchr(rel_path, '/');
+    base = base ? base + 1 : rel_path;
+    size_t base_len = strlen(base);
+
+    long best = index_get(&filter->names, base, base_len, is_dir);
+    const char* dot = memrchr(base, '.', base_len);
+    if (dot)
+    {
+        long ext = index_get(&filter->exts, dot + 1, base_len - (size_t)(dot + 1 - base), is_dir);
+        if (ext > best)
+            best = ext;
+    }
+
+    Component comps[FILTER_MAX_DEPTH];
+    size_t nc = 0;
+    int split = 0;
+    // newest first: the first generic match wins unless an indexed one is newer
+    for (size_t k = filter->generic_count; k-- > 0;)
+    {
+        size_t i = filter->generic[k];
+        if ((long)i <= best)
+            break;
+        const Rule* r = &filter->rules[i];
+        if (r->dir_only && !is_dir)
+            continue;
+
+        int matched;
+        if (!r->anchored)
+        {
+            matched = segment_matches(&r->segments[0], base, base_len);
+        }
+        else
+        {
+            if (!split)
+            {
+                nc = split_path(rel_path, comps, FILTER_MAX_DEPTH);
+                split = 1;
+            }
+            matched = (nc != SIZE_MAX) && segments_match(r->segments, r->segment_count, comps, nc);
+        }
+        if (matched)
+        {
+            best = (long)i;
+            break;
+        }
+    }
+    return best >= 0 && !filter->rules[best].include;
+}
+
+int filter_polled(const Filter* filter, const char* rel_path)
+{
+    return filter && filter_excluded(filter->polled, rel_path, 1);
+}
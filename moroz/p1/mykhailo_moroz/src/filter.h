@@ -0,0 +1,35 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+
+// gitignore-style include/exclude rules of one backup.
+//
+// Rules are "-pattern" (exclude) or "+pattern" (include again) and the last
+// matching rule wins. A pattern without a '/' matches the name at any depth, a
+// pattern with one is anchored at the backup root ("/build", "docs/**/*.md").
+// A trailing '/' matches directories only. '*', '?', "[a-z]" and "**" work as
+// in gitignore. An excluded directory is never descended into, so nothing
+// below it can be included again.
+//
+// Literal names ("node_modules") and plain extensions ("*.tmp") are looked up
+// in hash tables; only the remaining patterns are matched one by one.
+//
+// "~pattern" rules do not take part in that: they name directories that are
+// mirrored but tracked by periodic scans instead of inotify, see polled.h.
+typedef struct Filter Filter;
+
+Filter* filter_new(void);
+void filter_free(Filter* filter);
+// rule is "-pattern", "+pattern" or "~pattern"; returns -1 for an empty or malformed one
+int filter_add(Filter* filter, const char* rule);
+size_t filter_count(const Filter* filter);
+// the rule as it was added, sign included
+const char* filter_rule(const Filter* filter, size_t i);
+
+// rel_path is relative to the backup root, without a leading '/'
+int filter_excluded(const Filter* filter, const char* rel_path, int is_dir);
+// whether the directory rel_path matches a "~pattern" rule
+int filter_polled(const Filter* filter, const char* rel_path);
+
+#endif
@@ -0,0 +1,52 @@
+#include "histogram.h"
+
+unsigned long long hist_bucket_upper(int idx)
+{
+    if (idx < HIST_SUB_COUNT)
+        return (unsigned long long)idx;
+
+    int e = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    unsigned long long sub = (unsigned long long)(idx & (HIST_SUB_COUNT - 1));
+    unsigned long long width = 1ULL << (e - HIST_SUB_BITS);
+    unsigned long long lower = (HIST_SUB_COUNT + sub) << (e - HIST_SUB_BITS);
+    return lower + (width - 1);
+}
+
+unsigned long long hist_percentile(const Histogram* h, double q)
+{
+    // buckets are read one by one while workers keep recording, so the total is
+    // taken from the buckets themselves to keep the rank consistent with them
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        counts[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0)
+        return 0;
+
+    // nearest rank: the smallest count covering q of the samples, rounded up so
+    // the tail percentiles of a small sample land on its largest values
+    double want = q * (double)total;
+    unsigned long long rank = (unsigned long long)want;
+    if ((double)rank < want)
+        rank++;
+    if (rank == 0)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            unsigned long long upper = hist_bucket_upper(i);
+            return (upper > max) ? max : upper;
+        }
+    }
+    return max;
+}
@@ -0,0 +1,49 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+
+// Log-linear latency histogram in nanoseconds. Values below 2^HIST_SUB_BITS get
+// a bucket each; above that every power of two is split into 2^HIST_SUB_BITS
+// linear sub-buckets, so any recorded value is off by at most 1/8 (12.5%).
+// The whole 64-bit range fits in a fixed array, no allocation ever happens.
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct
+{
+    atomic_ullong count;
+    atomic_ullong max;
+    atomic_ullong buckets[HIST_BUCKETS];
+} Histogram;
+
+static inline int hist_bucket_index(unsigned long long v)
+{
+    if (v < HIST_SUB_COUNT)
+        return (int)v;
+    int e = 63 - __builtin_clzll(v);  // position of the highest set bit, >= HIST_SUB_BITS
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+// lock-free and syscall-free, safe to call from several processes on a shared mapping
+static inline void hist_record(Histogram* h, unsigned long long v)
+{
+    atomic_fetch_add_explicit(&h->buckets[hist_bucket_index(v)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+    unsigned long long cur = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (v > cur && !atomic_compare_exchange_weak_explicit(&h->max, &cur, v, memory_order_relaxed,
+                                                             memory_order_relaxed))
+    {
+    }
+}
+
+// highest value that falls into bucket idx
+unsigned long long hist_bucket_upper(int idx);
+
+// value at quantile q (0 < q <= 1), reported as the upper edge of its bucket
+// and clamped to the exact maximum; 0 when the histogram is empty
+unsigned long long hist_percentile(const Histogram* h, double q);
+
+#endif
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include "layout.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// physical byte offset of the file's first extent; 0 when it has no data on
+// disk yet (empty, or still delayed allocation), -1 when the filesystem does
+// not support FIEMAP
+static int first_extent(int fd, uint64_t* key)
+{
+    struct
+    {
+        struct fiemap map;
+        struct fiemap_extent extent[1];
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.map.fm_start = 0;
+    req.map.fm_length = FIEMAP_MAX_OFFSET;
+    req.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &req) < 0)
+        return -1;
+    *key = 0;
+    if (req.map.fm_mapped_extents > 0 && !(req.extent[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+        *key = req.extent[0].fe_physical;
+    return 0;
+}
+
+int layout_add(LayoutQueue* q, const char* path, const char* rel, const struct stat* st)
+{
+    if (q->count == q->capacity)
+    {
+        size_t capacity = q->capacity ? q->capacity * 2 : 1024;
+        LayoutEntry* entries = realloc(q->entries, capacity * sizeof(*entries));
+        if (!entries)
+        {
+            perror("realloc(layout)");
+            return -1;
+        }
+        q->entries = entries;
+        q->capacity = capacity;
+    }
+
+    uint64_t key = (uint64_t)st->st_ino;
+    if (!q->by_inode && st->st_size > 0)
+    {
+        int fd = open(path, O_RDONLY | O_NOATIME);
+        if (fd < 0 && errno == EPERM)
+            fd = open(path, O_RDONLY);
+        // a file that cannot be opened stays queued, its copy reports the error
+        if (fd >= 0)
+        {
+            if (first_extent(fd, &key) < 0)
+            {
+                if (errno == EOPNOTSUPP || errno == ENOTTY)
+                {
+                    // no layout to go by on this filesystem; inode numbers
+                    // for all, the ones keyed so far included
+                    q->by_inode = 1;
+                    for (size_t i = 0; i < q->count; i++)
+                        q->entries[i].key = (uint64_t)q->entries[i].ino;
+                }
+                key = (uint64_t)st->st_ino;
+            }
+            close(fd);
+        }
+    }
+    else if (!q->by_inode)
+    {
+        key = 0;  // nothing to read
+    }
+
+    char* copy = strdup(rel);
+    if (!copy)
+    {
+        perror("strdup(layout)");
+        return -1;
+    }
+    q->entries[q->count++] =
+        (LayoutEntry){.rel = copy, .mode = st->st_mode, .size = st->st_size, .ino = st->st_ino, .key = key};
+    return 0;
+}
+
+static int entry_cmp(const void* a, const void* b)
+{
+    const LayoutEntry* x = a;
+    const LayoutEntry* y = b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return strcmp(x->rel, y->rel);
+}
+
+void layout_sort(LayoutQueue* q)
+{
+    if (q->count > 1)
+        qsort(q->entries, q->count, sizeof(q->entries[0]), entry_cmp);
+    q->ahead = 0;
+}
+
+void layout_prefetch(LayoutQueue* q, const char* root, size_t next)
+{
+    if (q->ahead <= next)
+        q->ahead = next + 1;
+    size_t bytes = 0;
+    for (size_t i = next + 1; i < q->ahead && i < q->count; i++)
+    {
+        off_t size = q->entries[i].size;
+        bytes += size > (off_t)LAYOUT_AHEAD_FILE_MAX ? LAYOUT_AHEAD_FILE_MAX : (size_t)size;
+    }
+    while (q->ahead < q->count && q->ahead - next <= LAYOUT_AHEAD_FILES && bytes < LAYOUT_AHEAD_BYTES)
+    {
+        LayoutEntry* e = &q->entries[q->ahead++];
+        if (e->size == 0)
+            continue;
+        size_t len = e->size > (off_t)LAYOUT_AHEAD_FILE_MAX ? LAYOUT_AHEAD_FILE_MAX : (size_t)e->size;
+        char path[PATH_MAX];
+        if (snprintf(path, PATH_MAX, "%s/%s", root, e->rel) >= PATH_MAX)
+            continue;
+        int fd = open(path, O_RDONLY | O_NOATIME);
+        if (fd < 0 && errno == EPERM)
+            fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        readahead(fd, 0, len);
+        close(fd);
+        bytes += len;
+    }
+}
+
+void layout_free(LayoutQueue* q)
+{
+    for (size_t i = 0; i < q->count; i++)
+        free(q->entries[i].rel);
+    free(q->entries);
+    memset(q, 0, sizeof(*q));
+}
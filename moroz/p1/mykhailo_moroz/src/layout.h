@@ -0,0 +1,45 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Copy queue for an initial sync in on-disk order (-L). Copying in readdir
+// order makes a disk seek between nearly every pair of files, so the walk only
+// creates directories and links and queues the regular files, keyed by where
+// their first extent lies (FIEMAP), or by inode number where the filesystem
+// cannot tell, which on most of them still follows the layout roughly. The
+// copier then goes through the sorted queue with readahead issued for the
+// files just ahead of it.
+
+#define LAYOUT_AHEAD_BYTES (16u << 20)  // readahead issued ahead of the copier
+#define LAYOUT_AHEAD_FILES 256
+#define LAYOUT_AHEAD_FILE_MAX (2u << 20)  // of one file; the rest comes from its own sequential readahead
+
+typedef struct
+{
+    char* rel;  // path below the source root
+    mode_t mode;
+    off_t size;
+    ino_t ino;
+    uint64_t key;
+} LayoutEntry;
+
+typedef struct
+{
+    LayoutEntry* entries;
+    size_t count;
+    size_t capacity;
+    int by_inode;  // the filesystem has no FIEMAP, every key is an inode number
+    size_t ahead;  // entries below this had their readahead issued
+} LayoutQueue;
+
+// queues path (rel below the source root) with the key of its first extent
+int layout_add(LayoutQueue* q, const char* path, const char* rel, const struct stat* st);
+void layout_sort(LayoutQueue* q);
+// issues readahead for the entries after next, up to the LAYOUT_AHEAD_* limits
+void layout_prefetch(LayoutQueue* q, const char* root, size_t next);
+void layout_free(LayoutQueue* q);
+
+#endif
@@ -4,33 +4,90 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/fs.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "control.h"
+#include "dirdiff.h"
+#include "durable.h"
+#include "echoes.h"
+#include "filter.h"
+#include "layout.h"
+#include "moves.h"
+#include "pidmap.h"
+#include "polled.h"
+#include "scrub.h"
+#include "state.h"
+#include "stats.h"
+#include "stream.h"
+#include "tails.h"
+#include "tasks.h"
+#include "tierlog.h"
+#include "trash.h"
+#include "uncached.h"
+#include "watchtree.h"
+
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
 #define MAX_ARGS 32
-#define PENDING_MAX 128
+#define STOP_GRACE_SECONDS 5
+// crashed workers are restarted after 1, 2, 4, ... seconds, at most a minute
+#define RESTART_BACKOFF_MIN 1
+#define RESTART_BACKOFF_MAX 60
+// a worker that stayed up this long before dying starts the backoff over
+#define RESTART_STABLE_SECONDS 60
+// how often changed sync watermarks are written to the state file
+#define STATE_SAVE_SECONDS 5
+// file timestamps come from a coarse clock, so files changed slightly before
+// the watermark was taken are rechecked as well
+#define WATERMARK_SLACK_NS 1000000000LL
+// an idle worker wakes up this often to expire pending moves and advance its watermark
+#define WORKER_IDLE_TICK_MS 1000
+// how often "restore" checks whether the worker it handed the restore to is done
+#define RESTORE_WAIT_MS 10
+// Directories moved out of the source are parked here, inside the target, in
+// case they come back. The name is reserved at the top of both trees.
+#define QUARANTINE_NAME ".sop-quarantine"
+#define QUARANTINE_BUDGET_BYTES (256ULL << 20)
+#define QUARANTINE_MAX_ENTRIES 1024
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
 
 int copy_file(const char* src, const char* dst, mode_t mode);
+static int update_file(const char* src_path, const char* dst_path, mode_t mode);
+int same_file_quick(const struct stat* a, const struct stat* b);
+void copy_metadata(int fd, const struct stat* st);
 int copy_symplink_rewrite(const char* src_link, const char* dst_link, const char* src_real, const char* dst_real);
 int mkdir_p(const char* path, mode_t mode);
 int rm_tree(const char* path);
 int has_prefix_path(const char* s, const char* prefix);
 int copy_tree(const char* src_dir, const char* dst_dir, const char* src_real, const char* dst_real);
+int copy_tree_ordered(const char* src_real, const char* dst_real);
+int resume_tree(const char* src_dir, const char* dst_dir, const char* src_real, const char* dst_real,
+                long long since_ns);
 
-static volatile sig_atomic_t g_terminate = 0;
-static volatile sig_atomic_t g_got_sigchld = 0;
+// set by SIGTERM in a forked worker
 static volatile sig_atomic_t g_child_exit = 0;
+// what the worker code polls to know it has to stop: g_child_exit in a forked
+// worker, the cancel flag of the task being run on a pool thread
+static _Thread_local volatile sig_atomic_t* g_stop = &g_child_exit;
 
 typedef struct
 {
@@ -39,8 +96,32 @@ typedef struct
     pid_t pid;
     time_t created_at;
     int active;
+    time_t stop_requested;  // when SIGTERM was sent by "end", 0 otherwise
+    WorkerStats* stats;     // shared with the worker, see stats.h
+    int pidfd;              // watched by the control loop, -1 if not available
+    time_t started_at;      // when the current worker was forked
+    time_t restart_at;      // a crashed worker is due to be restarted, 0 otherwise
+    int backoff;            // seconds to wait before the next restart
+    int restarts;
+    long long saved_synced_ns;  // watermark last written to the state file
+    Filter* filter;             // --exclude/--include rules, NULL if none
+    Task* task;                 // served by the in-process runtime (-t) instead of a forked worker
+    TierLog* tier_log;          // primary of --tiered targets: what its worker logs for the secondaries
+    char* upstream;             // secondary of --tiered targets: the primary target it replicates from
+    unsigned restore_seq;       // restore handed to the worker and not answered yet, 0 if none
+    unsigned restore_reply;     // control_park() id of the client waiting for that restore
 } Backup;
 
+// what a restore did, reported back with its reply
+typedef struct
+{
+    unsigned long long copied;
+    unsigned long long skipped;
+} RestoreCounts;
+
+int apply_backup(const char* backup_path, const char* src_path, const char* backup_real, const char* src_real,
+                 RestoreCounts* counts);
+
 typedef struct
 {
     Backup* backups;
@@ -50,37 +131,78 @@ typedef struct
 
 typedef struct
 {
-    int wd;
+    DirId id;
+    long long moved_ns;  // realtime of the move-out, the watermark to resume from
+    unsigned long long bytes;
     char* path;
-} Watch;
-
-typedef struct
-{
-    Watch* watches;
-    size_t watches_count;
-    size_t watches_capacity;
-} WatchMap;
-
-typedef struct
-{
-    uint32_t cookie;
-    int is_dir;
-    time_t t;
-    char src_old[PATH_MAX];
-    char dst_old[PATH_MAX];
-} PendingMove;
+} Quarantined;
 
+// a worker's quarantine area, oldest entry first
 typedef struct
 {
-    PendingMove pending[PENDING_MAX];
-    size_t pending_count;
-} PendingMoves;
+    char* dir;
+    Quarantined* entries;
+    size_t count;
+    size_t capacity;
+    unsigned long long bytes;
+} QuarantineList;
 
 static BackupList g_list = {0};
-
-static void on_parent_terminate(int sig) { g_terminate = 1; }
-
-static void on_sigchld(int sig) { g_got_sigchld = 1; }
+// rules of the backup being worked on: set for good in a worker, while a task
+// runs on a pool thread, and around restore in the parent; NULL means
+// everything is mirrored
+static _Thread_local const Filter* g_filter = NULL;
+// worker only; a task keeps its own in between runs, see task_enter
+static _Thread_local QuarantineList g_quarantine = {0};
+// worker pid -> index in g_list, so exits are matched without a scan
+static PidMap g_pids = {0};
+// cleared when pidfd_open is unavailable; workers are then reaped on SIGCHLD
+static int g_pidfd_supported = 1;
+// registry persisted across daemon runs, NULL when started without -f
+static const char* g_state_path = NULL;
+static time_t g_state_saved_at = 0;
+static int g_state_dirty = 0;
+// workers resumed from the state file that have not reported being protected yet
+static size_t g_warm_pending = 0;
+static long long g_warm_start_ns = 0;
+// where command replies go; set per command by the control loop
+static FILE* g_out = NULL;
+// -c: seconds between the periodic scrubs of every target, 0 = only on "verify"
+static long long g_scrub_interval = 0;
+// -b: what a scrub may read per second, 0 = unlimited
+static unsigned long long g_scrub_rate = SCRUB_DEFAULT_RATE;
+// worker only: its running scrub, 0 if none
+static _Thread_local pid_t g_scrub_pid = 0;
+// -t: pool threads of the in-process runtime, 0 = a forked worker per backup
+static int g_threads = 0;
+// the task whose step the calling pool thread runs, NULL in a forked worker
+static _Thread_local Task* g_task = NULL;
+// fires every RESTORE_WAIT_MS while a worker has a restore to answer, see restore_check
+static int g_restore_timer = -1;
+static size_t g_restores_pending = 0;
+// -L: initial syncs copy files in on-disk order, see layout.h
+static int g_layout_order = 0;
+// -p: seconds between scans of the subtrees polled by rule or for lack of watches
+static long long g_poll_interval = POLL_DEFAULT_INTERVAL;
+// worker of a primary target: its changes are logged here for the secondaries
+static _Thread_local TierLog* g_tier = NULL;
+// subtrees of the target being mirrored that are scanned instead of watched,
+// see polled.h; NULL where nothing can scan them (stream targets)
+static _Thread_local PollSet* g_polls = NULL;
+// -d: the target being mirrored counts its changes toward the next sync here,
+// NULL in mode none and where nothing syncs them (stream targets)
+static _Thread_local Durable* g_durable = NULL;
+// what the worker last copied of each file, see tails.h; NULL where every
+// copy has to be a full one (bulk phases, scrub repairs, restore)
+static _Thread_local Tails* g_tails = NULL;
+// the trash of the target being mirrored, see trash.h; NULL where directories
+// are deleted in place (daemon side, scrub repairs, restore)
+static _Thread_local Trash* g_trash = NULL;
+// -r: entries a reclaimer removes from a trash per second, 0 = unlimited
+static unsigned long long g_trash_rate = TRASH_DEFAULT_RATE;
+// what the worker's last live restore wrote into the source, see echoes.h;
+// NULL outside a worker
+static _Thread_local Echoes* g_echoes = NULL;
 
 static void on_child_term(int sig) { g_child_exit = 1; }
 
@@ -99,13 +221,6 @@ static int sethandler(void (*f)(int), int sigNo)
     return 0;
 }
 
-static void install_parent_signals(void)
-{
-    sethandler(on_parent_terminate, SIGINT);
-    sethandler(on_parent_terminate, SIGTERM);
-    sethandler(on_sigchld, SIGCHLD);
-}
-
 static void child_install_signals(void)
 {
     if (sethandler(on_child_term, SIGTERM) < 0)
@@ -164,7 +279,7 @@ int parse_line(char* line, char* argv[MAX_ARGS], char argv_buf[MAX_ARGS][PATH_MA
 
         if (argc >= MAX_ARGS)
         {
-            printf("Too many arguments\n");
+            fprintf(g_out, "Too many arguments\n");
             return -1;
         }
 
@@ -182,7 +297,7 @@ int parse_line(char* line, char* argv[MAX_ARGS], char argv_buf[MAX_ARGS][PATH_MA
                     p++;
                     if (*p == '\0')  // string ended after backslash
                     {
-                        printf("Unexpected \\ or quote in the end of the argument\n");
+                        fprintf(g_out, "Unexpected \\ or quote in the end of the argument\n");
                         return -1;
                     }
                     char ch = *p;
@@ -190,7 +305,7 @@ int parse_line(char* line, char* argv[MAX_ARGS], char argv_buf[MAX_ARGS][PATH_MA
                     {  // supports only \\ and \"
                         if (out_len + 1 >= PATH_MAX)
                         {
-                            printf("Path is too big\n");
+                            fprintf(g_out, "Path is too big\n");
                             return -1;
                         }
                         out[out_len++] = ch;
@@ -199,7 +314,8 @@ int parse_line(char* line, char* argv[MAX_ARGS], char argv_buf[MAX_ARGS][PATH_MA
                     }
                     else
                     {
-                        printf("Unexpected escape sequence! Program supports only \\ and \" inside arguments\n");
+                        fprintf(g_out,
+                                "Unexpected escape sequence! Program supports only \\ and \" inside arguments\n");
                         return -1;
                     }
                 }
@@ -207,7 +323,7 @@ int parse_line(char* line, char* argv[MAX_ARGS], char argv_buf[MAX_ARGS][PATH_MA
                 {  // copy normal character
                     if (out_len >= PATH_MAX)
                     {
-                        printf("Path is too big\n");
+                        fprintf(g_out, "Path is too big\n");
                         return -1;
                     }
                     out[out_len++] = *p;
@@ -217,7 +333,7 @@ int parse_line(char* line, char* argv[MAX_ARGS], char argv_buf[MAX_ARGS][PATH_MA
             }
             if (*p != q)
             {
-                printf("No closing quote found\n");
+                fprintf(g_out, "No closing quote found\n");
                 return -1;
             }
             p++;
@@ -228,7 +344,7 @@ int parse_line(char* line, char* argv[MAX_ARGS], char argv_buf[MAX_ARGS][PATH_MA
             {
                 if (out_len >= PATH_MAX)
                 {
-                    printf("Path is too big\n");
+                    fprintf(g_out, "Path is too big\n");
                     return -1;
                 }
                 out[out_len++] = *p;
@@ -297,6 +413,15 @@ void split_dir_base(char* path, char dir[PATH_MAX], char base[PATH_MAX])
 
 int norm_target_path(char* in, char out[PATH_MAX])
 {
+    // a receiver's address names the target as it is
+    if (stream_is_target(in))
+    {
+        if (snprintf(out, PATH_MAX, "%s", in) >= PATH_MAX)
+        {
+            return -1;
+        }
+        return 0;
+    }
     if (realpath(in, out))
     {
         return 0;
@@ -398,7 +523,7 @@ int mirror_create_or_update(const char* src_path, const char* dst_path, const ch
 
     if (S_ISREG(st.st_mode))
     {
-        return copy_file(src_path, dst_path, st.st_mode);
+        return update_file(src_path, dst_path, st.st_mode);
     }
     if (S_ISLNK(st.st_mode))
     {
@@ -408,94 +533,146 @@ int mirror_create_or_update(const char* src_path, const char* dst_path, const ch
     return 0;
 }
 
-int mirror_delete_path(char* dst_path) { return rm_tree(dst_path); }
-
-int watch_ensure_capacity(WatchMap* map, size_t need)
+// deletes path from the target being mirrored: a directory goes to its trash
+// in one rename, anything else is deleted where it is
+static int discard_tree(const char* path)
 {
-    if (map->watches_capacity >= need)
-        return 0;
-    size_t new_cap = (map->watches_capacity == 0) ? 64 : (map->watches_capacity * 2);
-    while (new_cap < need)
-        new_cap *= 2;
-
-    Watch* new_watches = realloc(map->watches, new_cap * sizeof(*new_watches));
-    if (!new_watches)
+    if (g_trash && trash_put(g_trash, path) == 0)
     {
-        fprintf(stderr, "new_watches malloc failed\n");
-        return -1;
+        return 0;
     }
+    return rm_tree(path);
+}
 
-    map->watches = new_watches;
-    map->watches_capacity = new_cap;
-    return 0;
+int mirror_delete_path(char* dst_path) { return discard_tree(dst_path); }
+
+// a change was applied to the target: it waits for the next durable sync, and
+// the secondaries of a primary target are told what changed in it
+static void note_change(TierOp op, const char* dst_path, const char* dst_path2)
+{
+    if (g_durable)
+        durable_applied(g_durable, 1);
+    if (g_tier)
+        tier_log_append(g_tier, op, dst_path, dst_path2);
 }
 
-// some of the functions below were taken/modified from
-// https://gitlab.com/SaQQ/sop1/-/blob/master/05_events/watch_tree.c?ref_type=heads
-int watch_add(WatchMap* map, int wd, char* path)
+// the tree drops the watches of directories that are gone or were replaced
+static void watch_dropped(int wd, void* arg)
+{
+    if (g_task)
+        task_unwatch(g_task, wd);
+    else
+        inotify_rm_watch(*(const int*)arg, wd);
+}
+
+// whether path, somewhere below root, is left out by the backup's rules
+int path_excluded(const char* root, const char* path, int is_dir)
 {
-    if (watch_ensure_capacity(map, map->watches_count + 1) < 0)
+    const char* rel = path + strlen(root);
+    while (*rel == '/')
     {
-        fprintf(stderr, "watch add failed\n");
-        return -1;
+        rel++;
     }
+    if (*rel == '\0')
+    {
+        return 0;
+    }
+    return has_prefix_path(rel, QUARANTINE_NAME) || has_prefix_path(rel, TRASH_NAME) ||
+           (g_filter && filter_excluded(g_filter, rel, is_dir));
+}
 
-    map->watches[map->watches_count].wd = wd;
-    map->watches[map->watches_count].path = path;
-    map->watches_count++;
-    return 0;
+// whether the directory path, below root, is to be scanned instead of watched;
+// only a local target has the scans to do it
+int path_polled(const char* root, const char* path)
+{
+    if (!g_polls || !g_filter)
+    {
+        return 0;
+    }
+    const char* rel = path + strlen(root);
+    while (*rel == '/')
+    {
+        rel++;
+    }
+    return *rel != '\0' && filter_polled(g_filter, rel);
 }
 
-Watch* watch_find(WatchMap* map, int wd)
+// whether path is the quarantine area or the trash of the tree rooted at root,
+// or inside them
+int is_internal_path(const char* root, const char* path)
 {
-    for (size_t i = 0; i < map->watches_count; i++)
+    const char* rel = path + strlen(root);
+    while (*rel == '/')
     {
-        if (map->watches[i].wd == wd)
-        {
-            return &map->watches[i];
-        }
+        rel++;
     }
-    return NULL;
+    return has_prefix_path(rel, QUARANTINE_NAME) || has_prefix_path(rel, TRASH_NAME);
 }
 
-void watch_remove(WatchMap* map, int wd)
+// A source entry named like a target's quarantine area or trash is never
+// mirrored: "add" refuses such sources, and one that shows up later is
+// reported here instead of being skipped without a word.
+void report_reserved(const char* src_real, const char* src_path)
 {
-    for (size_t i = 0; i < map->watches_count; i++)
+    const char* rel = src_path + strlen(src_real);
+    while (*rel == '/')
     {
-        if (map->watches[i].wd == wd)
-        {
-            free(map->watches[i].path);
-            map->watches[i] = map->watches[map->watches_count - 1];
-            map->watches_count--;
-            return;
-        }
+        rel++;
+    }
+    if (strcmp(rel, QUARANTINE_NAME) == 0 || strcmp(rel, TRASH_NAME) == 0)
+    {
+        fprintf(stderr, "%s: \"%s\" has a name reserved for the target, not mirrored\n", src_real, src_path);
     }
 }
 
-void watch_free_all(WatchMap* map)
+// reads what identifies the directory open at fd, see DirId
+int dir_identify(int fd, DirId* id)
 {
-    for (size_t i = 0; i < map->watches_count; i++)
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        perror("fstat(dir_identify)");
+        return -1;
+    }
+    id->dev = (unsigned long long)st.st_dev;
+    id->ino = (unsigned long long)st.st_ino;
+    id->gen = 0;
+
+    long gen = 0;
+    if (ioctl(fd, FS_IOC_GETVERSION, &gen) == 0 && gen != 0)
     {
-        free(map->watches[i].path);
+        id->gen = (unsigned int)gen;
+        return 0;
+    }
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_BTIME, &stx) == 0 && (stx.stx_mask & STATX_BTIME))
+    {
+        id->gen = (unsigned long long)stx.stx_btime.tv_sec * 1000000000ULL + stx.stx_btime.tv_nsec;
     }
-    free(map->watches);
-    map->watches = NULL;
-    map->watches_capacity = 0;
-    map->watches_count = 0;
+    return 0;
 }
 
-int add_watch_tree(int notify_fd, WatchMap* map, const char* base_path)
+// some of the functions below were taken/modified from
+// https://gitlab.com/SaQQ/sop1/-/blob/master/05_events/watch_tree.c?ref_type=heads
+static int add_watch_node(int notify_fd, WatchTree* map, uint32_t parent, const char* name, const char* base_path,
+                          const char* src_real)
 {
     uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF |
                     IN_MOVE_SELF | IN_IGNORED;
 
-    int wd = inotify_add_watch(notify_fd, base_path, mask);
+    int wd = g_task ? task_watch(g_task, base_path, mask) : inotify_add_watch(notify_fd, base_path, mask);
+    if (wd < 0 && errno == ENOSPC && parent && g_polls)
+    {
+        // out of watches: scanned instead, its parent still reports it going away
+        stats_add(STAT_POLL_BUDGET, 1);
+        return poll_add(g_polls, base_path, POLL_BUDGET, stats_realtime_ns()) ? 0 : -1;
+    }
     if (wd < 0)
     {
         perror("inotify_add_watch");
         return -1;
     }
-    watch_add(map, wd, strdup(base_path));
+    uint32_t self = wt_add(map, wd, parent, name);
 
     DIR* dir = opendir(base_path);
     if (!dir)
@@ -503,6 +680,11 @@ int add_watch_tree(int notify_fd, WatchMap* map, const char* base_path)
         perror("opendir");
         return -1;
     }
+    // remembered so the directory can be recognised if it is moved out and back
+    if (self)
+    {
+        dir_identify(dirfd(dir), &map->nodes[self].id);
+    }
 
     struct dirent* entry;
     while ((entry = readdir(dir)) != NULL)
@@ -529,7 +711,21 @@ int add_watch_tree(int notify_fd, WatchMap* map, const char* base_path)
 
         if (S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode))
         {
-            if (add_watch_tree(notify_fd, map, child) < 0)
+            if (path_excluded(src_real, child, 1))
+            {
+                stats_add(STAT_SKIPPED_WATCHES, 1);
+                continue;
+            }
+            if (self && path_polled(src_real, child))
+            {
+                if (!poll_add(g_polls, child, POLL_RULE, stats_realtime_ns()))
+                {
+                    closedir(dir);
+                    return -1;
+                }
+                continue;
+            }
+            if (!self || add_watch_node(notify_fd, map, self, entry->d_name, child, src_real) < 0)
             {
                 closedir(dir);
                 return -1;
@@ -545,1108 +741,4666 @@ int add_watch_tree(int notify_fd, WatchMap* map, const char* base_path)
     return 0;
 }
 
-void watch_update_prefix(WatchMap* map, const char* old_path, const char* new_path)
+// src_real is the backup root the rules are relative to; excluded directories
+// never get a watch. base_path is the root or a directory whose parent is watched.
+int add_watch_tree(int notify_fd, WatchTree* map, const char* base_path, const char* src_real)
 {
-    size_t oldlen = strlen(old_path);
+    if (strcmp(base_path, src_real) == 0)
+    {
+        return add_watch_node(notify_fd, map, 0, base_path, base_path, src_real);
+    }
 
-    for (size_t i = 0; i < map->watches_count; i++)
+    const char* slash = strrchr(base_path, '/');
+    char parent_path[PATH_MAX];
+    if (!slash || (size_t)(slash - base_path) >= sizeof(parent_path))
     {
-        char* p = map->watches[i].path;
-        if (!has_prefix_path(p, old_path))
-        {
-            continue;
-        }
+        return -1;
+    }
+    memcpy(parent_path, base_path, (size_t)(slash - base_path));
+    parent_path[slash - base_path] = '\0';
+    uint32_t parent = wt_find_path(map, parent_path);
+    if (!parent)
+    {
+        fprintf(stderr, "no watch for %s\n", parent_path);
+        return -1;
+    }
+    return add_watch_node(notify_fd, map, parent, slash + 1, base_path, src_real);
+}
 
-        char* suffix = p + oldlen;
-        if (*suffix == '/')
-            suffix++;
+// drops the watches of path and everything below it
+void watch_remove_subtree(WatchTree* map, const char* path) { wt_remove(map, wt_find_path(map, path)); }
+
+// quarantine of directories moved out of the source
+static unsigned long long tree_bytes(const char* path)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0)
+    {
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        return S_ISREG(st.st_mode) ? (unsigned long long)st.st_size : 0;
+    }
 
-        char buf[PATH_MAX];
-        if (*suffix)
+    DIR* dir = opendir(path);
+    if (!dir)
+    {
+        return 0;
+    }
+    unsigned long long total = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
         {
-            snprintf(buf, PATH_MAX, "%s/%s", new_path, suffix);
+            continue;
         }
-        else
+        char child[PATH_MAX];
+        if (snprintf(child, PATH_MAX, "%s/%s", path, entry->d_name) < PATH_MAX)
         {
-            snprintf(buf, PATH_MAX, "%s", new_path);
+            total += tree_bytes(child);
         }
-
-        free(map->watches[i].path);
-        map->watches[i].path = strdup(buf);
     }
+    closedir(dir);
+    return total;
 }
 
-void watch_remove_subtree(int notify_fd, WatchMap* map, const char* prefix)
+static void quarantine_publish(void)
 {
-    size_t i = 0;
-    while (i < map->watches_count)
-    {
-        if (has_prefix_path(map->watches[i].path, prefix))
-        {
-            inotify_rm_watch(notify_fd, map->watches[i].wd);
-            watch_remove(map, map->watches[i].wd);
-            continue;
-        }
-        i++;
-    }
+    stats_set(STAT_QUARANTINED, g_quarantine.count);
+    stats_set(STAT_QUARANTINE_BYTES, g_quarantine.bytes);
 }
 
-// helpers for pending move management
-void pending_move_add(PendingMoves* pm, uint32_t cookie, int is_dir, const char* src_old, const char* dst_old)
+static int quarantine_append(const DirId* id, long long moved_ns, unsigned long long bytes, char* path)
 {
-    if (pm->pending_count == PENDING_MAX)
+    if (g_quarantine.count == g_quarantine.capacity)
     {
-        size_t oldest = 0;
-        for (size_t i = 0; i < pm->pending_count; i++)
+        size_t new_capacity = g_quarantine.capacity ? g_quarantine.capacity * 2 : 16;
+        Quarantined* entries = realloc(g_quarantine.entries, new_capacity * sizeof(*entries));
+        if (!entries)
         {
-            if (pm->pending[i].t < pm->pending[oldest].t)
-            {
-                oldest = i;
-            }
+            perror("realloc(quarantine)");
+            return -1;
         }
-
-        pm->pending[oldest] = pm->pending[pm->pending_count - 1];
-        pm->pending_count--;
+        g_quarantine.entries = entries;
+        g_quarantine.capacity = new_capacity;
     }
-
-    PendingMove* new_move = &pm->pending[pm->pending_count++];
-    new_move->cookie = cookie;
-    new_move->is_dir = is_dir;
-    new_move->t = time(NULL);
-    snprintf(new_move->src_old, PATH_MAX, "%s", src_old);
-    snprintf(new_move->dst_old, PATH_MAX, "%s", dst_old);
+    g_quarantine.entries[g_quarantine.count++] = (Quarantined){*id, moved_ns, bytes, path};
+    g_quarantine.bytes += bytes;
+    return 0;
 }
 
-int pm_take(PendingMoves* pm, uint32_t cookie, PendingMove* out)
+// forgets entry i; its directory has already been renamed away or removed
+static void quarantine_forget(size_t i)
 {
-    for (size_t i = 0; i < pm->pending_count; i++)
+    g_quarantine.bytes -= g_quarantine.entries[i].bytes;
+    free(g_quarantine.entries[i].path);
+    memmove(&g_quarantine.entries[i], &g_quarantine.entries[i + 1],
+            (g_quarantine.count - i - 1) * sizeof(*g_quarantine.entries));
+    g_quarantine.count--;
+    if (g_quarantine.count == 0)
     {
-        if (pm->pending[i].cookie == cookie)
-        {
-            *out = pm->pending[i];
-            pm->pending[i] = pm->pending[pm->pending_count - 1];
-            pm->pending_count--;
-            return 1;
-        }
+        rmdir(g_quarantine.dir);  // only leave the area behind while it holds something
     }
+}
 
-    return 0;
+static int quarantine_cmp(const void* a, const void* b)
+{
+    long long x = ((const Quarantined*)a)->moved_ns;
+    long long y = ((const Quarantined*)b)->moved_ns;
+    return (x > y) - (x < y);
 }
 
-void pm_1s_expire(PendingMoves* pm, int notify_fd, WatchMap* map)
+// Picks up what an earlier worker left in dst_real's quarantine area, so a
+// directory moved out before a restart can still come back without a recopy.
+int quarantine_open(const char* dst_real)
 {
-    time_t now = time(NULL);
-    size_t i = 0;
-    while (i < pm->pending_count)
+    char dir_path[PATH_MAX];
+    if (snprintf(dir_path, PATH_MAX, "%s/%s", dst_real, QUARANTINE_NAME) >= PATH_MAX)
+    {
+        fprintf(stderr, "Name too long(quarantine)\n");
+        return -1;
+    }
+    g_quarantine.dir = strdup(dir_path);
+    if (!g_quarantine.dir)
+    {
+        perror("strdup(quarantine)");
+        return -1;
+    }
+
+    DIR* dir = opendir(dir_path);
+    if (!dir)
+    {
+        return 0;  // created on first use
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
     {
-        if (now - pm->pending[i].t < 1)
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
         {
-            i++;
             continue;
         }
-
-        rm_tree(pm->pending[i].dst_old);
-        if (pm->pending[i].is_dir)
+        char path[PATH_MAX];
+        if (snprintf(path, PATH_MAX, "%s/%s", dir_path, entry->d_name) >= PATH_MAX)
         {
-            watch_remove_subtree(notify_fd, map, pm->pending[i].src_old);
+            continue;
+        }
+        DirId id;
+        long long moved_ns;
+        int used = 0;
+        if (sscanf(entry->d_name, "%llx-%llx-%llx-%lld%n", &id.dev, &id.ino, &id.gen, &moved_ns, &used) != 4 ||
+            entry->d_name[used] != '\0')
+        {
+            rm_tree(path);  // not ours, or a rename that was interrupted
+            continue;
+        }
+        char* copy = strdup(path);
+        if (!copy || quarantine_append(&id, moved_ns, tree_bytes(path), copy) < 0)
+        {
+            free(copy);
+            break;
         }
-
-        pm->pending[i] = pm->pending[pm->pending_count - 1];
-        pm->pending_count--;
     }
+    closedir(dir);
+    qsort(g_quarantine.entries, g_quarantine.count, sizeof(*g_quarantine.entries), quarantine_cmp);
+    quarantine_publish();
+    return 0;
 }
 
-// mirroring itself
-int monitor_and_mirror(const char* src_real, const char* dst_real)
+void quarantine_close(void)
 {
-    int ifd = inotify_init();
-    if (ifd < 0)
+    for (size_t i = 0; i < g_quarantine.count; i++)
     {
-        perror("inotify_init");
-        exit(EXIT_FAILURE);
+        free(g_quarantine.entries[i].path);
     }
+    free(g_quarantine.entries);
+    free(g_quarantine.dir);
+    memset(&g_quarantine, 0, sizeof(g_quarantine));
+}
 
-    WatchMap map = {0};
-    if (add_watch_tree(ifd, &map, src_real) < 0)
+// Parks the mirror of a directory moved out of the source instead of deleting
+// it. Returns -1 when it does not fit the budget and should be removed instead.
+int quarantine_put(const char* dst_old, const DirId* id, long long moved_ns)
+{
+    if (!g_quarantine.dir || (id->ino == 0 && id->gen == 0))
     {
-        close(ifd);
+        return -1;
+    }
+    unsigned long long bytes = tree_bytes(dst_old);
+    if (bytes > QUARANTINE_BUDGET_BYTES)
+    {
+        return -1;
+    }
+    if (mkdir(g_quarantine.dir, 0700) < 0 && errno != EEXIST)
+    {
+        perror("mkdir(quarantine)");
         return -1;
     }
 
-    PendingMoves pm = {0};
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/%llx-%llx-%llx-%lld", g_quarantine.dir, id->dev, id->ino, id->gen, moved_ns) >=
+        PATH_MAX)
+    {
+        return -1;
+    }
+    char* copy = strdup(path);
+    if (!copy)
+    {
+        perror("strdup(quarantine)");
+        return -1;
+    }
+    if (rename(dst_old, path) < 0)
+    {
+        if (errno != ENOENT)
+            perror("rename(quarantine)");
+        free(copy);
+        return -1;
+    }
+    if (quarantine_append(id, moved_ns, bytes, copy) < 0)
+    {
+        rm_tree(path);
+        free(copy);
+        return -1;
+    }
+    quarantine_publish();
+    return 0;
+}
 
-    char buffer[4096];
-    while (!g_child_exit)
+// Moves the quarantined mirror of the directory now at src_path to dst_path.
+// Returns 0 and the realtime it was moved out at, or -1 if there is none.
+int quarantine_reclaim(const char* src_path, const char* dst_path, long long* moved_ns)
+{
+    if (g_quarantine.count == 0)
+    {
+        return -1;
+    }
+    int fd = open(src_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
     {
-        pm_1s_expire(&pm, ifd, &map);
+        return -1;
+    }
+    DirId id;
+    int identified = dir_identify(fd, &id);
+    close(fd);
+    if (identified < 0)
+    {
+        return -1;
+    }
 
-        ssize_t len = read(ifd, buffer, sizeof(buffer));
-        if (len < 0)
+    // newest first: if an inode came back twice, the latest copy is the one to keep
+    for (size_t i = g_quarantine.count; i-- > 0;)
+    {
+        Quarantined* q = &g_quarantine.entries[i];
+        if (q->id.dev != id.dev || q->id.ino != id.ino || q->id.gen != id.gen)
         {
-            if (errno == EINTR)
-                continue;
-            break;
+            continue;
         }
-
-        ssize_t i = 0;
-        while (i < len)
+        if (ensure_parent_dir(dst_path) < 0 || rename(q->path, dst_path) < 0)
         {
-            struct inotify_event* event = (struct inotify_event*)&buffer[i];
-            i += (ssize_t)sizeof(*event) + (ssize_t)event->len;
+            return -1;
+        }
+        *moved_ns = q->moved_ns;
+        quarantine_forget(i);
+        stats_add(STAT_RECLAIMED, 1);
+        quarantine_publish();
+        return 0;
+    }
+    return -1;
+}
 
-            Watch* watch = watch_find(&map, event->wd);
-            if (!watch)
-                continue;
+// Lazy cleanup: removes the oldest entry while the area is over its budget,
+// one per call so a large removal never holds up the event loop for long.
+void quarantine_trim(void)
+{
+    if (g_quarantine.count == 0 ||
+        (g_quarantine.bytes <= QUARANTINE_BUDGET_BYTES && g_quarantine.count <= QUARANTINE_MAX_ENTRIES))
+    {
+        return;
+    }
+    discard_tree(g_quarantine.entries[0].path);
+    quarantine_forget(0);
+    quarantine_publish();
+}
 
-            if (event->mask & IN_IGNORED)
-            {
-                // watch was removed by the kernel
-                watch_remove(&map, event->wd);
-                continue;
-            }
+typedef struct
+{
+    int notify_fd;
+    WatchTree* map;
+} MoveContext;
 
-            char src_path[PATH_MAX];
-            if (event->len > 0)
-                snprintf(src_path, PATH_MAX, "%s/%s", watch->path, event->name);
-            else
-                snprintf(src_path, PATH_MAX, "%s", watch->path);
+// an IN_MOVED_FROM got no IN_MOVED_TO in time: the entry left the source
+void move_expired(PendingMove* mv, void* arg)
+{
+    MoveContext* ctx = arg;
+    if (mv->is_dir)
+    {
+        uint32_t node = wt_find_path(ctx->map, mv->src_old);
+        if (!node || quarantine_put(mv->dst_old, &ctx->map->nodes[node].id, mv->wall_ns) < 0)
+        {
+            discard_tree(mv->dst_old);
+        }
+        wt_remove(ctx->map, node);
+    }
+    else
+    {
+        rm_tree(mv->dst_old);
+    }
+    note_change(TIER_DELETE, mv->dst_old, NULL);
+    stats_record_latency(LAT_DELETE, mv->read_ns);
+}
 
-            char dst_path[PATH_MAX];
-            if (map_src_to_dst(src_real, dst_real, src_path, dst_path) < 0)
-            {
-                continue;
-            }
+// remembers what a live restore just wrote at src_path, see echoes.h
+static void restore_note(const char* src_path)
+{
+    struct stat st;
+    if (g_echoes && lstat(src_path, &st) == 0)
+        echoes_put(g_echoes, &st);
+}
 
-            int is_dir = (event->mask & IN_ISDIR) != 0;
+// whether the entry at src_path is still as the last live restore left it, so
+// the event on it is the restore's echo; its mirror is that entry already
+static int restore_echo(const char* src_path)
+{
+    struct stat st;
+    if (!g_echoes || g_echoes->used == 0 || lstat(src_path, &st) < 0 || !echoes_has(g_echoes, &st))
+        return 0;
+    stats_add(STAT_RESTORE_ECHOES, 1);
+    return 1;
+}
 
-            // root deleted/moved
-            if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && strcmp(src_path, src_real) == 0)
-            {
-                g_child_exit = 1;
-                break;
-            }
+// A directory appeared in the source; if it is one that was moved out
+// earlier, its quarantined mirror is moved back and only brought up to date.
+// Returns -1 when it has to be copied as new.
+int mirror_reclaim_dir(int ifd, WatchTree* map, const char* src_path, const char* dst_path, const char* src_real,
+                       const char* dst_real)
+{
+    long long moved_ns;
+    if (quarantine_reclaim(src_path, dst_path, &moved_ns) < 0)
+    {
+        return -1;
+    }
+    add_watch_tree(ifd, map, src_path, src_real);
+    long long since_ns = (moved_ns > WATERMARK_SLACK_NS) ? moved_ns - WATERMARK_SLACK_NS : 0;
+    resume_tree(src_path, dst_path, src_real, dst_real, since_ns);
+    return 0;
+}
 
-            if (event->mask & IN_DELETE_SELF)
-            {
-                mirror_delete_path(dst_path);
-                watch_remove_subtree(ifd, &map, src_path);
-                continue;
-            }
-
-            if (event->mask & IN_MOVED_FROM)
-            {
-                pending_move_add(&pm, event->cookie, is_dir, src_path, dst_path);
-                continue;
-            }
-
-            if (event->mask & IN_MOVED_TO)
-            {
-                PendingMove mv;
-                if (pm_take(&pm, event->cookie, &mv))
-                {  // if it is a pair
-                    if (ensure_parent_dir(dst_path) < 0)
-                    {
-                        continue;
-                    }
-                    rename(mv.dst_old, dst_path);
-                    if (mv.is_dir)
-                    {
-                        // update watch paths for all watches under that directory
-                        watch_update_prefix(&map, mv.src_old, src_path);
-                    }
-                }
-
-                else
-                {
-                    if (is_dir)
-                    {
-                        mirror_create_or_update(src_path, dst_path, src_real, dst_real);
-                        add_watch_tree(ifd, &map, src_path);
-                        copy_tree(src_path, dst_path, src_real, dst_real);
-                    }
-                    else
-                    {
-                        mirror_create_or_update(src_path, dst_path, src_real, dst_real);
-                    }
-                }
-                continue;
-            }
-
-            if (event->mask & IN_CREATE)
-            {
-                if (is_dir)
-                {
-                    mirror_create_or_update(src_path, dst_path, src_real, dst_real);
-                    add_watch_tree(ifd, &map, src_path);
-                    copy_tree(src_path, dst_path, (char*)src_real, (char*)dst_real);
-                }
-                else
-                {
-                    struct stat st;
-                    if (lstat(src_path, &st) == 0 && S_ISLNK(st.st_mode))
-                    {
-                        mirror_create_or_update(src_path, dst_path, src_real, dst_real);
-                    }
-                }
-                continue;
-            }
-
-            if ((event->mask & IN_CLOSE_WRITE) && !is_dir)
-            {
-                mirror_create_or_update(src_path, dst_path, src_real, dst_real);
-                continue;
-            }
+// mirroring itself
+// returns 1 when the watched root itself is gone and the worker should stop;
+// read_ns is when the event's batch was read and is used for latency samples
+int mirror_handle_event(int ifd, WatchTree* map, PendingMoves* pm, const char* src_real, const char* dst_real,
+                        struct inotify_event* event, long long read_ns)
+{
+    uint32_t node = wt_find_wd(map, event->wd);
+    if (!node)
+        return 0;
 
-            if (event->mask & IN_DELETE)
-            {
-                mirror_delete_path(dst_path);
-                if (is_dir)
-                    watch_remove_subtree(ifd, &map, src_path);
-            }
-        }
+    if (event->mask & IN_IGNORED)
+    {
+        // watch was removed by the kernel
+        wt_remove(map, node);
+        return 0;
     }
+    if (g_polls)
+        poll_heat(g_polls, map, node);
 
-    close(ifd);
-    watch_free_all(&map);
-    return 0;
-}
-
-// restoring helpers
-int check_src_against_backup(const char* src_path, const char* backup_path)
-{
-    struct stat backup_st;
-    if (lstat(backup_path, &backup_st) < 0)
-    {  // if backup doesn't have smth, delete it from src
-        if (errno == ENOENT)
-        {
-            return rm_tree(src_path);  // rm_tree handles non-existent files
-        }
-        perror("lstat(check_src_against_backup)");
-        return -1;
+    char src_path[PATH_MAX];
+    if (wt_path(map, node, src_path, sizeof(src_path)) < 0)
+        return 0;
+    if (event->len > 0)
+    {
+        size_t dir_len = strlen(src_path);
+        if (snprintf(src_path + dir_len, sizeof(src_path) - dir_len, "/%s", event->name) >=
+            (int)(sizeof(src_path) - dir_len))
+            return 0;
     }
 
-    struct stat source_st;
-    if (lstat(src_path, &source_st) < 0)
+    char dst_path[PATH_MAX];
+    if (map_src_to_dst(src_real, dst_real, src_path, dst_path) < 0)
     {
-        if (errno == ENOENT)
-        {
-            return 0;
-        }
-        perror("lstat(check_src_against_backup)");
-        return -1;
+        return 0;
     }
 
-    int src_is_dir = S_ISDIR(source_st.st_mode) && !S_ISLNK(source_st.st_mode);
-    int bck_is_dir = S_ISDIR(backup_st.st_mode) && !S_ISLNK(backup_st.st_mode);
+    int is_dir = (event->mask & IN_ISDIR) != 0;
 
-    if (src_is_dir != bck_is_dir || (S_ISREG(source_st.st_mode) != S_ISREG(backup_st.st_mode)) ||
-        (S_ISLNK(source_st.st_mode) != S_ISLNK(backup_st.st_mode)))
+    // root deleted/moved
+    if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && strcmp(src_path, src_real) == 0)
     {
-        return rm_tree(src_path);
+        return 1;
     }
 
-    if (!src_is_dir)
+    // Excluded entries have no mirror. A move out of them arrives as an unpaired
+    // IN_MOVED_TO and is copied like a new entry; a move into them is handled below.
+    int excluded = event->len > 0 && path_excluded(src_real, src_path, is_dir);
+    if (excluded && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+    {
+        report_reserved(src_real, src_path);
+    }
+    if (excluded && !(event->mask & IN_MOVED_TO))
+    {
+        stats_add(STAT_SKIPPED_EVENTS, 1);
         return 0;
+    }
 
-    DIR* dir;
-    if ((dir = opendir(src_path)) == NULL)
+    if (event->mask & IN_DELETE_SELF)
     {
-        perror("opendir(check_src_against_backup)");
-        return -1;
+        mirror_delete_path(dst_path);
+        note_change(TIER_DELETE, dst_path, NULL);
+        wt_remove(map, node);
+        stats_record_latency(LAT_DELETE, read_ns);
+        return 0;
     }
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL)
+
+    if (event->mask & IN_MOVED_FROM)
     {
-        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
-            continue;
+        if (pm_add(pm, event->cookie, is_dir, src_path, dst_path, read_ns, stats_realtime_ns(), read_ns) < 0)
+        {
+            // cannot wait for the other half, treat it as a removal
+            mirror_delete_path(dst_path);
+            note_change(TIER_DELETE, dst_path, NULL);
+            if (is_dir)
+                watch_remove_subtree(map, src_path);
+        }
+        return 0;
+    }
 
-        char src_child[PATH_MAX], bck_child[PATH_MAX];
-        if (snprintf(src_child, PATH_MAX, "%s/%s", src_path, entry->d_name) >= PATH_MAX)
+    if (event->mask & IN_MOVED_TO)
+    {
+        PendingMove mv;
+        int paired = pm_take(pm, event->cookie, &mv);
+        if (excluded)
         {
-            if (closedir(dir) < 0)
+            // renamed to an excluded name (foo -> foo.tmp): it leaves the mirror
+            if (paired)
             {
-                perror("closedir(check_src_against_backup)");
+                discard_tree(mv.dst_old);
+                note_change(TIER_DELETE, mv.dst_old, NULL);
+                if (mv.is_dir)
+                    watch_remove_subtree(map, mv.src_old);
+                stats_record_latency(LAT_DELETE, mv.read_ns);
+                pm_release(&mv);
             }
-            return -1;
+            stats_add(STAT_SKIPPED_EVENTS, 1);
+            return 0;
         }
-        if (snprintf(bck_child, PATH_MAX, "%s/%s", backup_path, entry->d_name) >= PATH_MAX)
-        {
-            if (closedir(dir) < 0)
+        if (paired)
+        {  // if it is a pair
+            if (ensure_parent_dir(dst_path) < 0)
             {
-                perror("closedir(check_src_against_backup)");
+                pm_release(&mv);
+                return 0;
             }
-            return -1;
+            rename(mv.dst_old, dst_path);
+            note_change(TIER_RENAME, mv.dst_old, dst_path);
+            if (mv.is_dir)
+            {
+                // one node moves, the watches below it follow
+                wt_move(map, wt_find_path(map, mv.src_old), node, event->name);
+                if (g_polls)
+                    poll_moved(g_polls, mv.src_old, src_path);
+            }
+            // the rename started when its IN_MOVED_FROM half was read
+            stats_record_latency(LAT_RENAME, mv.read_ns);
+            pm_release(&mv);
         }
 
-        if (check_src_against_backup(src_child, bck_child) < 0)
+        else
         {
-            if (closedir(dir) < 0)
+            if (is_dir && mirror_reclaim_dir(ifd, map, src_path, dst_path, src_real, dst_real) == 0)
             {
-                perror("closedir(check_src_against_backup)");
+                stats_record_latency(LAT_RENAME, read_ns);
             }
-            return -1;
+            else if (is_dir)
+            {
+                mirror_create_or_update(src_path, dst_path, src_real, dst_real);
+                add_watch_tree(ifd, map, src_path, src_real);
+                copy_tree(src_path, dst_path, src_real, dst_real);
+            }
+            else
+            {
+                mirror_create_or_update(src_path, dst_path, src_real, dst_real);
+            }
+            note_change(TIER_UPDATE, dst_path, NULL);
+            stats_record_latency(LAT_COPY, read_ns);
         }
+        return 0;
     }
 
-    if (closedir(dir) < 0)
-    {
-        perror("closedir(check_src_against_backup)");
-        return -1;
-    }
-    return 0;
-}
-
-int apply_backup(const char* backup_path, const char* src_path, const char* backup_real, const char* src_real,
-                 time_t created_at)
-{
-    struct stat backup_st;
-    if (lstat(backup_path, &backup_st) < 0)
-        return -1;
-
-    if (S_ISDIR(backup_st.st_mode) && !S_ISLNK(backup_st.st_mode))
+    if (event->mask & IN_CREATE)
     {
-        if (mkdir_p(src_path, backup_st.st_mode & 0777) < 0)
-            return -1;
-
-        DIR* dir;
-        if ((dir = opendir(backup_path)) == NULL)
+        if (is_dir && restore_echo(src_path))
         {
-            perror("opendir(apply_backup)");
-            return -1;
+            // restored from the target: only what changed in it since is copied
+            mirror_create_or_update(src_path, dst_path, src_real, dst_real);
+            add_watch_tree(ifd, map, src_path, src_real);
+            resume_tree(src_path, dst_path, src_real, dst_real, 0);
+            return 0;
         }
-
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != NULL)
+        if (is_dir && mirror_reclaim_dir(ifd, map, src_path, dst_path, src_real, dst_real) == 0)
         {
-            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
-                continue;
-
-            char bck_child[PATH_MAX], src_child[PATH_MAX];
-            if (snprintf(bck_child, PATH_MAX, "%s/%s", backup_path, entry->d_name) >= PATH_MAX)
-            {
-                if (closedir(dir) < 0)
-                    perror("closedir(apply_backup)");
-                return -1;
-            }
-            if (snprintf(src_child, PATH_MAX, "%s/%s", src_path, entry->d_name) >= PATH_MAX)
-            {
-                if (closedir(dir) < 0)
-                    perror("closedir(apply_backup)");
-                return -1;
-            }
-
-            if (apply_backup(bck_child, src_child, backup_real, src_real, created_at) < 0)
-            {
-                closedir(dir);
-                return -1;
-            }
+            stats_record_latency(LAT_RENAME, read_ns);
         }
-        if (closedir(dir) < 0)
+        else if (is_dir)
         {
-            perror("closedir(apply_backup)");
-            return -1;
+            mirror_create_or_update(src_path, dst_path, src_real, dst_real);
+            add_watch_tree(ifd, map, src_path, src_real);
+            copy_tree(src_path, dst_path, (char*)src_real, (char*)dst_real);
+            stats_record_latency(LAT_MKDIR, read_ns);
+        }
+        else
+        {
+            // a regular file is copied once it is closed
+            struct stat st;
+            if (lstat(src_path, &st) < 0 || !S_ISLNK(st.st_mode) || restore_echo(src_path))
+                return 0;
+            mirror_create_or_update(src_path, dst_path, src_real, dst_real);
+            stats_record_latency(LAT_COPY, read_ns);
         }
+        note_change(TIER_UPDATE, dst_path, NULL);
         return 0;
     }
 
-    struct stat source_st;
-    int src_exists = (lstat(src_path, &source_st) == 0);
-    int to_write = 0;
-    if (!src_exists)
+    if ((event->mask & IN_CLOSE_WRITE) && !is_dir)
     {
-        to_write = 1;
+        if (restore_echo(src_path))
+            return 0;
+        mirror_create_or_update(src_path, dst_path, src_real, dst_real);
+        note_change(TIER_UPDATE, dst_path, NULL);
+        stats_record_latency(LAT_COPY, read_ns);
+        return 0;
     }
-    else if (source_st.st_mtime > created_at)
+
+    if (event->mask & IN_DELETE)
     {
-        to_write = 1;
+        // the restore replaced an entry of another type: what is there now
+        // came from the target, which keeps it
+        if (restore_echo(src_path))
+            return 0;
+        mirror_delete_path(dst_path);
+        note_change(TIER_DELETE, dst_path, NULL);
+        if (is_dir)
+            watch_remove_subtree(map, src_path);
+        stats_record_latency(LAT_DELETE, read_ns);
     }
+    return 0;
+}
 
-    if (!to_write)
-        return 0;
-
-    // types dont match
-    if (src_exists && ((S_ISREG(source_st.st_mode) != S_ISREG(backup_st.st_mode)) ||
-                       (S_ISLNK(source_st.st_mode) != S_ISLNK(backup_st.st_mode)) ||
-                       (S_ISDIR(source_st.st_mode) && !S_ISLNK(source_st.st_mode) != S_ISDIR(backup_st.st_mode) &&
-                        !S_ISLNK(backup_st.st_mode))))
+// number of whole events in a buffer returned by read(inotify)
+size_t count_events(const char* buffer, ssize_t len)
+{
+    size_t n = 0;
+    ssize_t i = 0;
+    while (i < len)
     {
-        if (rm_tree(src_path) < 0)
-            return -1;
+        const struct inotify_event* event = (const struct inotify_event*)&buffer[i];
+        i += (ssize_t)sizeof(*event) + (ssize_t)event->len;
+        n++;
     }
+    return n;
+}
 
-    if (ensure_parent_dir(src_path) < 0)
-        return -1;
+// scrubbing: a child of the worker walks the source and the target side by
+// side, at idle priority and within g_scrub_rate, and puts back whatever the
+// target lost or got wrong behind the worker's back
+typedef struct
+{
+    const char* src_real;
+    const char* dst_real;
+    int flags;  // SCRUB_*
+    IoBudget budget;
+} ScrubWalk;
+
+// Differences the worker has yet to apply are not drift. Everything that
+// changed in the source before the sync watermark is mirrored already, so only
+// entries older than that are repaired; newer ones are left to the worker.
+static int scrub_settled(const struct stat* src_st)
+{
+    long long ctime_ns = (long long)src_st->st_ctim.tv_sec * 1000000000LL + src_st->st_ctim.tv_nsec;
+    long long synced = g_stats ? atomic_load_explicit(&g_stats->synced_ns, memory_order_relaxed) : 0;
+    return ctime_ns + WATERMARK_SLACK_NS < synced;
+}
 
-    if (S_ISREG(backup_st.st_mode))
+// whether the symlink at dst_path points where its copy of src_path should
+static int scrub_same_link(const ScrubWalk* w, const char* src_path, const char* dst_path)
+{
+    char src_target[PATH_MAX], dst_target[PATH_MAX], expected[PATH_MAX];
+    ssize_t n = readlink(src_path, src_target, sizeof(src_target) - 1);
+    ssize_t m = readlink(dst_path, dst_target, sizeof(dst_target) - 1);
+    if (n < 0 || m < 0)
     {
-        return copy_file(backup_path, src_path, backup_st.st_mode);
+        return 0;
     }
-
-    if (S_ISLNK(backup_st.st_mode))
+    src_target[n] = '\0';
+    dst_target[m] = '\0';
+    // absolute links into the source are rewritten to the target, see copy_symplink_rewrite
+    if (src_target[0] == '/' && has_prefix_path(src_target, w->src_real))
     {
-        return copy_symplink_rewrite(backup_path, src_path, backup_real, src_real);
+        if (snprintf(expected, PATH_MAX, "%s%s", w->dst_real, src_target + strlen(w->src_real)) >= PATH_MAX)
+        {
+            return 0;
+        }
+        return strcmp(expected, dst_target) == 0;
     }
-    return 0;
+    return strcmp(src_target, dst_target) == 0;
 }
 
-// dynamic registry for backups
-int ensure_capacity(BackupList* lst, size_t need)
+// why the mirror does not match the source entry, NULL if it does
+static const char* scrub_compare(ScrubWalk* w, const char* src_path, const struct stat* src_st, const char* dst_path,
+                                 const struct stat* dst_st)
 {
-    if (lst->backups_capacity >= need)
+    if ((src_st->st_mode & S_IFMT) != (dst_st->st_mode & S_IFMT))
     {
-        return 0;
+        return "type";
     }
-    size_t new_capacity = (lst->backups_capacity == 0) ? 8 : (lst->backups_capacity * 2);
-    while (new_capacity < need)
+    if (S_ISLNK(src_st->st_mode))
     {
-        new_capacity *= 2;
+        return scrub_same_link(w, src_path, dst_path) ? NULL : "link";
     }
-    Backup* new_backup = realloc(lst->backups, sizeof(Backup) * new_capacity);
-    if (!new_backup)
+    if ((src_st->st_mode & 07777) != (dst_st->st_mode & 07777))
     {
-        return -1;
+        return "mode";
     }
-    lst->backups = new_backup;
-    lst->backups_capacity = new_capacity;
-    return 0;
-}
-
-void free_backup(Backup* backup)
-{
-    if (!backup)
+    if (!S_ISREG(src_st->st_mode))
     {
-        return;
+        return NULL;
     }
-    free(backup->dst);
-    free(backup->src);
-    backup->dst = NULL;
-    backup->src = NULL;
-    backup->created_at = 0;
-    backup->active = 0;
+    if (!same_file_quick(src_st, dst_st))
+    {
+        return "size/mtime";
+    }
+    if ((w->flags & SCRUB_CONTENT) && scrub_same_content(src_path, dst_path, (size_t)src_st->st_size, &w->budget) == 0)
+    {
+        return "content";
+    }
+    return NULL;
 }
 
-int find_backup(char* src, char* dst)
+// The walk is slow on purpose, so what it saw of an entry may be stale by the
+// time it is repaired. Whether path is still what seen describes, NULL seen
+// meaning nothing at all; any change to an entry, or to the entries of a
+// directory, moves its ctime.
+static int scrub_unchanged(const char* path, const struct stat* seen)
 {
-    for (int i = 0; i < (int)g_list.backups_count; i++)
+    struct stat now;
+    if (lstat(path, &now) < 0)
     {
-        if (strcmp(g_list.backups[i].src, src) == 0 && strcmp(g_list.backups[i].dst, dst) == 0)
-        {
-            return i;
-        }
+        return !seen && errno == ENOENT;
     }
-    return -1;
+    return seen && now.st_dev == seen->st_dev && now.st_ino == seen->st_ino && now.st_mode == seen->st_mode &&
+           now.st_ctim.tv_sec == seen->st_ctim.tv_sec && now.st_ctim.tv_nsec == seen->st_ctim.tv_nsec;
 }
 
-void reap_children()
+// makes dst_path a fresh copy of the source entry; a file whose mode differs
+// is copied again too, since its content was not compared
+static int scrub_repair(ScrubWalk* w, const char* src_path, const struct stat* src_st, const char* dst_path,
+                        const char* why)
 {
-    while (1)
+    if (why && strcmp(why, "mode") == 0 && S_ISDIR(src_st->st_mode))
     {
-        pid_t pid = waitpid(-1, NULL, WNOHANG);
-        if (pid <= 0)
-            break;
-
-        for (size_t i = 0; i < g_list.backups_count; i++)
+        if (chmod(dst_path, src_st->st_mode & 07777) < 0)
         {
-            if (g_list.backups[i].active && g_list.backups[i].pid == pid)
-            {
-                g_list.backups[i].active = 0;
-                g_list.backups[i].pid = 0;
-                break;
-            }
+            perror("chmod(scrub)");
+            return -1;
         }
+        return 0;
+    }
+    if (why && rm_tree(dst_path) < 0)
+    {
+        return -1;
+    }
+    if (mirror_create_or_update(src_path, dst_path, w->src_real, w->dst_real) < 0)
+    {
+        return -1;
+    }
+    if (S_ISDIR(src_st->st_mode))
+    {
+        return copy_tree(src_path, dst_path, w->src_real, w->dst_real);
     }
+    return 0;
 }
 
-// helpers for copy to target
-int is_dir_empty(char* path)
+static int scrub_dir(ScrubWalk* w, const char* src_dir, const struct stat* src_dir_st, const char* dst_dir);
+
+// an entry of the target directory that is not in the source (any more)
+static int scrub_extra(ScrubWalk* w, const char* src_dir, const struct stat* src_dir_st, const char* src_path,
+                       const char* dst_path, const struct stat* dst_st)
 {
-    DIR* dir = opendir(path);
-    if (!dir)
+    if (path_excluded(w->dst_real, dst_path, S_ISDIR(dst_st->st_mode)))
+    {
+        return 0;
+    }
+    if (budget_charge(&w->budget, SCRUB_ENTRY_COST) < 0)
     {
-        perror("opendir");
         return -1;
     }
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL)
+    stats_add(STAT_SCRUB_CHECKED, 1);
+    stats_add(STAT_SCRUB_DIVERGED, 1);
+    fprintf(stderr, "scrub: \"%s\" is not in the source\n", dst_path);
+    // removing something shows up as a change of the directory holding it
+    if (!(w->flags & SCRUB_REPAIR) || !scrub_settled(src_dir_st))
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-        {
-            continue;
-        }
-        if (closedir(dir) < 0)
-        {
-            perror("closedir");
-            return -1;
-        }
-        return 0;  // not empty
+        return 0;
     }
-    if (closedir(dir) < 0)
+    // the entry may have come back to the source, or the worker may be
+    // replacing the copy, since the directories were read
+    if (!scrub_unchanged(src_dir, src_dir_st) || !scrub_unchanged(src_path, NULL) ||
+        !scrub_unchanged(dst_path, dst_st))
     {
-        perror("closedir");
-        return -1;
+        fprintf(stderr, "scrub: \"%s\" changed meanwhile, left to the worker\n", dst_path);
+        return 0;
     }
-    return 1;
+    if (rm_tree(dst_path) == 0)
+    {
+        stats_add(STAT_SCRUB_REPAIRED, 1);
+    }
+    return 0;
 }
 
-int mkdir_p(const char* path, mode_t mode)
+// compares one source entry with its mirror, NULL dst_st if there is none,
+// then the directories below it; problems with single entries are reported
+// and skipped, -1 only means stop
+static int scrub_entry(ScrubWalk* w, const char* src_path, const struct stat* src_st, const char* dst_path,
+                       const struct stat* dst_st)
 {
-    char tmp[PATH_MAX];
-    if (snprintf(tmp, sizeof(tmp), "%s", path) >= PATH_MAX)
+    if (*g_stop)
     {
-        printf("Path is too big\n");
         return -1;
     }
-
-    size_t len = strlen(tmp);
-    if (len == 0)
+    if (path_excluded(w->src_real, src_path, S_ISDIR(src_st->st_mode)))
+    {
+        return 0;
+    }
+    if (budget_charge(&w->budget, SCRUB_ENTRY_COST) < 0)
     {
-        printf("Path is empty\n");
         return -1;
     }
+    stats_add(STAT_SCRUB_CHECKED, 1);
 
-    while (len > 1 && tmp[len - 1] == '/')
+    const char* why = dst_st ? scrub_compare(w, src_path, src_st, dst_path, dst_st) : "missing";
+    if (why)
     {
-        tmp[--len] = '\0';
-    }
-
-    for (char* p = tmp + 1; *p; p++)
-    {
-        if (*p == '/')
+        stats_add(STAT_SCRUB_DIVERGED, 1);
+        fprintf(stderr, "scrub: \"%s\" differs from the source (%s)\n", dst_path, why);
+        if (!(w->flags & SCRUB_REPAIR) || !scrub_settled(src_st))
         {
-            *p = '\0';
-            if (mkdir(tmp, mode) < 0 && errno != EEXIST)
-            {
-                perror("mkdir");
-                return -1;
-            }
-            *p = '/';
+            return 0;
         }
-    }
-    if (mkdir(tmp, mode) < 0 && errno != EEXIST)
-    {
-        perror("mkdir");
-        return -1;
-    }
-    return 0;
-}
-
-int ensure_empty_dir(char* dst)
-{
-    struct stat st;
-    if (lstat(dst, &st) == 0)
-    {
-        if (!S_ISDIR(st.st_mode))
+        if (!scrub_unchanged(src_path, src_st) || !scrub_unchanged(dst_path, dst_st))
         {
-            fprintf(stderr, "%s is not a directory\n", dst);
-            return -1;
+            fprintf(stderr, "scrub: \"%s\" changed meanwhile, left to the worker\n", dst_path);
+            return 0;
         }
-
-        int empty = is_dir_empty(dst);
-        if (empty < 0)
+        if (scrub_repair(w, src_path, src_st, dst_path, strcmp(why, "missing") ? why : NULL) < 0)
         {
-            perror("is_dir_empty");
-            return -1;
+            return *g_stop ? -1 : 0;
         }
-        if (empty == 0)
+        stats_add(STAT_SCRUB_REPAIRED, 1);
+        // a directory copied afresh matches already; a chmod only fixed the top
+        if (strcmp(why, "mode") != 0)
         {
-            fprintf(stderr, "dst exists and is not empty\n");
-            return -1;
+            return 0;
         }
-        return 0;
     }
-
-    if (errno != ENOENT)
+    if (!S_ISDIR(src_st->st_mode))
     {
-        perror("lstat(dst)");
-        return -1;
+        return 0;
     }
-    return 0;
+    return scrub_dir(w, src_path, src_st, dst_path);
 }
 
-int create_empty_dir(char* dst)
+typedef struct
 {
-    struct stat st;
-    if (lstat(dst, &st) == 0)
-    {  // it already exists and 100% empty
+    ScrubWalk* w;
+    const char* src_dir;
+    const struct stat* src_dir_st;
+    const char* dst_dir;
+} ScrubDir;
+
+static int scrub_diff_entry(const DiffEntry* e, void* arg)
+{
+    const ScrubDir* d = arg;
+    char src_path[PATH_MAX], dst_path[PATH_MAX];
+    if (snprintf(src_path, PATH_MAX, "%s/%s", d->src_dir, e->name) >= PATH_MAX ||
+        snprintf(dst_path, PATH_MAX, "%s/%s", d->dst_dir, e->name) >= PATH_MAX)
+    {
+        fprintf(stderr, "scrub: name too long in \"%s\"\n", d->src_dir);
         return 0;
     }
-
-    if (mkdir_p(dst, 0755) < 0)
+    if (e->kind == DIFF_REMOVED)
     {
-        perror("mkdir_p(dst)");
-        return -1;
+        return scrub_extra(d->w, d->src_dir, d->src_dir_st, src_path, dst_path, &e->to);
     }
-    return 0;
+    return scrub_entry(d->w, src_path, &e->from, dst_path, e->kind == DIFF_ADDED ? NULL : &e->to);
 }
 
-int has_prefix_path(const char* s, const char* prefix)
+// the entries of src_dir and of its mirror dst_dir, side by side in one diff
+static int scrub_dir(ScrubWalk* w, const char* src_dir, const struct stat* src_dir_st, const char* dst_dir)
 {
-    size_t len = strlen(prefix);
-    if (strncmp(s, prefix, len) != 0)
+    ScrubDir d = {w, src_dir, src_dir_st, dst_dir};
+    dir_diff(src_dir, dst_dir, scrub_diff_entry, &d);
+    return *g_stop ? -1 : 0;
+}
+
+// body of the scrub process; its results land in the worker's shared stats
+static void scrub_run(const char* src_real, const char* dst_real, int flags)
+{
+    scrub_lower_priority();
+    ScrubWalk w = {src_real, dst_real, flags, {0}};
+    budget_init(&w.budget, g_scrub_rate, g_stop);
+
+    stats_set(STAT_SCRUB_CHECKED, 0);
+    stats_set(STAT_SCRUB_BYTES, 0);
+    stats_set(STAT_SCRUB_DIVERGED, 0);
+    stats_set(STAT_SCRUB_REPAIRED, 0);
+    atomic_store_explicit(&g_stats->scrub_done_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&g_stats->scrub_started_ns, stats_realtime_ns(), memory_order_relaxed);
+
+    int ret = 0;
+    struct stat src_st, dst_st;
+    if (lstat(src_real, &src_st) == 0)
     {
-        return 0;
+        ret = scrub_entry(&w, src_real, &src_st, dst_real, lstat(dst_real, &dst_st) == 0 ? &dst_st : NULL);
     }
-    return (s[len] == '\0' || s[len] == '/');
+
+    stats_add(STAT_SCRUB_RUNS, 1);
+    atomic_store_explicit(&g_stats->scrub_done_ns, stats_realtime_ns(), memory_order_relaxed);
+    fprintf(stderr, "scrub of dst=\"%s\" %s: checked=%llu diverged=%llu repaired=%llu\n", dst_real,
+            ret < 0 ? "stopped" : "done", atomic_load(&g_stats->counters[STAT_SCRUB_CHECKED]),
+            atomic_load(&g_stats->counters[STAT_SCRUB_DIVERGED]),
+            atomic_load(&g_stats->counters[STAT_SCRUB_REPAIRED]));
 }
 
-int copy_file(const char* src, const char* dst, mode_t mode)
+// Run from the worker loop: reaps the last scrub, then starts one if "verify"
+// asked for it or the periodic one is due. A scrub runs as its own process so
+// its throttled reads never hold up the events; one at a time.
+static void scrub_poll(const char* src_real, const char* dst_real, long long* next_ns)
 {
-    int in = open(src, O_RDONLY);
-    if (in < 0)
+    if (!g_stats)
     {
-        perror("open src");
-        return -1;
+        return;
+    }
+    if (g_scrub_pid > 0)
+    {
+        pid_t r = waitpid(g_scrub_pid, NULL, WNOHANG);
+        if (r == 0)
+        {
+            return;
+        }
+        if (r < 0)
+        {
+            perror("waitpid(scrub)");
+        }
+        g_scrub_pid = 0;
     }
 
-    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
-    if (out < 0)
+    long long now = stats_now_ns();
+    int flags = atomic_exchange_explicit(&g_stats->scrub_request, 0, memory_order_relaxed);
+    if (!flags && g_scrub_interval > 0 && now >= *next_ns)
     {
-        perror("open dst");
-        close(in);
-        return -1;
+        flags = SCRUB_RUN | SCRUB_CONTENT | SCRUB_REPAIR;
+    }
+    if (!flags)
+    {
+        return;
     }
+    *next_ns = now + g_scrub_interval * 1000000000LL;
 
-    char buf[1024];
-    while (1)
+    pid_t pid = fork();
+    if (pid < 0)
     {
-        if (g_child_exit)
+        perror("fork(scrub)");
+        return;
+    }
+    if (pid == 0)
+    {
+        // forked from a pool thread, the scrub has all signals blocked, the
+        // control loop's descriptors and the task's cancel flag to unlearn
+        if (g_task)
         {
-            if (close(in) < 0)
-            {
-                perror("close");
-                return -1;
-            }
-            if (close(out) < 0)
-            {
-                perror("close");
-                return -1;
-            }
-            errno = EINTR;
-            return -1;
+            control_after_fork();
+            g_stop = &g_child_exit;
+            child_install_signals();
         }
+        // what diverged is copied whole, whatever the table says, and what
+        // has to go is deleted in place
+        g_tails = NULL;
+        g_trash = NULL;
+        scrub_run(src_real, dst_real, flags);
+        _exit(EXIT_SUCCESS);
+    }
+    g_scrub_pid = pid;
+}
 
-        ssize_t r = bulk_read(in, buf, sizeof(buf));
-        if (r < 0)
+static void scrub_stop(void)
+{
+    if (g_scrub_pid <= 0)
+    {
+        return;
+    }
+    if (kill(g_scrub_pid, SIGTERM) < 0)
+    {
+        perror("kill(scrub)");
+    }
+    while (waitpid(g_scrub_pid, NULL, 0) < 0)
+    {
+        if (errno != EINTR)
         {
-            perror("bulk_read");
-            if (close(in) < 0)
-            {
-                perror("close");
-                return -1;
-            }
-            if (close(out) < 0)
-            {
-                perror("close");
-                return -1;
-            }
-            return -1;
-        }
-        if (r == 0)
+            perror("waitpid(scrub)");
             break;
+        }
+    }
+    g_scrub_pid = 0;
+}
 
-        ssize_t w = bulk_write(out, buf, r);
-        if (w < 0)
+// Starts a reclaimer when something is waiting in the trash and none runs, and
+// reaps the one that finished. Like the scrub it is a process of its own, so
+// neither its unlinks nor its throttling hold up the events.
+static void trash_poll(Trash* trash)
+{
+    if (!trash->dir)
+    {
+        return;
+    }
+    long long now = stats_now_ns();
+    if (trash->reclaimer > 0)
+    {
+        int status;
+        pid_t r = waitpid(trash->reclaimer, &status, WNOHANG);
+        if (r == 0)
         {
-            perror("bulk_write");
-            if (close(in) < 0)
-            {
-                perror("close");
-            }
-            if (close(out) < 0)
-            {
-                perror("close");
-            }
-            return -1;
+            return;
+        }
+        trash->reclaimer = 0;
+        if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            if (r < 0)
+                perror("waitpid(trash)");
+            trash->pending = 1;
+            trash->next_ns = now + TRASH_RETRY_MS * 1000000LL;
+        }
+        else if (!trash->pending && rmdir(trash->dir) < 0 && errno != ENOENT && errno != ENOTEMPTY)
+        {
+            perror("rmdir(trash)");
         }
     }
+    if (!trash->pending || now < trash->next_ns)
+    {
+        return;
+    }
 
-    if (close(in) < 0)
+    pid_t pid = fork();
+    if (pid < 0)
     {
-        perror("close");
-        return -1;
+        perror("fork(trash)");
+        trash->next_ns = now + TRASH_RETRY_MS * 1000000LL;
+        return;
     }
-    if (close(out) < 0)
+    if (pid == 0)
     {
-        perror("close");
-        return -1;
+        if (g_task)
+        {
+            control_after_fork();
+            g_stop = &g_child_exit;
+            child_install_signals();
+        }
+        scrub_lower_priority();
+        IoBudget budget;
+        budget_init(&budget, g_trash_rate, g_stop);
+        _exit(trash_reclaim(trash->dir, &budget) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
     }
-    return 0;
+    // what is put in the trash from now on may be missed by this one
+    trash->pending = 0;
+    trash->reclaimer = pid;
 }
 
-int copy_symplink_rewrite(const char* src_link, const char* dst_link, const char* src_real, const char* dst_real)
+// what the reclaimer did not get to stays in the trash for the next worker
+static void trash_stop(Trash* trash)
 {
-    char linkbuf[PATH_MAX];
-    ssize_t n = readlink(src_link, linkbuf, sizeof(linkbuf) - 1);
-    if (n < 0)
+    if (trash->reclaimer <= 0)
     {
-        perror("readlink");
-        return -1;
+        return;
     }
-    linkbuf[n] = '\0';
-
-    char* final_target = linkbuf;
-    char rewritten[PATH_MAX];
-
-    if (linkbuf[0] == '/' && has_prefix_path(linkbuf, src_real))
-    {  // checking if contains an absolute path leading to this directory
-        char* suffix = linkbuf + strlen(src_real);
-        if (snprintf(rewritten, PATH_MAX, "%s%s", dst_real, suffix) >= PATH_MAX)
+    if (kill(trash->reclaimer, SIGTERM) < 0)
+    {
+        perror("kill(trash)");
+    }
+    while (waitpid(trash->reclaimer, NULL, 0) < 0)
+    {
+        if (errno != EINTR)
         {
-            perror("Name too long(link)");
-            return -1;
+            perror("waitpid(trash)");
+            break;
         }
-        final_target = rewritten;
     }
+    trash->reclaimer = 0;
+}
 
-    unlink(dst_link);
-    if (symlink(final_target, dst_link) < 0)
+// Copies the source into the target, or with resume brings an earlier mirror
+// up to date: entries gone from the source are pruned and files are only
+// copied when they changed after the stored sync watermark. Copies made here
+// stay out of the page cache with -n/-D.
+int initial_sync(const char* src_real, const char* dst_real, int resume)
+{
+    int ret;
+    uncached_begin();
+    if (!resume)
+    {
+        if (g_layout_order)
+            ret = copy_tree_ordered(src_real, dst_real);
+        else
+            ret = copy_tree(src_real, dst_real, src_real, dst_real);
+    }
+    else
+    {
+        long long watermark = g_stats ? atomic_load_explicit(&g_stats->synced_ns, memory_order_relaxed) : 0;
+        long long since_ns = (watermark > WATERMARK_SLACK_NS) ? watermark - WATERMARK_SLACK_NS : 0;
+        ret = resume_tree(src_real, dst_real, src_real, dst_real, since_ns);
+    }
+    uncached_end();
+    return ret;
+}
+
+// A sync of the target failed, so what was written to it since the last good
+// one may not be on disk however the page cache shows it (see durable.h).
+// Everything changed in src_real since the published watermark is copied
+// again in full, appends included, before the held watermark is released;
+// with everything set (after a bulk copy, which wrote unchanged files too)
+// every file is.
+static long long durable_recover(Durable* d, const char* src_real, const char* dst_real, int everything)
+{
+    long long watermark = g_stats ? atomic_load_explicit(&g_stats->synced_ns, memory_order_relaxed) : 0;
+    // without a watermark nothing is known to be durable either
+    long long since_ns = (!everything && watermark > WATERMARK_SLACK_NS) ? watermark - WATERMARK_SLACK_NS : 1;
+    fprintf(stderr, "%s: sync failed, copying again what changed since the last good one\n", dst_real);
+    Tails* tails = g_tails;
+    if (tails)
+        tails_free(tails);
+    g_tails = NULL;
+    int ret = resume_tree(src_real, dst_real, src_real, dst_real, since_ns);
+    g_tails = tails;
+    if (ret < 0)
+    {
+        return 0;  // still failed, tried again on the next tick
+    }
+    return durable_resynced(d);
+}
+
+// bytes of events the kernel has queued that were not read yet
+static int inotify_queued(int ifd)
+{
+    int queued = 0;
+    if (ioctl(ifd, FIONREAD, &queued) < 0)
     {
-        perror("symlink");
         return -1;
     }
-    return 0;
+    return queued;
 }
 
-int copy_tree(const char* src_dir, const char* dst_dir, const char* src_real, const char* dst_real)
+// one local target being mirrored, by a forked worker or as a task
+typedef struct
 {
-    DIR* d = opendir(src_dir);
+    const char* src_real;
+    const char* dst_real;
+    int ifd;
+    WatchTree map;
+    PendingMoves pm;
+    MoveContext move_ctx;
+    long long scrub_next_ns;
+    PollSet polls;
+    Durable durable;
+    Tails tails;
+    Trash trash;
+    Echoes echoes;         // what the last live restore wrote, see echoes.h
+    long long restored_ns;  // realtime it finished
+    int overflowed;         // the kernel dropped events, see mirror_rescan
+} Mirror;
+
+// polled subtrees, see polled.h
+
+static long long ctime_ns(const struct stat* st)
+{
+    return (long long)st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+}
+
+// removes what dst_dir holds that src_dir no longer has; excluded entries are
+// left alone, as by resume_tree
+static int poll_prune(const char* src_dir, const char* dst_dir, unsigned long long* changed)
+{
+    DIR* d = opendir(dst_dir);
     if (!d)
     {
-        perror("opendir(src_dir)");
+        perror("opendir(poll_prune)");
         return -1;
     }
-
+    int ret = 0;
     struct dirent* entity;
-    while ((entity = readdir(d)) != NULL)
+    while (ret == 0 && (entity = readdir(d)) != NULL)
     {
-        if (g_child_exit == 1)
-        {
-            if (closedir(d) < 0)
-            {
-                perror("closedir");
-                return -1;
-            }
-            return -1;
-        }
         if (strcmp(entity->d_name, ".") == 0 || strcmp(entity->d_name, "..") == 0)
         {
             continue;
         }
-
         char src_path[PATH_MAX], dst_path[PATH_MAX];
-        if (snprintf(src_path, PATH_MAX, "%s/%s", src_dir, entity->d_name) >= PATH_MAX)
+        if (snprintf(src_path, PATH_MAX, "%s/%s", src_dir, entity->d_name) >= PATH_MAX ||
+            snprintf(dst_path, PATH_MAX, "%s/%s", dst_dir, entity->d_name) >= PATH_MAX)
         {
-            if (closedir(d) < 0)
-            {
-                perror("closedir");
-                return -1;
-            }
-            perror("Name too long(src_dir + name)");
-            return -1;
+            fprintf(stderr, "Name too long(poll_prune)\n");
+            ret = -1;
+            break;
         }
-        if (snprintf(dst_path, PATH_MAX, "%s/%s", dst_dir, entity->d_name) >= PATH_MAX)
+        struct stat st;
+        if (lstat(src_path, &st) == 0 || errno != ENOENT)
         {
-            if (closedir(d) < 0)
-            {
-                perror("closedir");
-                return -1;
-            }
-            perror("Name too long(dst_dir + name)");
-            return -1;
+            continue;
+        }
+        ret = discard_tree(dst_path);
+        (*changed)++;
+    }
+    closedir(d);
+    return ret;
+}
+
+// Brings dst_dir up to date with src_dir (whose lstat is dir_st) for whatever
+// changed since since_ns, 0 meaning anything may have. ctime is what is gone
+// by: it moves with every mtime change, also when the mtime is set back. A
+// directory whose ctime is older has the entries it had then, so its target
+// side is only read for entries that changed themselves.
+static int poll_walk(const char* src_dir, const char* dst_dir, const struct stat* dir_st, const char* src_real,
+                     const char* dst_real, long long since_ns, unsigned long long* changed)
+{
+    int dir_changed = since_ns == 0 || ctime_ns(dir_st) >= since_ns;
+    if (dir_changed && poll_prune(src_dir, dst_dir, changed) < 0)
+    {
+        return -1;
+    }
+
+    DIR* d = opendir(src_dir);
+    if (!d)
+    {
+        // removed meanwhile, the watched parent reports it
+        if (errno == ENOENT)
+            return 0;
+        perror("opendir(poll_walk)");
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent* entity;
+    while (ret == 0 && (entity = readdir(d)) != NULL)
+    {
+        if (*g_stop)
+        {
+            ret = -1;
+            break;
+        }
+        if (strcmp(entity->d_name, ".") == 0 || strcmp(entity->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        char src_path[PATH_MAX], dst_path[PATH_MAX];
+        if (snprintf(src_path, PATH_MAX, "%s/%s", src_dir, entity->d_name) >= PATH_MAX ||
+            snprintf(dst_path, PATH_MAX, "%s/%s", dst_dir, entity->d_name) >= PATH_MAX)
+        {
+            fprintf(stderr, "Name too long(poll_walk)\n");
+            ret = -1;
+            break;
         }
 
         struct stat st;
         if (lstat(src_path, &st) < 0)
         {
-            if (closedir(d) < 0)
+            if (errno == ENOENT)
+                continue;  // the next scan sees its directory changed
+            perror("lstat(poll_walk)");
+            ret = -1;
+            break;
+        }
+        if (path_excluded(src_real, src_path, S_ISDIR(st.st_mode)))
+        {
+            continue;
+        }
+
+        int recent = since_ns == 0 || ctime_ns(&st) >= since_ns;
+        if (!recent && !dir_changed)
+        {
+            if (S_ISDIR(st.st_mode))
+                ret = poll_walk(src_path, dst_path, &st, src_real, dst_real, since_ns, changed);
+            continue;
+        }
+
+        struct stat dst_st;
+        int dst_exists = (lstat(dst_path, &dst_st) == 0);
+        if (dst_exists && (st.st_mode & S_IFMT) != (dst_st.st_mode & S_IFMT))
+        {
+            if (discard_tree(dst_path) < 0)
             {
-                perror("closedir");
-                return -1;
+                ret = -1;
+                break;
             }
-            return -1;
+            dst_exists = 0;
         }
 
         if (S_ISDIR(st.st_mode))
         {
+            if (dst_exists)
+            {
+                ret = poll_walk(src_path, dst_path, &st, src_real, dst_real, since_ns, changed);
+                continue;
+            }
+            (*changed)++;
             if (mkdir(dst_path, st.st_mode & 0777) < 0 && errno != EEXIST)
             {
-                if (closedir(d) < 0)
-                {
-                    perror("closedir");
-                    return -1;
-                }
-                return -1;
+                perror("mkdir(poll_walk)");
+                ret = -1;
             }
-            if (copy_tree(src_path, dst_path, src_real, dst_real) < 0)
+            else
             {
-                if (closedir(d) < 0)
-                {
-                    perror("closedir");
-                    return -1;
-                }
-                return -1;
+                ret = copy_tree(src_path, dst_path, src_real, dst_real);
             }
         }
         else if (S_ISREG(st.st_mode))
         {
-            if (copy_file(src_path, dst_path, st.st_mode) < 0)
+            if (recent || !dst_exists || dst_st.st_size != st.st_size || !same_file_quick(&st, &dst_st))
             {
-                if (closedir(d) < 0)
-                {
-                    perror("closedir");
-                    return -1;
-                }
-                return -1;
+                (*changed)++;
+                ret = update_file(src_path, dst_path, st.st_mode);
             }
         }
         else if (S_ISLNK(st.st_mode))
         {
-            if (copy_symplink_rewrite(src_path, dst_path, src_real, dst_real) < 0)
+            if (recent || !dst_exists)
             {
-                if (closedir(d) < 0)
-                {
-                    perror("closedir");
-                    return -1;
-                }
-                return -1;
+                (*changed)++;
+                ret = copy_symplink_rewrite(src_path, dst_path, src_real, dst_real);
             }
         }
-        else
+        // entries removed between the readdir and the copy are the next scan's business
+        if (ret < 0 && lstat(src_path, &st) < 0 && errno == ENOENT)
         {
-            fprintf(stderr, "Skipping unsupported file type: %s\n", src_path);
+            ret = 0;
         }
     }
 
-    if (closedir(d) < 0)
-    {
-        perror("closedir");
-        return -1;
-    }
-    return 0;
+    closedir(d);
+    return ret;
 }
 
-int rm_tree(const char* path)
+static long long poll_interval_ns(const PolledDir* p)
+{
+    return p->reason == POLL_HOT ? POLL_HOT_INTERVAL_MS * 1000000LL : g_poll_interval * 1000000000LL;
+}
+
+// Puts a hot subtree that has calmed down back on inotify. The watches go up
+// first and a last scan covers what changed since the previous one.
+static void poll_cool(Mirror* m, size_t i, const char* dst_path)
 {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", m->polls.dirs[i].path);
+    long long since_ns = m->polls.dirs[i].since_ns;
+    poll_remove(&m->polls, i);
+
+    int ret = add_watch_tree(m->ifd, &m->map, path, m->src_real);
+    if (ret < 0 || !wt_find_path(&m->map, path))
+    {
+        // no watch for it after all (none left, if add_watch_tree polls it now)
+        watch_remove_subtree(&m->map, path);
+        poll_forget_below(&m->polls, path);
+        PolledDir* p = poll_add(&m->polls, path, ret < 0 ? POLL_HOT : POLL_BUDGET, since_ns);
+        if (p)
+            p->next_ns = stats_now_ns() + poll_interval_ns(p);
+        return;
+    }
+
     struct stat st;
-    if (lstat(path, &st) < 0)
+    unsigned long long changed = 0;
+    long long scan_since = since_ns > WATERMARK_SLACK_NS ? since_ns - WATERMARK_SLACK_NS : 0;
+    if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode) &&
+        poll_walk(path, dst_path, &st, m->src_real, m->dst_real, scan_since, &changed) < 0)
     {
-        if (errno == ENOENT)
-            return 0;
-        perror("lstat(rm_tree)");
-        return -1;
+        // watched, but what the last scan missed still has to be found
+        poll_add(&m->polls, path, POLL_HOT, since_ns);
+        return;
     }
+    stats_add(STAT_POLL_CHANGES, changed);
+    if (changed)
+        note_change(TIER_UPDATE, dst_path, NULL);
+    fprintf(stderr, "%s: quiet again, watched\n", path);
+}
 
-    if (S_ISDIR(st.st_mode))
+// runs the scans that are due, for at most POLL_TICK_BUDGET_MS
+static void poll_run(Mirror* m)
+{
+    long long started = stats_now_ns();
+    size_t i;
+    while (!*g_stop && (i = poll_due(&m->polls, stats_now_ns())) != SIZE_MAX)
     {
-        DIR* d = opendir(path);
-        if (!d)
+        PolledDir* p = &m->polls.dirs[i];
+        char dst_path[PATH_MAX];
+        struct stat st;
+        int found = (lstat(p->path, &st) == 0);
+        if (!found && errno != ENOENT && errno != ENOTDIR)
         {
-            perror("opendir(rm_tree)");
-            return -1;
+            perror("lstat(poll_run)");
+            p->next_ns = stats_now_ns() + poll_interval_ns(p);
+            continue;
         }
-
-        struct dirent* entity;
-        while ((entity = readdir(d)) != NULL)
+        if (!found || !S_ISDIR(st.st_mode) || map_src_to_dst(m->src_real, m->dst_real, p->path, dst_path) < 0)
         {
-            if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
-                continue;
+            // removed or moved away, the watch of its parent took care of the target
+            poll_remove(&m->polls, i);
+            continue;
+        }
 
-            char child[PATH_MAX];
-            if (snprintf(child, PATH_MAX, "%s/%s", path, entity->d_name) >= PATH_MAX)
-            {
-                closedir(d);
-                fprintf(stderr, "Name too long(rm_tree)\n");
-                return -1;
-            }
-            if (rm_tree(child) < 0)
-            {
-                closedir(d);
-                return -1;
-            }
+        long long scan_ns = stats_realtime_ns();
+        long long since_ns = p->since_ns > WATERMARK_SLACK_NS ? p->since_ns - WATERMARK_SLACK_NS : 0;
+        struct stat dst_st;
+        if (lstat(dst_path, &dst_st) < 0)
+        {
+            // the target lost it behind the worker's back: copied in full
+            mkdir_p(dst_path, st.st_mode & 0777);
+            since_ns = 0;
         }
-        if (closedir(d) < 0)
+        unsigned long long changed = 0;
+        int ret = poll_walk(p->path, dst_path, &st, m->src_real, m->dst_real, since_ns, &changed);
+        stats_add(STAT_POLL_SCANS, 1);
+        stats_add(STAT_POLL_CHANGES, changed);
+        if (changed)
+            note_change(TIER_UPDATE, dst_path, NULL);
+        p->next_ns = stats_now_ns() + poll_interval_ns(p);
+        if (ret == 0)
         {
-            perror("closedir(rm_tree)");
-            return -1;
+            p->since_ns = scan_ns;
+        }
+        if (p->reason == POLL_HOT)
+        {
+            p->quiet = (ret == 0 && changed == 0) ? p->quiet + 1 : 0;
+            if (p->quiet >= POLL_QUIET_SCANS)
+                poll_cool(m, i, dst_path);
+        }
+        if (stats_now_ns() - started >= POLL_TICK_BUDGET_MS * 1000000LL)
+        {
+            break;
         }
+    }
+    stats_set(STAT_POLLED, m->polls.count);
+}
 
-        if (rmdir(path) < 0 && errno != ENOENT)
+// subtrees that took too many events in the last window lose their watches
+// and are rescanned in batches instead
+static void poll_check_hot(Mirror* m)
+{
+    uint32_t hot[16];
+    size_t n = poll_hot_nodes(&m->polls, &m->map, stats_now_ns(), hot, sizeof(hot) / sizeof(hot[0]));
+    for (size_t k = 0; k < n; k++)
+    {
+        char path[PATH_MAX];
+        if (wt_path(&m->map, hot[k], path, sizeof(path)) < 0)
         {
-            perror("rmdir(rm_tree)");
-            return -1;
+            continue;
         }
-        return 0;
+        // everything applied so far is in the target; the events still
+        // queued for these watches are dropped and left to the scans
+        long long since_ns = g_stats ? atomic_load_explicit(&g_stats->synced_ns, memory_order_relaxed) : 0;
+        long long nested = poll_forget_below(&m->polls, path);
+        PolledDir* p = poll_add(&m->polls, path, POLL_HOT, nested < since_ns ? nested : since_ns);
+        if (!p)
+        {
+            continue;  // stays on inotify
+        }
+        p->next_ns = stats_now_ns() + POLL_HOT_INTERVAL_MS * 1000000LL;
+        wt_remove(&m->map, hot[k]);
+        stats_add(STAT_POLL_HOT, 1);
+        fprintf(stderr, "%s: too many events, rescanned every %d ms\n", path, POLL_HOT_INTERVAL_MS);
     }
+}
 
-    if (unlink(path) < 0 && errno != ENOENT)
+// Puts up the watches and brings the target up to date. Returns 0 when the
+// target is protected, 1 when told to stop meanwhile and -1 on failure; m only
+// needs mirror_end after 0.
+static int mirror_begin(Mirror* m, int ifd, const char* src_real, const char* dst_real, int resume)
+{
+    memset(m, 0, sizeof(*m));
+    m->src_real = src_real;
+    m->dst_real = dst_real;
+    m->ifd = ifd;
+    m->map.dropped = watch_dropped;
+    m->map.dropped_arg = &m->ifd;
+    g_polls = &m->polls;
+    if (trash_open(&m->trash, dst_real) < 0)
     {
-        perror("unlink(rm_tree)");
         return -1;
     }
+    if (durable_open(&m->durable, dst_real) < 0)
+    {
+        trash_close(&m->trash);
+        return -1;
+    }
+    g_durable = m->durable.fd >= 0 ? &m->durable : NULL;
+    g_tails = &m->tails;
+    g_trash = &m->trash;
+    // the secondaries wait for this sync and then compare against the result
+    if (g_tier)
+        tier_log_begin(g_tier);
+    if (add_watch_tree(ifd, &m->map, src_real, src_real) < 0)
+    {
+        wt_free(&m->map);
+        poll_free(&m->polls);
+        durable_close(&m->durable);
+        trash_close(&m->trash);
+        g_durable = NULL;
+        g_tails = NULL;
+        g_trash = NULL;
+        return -1;
+    }
+
+    // watches go up before the sync, so whatever changes while it runs is
+    // queued and applied afterwards instead of being missed
+    long long sync_start = stats_realtime_ns();
+    stats_set_phase(PHASE_INITIAL_SYNC);
+    // with -d the target is not protected before what the sync wrote is durable
+    int synced = initial_sync(src_real, dst_real, resume);
+    if (synced == 0)
+    {
+        durable_applied(&m->durable, 1);
+        durable_poll(&m->durable, 1);
+        // a resumed sync only wrote what changed since the watermark
+        if (m->durable.failed)
+            durable_recover(&m->durable, src_real, dst_real, !resume);
+        synced = m->durable.failed ? -1 : 0;
+    }
+    if (synced < 0)
+    {
+        wt_free(&m->map);
+        poll_free(&m->polls);
+        tails_free(&m->tails);
+        durable_close(&m->durable);
+        trash_close(&m->trash);
+        g_durable = NULL;
+        g_tails = NULL;
+        g_trash = NULL;
+        // an incomplete mirror is not worth watching; fail so the parent retries
+        return *g_stop ? 1 : -1;
+    }
+    stats_mark_synced(sync_start);
+    stats_mark_protected();
+    if (g_tier)
+    {
+        tier_log_synced(g_tier, sync_start);
+        tier_log_ready(g_tier);
+    }
+    // the sync covered the polled subtrees as well
+    for (size_t i = 0; i < m->polls.count; i++)
+    {
+        m->polls.dirs[i].since_ns = sync_start;
+        m->polls.dirs[i].next_ns = stats_now_ns() + poll_interval_ns(&m->polls.dirs[i]);
+    }
+    stats_set(STAT_POLLED, m->polls.count);
+
+    m->move_ctx = (MoveContext){ifd, &m->map};
+    quarantine_open(dst_real);
+    m->scrub_next_ns = stats_now_ns() + g_scrub_interval * 1000000000LL;
+    g_echoes = &m->echoes;
     return 0;
 }
 
-void child_loop(char* src, char* dst)
+// realtime the target matches the source as of, 0 while that is not known
+static long long mirror_synced_ns(const Mirror* m)
 {
-    child_install_signals();
+    if (!g_stats || m->pm.count != 0)
+    {
+        return 0;
+    }
+    // everything read so far is applied and nothing else is queued, so the
+    // target matches the source as of now
+    long long synced;
+    if (!g_task)
+    {
+        if (inotify_queued(m->ifd) != 0)
+            return 0;
+        synced = stats_realtime_ns();
+    }
+    else
+    {
+        synced = task_drained_ns(g_task);
+        if (synced <= atomic_load_explicit(&g_stats->synced_ns, memory_order_relaxed))
+            return 0;
+    }
+    // except for the polled subtrees, which are as of their last scan
+    long long polled = poll_synced_ns(&m->polls);
+    return polled < synced ? polled : synced;
+}
 
-    char src_real[PATH_MAX];
+static void mirror_mark_synced(long long realtime_ns)
+{
+    if (realtime_ns <= 0)
+        return;
+    stats_mark_synced(realtime_ns);
+    if (g_tier)
+        tier_log_synced(g_tier, realtime_ns);
+}
 
-    if (norm_existing_dir(src, src_real) < 0)
+// brings src_real back to what backup_real holds, see apply_backup
+int restore_source(const char* src_real, const char* backup_real, RestoreCounts* counts)
+{
+    uncached_begin();
+    int applied = apply_backup(backup_real, src_real, backup_real, src_real, counts);
+    uncached_end();
+    if (applied < 0)
     {
-        _exit(0);
+        perror("apply backup");
     }
+    return applied;
+}
 
-    if (create_empty_dir(dst))
+// Runs the restore cmd_restore handed over, between two batches of events, so
+// nothing is applied while it writes the source. What it writes is remembered
+// and its events are dropped as echoes once they are read; the watches stay.
+static void restore_poll(Mirror* m)
+{
+    if (!g_stats)
     {
-        _exit(0);
+        return;
+    }
+    unsigned seq = atomic_load_explicit(&g_stats->restore_request, memory_order_acquire);
+    if (seq == atomic_load_explicit(&g_stats->restore_done, memory_order_relaxed))
+    {
+        return;
     }
+    // a scrub would take the restore's half-written files for drift
+    scrub_stop();
+    char backup_real[PATH_MAX];
+    memcpy(backup_real, g_stats->restore_from, sizeof(backup_real));
+    backup_real[sizeof(backup_real) - 1] = '\0';
+    stats_set_phase(PHASE_RESTORING);
+
+    // copies into the source are no mirror work: none is counted, none
+    // appended, synced or trashed as if it went to the target
+    WorkerStats* stats = g_stats;
+    Tails* tails = g_tails;
+    Trash* trash = g_trash;
+    Durable* durable = g_durable;
+    g_stats = NULL;
+    g_tails = NULL;
+    g_trash = NULL;
+    g_durable = NULL;
+    // restored from a --tiered secondary, the source may now differ from this
+    // target: its events are no echoes and are applied as usual
+    echoes_free(&m->echoes);
+    g_echoes = strcmp(backup_real, m->dst_real) == 0 ? &m->echoes : NULL;
+    RestoreCounts counts = {0};
+    int ret = restore_source(m->src_real, backup_real, &counts);
+    g_stats = stats;
+    g_tails = tails;
+    g_trash = trash;
+    g_durable = durable;
+    g_echoes = &m->echoes;
+
+    m->restored_ns = stats_realtime_ns();
+    stats_add(STAT_RESTORES, 1);
+    atomic_store_explicit(&g_stats->restore_failed, ret < 0, memory_order_relaxed);
+    atomic_store_explicit(&g_stats->restore_copied, counts.copied, memory_order_relaxed);
+    atomic_store_explicit(&g_stats->restore_unchanged, counts.skipped, memory_order_relaxed);
+    atomic_store_explicit(&g_stats->restore_done, seq, memory_order_release);
+}
 
-    char dst_real[PATH_MAX];
-    if (!realpath(dst, dst_real))
+// The inotify queue overflowed and the kernel dropped events; what they
+// announced is found by comparing the trees again. Moves still waiting for
+// their other half may never get it, so they are taken as removals first and
+// the rescan copies back whatever is in the source after all. Directories
+// created meanwhile get their watches, and the watermark is not moved before
+// the rescan is done.
+static void mirror_rescan(Mirror* m)
+{
+    m->overflowed = 0;
+    fprintf(stderr, "%s: inotify queue overflow, rescanning\n", m->src_real);
+    pm_expire(&m->pm, LLONG_MAX / 2, move_expired, &m->move_ctx);
+    add_watch_tree(m->ifd, &m->map, m->src_real, m->src_real);
+    resume_tree(m->src_real, m->dst_real, m->src_real, m->dst_real, 0);
+    note_change(TIER_UPDATE, m->dst_real, NULL);
+}
+
+// housekeeping between batches of events
+static void mirror_tick(Mirror* m)
+{
+    if (m->overflowed)
+        mirror_rescan(m);
+    pm_expire(&m->pm, stats_now_ns(), move_expired, &m->move_ctx);
+    quarantine_trim();
+    trash_poll(&m->trash);
+    restore_poll(m);
+    scrub_poll(m->src_real, m->dst_real, &m->scrub_next_ns);
+    poll_check_hot(m);
+    poll_run(m);
+
+    stats_set_phase(PHASE_IDLE);
+    // with -d the watermark waits for the sync that makes it durable
+    long long synced = mirror_synced_ns(m);
+    // the restore's echoes were all read once the target is synced past it
+    if (m->echoes.used && synced >= m->restored_ns)
+        echoes_free(&m->echoes);
+    if (synced)
+        synced = durable_hold(&m->durable, synced);
+    long long made = m->durable.failed ? durable_recover(&m->durable, m->src_real, m->dst_real, 0)
+                                       : durable_poll(&m->durable, 0);
+    mirror_mark_synced(made > synced ? made : synced);
+}
+
+// ms until the next mirror_tick is due
+static int mirror_tick_ms(const Mirror* m)
+{
+    return durable_timeout_ms(&m->durable, m->pm.count ? MOVE_WHEEL_TICK_MS : WORKER_IDLE_TICK_MS);
+}
+
+// applies a batch of events read from inotify; 1 once the source root is gone
+static int mirror_apply(Mirror* m, char* buffer, ssize_t len)
+{
+    long long read_ns = stats_now_ns();
+    size_t queued = count_events(buffer, len);
+    stats_touch_event();
+    stats_add(STAT_EVENTS_READ, queued);
+    stats_set(STAT_QUEUE_DEPTH, queued);
+    stats_set_phase(PHASE_APPLYING);
+
+    ssize_t i = 0;
+    while (i < len)
     {
-        _exit(0);
+        struct inotify_event* event = (struct inotify_event*)&buffer[i];
+        i += (ssize_t)sizeof(*event) + (ssize_t)event->len;
+
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+            // rescanned by the next mirror_tick, once the batch is applied
+            m->overflowed = 1;
+            stats_add(STAT_OVERFLOWS, 1);
+        }
+        else if (mirror_handle_event(m->ifd, &m->map, &m->pm, m->src_real, m->dst_real, event, read_ns))
+        {
+            return 1;
+        }
+        stats_add(STAT_EVENTS_APPLIED, 1);
+        stats_set(STAT_QUEUE_DEPTH, --queued);
+        // a full batch is synced right away, not after the rest of the read
+        if (g_durable)
+            mirror_mark_synced(durable_poll(g_durable, 0));
+    }
+    return 0;
+}
+
+static void mirror_end(Mirror* m)
+{
+    scrub_stop();
+    stats_set(STAT_QUEUE_DEPTH, 0);
+    wt_free(&m->map);
+    pm_free(&m->pm);
+    poll_free(&m->polls);
+    g_polls = NULL;
+    tails_free(&m->tails);
+    g_tails = NULL;
+    trash_stop(&m->trash);
+    trash_close(&m->trash);
+    g_trash = NULL;
+    echoes_free(&m->echoes);
+    g_echoes = NULL;
+    // the watermark held for the last changes is good once they are synced
+    long long held = m->durable.held_ns;
+    durable_close(&m->durable);
+    if (m->durable.pending == 0)
+        mirror_mark_synced(held);
+    g_durable = NULL;
+    quarantine_close();
+}
+
+int monitor_and_mirror(const char* src_real, const char* dst_real, int resume)
+{
+    int ifd = inotify_init();
+    if (ifd < 0)
+    {
+        perror("inotify_init");
+        exit(EXIT_FAILURE);
     }
 
-    copy_tree(src_real, dst_real, src_real, dst_real);
+    Mirror m;
+    int begun = mirror_begin(&m, ifd, src_real, dst_real, resume);
+    if (begun != 0)
+    {
+        close(ifd);
+        return begun < 0 ? -1 : 0;
+    }
 
-    if (monitor_and_mirror(src_real, dst_real) < 0)
-        _exit(1);
-    _exit(0);
+    int ret = 0;
+    char buffer[4096];
+    while (!*g_stop)
+    {
+        mirror_tick(&m);
+
+        // wake up in time to expire pending moves close to their deadline
+        struct pollfd pfd = {ifd, POLLIN, 0};
+        int ready = poll(&pfd, 1, mirror_tick_ms(&m));
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll(inotify)");
+            ret = -1;
+            break;
+        }
+        if (ready == 0)
+            continue;
+
+        ssize_t len = read(ifd, buffer, sizeof(buffer));
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("read(inotify)");
+            ret = -1;
+            break;
+        }
+        if (mirror_apply(&m, buffer, len))
+        {
+            *g_stop = 1;
+        }
+    }
+
+    mirror_end(&m);
+    close(ifd);
+    return ret;
+}
+
+// secondaries of --tiered targets, see tierlog.h: they follow the change log
+// of their primary and copy from its target, never from the source
+
+// up_path in the primary target was created or changed; a directory is
+// brought up to date with everything below it
+static int tier_update(const char* up_real, const char* dst_real, const char* up_path, const char* dst_path)
+{
+    struct stat st, dst_st;
+    if (lstat(up_path, &st) < 0)
+    {
+        // gone again, its delete is further on in the log
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (lstat(dst_path, &dst_st) == 0 && (st.st_mode & S_IFMT) != (dst_st.st_mode & S_IFMT) &&
+        discard_tree(dst_path) < 0)
+    {
+        return -1;
+    }
+    if (mirror_create_or_update(up_path, dst_path, up_real, dst_real) < 0)
+    {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        return 0;
+    }
+    return resume_tree(up_path, dst_path, up_real, dst_real, 0);
+}
+
+static int tier_apply(const char* up_real, const char* dst_real, const TierRecord* rec)
+{
+    char dst_path[PATH_MAX];
+    if (map_src_to_dst(up_real, dst_real, rec->path, dst_path) < 0)
+    {
+        return 0;
+    }
+    if (rec->op == TIER_DELETE)
+    {
+        return discard_tree(dst_path);
+    }
+    if (rec->op != TIER_RENAME)
+    {
+        return tier_update(up_real, dst_real, rec->path, dst_path);
+    }
+    char dst_new[PATH_MAX];
+    if (map_src_to_dst(up_real, dst_real, rec->path2, dst_new) < 0)
+    {
+        return 0;
+    }
+    if (ensure_parent_dir(dst_new) == 0 && rename(dst_path, dst_new) == 0)
+    {
+        return 0;
+    }
+    // this target never got the old name; the new one is copied as new
+    discard_tree(dst_path);
+    return tier_update(up_real, dst_real, rec->path2, dst_new);
+}
+
+static void tier_sleep(void)
+{
+    struct timespec ts = {0, TIER_POLL_MS * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+// Replays the log of the primary target at up_real into dst_real until told
+// to stop. The whole target is compared against the primary's first, and
+// again whenever the log cannot be followed.
+int tier_follow(const char* up_real, const char* dst_real, TierLog* log)
+{
+    TierRecord rec;
+    uint64_t pos = 0;
+    unsigned epoch = 0;
+    int in_step = 0;
+    int protected_once = 0;
+    Durable durable;
+    if (durable_open(&durable, dst_real) < 0)
+    {
+        return -1;
+    }
+    Tails tails = {0};
+    g_tails = &tails;
+    Trash trash;
+    if (trash_open(&trash, dst_real) == 0)
+        g_trash = &trash;
+    while (!*g_stop)
+    {
+        if (g_trash)
+            trash_poll(g_trash);
+        unsigned current = atomic_load_explicit(&log->epoch, memory_order_acquire);
+        if (!in_step || epoch != current)
+        {
+            // the primary target is only worth comparing against once its own sync is done
+            if (current == 0 || atomic_load_explicit(&log->ready_epoch, memory_order_acquire) != current)
+            {
+                tier_sleep();
+                continue;
+            }
+            long long synced = atomic_load_explicit(&log->synced_ns, memory_order_acquire);
+            pos = atomic_load_explicit(&log->head, memory_order_acquire);
+            stats_set_phase(PHASE_INITIAL_SYNC);
+            uncached_begin();
+            int ret = resume_tree(up_real, dst_real, up_real, dst_real, 0);
+            uncached_end();
+            if (ret < 0)
+            {
+                tier_sleep();
+                continue;
+            }
+            stats_add(STAT_TIER_RESYNCS, 1);
+            durable_applied(&durable, 1);
+            durable_poll(&durable, 1);
+            // the compare may have rewritten any file
+            if (durable.failed)
+                durable_recover(&durable, up_real, dst_real, 1);
+            if (durable.failed)
+            {
+                tier_sleep();
+                continue;
+            }
+            epoch = current;
+            in_step = 1;
+            stats_mark_synced(synced);
+            if (!protected_once)
+                stats_mark_protected();
+            protected_once = 1;
+            stats_set_phase(PHASE_IDLE);
+            continue;
+        }
+
+        // published after the records it covers, so once those are applied
+        // this target matches the source as of it
+        long long synced = atomic_load_explicit(&log->synced_ns, memory_order_acquire);
+        int got = 0;
+        size_t applied = 0;
+        while (!*g_stop && (got = tier_log_next(log, &pos, &rec)) == 1)
+        {
+            stats_set_phase(PHASE_APPLYING);
+            tier_apply(up_real, dst_real, &rec);
+            durable_applied(&durable, 1);
+            stats_add(STAT_TIER_APPLIED, 1);
+            if (++applied % 64 == 0)
+                stats_set(STAT_TIER_BEHIND, atomic_load_explicit(&log->head, memory_order_relaxed) - pos);
+        }
+        if (got < 0)
+        {
+            fprintf(stderr, "%s: fell behind the log of %s, comparing the whole target\n", dst_real, up_real);
+            in_step = 0;
+            continue;
+        }
+        uint64_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+        stats_set(STAT_TIER_BEHIND, head - pos);
+        long long made = durable.failed ? durable_recover(&durable, up_real, dst_real, 0) : durable_poll(&durable, 0);
+        if (head == pos)
+            synced = durable_hold(&durable, synced);
+        else
+            synced = 0;
+        if (made > synced)
+            synced = made;
+        if (synced)
+            stats_mark_synced(synced);
+        if (head == pos)
+        {
+            stats_set_phase(PHASE_IDLE);
+            tier_sleep();
+        }
+    }
+    durable_close(&durable);
+    g_tails = NULL;
+    tails_free(&tails);
+    if (g_trash)
+    {
+        trash_stop(g_trash);
+        trash_close(g_trash);
+        g_trash = NULL;
+    }
+    return 0;
+}
+
+// stream targets, see stream.h: the same watches and event handling as a local
+// target, but every change becomes an operation for the receiver
+
+// path below src_real as the receiver names it, "" for the root
+static const char* stream_rel(const char* src_real, const char* path)
+{
+    const char* rel = path + strlen(src_real);
+    while (*rel == '/')
+    {
+        rel++;
+    }
+    return rel;
+}
+
+static int stream_send_entry(StreamConn* c, const char* src_real, const char* path);
+
+// sends the directory at path and everything below it, then the names it holds
+// so the receiver drops whatever else it has there
+static int stream_send_tree(StreamConn* c, const char* src_real, const char* path, const struct stat* st)
+{
+    const char* rel = stream_rel(src_real, path);
+    if (stream_mkdir(c, rel, st) < 0)
+    {
+        return -1;
+    }
+    DIR* dir = opendir(path);
+    if (!dir)
+    {
+        perror("opendir(stream)");
+        return 0;
+    }
+
+    char* names = NULL;
+    size_t names_len = 0, names_cap = 0;
+    int ret = 0;
+    struct dirent* entry;
+    while (ret == 0 && !*g_stop && (entry = readdir(dir)) != NULL)
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+        // excluded entries are listed too, the receiver leaves them alone like a local target does
+        size_t n = strlen(entry->d_name) + 1;
+        if (names_len + n > names_cap)
+        {
+            size_t cap = names_cap ? names_cap * 2 : 1024;
+            while (cap < names_len + n)
+                cap *= 2;
+            char* grown = realloc(names, cap);
+            if (!grown)
+            {
+                perror("realloc(stream)");
+                ret = -1;
+                break;
+            }
+            names = grown;
+            names_cap = cap;
+        }
+        memcpy(names + names_len, entry->d_name, n);
+        names_len += n;
+
+        char child[PATH_MAX];
+        if (snprintf(child, PATH_MAX, "%s/%s", path, entry->d_name) >= PATH_MAX)
+        {
+            fprintf(stderr, "stream: name too long in \"%s\"\n", path);
+            continue;
+        }
+        ret = stream_send_entry(c, src_real, child);
+    }
+    closedir(dir);
+
+    if (ret == 0 && !*g_stop)
+    {
+        ret = stream_prune(c, rel, names, names_len);
+    }
+    free(names);
+    return *g_stop ? -1 : ret;
+}
+
+// sends one entry of the source: a directory with everything below it, a file or a symlink
+static int stream_send_entry(StreamConn* c, const char* src_real, const char* path)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0)
+    {
+        return 0;
+    }
+    if (path_excluded(src_real, path, S_ISDIR(st.st_mode)))
+    {
+        stats_add(STAT_SKIPPED_PATHS, 1);
+        if (S_ISREG(st.st_mode))
+            stats_add(STAT_SKIPPED_BYTES, (unsigned long long)st.st_size);
+        return 0;
+    }
+    const char* rel = stream_rel(src_real, path);
+    if (S_ISDIR(st.st_mode))
+    {
+        return stream_send_tree(c, src_real, path, &st);
+    }
+    if (S_ISREG(st.st_mode))
+    {
+        return stream_send_file(c, rel, path);
+    }
+    if (S_ISLNK(st.st_mode))
+    {
+        // sent as is: the sender does not know where the receiver keeps the tree
+        char link_target[PATH_MAX];
+        ssize_t n = readlink(path, link_target, sizeof(link_target) - 1);
+        if (n < 0)
+        {
+            return 0;
+        }
+        link_target[n] = '\0';
+        return stream_symlink(c, rel, link_target, &st);
+    }
+    return 0;
+}
+
+typedef struct
+{
+    WatchTree* map;
+    StreamConn* conn;
+} StreamMoveContext;
+
+// an IN_MOVED_FROM got no IN_MOVED_TO in time: the entry left the source
+static void stream_move_expired(PendingMove* mv, void* arg)
+{
+    StreamMoveContext* ctx = arg;
+    stream_delete(ctx->conn, mv->dst_old);
+    if (mv->is_dir)
+    {
+        wt_remove(ctx->map, wt_find_path(ctx->map, mv->src_old));
+    }
+}
+
+// mirror_handle_event for a stream target; the pending moves remember the
+// receiver's relative name in place of the target path
+static int stream_handle_event(int ifd, WatchTree* map, PendingMoves* pm, StreamConn* c, const char* src_real,
+                               struct inotify_event* event, long long read_ns)
+{
+    uint32_t node = wt_find_wd(map, event->wd);
+    if (!node)
+        return 0;
+
+    if (event->mask & IN_IGNORED)
+    {
+        wt_remove(map, node);
+        return 0;
+    }
+
+    char src_path[PATH_MAX];
+    if (wt_path(map, node, src_path, sizeof(src_path)) < 0)
+        return 0;
+    if (event->len > 0)
+    {
+        size_t dir_len = strlen(src_path);
+        if (snprintf(src_path + dir_len, sizeof(src_path) - dir_len, "/%s", event->name) >=
+            (int)(sizeof(src_path) - dir_len))
+            return 0;
+    }
+    const char* rel = stream_rel(src_real, src_path);
+    int is_dir = (event->mask & IN_ISDIR) != 0;
+
+    if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && strcmp(src_path, src_real) == 0)
+    {
+        return 1;
+    }
+
+    int excluded = event->len > 0 && path_excluded(src_real, src_path, is_dir);
+    if (excluded && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+    {
+        report_reserved(src_real, src_path);
+    }
+    if (excluded && !(event->mask & IN_MOVED_TO))
+    {
+        stats_add(STAT_SKIPPED_EVENTS, 1);
+        return 0;
+    }
+
+    if (event->mask & IN_DELETE_SELF)
+    {
+        stream_delete(c, rel);
+        wt_remove(map, node);
+        return 0;
+    }
+
+    if (event->mask & IN_MOVED_FROM)
+    {
+        if (pm_add(pm, event->cookie, is_dir, src_path, rel, read_ns, stats_realtime_ns(), read_ns) < 0)
+        {
+            stream_delete(c, rel);
+            if (is_dir)
+                watch_remove_subtree(map, src_path);
+        }
+        return 0;
+    }
+
+    if (event->mask & IN_MOVED_TO)
+    {
+        PendingMove mv;
+        int paired = pm_take(pm, event->cookie, &mv);
+        if (excluded)
+        {
+            if (paired)
+            {
+                stream_delete(c, mv.dst_old);
+                if (mv.is_dir)
+                    watch_remove_subtree(map, mv.src_old);
+                pm_release(&mv);
+            }
+            stats_add(STAT_SKIPPED_EVENTS, 1);
+            return 0;
+        }
+        if (paired)
+        {
+            stream_rename(c, mv.dst_old, rel);
+            if (mv.is_dir)
+            {
+                wt_move(map, wt_find_path(map, mv.src_old), node, event->name);
+            }
+            pm_release(&mv);
+            return 0;
+        }
+        if (is_dir)
+        {
+            add_watch_tree(ifd, map, src_path, src_real);
+        }
+        stream_send_entry(c, src_real, src_path);
+        return 0;
+    }
+
+    if (event->mask & IN_CREATE)
+    {
+        struct stat st;
+        if (is_dir)
+        {
+            add_watch_tree(ifd, map, src_path, src_real);
+            stream_send_entry(c, src_real, src_path);
+        }
+        else if (lstat(src_path, &st) == 0 && S_ISLNK(st.st_mode))
+        {
+            stream_send_entry(c, src_real, src_path);
+        }
+        return 0;
+    }
+
+    if ((event->mask & IN_CLOSE_WRITE) && !is_dir)
+    {
+        stream_send_file(c, rel, src_path);
+        return 0;
+    }
+
+    if (event->mask & IN_DELETE)
+    {
+        stream_delete(c, rel);
+        if (is_dir)
+            watch_remove_subtree(map, src_path);
+    }
+    return 0;
+}
+
+// monitor_and_mirror for a stream target. Operations of one inotify read go
+// out together and acknowledgements are taken whenever they arrive, so the
+// worker never waits for the receiver unless the window is full.
+int stream_and_mirror(const char* src_real, const char* target)
+{
+    int ifd = inotify_init();
+    if (ifd < 0)
+    {
+        perror("inotify_init");
+        exit(EXIT_FAILURE);
+    }
+
+    WatchTree map = {0};
+    map.dropped = watch_dropped;
+    map.dropped_arg = &ifd;
+    StreamConn* c = NULL;
+    if (add_watch_tree(ifd, &map, src_real, src_real) < 0 || !(c = stream_open(target, g_stop)))
+    {
+        close(ifd);
+        wt_free(&map);
+        return -1;
+    }
+
+    // a restarted worker sends everything again as well; the receiver
+    // overwrites what it has and prunes the rest
+    stats_set_phase(PHASE_INITIAL_SYNC);
+    if (stream_send_entry(c, src_real, src_real) < 0 || stream_flush(c) < 0)
+    {
+        close(ifd);
+        wt_free(&map);
+        stream_close(c);
+        return *g_stop ? 0 : -1;
+    }
+    stats_mark_protected();
+
+    PendingMoves pm = {0};
+    StreamMoveContext move_ctx = {&map, c};
+
+    int ret = 0;
+    char buffer[4096];
+    while (!*g_stop)
+    {
+        pm_expire(&pm, stats_now_ns(), stream_move_expired, &move_ctx);
+
+        int flushed = stream_flush(c);
+        if (flushed < 0)
+            break;
+        if (flushed == STREAM_RESYNC)
+        {
+            stats_set_phase(PHASE_INITIAL_SYNC);
+            stream_send_entry(c, src_real, src_real);
+            continue;
+        }
+
+        stats_set_phase(PHASE_IDLE);
+        // the receiver has applied everything read so far
+        if (g_stats && pm.count == 0 && inotify_queued(ifd) == 0 && stream_unacked(c) == 0)
+        {
+            stats_mark_synced(stats_realtime_ns());
+        }
+
+        struct pollfd pfd[2] = {{ifd, POLLIN, 0}, {stream_fd(c), POLLIN, 0}};
+        int ready = poll(pfd, 2, pm.count ? MOVE_WHEEL_TICK_MS : WORKER_IDLE_TICK_MS);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll(inotify)");
+            ret = -1;
+            break;
+        }
+        if (pfd[1].revents)
+            stream_read_acks(c);
+        if (!(pfd[0].revents & POLLIN))
+            continue;
+
+        ssize_t len = read(ifd, buffer, sizeof(buffer));
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("read(inotify)");
+            ret = -1;
+            break;
+        }
+
+        long long read_ns = stats_now_ns();
+        size_t queued = count_events(buffer, len);
+        stats_touch_event();
+        stats_add(STAT_EVENTS_READ, queued);
+        stats_set(STAT_QUEUE_DEPTH, queued);
+        stats_set_phase(PHASE_APPLYING);
+
+        int overflowed = 0;
+        ssize_t i = 0;
+        while (i < len)
+        {
+            struct inotify_event* event = (struct inotify_event*)&buffer[i];
+            i += (ssize_t)sizeof(*event) + (ssize_t)event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                overflowed = 1;
+                stats_add(STAT_OVERFLOWS, 1);
+            }
+            else if (stream_handle_event(ifd, &map, &pm, c, src_real, event, read_ns))
+            {
+                *g_stop = 1;
+                break;
+            }
+            stats_add(STAT_EVENTS_APPLIED, 1);
+            stats_set(STAT_QUEUE_DEPTH, --queued);
+        }
+        if (overflowed && !*g_stop)
+        {
+            // events were dropped: everything is sent again, as by a restarted
+            // worker, and pending moves are taken as removals, see mirror_rescan
+            fprintf(stderr, "%s: inotify queue overflow, sending everything again\n", src_real);
+            pm_expire(&pm, LLONG_MAX / 2, stream_move_expired, &move_ctx);
+            add_watch_tree(ifd, &map, src_real, src_real);
+            stats_set_phase(PHASE_INITIAL_SYNC);
+            stream_send_entry(c, src_real, src_real);
+        }
+    }
+
+    stats_set(STAT_QUEUE_DEPTH, 0);
+    close(ifd);
+    wt_free(&map);
+    pm_free(&pm);
+    stream_close(c);
+    return ret;
+}
+
+// receive mode: the other end of a stream target, applying its operations
+// below the directory given on the command line
+
+static int receive_part_path(const char* path, char out[PATH_MAX])
+{
+    if (snprintf(out, PATH_MAX, "%s%s", path, STREAM_PART_SUFFIX) >= PATH_MAX)
+    {
+        fprintf(stderr, "receive: name too long \"%s\"\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int receive_name_cmp(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// removes what the directory holds beyond the names the sender listed
+static void receive_prune(const char* dir_path, const char* names, size_t names_len)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < names_len; i++)
+    {
+        count += (names[i] == '\0');
+    }
+    const char** sorted = malloc((count ? count : 1) * sizeof(*sorted));
+    if (!sorted)
+    {
+        perror("malloc(receive)");
+        return;
+    }
+    size_t k = 0;
+    for (const char* name = names; name < names + names_len; name += strlen(name) + 1)
+    {
+        sorted[k++] = name;
+    }
+    qsort(sorted, count, sizeof(*sorted), receive_name_cmp);
+
+    DIR* dir = opendir(dir_path);
+    if (!dir)
+    {
+        perror("opendir(receive)");
+        free(sorted);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        const char* key = entry->d_name;
+        if (bsearch(&key, sorted, count, sizeof(*sorted), receive_name_cmp))
+            continue;
+        char child[PATH_MAX];
+        if (snprintf(child, PATH_MAX, "%s/%s", dir_path, entry->d_name) < PATH_MAX)
+        {
+            rm_tree(child);
+        }
+    }
+    closedir(dir);
+    free(sorted);
+}
+
+static int receive_apply(const StreamOp* op, void* arg)
+{
+    const char* root = arg;
+    char path[PATH_MAX], part[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s%s%s", root, *op->path ? "/" : "", op->path) >= PATH_MAX)
+    {
+        fprintf(stderr, "receive: name too long \"%s\"\n", op->path);
+        return -1;
+    }
+
+    struct stat st;
+    int fd;
+    switch (op->op)
+    {
+        case STREAM_OP_MKDIR:
+            if (lstat(path, &st) == 0 && !S_ISDIR(st.st_mode) && rm_tree(path) < 0)
+                return -1;
+            return mkdir_p(path, op->mode & 0777);
+
+        case STREAM_OP_FILE_BEGIN:
+        case STREAM_OP_WRITE:
+        case STREAM_OP_FILE_END:
+            if (receive_part_path(path, part) < 0 || ensure_parent_dir(part) < 0)
+                return -1;
+            fd = open(part, O_WRONLY | O_CREAT | O_CLOEXEC | (op->op == STREAM_OP_FILE_BEGIN ? O_TRUNC : 0), 0600);
+            if (fd < 0)
+            {
+                perror("open(receive)");
+                return -1;
+            }
+            if (op->op == STREAM_OP_WRITE)
+            {
+                for (size_t done = 0; done < op->data_len;)
+                {
+                    ssize_t w = pwrite(fd, op->data + done, op->data_len - done, (off_t)(op->offset + done));
+                    if (w < 0)
+                    {
+                        perror("pwrite(receive)");
+                        close(fd);
+                        return -1;
+                    }
+                    done += (size_t)w;
+                }
+                stats_add(STAT_BYTES_COPIED, op->data_len);
+            }
+            else if (op->op == STREAM_OP_FILE_END)
+            {
+                if (ftruncate(fd, (off_t)op->size) < 0)
+                    perror("ftruncate(receive)");
+                struct stat meta;
+                memset(&meta, 0, sizeof(meta));
+                meta.st_mode = op->mode;
+                meta.st_atim.tv_sec = meta.st_mtim.tv_sec = op->mtime_ns / 1000000000LL;
+                meta.st_atim.tv_nsec = meta.st_mtim.tv_nsec = op->mtime_ns % 1000000000LL;
+                meta.st_uid = geteuid();
+                meta.st_gid = getegid();
+                copy_metadata(fd, &meta);
+            }
+            close(fd);
+            if (op->op != STREAM_OP_FILE_END)
+                return 0;
+            if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && rm_tree(path) < 0)
+                return -1;
+            if (rename(part, path) < 0)
+            {
+                perror("rename(receive)");
+                return -1;
+            }
+            return 0;
+
+        case STREAM_OP_SYMLINK:
+            if (ensure_parent_dir(path) < 0 || rm_tree(path) < 0)
+                return -1;
+            if (symlink(op->data, path) < 0)
+            {
+                perror("symlink(receive)");
+                return -1;
+            }
+            struct timespec times[2] = {{op->mtime_ns / 1000000000LL, op->mtime_ns % 1000000000LL},
+                                        {op->mtime_ns / 1000000000LL, op->mtime_ns % 1000000000LL}};
+            utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+            return 0;
+
+        case STREAM_OP_RENAME:
+            if (snprintf(part, PATH_MAX, "%s/%s", root, op->data) >= PATH_MAX || ensure_parent_dir(part) < 0)
+                return -1;
+            if (rename(path, part) < 0)
+            {
+                perror("rename(receive)");
+                return -1;
+            }
+            return 0;
+
+        case STREAM_OP_DELETE:
+            if (receive_part_path(path, part) == 0)
+                unlink(part);
+            return rm_tree(path);
+
+        case STREAM_OP_PRUNE:
+            receive_prune(path, op->data, op->data_len);
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+// "sop-backup receive <address> <directory>"
+static int receive_main(const char* address, const char* dir)
+{
+    char root[PATH_MAX];
+    if (mkdir_p(dir, 0755) < 0 || !realpath(dir, root))
+    {
+        perror("receive directory");
+        return -1;
+    }
+    if (sethandler(on_child_term, SIGTERM) < 0 || sethandler(on_child_term, SIGINT) < 0)
+    {
+        return -1;
+    }
+    return stream_receive(address, receive_apply, root, &g_child_exit);
+}
+
+// restoring helpers
+typedef struct
+{
+    const char* backup_dir;
+    const char* src_dir;
+    const char* backup_real;
+    const char* src_real;
+    RestoreCounts* counts;
+} RestoreWalk;
+
+static int restore_entry(const DiffEntry* e, void* arg)
+{
+    const RestoreWalk* w = arg;
+    char bck_path[PATH_MAX], src_path[PATH_MAX];
+    if (snprintf(bck_path, PATH_MAX, "%s/%s", w->backup_dir, e->name) >= PATH_MAX ||
+        snprintf(src_path, PATH_MAX, "%s/%s", w->src_dir, e->name) >= PATH_MAX)
+    {
+        fprintf(stderr, "Name too long(apply_backup)\n");
+        return -1;
+    }
+
+    if (e->kind == DIFF_REMOVED)
+    {
+        // not in the backup: deleted from the source, unless the backup's
+        // rules never mirrored it
+        if (path_excluded(w->src_real, src_path, S_ISDIR(e->to.st_mode)))
+        {
+            return 0;
+        }
+        return discard_tree(src_path);
+    }
+    if (is_internal_path(w->backup_real, bck_path))
+    {
+        return 0;
+    }
+    const struct stat* st = &e->from;
+    if (e->kind == DIFF_SAME && !S_ISDIR(st->st_mode))
+    {
+        w->counts->skipped++;
+        return 0;
+    }
+    if (e->kind == DIFF_CHANGED && (st->st_mode & S_IFMT) != (e->to.st_mode & S_IFMT) && discard_tree(src_path) < 0)
+    {
+        return -1;
+    }
+
+    if (S_ISDIR(st->st_mode))
+    {
+        if (e->kind != DIFF_SAME)
+        {
+            if (mkdir(src_path, st->st_mode & 0777) < 0 && errno != EEXIST)
+            {
+                perror("mkdir(apply_backup)");
+                return -1;
+            }
+            restore_note(src_path);
+        }
+        return apply_backup(bck_path, src_path, w->backup_real, w->src_real, w->counts);
+    }
+    int ret = 0;
+    if (S_ISREG(st->st_mode))
+    {
+        w->counts->copied++;
+        ret = copy_file(bck_path, src_path, st->st_mode);
+    }
+    else if (S_ISLNK(st->st_mode))
+    {
+        ret = copy_symplink_rewrite(bck_path, src_path, w->backup_real, w->src_real);
+    }
+    if (ret == 0)
+    {
+        restore_note(src_path);
+    }
+    return ret;
+}
+
+// Makes the source directory src_dir what the backup directory backup_dir
+// holds, in one diff per directory: what the backup has not is deleted, what
+// differs is copied back. Entries the backup's rules (g_filter) exclude are
+// left alone.
+int apply_backup(const char* backup_dir, const char* src_dir, const char* backup_real, const char* src_real,
+                 RestoreCounts* counts)
+{
+    RestoreWalk w = {backup_dir, src_dir, backup_real, src_real, counts};
+    return dir_diff(backup_dir, src_dir, restore_entry, &w);
+}
+
+// dynamic registry for backups
+int ensure_capacity(BackupList* lst, size_t need)
+{
+    if (lst->backups_capacity >= need)
+    {
+        return 0;
+    }
+    size_t new_capacity = (lst->backups_capacity == 0) ? 8 : (lst->backups_capacity * 2);
+    while (new_capacity < need)
+    {
+        new_capacity *= 2;
+    }
+    Backup* new_backup = realloc(lst->backups, sizeof(Backup) * new_capacity);
+    if (!new_backup)
+    {
+        return -1;
+    }
+    lst->backups = new_backup;
+    lst->backups_capacity = new_capacity;
+    return 0;
+}
+
+void free_backup(Backup* backup)
+{
+    if (!backup)
+    {
+        return;
+    }
+    if (backup->pidfd >= 0)
+    {
+        control_unwatch_fd(backup->pidfd);
+        close(backup->pidfd);
+        backup->pidfd = -1;
+    }
+    free(backup->dst);
+    free(backup->src);
+    stats_destroy(backup->stats);
+    filter_free(backup->filter);
+    tier_log_destroy(backup->tier_log);
+    free(backup->upstream);
+    backup->filter = NULL;
+    backup->tier_log = NULL;
+    backup->upstream = NULL;
+    backup->dst = NULL;
+    backup->src = NULL;
+    backup->stats = NULL;
+    backup->created_at = 0;
+    backup->active = 0;
+}
+
+int find_backup(char* src, char* dst)
+{
+    for (int i = 0; i < (int)g_list.backups_count; i++)
+    {
+        if (strcmp(g_list.backups[i].src, src) == 0 && strcmp(g_list.backups[i].dst, dst) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// a worker that ignores "end" for too long is killed; runs on the control loop timer
+void enforce_stop_deadlines(void)
+{
+    time_t now = time(NULL);
+    for (size_t i = 0; i < g_list.backups_count; i++)
+    {
+        Backup* b = &g_list.backups[i];
+        // a task cannot be killed; it stops once its current copy polls the flag
+        if (b->active && b->stop_requested && !b->task && now - b->stop_requested >= STOP_GRACE_SECONDS)
+        {
+            if (kill(b->pid, SIGKILL) < 0 && errno != ESRCH)
+            {
+                perror("kill");
+            }
+            b->stop_requested = now;
+        }
+    }
+}
+
+// stops watching the worker's pidfd and forgets its pid
+void backup_detach(Backup* b)
+{
+    if (b->pidfd >= 0)
+    {
+        control_unwatch_fd(b->pidfd);
+        if (close(b->pidfd) < 0)
+        {
+            perror("close(pidfd)");
+        }
+        b->pidfd = -1;
+    }
+    if (b->pid > 0)
+    {
+        pidmap_del(&g_pids, b->pid);
+    }
+}
+
+// a worker is gone: it either was asked to stop or exited cleanly (source
+// removed), or it failed and gets restarted once its backoff has elapsed
+void worker_exited(Backup* b, int failed)
+{
+    backup_detach(b);
+    b->active = 0;
+    b->pid = 0;
+
+    if (!failed || b->stop_requested)
+    {
+        b->stop_requested = 0;
+        g_state_dirty = 1;
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (now - b->started_at >= RESTART_STABLE_SECONDS)
+    {
+        b->backoff = RESTART_BACKOFF_MIN;
+    }
+    b->restart_at = now + b->backoff;
+    fprintf(stderr, "worker for src=\"%s\" dst=\"%s\" died, restarting in %ds\n", b->src, b->dst, b->backoff);
+    b->backoff = (b->backoff * 2 > RESTART_BACKOFF_MAX) ? RESTART_BACKOFF_MAX : b->backoff * 2;
+}
+
+// the pidfd of a worker became readable, i.e. the worker exited
+static void on_pidfd_ready(int fd, void* arg)
+{
+    pid_t pid = (pid_t)(intptr_t)arg;
+    size_t index;
+    if (pidmap_get(&g_pids, pid, &index) < 0)
+    {
+        return;
+    }
+    Backup* b = &g_list.backups[index];
+
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (waitid((idtype_t)P_PIDFD, (id_t)fd, &info, WEXITED | WNOHANG) < 0)
+    {
+        if (errno != ECHILD)
+        {
+            perror("waitid(pidfd)");
+            return;
+        }
+        // already reaped elsewhere, only the descriptor is left
+        backup_detach(b);
+        return;
+    }
+    if (info.si_pid == 0)
+    {
+        return;
+    }
+    worker_exited(b, !(info.si_code == CLD_EXITED && info.si_status == 0));
+}
+
+// SIGCHLD fallback for kernels without pidfd_open
+void reap_children(void)
+{
+    if (g_pidfd_supported)
+    {
+        return;
+    }
+    while (1)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0)
+            break;
+
+        size_t index;
+        if (pidmap_get(&g_pids, pid, &index) == 0)
+        {
+            worker_exited(&g_list.backups[index], !(WIFEXITED(status) && WEXITSTATUS(status) == 0));
+        }
+    }
+}
+
+// helpers for copy to target
+int is_dir_empty(char* path)
+{
+    DIR* dir = opendir(path);
+    if (!dir)
+    {
+        perror("opendir");
+        return -1;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if (closedir(dir) < 0)
+        {
+            perror("closedir");
+            return -1;
+        }
+        return 0;  // not empty
+    }
+    if (closedir(dir) < 0)
+    {
+        perror("closedir");
+        return -1;
+    }
+    return 1;
+}
+
+int mkdir_p(const char* path, mode_t mode)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s", path) >= PATH_MAX)
+    {
+        printf("Path is too big\n");
+        return -1;
+    }
+
+    size_t len = strlen(tmp);
+    if (len == 0)
+    {
+        printf("Path is empty\n");
+        return -1;
+    }
+
+    while (len > 1 && tmp[len - 1] == '/')
+    {
+        tmp[--len] = '\0';
+    }
+
+    for (char* p = tmp + 1; *p; p++)
+    {
+        if (*p == '/')
+        {
+            *p = '\0';
+            if (mkdir(tmp, mode) < 0 && errno != EEXIST)
+            {
+                perror("mkdir");
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (mkdir(tmp, mode) < 0 && errno != EEXIST)
+    {
+        perror("mkdir");
+        return -1;
+    }
+    return 0;
+}
+
+int ensure_empty_dir(char* dst)
+{
+    struct stat st;
+    if (lstat(dst, &st) == 0)
+    {
+        if (!S_ISDIR(st.st_mode))
+        {
+            fprintf(stderr, "%s is not a directory\n", dst);
+            return -1;
+        }
+
+        int empty = is_dir_empty(dst);
+        if (empty < 0)
+        {
+            perror("is_dir_empty");
+            return -1;
+        }
+        if (empty == 0)
+        {
+            fprintf(stderr, "dst exists and is not empty\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (errno != ENOENT)
+    {
+        perror("lstat(dst)");
+        return -1;
+    }
+    return 0;
+}
+
+int create_empty_dir(char* dst)
+{
+    struct stat st;
+    if (lstat(dst, &st) == 0)
+    {  // it already exists and 100% empty
+        return 0;
+    }
+
+    if (mkdir_p(dst, 0755) < 0)
+    {
+        perror("mkdir_p(dst)");
+        return -1;
+    }
+    return 0;
+}
+
+int has_prefix_path(const char* s, const char* prefix)
+{
+    size_t len = strlen(prefix);
+    if (strncmp(s, prefix, len) != 0)
+    {
+        return 0;
+    }
+    return (s[len] == '\0' || s[len] == '/');
+}
+
+// Copies carry the source's mode, timestamps and, when running as root, owner,
+// so equal size and nanosecond mtime mean a file did not change since it was
+// copied. Restore, resume and reconciliation all decide with this check.
+int same_file_quick(const struct stat* a, const struct stat* b)
+{
+    return a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+void copy_metadata(int fd, const struct stat* st)
+{
+    if (geteuid() == 0 && fchown(fd, st->st_uid, st->st_gid) < 0)
+    {
+        perror("fchown");
+    }
+    if (fchmod(fd, st->st_mode & 07777) < 0)
+    {
+        perror("fchmod");
+    }
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    if (futimens(fd, times) < 0)
+    {
+        perror("futimens");
+    }
+}
+
+// Bulk-phase copy (see uncached.h), takes over in. Source pages nobody had
+// cached are dropped behind the read and target pages once written back;
+// files of at least -D bytes go around the cache with O_DIRECT instead.
+static int copy_file_uncached(int in, const struct stat* st, const char* dst, mode_t mode)
+{
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
+    if (out < 0)
+    {
+        perror("open dst");
+        close(in);
+        return -1;
+    }
+
+    // a filesystem without O_DIRECT refuses the flag, the copy then goes
+    // through the cache like a smaller file
+    int direct = g_uncached_direct_min > 0 && (unsigned long long)st->st_size >= g_uncached_direct_min;
+    if (direct)
+    {
+        int in_flags = fcntl(in, F_GETFL);
+        int out_flags = fcntl(out, F_GETFL);
+        if (fcntl(in, F_SETFL, in_flags | O_DIRECT) < 0)
+            direct = 0;
+        else if (fcntl(out, F_SETFL, out_flags | O_DIRECT) < 0)
+        {
+            fcntl(in, F_SETFL, in_flags);
+            direct = 0;
+        }
+    }
+    int drop = g_uncached_drop && !direct;
+
+    char* buf = uncached_buffer_get();
+    if (!buf)
+    {
+        perror("posix_memalign");
+        close(in);
+        close(out);
+        return -1;
+    }
+    UncachedSource source = {0};
+    if (drop)
+        uncached_source_open(&source, in, st->st_size);
+
+    int ret = 0;
+    off_t off = 0;
+    while (1)
+    {
+        if (*g_stop)
+        {
+            errno = EINTR;
+            ret = -1;
+            break;
+        }
+
+        ssize_t r = bulk_read(in, buf, UNCACHED_CHUNK);
+        if (r < 0)
+        {
+            perror("bulk_read");
+            ret = -1;
+            break;
+        }
+        if (drop)
+            uncached_source_after(&source, in, off, (size_t)r);
+        if (r == 0)
+            break;
+
+        // O_DIRECT writes whole blocks; the padding is cut off again below
+        size_t len = (size_t)r;
+        if (direct && len % UNCACHED_ALIGN != 0)
+        {
+            size_t padded = (len + UNCACHED_ALIGN - 1) / UNCACHED_ALIGN * UNCACHED_ALIGN;
+            memset(buf + len, 0, padded - len);
+            len = padded;
+        }
+        if (bulk_write(out, buf, len) < 0)
+        {
+            perror("bulk_write");
+            ret = -1;
+            break;
+        }
+        if (drop)
+            uncached_target_written(out, off, (size_t)r);
+        stats_add(STAT_BYTES_COPIED, (unsigned long long)r);
+        off += r;
+        if ((size_t)r < UNCACHED_CHUNK)
+            break;  // EOF
+    }
+    uncached_source_close(&source);
+    uncached_buffer_put(buf);
+
+    if (ret == 0 && direct && ftruncate(out, off) < 0)
+    {
+        perror("ftruncate");
+        ret = -1;
+    }
+    if (ret == 0)
+        copy_metadata(out, st);
+    if (close(in) < 0)
+    {
+        perror("close");
+        ret = -1;
+    }
+    if (drop)
+        uncached_target_close(out);
+    else if (close(out) < 0)
+    {
+        perror("close");
+        ret = -1;
+    }
+    if (ret == 0)
+        stats_add(STAT_FILES_COPIED, 1);
+    return ret;
+}
+
+int copy_file(const char* src, const char* dst, mode_t mode)
+{
+    int in = open(src, O_RDONLY);
+    if (in < 0)
+    {
+        perror("open src");
+        return -1;
+    }
+    // taken before reading, so a change made during the copy leaves a
+    // different mtime behind and is picked up again
+    struct stat st;
+    if (fstat(in, &st) < 0)
+    {
+        perror("fstat src");
+        close(in);
+        return -1;
+    }
+    if (uncached_active())
+        return copy_file_uncached(in, &st, dst, mode);
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
+    if (out < 0)
+    {
+        perror("open dst");
+        close(in);
+        return -1;
+    }
+
+    char buf[1024];
+    while (1)
+    {
+        if (*g_stop)
+        {
+            if (close(in) < 0)
+            {
+                perror("close");
+                return -1;
+            }
+            if (close(out) < 0)
+            {
+                perror("close");
+                return -1;
+            }
+            errno = EINTR;
+            return -1;
+        }
+
+        ssize_t r = bulk_read(in, buf, sizeof(buf));
+        if (r < 0)
+        {
+            perror("bulk_read");
+            if (close(in) < 0)
+            {
+                perror("close");
+                return -1;
+            }
+            if (close(out) < 0)
+            {
+                perror("close");
+                return -1;
+            }
+            return -1;
+        }
+        if (r == 0)
+            break;
+
+        ssize_t w = bulk_write(out, buf, r);
+        if (w < 0)
+        {
+            perror("bulk_write");
+            if (close(in) < 0)
+            {
+                perror("close");
+            }
+            if (close(out) < 0)
+            {
+                perror("close");
+            }
+            return -1;
+        }
+        stats_add(STAT_BYTES_COPIED, (unsigned long long)w);
+    }
+    copy_metadata(out, &st);
+
+    if (close(in) < 0)
+    {
+        perror("close");
+        return -1;
+    }
+    if (close(out) < 0)
+    {
+        perror("close");
+        return -1;
+    }
+    stats_add(STAT_FILES_COPIED, 1);
+    return 0;
+}
+
+// Brings dst_path up to date with in from the entry of the last copy, see
+// tails.h: appends what the source grew by, or truncates what it lost. Returns
+// 0 once done, 1 when it takes a full copy and -1 on failure.
+static int tail_update(int in, const struct stat* st, const char* dst_path)
+{
+    TailEntry* e = tails_get(g_tails, st->st_dev, st->st_ino);
+    if (!e)
+    {
+        return 1;
+    }
+    int out = open(dst_path, O_RDWR);
+    if (out < 0)
+    {
+        return 1;
+    }
+    struct stat dst_st;
+    TailHash src_hash;
+    off_t size = e->size;
+    int ret = 1;
+    if (fstat(out, &dst_st) < 0 || dst_st.st_ino != e->dst_ino || dst_st.st_size != size)
+    {
+        // the target was replaced or changed behind the worker's back
+    }
+    else if (st->st_size > size)
+    {
+        // a file that kept its size was written in place, never appended to
+        if (tails_hash_fd(in, size, &src_hash) == 0 &&
+            tails_hash_value(&src_hash) == tails_hash_value(&e->hash) && lseek(out, size, SEEK_SET) == size)
+        {
+            // up to whatever the source holds by now, as copy_file would
+            char buf[65536];
+            ssize_t r;
+            ret = 0;
+            while ((r = pread(in, buf, sizeof(buf), size)) != 0)
+            {
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r < 0 || bulk_write(out, buf, (size_t)r) < 0)
+                {
+                    perror("append");
+                    ret = -1;
+                    break;
+                }
+                tails_hash_update(&src_hash, buf, (size_t)r);
+                stats_add(STAT_BYTES_COPIED, (unsigned long long)r);
+                size += r;
+            }
+            if (ret == 0)
+                stats_add(STAT_TAIL_APPENDS, 1);
+        }
+    }
+    else if (st->st_size < size)
+    {
+        TailHash dst_hash;
+        if (tails_hash_fd(in, st->st_size, &src_hash) == 0 && tails_hash_fd(out, st->st_size, &dst_hash) == 0 &&
+            tails_hash_value(&src_hash) == tails_hash_value(&dst_hash))
+        {
+            ret = ftruncate(out, st->st_size);
+            if (ret < 0)
+                perror("ftruncate");
+            size = st->st_size;
+            if (ret == 0)
+                stats_add(STAT_TAIL_TRUNCATES, 1);
+        }
+    }
+
+    if (ret == 0)
+    {
+        stats_add(STAT_TAIL_BYTES_SAVED, (unsigned long long)(size < e->size ? size : e->size));
+        // the append read up to the end of the source, which may be past
+        // st_size by now; its times are stamped only when the source still
+        // ends where the copy did, otherwise the older ones stay so a quick
+        // check takes the file as changed
+        struct stat now;
+        copy_metadata(out, fstat(in, &now) == 0 && now.st_size == size ? &now : st);
+        // the next update compares against what the target holds now
+        e->hash = src_hash;
+        e->size = size;
+    }
+    if (close(out) < 0)
+    {
+        perror("close");
+        ret = -1;
+    }
+    return ret;
+}
+
+// remembers what dst_path holds after a full copy of the source file dev:ino
+static void tail_record(dev_t dev, ino_t ino, const char* dst_path)
+{
+    int fd = open(dst_path, O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    struct stat st;
+    TailEntry e = {.dev = dev, .ino = ino};
+    if (fstat(fd, &st) == 0 && tails_hash_fd(fd, st.st_size, &e.hash) == 0)
+    {
+        e.dst_ino = st.st_ino;
+        e.size = st.st_size;
+        tails_put(g_tails, &e);
+    }
+    close(fd);
+}
+
+// a regular file changed during mirroring: copy_file, unless the source only
+// grew or shrank since its last copy
+static int update_file(const char* src_path, const char* dst_path, mode_t mode)
+{
+    if (!g_tails)
+    {
+        return copy_file(src_path, dst_path, mode);
+    }
+    int in = open(src_path, O_RDONLY);
+    if (in < 0)
+    {
+        perror("open src");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(in, &st) < 0)
+    {
+        perror("fstat src");
+        close(in);
+        return -1;
+    }
+    int ret = tail_update(in, &st, dst_path);
+    close(in);
+    if (ret <= 0)
+    {
+        return ret;
+    }
+    if (copy_file(src_path, dst_path, mode) < 0)
+    {
+        return -1;
+    }
+    tail_record(st.st_dev, st.st_ino, dst_path);
+    return 0;
+}
+
+int copy_symplink_rewrite(const char* src_link, const char* dst_link, const char* src_real, const char* dst_real)
+{
+    char linkbuf[PATH_MAX];
+    ssize_t n = readlink(src_link, linkbuf, sizeof(linkbuf) - 1);
+    if (n < 0)
+    {
+        perror("readlink");
+        return -1;
+    }
+    linkbuf[n] = '\0';
+
+    char* final_target = linkbuf;
+    char rewritten[PATH_MAX];
+
+    if (linkbuf[0] == '/' && has_prefix_path(linkbuf, src_real))
+    {  // checking if contains an absolute path leading to this directory
+        char* suffix = linkbuf + strlen(src_real);
+        if (snprintf(rewritten, PATH_MAX, "%s%s", dst_real, suffix) >= PATH_MAX)
+        {
+            perror("Name too long(link)");
+            return -1;
+        }
+        final_target = rewritten;
+    }
+
+    unlink(dst_link);
+    if (symlink(final_target, dst_link) < 0)
+    {
+        perror("symlink");
+        return -1;
+    }
+
+    struct stat st;
+    if (lstat(src_link, &st) == 0)
+    {
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        utimensat(AT_FDCWD, dst_link, times, AT_SYMLINK_NOFOLLOW);
+        if (geteuid() == 0)
+        {
+            lchown(dst_link, st.st_uid, st.st_gid);
+        }
+    }
+    return 0;
+}
+
+int copy_tree(const char* src_dir, const char* dst_dir, const char* src_real, const char* dst_real)
+{
+    DIR* d = opendir(src_dir);
+    if (!d)
+    {
+        perror("opendir(src_dir)");
+        return -1;
+    }
+
+    struct dirent* entity;
+    while ((entity = readdir(d)) != NULL)
+    {
+        if (*g_stop)
+        {
+            if (closedir(d) < 0)
+            {
+                perror("closedir");
+                return -1;
+            }
+            return -1;
+        }
+        if (strcmp(entity->d_name, ".") == 0 || strcmp(entity->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        char src_path[PATH_MAX], dst_path[PATH_MAX];
+        if (snprintf(src_path, PATH_MAX, "%s/%s", src_dir, entity->d_name) >= PATH_MAX)
+        {
+            if (closedir(d) < 0)
+            {
+                perror("closedir");
+                return -1;
+            }
+            perror("Name too long(src_dir + name)");
+            return -1;
+        }
+        if (snprintf(dst_path, PATH_MAX, "%s/%s", dst_dir, entity->d_name) >= PATH_MAX)
+        {
+            if (closedir(d) < 0)
+            {
+                perror("closedir");
+                return -1;
+            }
+            perror("Name too long(dst_dir + name)");
+            return -1;
+        }
+
+        struct stat st;
+        if (lstat(src_path, &st) < 0)
+        {
+            if (closedir(d) < 0)
+            {
+                perror("closedir");
+                return -1;
+            }
+            return -1;
+        }
+
+        if (path_excluded(src_real, src_path, S_ISDIR(st.st_mode)))
+        {
+            report_reserved(src_real, src_path);
+            stats_add(STAT_SKIPPED_PATHS, 1);
+            if (S_ISREG(st.st_mode))
+                stats_add(STAT_SKIPPED_BYTES, (unsigned long long)st.st_size);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (mkdir(dst_path, st.st_mode & 0777) < 0 && errno != EEXIST)
+            {
+                if (closedir(d) < 0)
+                {
+                    perror("closedir");
+                    return -1;
+                }
+                return -1;
+            }
+            if (copy_tree(src_path, dst_path, src_real, dst_real) < 0)
+            {
+                if (closedir(d) < 0)
+                {
+                    perror("closedir");
+                    return -1;
+                }
+                return -1;
+            }
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            if (copy_file(src_path, dst_path, st.st_mode) < 0)
+            {
+                if (closedir(d) < 0)
+                {
+                    perror("closedir");
+                    return -1;
+                }
+                return -1;
+            }
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            if (copy_symplink_rewrite(src_path, dst_path, src_real, dst_real) < 0)
+            {
+                if (closedir(d) < 0)
+                {
+                    perror("closedir");
+                    return -1;
+                }
+                return -1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Skipping unsupported file type: %s\n", src_path);
+        }
+    }
+
+    if (closedir(d) < 0)
+    {
+        perror("closedir");
+        return -1;
+    }
+    return 0;
+}
+
+// First pass of copy_tree_ordered: the same walk as copy_tree, except that
+// regular files are queued instead of copied. rel is src_dir below src_real.
+static int layout_walk(LayoutQueue* q, const char* src_dir, const char* dst_dir, const char* rel,
+                       const char* src_real, const char* dst_real)
+{
+    DIR* d = opendir(src_dir);
+    if (!d)
+    {
+        perror("opendir(src_dir)");
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent* entity;
+    while (ret == 0 && (entity = readdir(d)) != NULL)
+    {
+        if (*g_stop)
+        {
+            ret = -1;
+            break;
+        }
+        if (strcmp(entity->d_name, ".") == 0 || strcmp(entity->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        char src_path[PATH_MAX], dst_path[PATH_MAX], rel_path[PATH_MAX];
+        if (snprintf(src_path, PATH_MAX, "%s/%s", src_dir, entity->d_name) >= PATH_MAX ||
+            snprintf(dst_path, PATH_MAX, "%s/%s", dst_dir, entity->d_name) >= PATH_MAX ||
+            snprintf(rel_path, PATH_MAX, "%s%s%s", rel, *rel ? "/" : "", entity->d_name) >= PATH_MAX)
+        {
+            fprintf(stderr, "Name too long: %s/%s\n", src_dir, entity->d_name);
+            ret = -1;
+            break;
+        }
+
+        struct stat st;
+        if (lstat(src_path, &st) < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        if (path_excluded(src_real, src_path, S_ISDIR(st.st_mode)))
+        {
+            report_reserved(src_real, src_path);
+            stats_add(STAT_SKIPPED_PATHS, 1);
+            if (S_ISREG(st.st_mode))
+                stats_add(STAT_SKIPPED_BYTES, (unsigned long long)st.st_size);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (mkdir(dst_path, st.st_mode & 0777) < 0 && errno != EEXIST)
+                ret = -1;
+            else
+                ret = layout_walk(q, src_path, dst_path, rel_path, src_real, dst_real);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            ret = layout_add(q, src_path, rel_path, &st);
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            ret = copy_symplink_rewrite(src_path, dst_path, src_real, dst_real);
+        }
+        else
+        {
+            fprintf(stderr, "Skipping unsupported file type: %s\n", src_path);
+        }
+    }
+
+    if (closedir(d) < 0)
+    {
+        perror("closedir");
+        return -1;
+    }
+    return ret;
+}
+
+// copy_tree for a whole initial sync, with the files copied in on-disk order
+// instead of directory order (-L, see layout.h)
+int copy_tree_ordered(const char* src_real, const char* dst_real)
+{
+    LayoutQueue q = {0};
+    if (layout_walk(&q, src_real, dst_real, "", src_real, dst_real) < 0)
+    {
+        layout_free(&q);
+        return -1;
+    }
+    layout_sort(&q);
+
+    // with -n the copy drops only what was not cached before it read the
+    // file, and pages prefetched here would look like somebody else's
+    int prefetch = !(uncached_active() && g_uncached_drop);
+    int ret = 0;
+    for (size_t i = 0; i < q.count && ret == 0; i++)
+    {
+        if (prefetch)
+            layout_prefetch(&q, src_real, i);
+        char src_path[PATH_MAX], dst_path[PATH_MAX];
+        if (snprintf(src_path, PATH_MAX, "%s/%s", src_real, q.entries[i].rel) >= PATH_MAX ||
+            snprintf(dst_path, PATH_MAX, "%s/%s", dst_real, q.entries[i].rel) >= PATH_MAX)
+        {
+            fprintf(stderr, "Name too long: %s\n", q.entries[i].rel);
+            ret = -1;
+            break;
+        }
+        ret = copy_file(src_path, dst_path, q.entries[i].mode);
+    }
+    layout_free(&q);
+    return ret;
+}
+
+typedef struct
+{
+    const char* src_dir;
+    const char* dst_dir;
+    const char* src_real;
+    const char* dst_real;
+    long long since_ns;
+} ResumeWalk;
+
+static int resume_entry(const DiffEntry* e, void* arg)
+{
+    const ResumeWalk* w = arg;
+    if (*g_stop)
+    {
+        return -1;
+    }
+    char src_path[PATH_MAX], dst_path[PATH_MAX];
+    if (snprintf(src_path, PATH_MAX, "%s/%s", w->src_dir, e->name) >= PATH_MAX ||
+        snprintf(dst_path, PATH_MAX, "%s/%s", w->dst_dir, e->name) >= PATH_MAX)
+    {
+        fprintf(stderr, "Name too long(resume_tree)\n");
+        return -1;
+    }
+
+    if (e->kind == DIFF_REMOVED)
+    {
+        // gone from the source, unless the target keeps it for itself or the
+        // backup's rules leave it alone
+        if (path_excluded(w->dst_real, dst_path, S_ISDIR(e->to.st_mode)))
+        {
+            return 0;
+        }
+        return discard_tree(dst_path);
+    }
+
+    const struct stat* st = &e->from;
+    if (path_excluded(w->src_real, src_path, S_ISDIR(st->st_mode)))
+    {
+        stats_add(STAT_SKIPPED_PATHS, 1);
+        if (S_ISREG(st->st_mode))
+            stats_add(STAT_SKIPPED_BYTES, (unsigned long long)st->st_size);
+        return 0;
+    }
+    int dst_exists = e->kind != DIFF_ADDED;
+    if (dst_exists && (st->st_mode & S_IFMT) != (e->to.st_mode & S_IFMT))
+    {
+        if (discard_tree(dst_path) < 0)
+        {
+            return -1;
+        }
+        dst_exists = 0;
+    }
+
+    if (S_ISDIR(st->st_mode))
+    {
+        if (!dst_exists && mkdir(dst_path, st->st_mode & 0777) < 0 && errno != EEXIST)
+        {
+            perror("mkdir(resume_tree)");
+            return -1;
+        }
+        return resume_tree(src_path, dst_path, w->src_real, w->dst_real, w->since_ns);
+    }
+    if (S_ISREG(st->st_mode))
+    {
+        int unchanged;
+        if (w->since_ns > 0)
+        {
+            // ctime also moves when the mtime is set back, e.g. by cp -p
+            unchanged = (long long)st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec < w->since_ns;
+        }
+        else
+        {
+            unchanged = e->kind == DIFF_SAME;
+        }
+        if (dst_exists && e->to.st_size == st->st_size && unchanged)
+        {
+            stats_add(STAT_FILES_UNCHANGED, 1);
+            return 0;
+        }
+        return copy_file(src_path, dst_path, st->st_mode);
+    }
+    if (S_ISLNK(st->st_mode))
+    {
+        return copy_symplink_rewrite(src_path, dst_path, w->src_real, w->dst_real);
+    }
+    fprintf(stderr, "Skipping unsupported file type: %s\n", src_path);
+    return 0;
+}
+
+// Brings dst_dir up to date without recopying it, after a worker restart or
+// wherever a mirror may have fallen behind. One diff per directory prunes what
+// is gone from the source and copies what is new or changed: a regular file is
+// copied again only if the sizes differ or its inode changed after since_ns
+// (the sync watermark); without a watermark the quick check decides.
+int resume_tree(const char* src_dir, const char* dst_dir, const char* src_real, const char* dst_real,
+                long long since_ns)
+{
+    ResumeWalk w = {src_dir, dst_dir, src_real, dst_real, since_ns};
+    return dir_diff(src_dir, dst_dir, resume_entry, &w);
+}
+
+int rm_tree(const char* path)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        perror("lstat(rm_tree)");
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode))
+    {
+        DIR* d = opendir(path);
+        if (!d)
+        {
+            perror("opendir(rm_tree)");
+            return -1;
+        }
+
+        struct dirent* entity;
+        while ((entity = readdir(d)) != NULL)
+        {
+            if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+                continue;
+
+            char child[PATH_MAX];
+            if (snprintf(child, PATH_MAX, "%s/%s", path, entity->d_name) >= PATH_MAX)
+            {
+                closedir(d);
+                fprintf(stderr, "Name too long(rm_tree)\n");
+                return -1;
+            }
+            if (rm_tree(child) < 0)
+            {
+                closedir(d);
+                return -1;
+            }
+        }
+        if (closedir(d) < 0)
+        {
+            perror("closedir(rm_tree)");
+            return -1;
+        }
+
+        if (rmdir(path) < 0 && errno != ENOENT)
+        {
+            perror("rmdir(rm_tree)");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (unlink(path) < 0 && errno != ENOENT)
+    {
+        perror("unlink(rm_tree)");
+        return -1;
+    }
+    return 0;
+}
+
+// resume is set when a crashed worker is restarted and its target already
+// holds an earlier mirror
+void child_loop(char* src, char* dst, int resume)
+{
+    child_install_signals();
+
+    char src_real[PATH_MAX];
+
+    if (norm_existing_dir(src, src_real) < 0)
+    {
+        _exit(0);
+    }
+
+    if (stream_is_target(dst))
+    {
+        int ret = stream_and_mirror(src_real, dst);
+        stats_set_phase(PHASE_STOPPED);
+        _exit(ret < 0 ? 1 : 0);
+    }
+
+    if (create_empty_dir(dst))
+    {
+        _exit(0);
+    }
+
+    char dst_real[PATH_MAX];
+    if (!realpath(dst, dst_real))
+    {
+        _exit(0);
+    }
+
+    int ret = monitor_and_mirror(src_real, dst_real, resume);
+    stats_set_phase(PHASE_STOPPED);
+    if (ret < 0)
+        _exit(1);
+    _exit(0);
+}
+
+// worker of a --tiered secondary target, fed by the log of the primary at upstream
+void tier_child_loop(const char* upstream, char* dst, TierLog* log)
+{
+    child_install_signals();
+
+    char up_real[PATH_MAX], dst_real[PATH_MAX];
+    if (norm_existing_dir(upstream, up_real) < 0 || create_empty_dir(dst) || !realpath(dst, dst_real))
+    {
+        _exit(1);
+    }
+    int ret = tier_follow(up_real, dst_real, log);
+    stats_set_phase(PHASE_STOPPED);
+    _exit(ret < 0 ? 1 : 0);
+}
+
+// the in-process runtime (-t), see tasks.h: a local target mirrored by steps
+// run on the pool threads instead of a forked worker's loop
+typedef struct
+{
+    size_t index;  // in g_list
+    char* src;
+    char* dst;
+    char* src_real;
+    char* dst_real;
+    int resume;
+    WorkerStats* stats;
+    const Filter* filter;
+    TierLog* tier;
+    Mirror mirror;
+    // what a forked worker keeps in globals, held here between steps
+    QuarantineList quarantine;
+    pid_t scrub_pid;
+} MirrorTask;
+
+// makes the calling pool thread look like the task's worker for one step
+static void task_enter(Task* task, MirrorTask* mt)
+{
+    g_task = task;
+    g_stop = task_cancel_flag(task);
+    g_stats = mt->stats;
+    g_filter = mt->filter;
+    g_quarantine = mt->quarantine;
+    g_scrub_pid = mt->scrub_pid;
+    g_polls = &mt->mirror.polls;
+    g_durable = mt->mirror.durable.fd >= 0 ? &mt->mirror.durable : NULL;
+    g_tails = &mt->mirror.tails;
+    g_trash = mt->mirror.trash.dir ? &mt->mirror.trash : NULL;
+    g_echoes = &mt->mirror.echoes;
+    g_tier = mt->tier;
+}
+
+static void task_leave(MirrorTask* mt)
+{
+    mt->quarantine = g_quarantine;
+    mt->scrub_pid = g_scrub_pid;
+    memset(&g_quarantine, 0, sizeof(g_quarantine));
+    g_scrub_pid = 0;
+    g_polls = NULL;
+    g_durable = NULL;
+    g_tails = NULL;
+    g_trash = NULL;
+    g_echoes = NULL;
+    g_tier = NULL;
+    g_filter = NULL;
+    g_stats = NULL;
+    g_stop = &g_child_exit;
+    g_task = NULL;
+}
+
+// the same as child_loop up to its loop; 1 ends the task cleanly
+static int task_start(Task* task, void* arg)
+{
+    MirrorTask* mt = arg;
+    task_enter(task, mt);
+
+    char path[PATH_MAX];
+    int ret = 1;
+    if (norm_existing_dir(mt->src, path) < 0 || !(mt->src_real = strdup(path)) || create_empty_dir(mt->dst) ||
+        !realpath(mt->dst, path) || !(mt->dst_real = strdup(path)))
+    {
+        stats_set_phase(PHASE_STOPPED);
+    }
+    else
+    {
+        ret = mirror_begin(&mt->mirror, -1, mt->src_real, mt->dst_real, mt->resume);
+        if (ret == 0)
+        {
+            mirror_tick(&mt->mirror);
+            task_set_tick(task, mirror_tick_ms(&mt->mirror));
+        }
+        else
+        {
+            stats_set_phase(PHASE_STOPPED);
+        }
+    }
+    task_leave(mt);
+    return ret;
+}
+
+static int task_events(Task* task, void* arg, char* buf, size_t len)
+{
+    MirrorTask* mt = arg;
+    task_enter(task, mt);
+    int ret = mirror_apply(&mt->mirror, buf, (ssize_t)len);
+    if (ret == 0)
+    {
+        mirror_tick(&mt->mirror);
+        if (mt->mirror.pm.count || mt->mirror.durable.pending)
+            task_set_tick(task, mirror_tick_ms(&mt->mirror));
+    }
+    task_leave(mt);
+    return ret;
+}
+
+static int task_tick(Task* task, void* arg)
+{
+    MirrorTask* mt = arg;
+    task_enter(task, mt);
+    mirror_tick(&mt->mirror);
+    task_set_tick(task, mirror_tick_ms(&mt->mirror));
+    task_leave(mt);
+    return 0;
+}
+
+static void task_stop(Task* task, void* arg)
+{
+    MirrorTask* mt = arg;
+    task_enter(task, mt);
+    mirror_end(&mt->mirror);
+    stats_set_phase(PHASE_STOPPED);
+    task_leave(mt);
+}
+
+static const TaskOps g_mirror_task_ops = {task_start, task_events, task_tick, task_stop};
+
+static void mirror_task_free(void* arg)
+{
+    MirrorTask* mt = arg;
+    free(mt->src);
+    free(mt->dst);
+    free(mt->src_real);
+    free(mt->dst_real);
+    free(mt);
+}
+
+// a task ended, on the control loop: the same as a worker exiting
+static void task_finished(void* arg, int failed)
+{
+    MirrorTask* mt = arg;
+    Backup* b = &g_list.backups[mt->index];
+    b->task = NULL;
+    mirror_task_free(mt);
+    worker_exited(b, failed);
+}
+
+// a task that ended with the daemon; its backup stays active in the registry
+static void task_discard(void* arg, int failed) { mirror_task_free(arg); }
+
+static void on_tasks_done(int fd, void* arg) { tasks_reap(task_finished); }
+
+static int start_task(size_t index, int resume)
+{
+    Backup* b = &g_list.backups[index];
+    MirrorTask* mt = calloc(1, sizeof(*mt));
+    if (!mt || !(mt->src = strdup(b->src)) || !(mt->dst = strdup(b->dst)))
+    {
+        perror("calloc(task)");
+        if (mt)
+            mirror_task_free(mt);
+        return -1;
+    }
+    mt->index = index;
+    mt->resume = resume;
+    mt->mirror.durable.fd = -1;
+    mt->stats = b->stats;
+    mt->filter = b->filter;
+    mt->tier = b->tier_log;
+
+    b->task = tasks_spawn(&g_mirror_task_ops, mt);
+    if (!b->task)
+    {
+        mirror_task_free(mt);
+        return -1;
+    }
+    b->pid = 0;
+    b->active = 1;
+    b->started_at = time(NULL);
+    b->restart_at = 0;
+    b->stop_requested = 0;
+    return 0;
+}
+
+// spawning
+static int start_worker(size_t index, int resume)
+{
+    Backup* b = &g_list.backups[index];
+    stats_worker_started(b->stats);
+
+    // stream targets keep their forked worker, their loop also waits on the
+    // socket; so do tier secondaries, which follow a log instead of inotify
+    if (g_threads > 0 && !stream_is_target(b->dst) && !b->upstream)
+    {
+        return start_task(index, resume);
+    }
+    int primary = b->upstream ? find_backup(b->src, b->upstream) : -1;
+    if (b->upstream && (primary < 0 || !g_list.backups[primary].tier_log))
+    {
+        fprintf(stderr, "no primary target \"%s\" for dst=\"%s\"\n", b->upstream, b->dst);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        control_after_fork();
+        g_stats = b->stats;
+        g_filter = b->filter;
+        g_tier = b->tier_log;
+        if (b->upstream)
+            tier_child_loop(b->upstream, b->dst, g_list.backups[primary].tier_log);
+        child_loop(b->src, b->dst, resume);
+        _exit(EXIT_SUCCESS);
+    }
+
+    if (pidmap_put(&g_pids, pid, index) < 0)
+    {
+        // an exit we could not match would leave the backup stuck as active
+        if (kill(pid, SIGKILL) < 0)
+        {
+            perror("kill");
+        }
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    b->pid = pid;
+    b->active = 1;
+    b->started_at = time(NULL);
+    b->restart_at = 0;
+    b->stop_requested = 0;
+    b->pidfd = -1;
+    if (g_pidfd_supported)
+    {
+        int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+        if (fd < 0 || control_watch_fd(fd, on_pidfd_ready, (void*)(intptr_t)pid) < 0)
+        {
+            perror("pidfd_open");
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            // every worker is reaped on SIGCHLD from now on
+            g_pidfd_supported = 0;
+        }
+        else
+        {
+            b->pidfd = fd;
+        }
+    }
+    return 0;
+}
+
+// rules are "-pattern"/"+pattern" strings, see filter.h
+static Filter* build_filter(char* const rules[], size_t count)
+{
+    if (count == 0)
+    {
+        return NULL;
+    }
+    Filter* filter = filter_new();
+    if (!filter)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (filter_add(filter, rules[i]) < 0)
+        {
+            filter_free(filter);
+            return NULL;
+        }
+    }
+    return filter;
+}
+
+// primary: dst feeds --tiered secondaries; upstream: dst is a secondary of that primary
+static int spawn_backup(char* src, char* dst, char* const rules[], size_t rule_count, int primary,
+                        const char* upstream)
+{
+    if (ensure_capacity(&g_list, g_list.backups_count + 1) < 0)
+    {
+        return -1;
+    }
+
+    Backup* b = &g_list.backups[g_list.backups_count];
+    memset(b, 0, sizeof(*b));
+    b->src = strdup(src);
+    b->dst = strdup(dst);
+    b->stats = stats_create();
+    b->pidfd = -1;
+    b->created_at = time(NULL);
+    b->backoff = RESTART_BACKOFF_MIN;
+    b->filter = build_filter(rules, rule_count);
+    b->tier_log = primary ? tier_log_create() : NULL;
+    b->upstream = upstream ? strdup(upstream) : NULL;
+    if (!b->src || !b->dst || !b->stats || (rule_count > 0 && !b->filter) || (primary && !b->tier_log) ||
+        (upstream && !b->upstream) || start_worker(g_list.backups_count, 0) < 0)
+    {
+        free_backup(b);
+        return -1;
+    }
+    g_list.backups_count++;
+    return 0;
+}
+
+// restarts crashed workers whose backoff has elapsed; they resume from what the
+// previous worker already mirrored instead of copying everything again
+void restart_due_workers(void)
+{
+    time_t now = time(NULL);
+    for (size_t i = 0; i < g_list.backups_count; i++)
+    {
+        Backup* b = &g_list.backups[i];
+        if (b->active || !b->restart_at || now < b->restart_at)
+        {
+            continue;
+        }
+        b->restarts++;
+        if (start_worker(i, 1) < 0)
+        {
+            b->restart_at = now + b->backoff;
+            b->backoff = (b->backoff * 2 > RESTART_BACKOFF_MAX) ? RESTART_BACKOFF_MAX : b->backoff * 2;
+            continue;
+        }
+        fprintf(stderr, "restarted worker for src=\"%s\" dst=\"%s\" (restart #%d)\n", b->src, b->dst,
+                b->restarts);
+    }
+}
+
+// writes the registry with every target's sync watermark to the state file
+void registry_save(void)
+{
+    g_state_dirty = 0;
+    if (!g_state_path)
+    {
+        return;
+    }
+
+    StateEntry* entries = calloc(g_list.backups_count ? g_list.backups_count : 1, sizeof(*entries));
+    if (!entries)
+    {
+        perror("calloc(state)");
+        g_state_dirty = 1;
+        return;
+    }
+    for (size_t i = 0; i < g_list.backups_count; i++)
+    {
+        Backup* b = &g_list.backups[i];
+        entries[i].src = b->src;
+        entries[i].dst = b->dst;
+        entries[i].upstream = b->upstream;
+        entries[i].created_at = b->created_at;
+        entries[i].synced_ns = atomic_load_explicit(&b->stats->synced_ns, memory_order_relaxed);
+        // a backup being ended is not brought back on the next start
+        entries[i].active = (b->active && !b->stop_requested) || b->restart_at != 0;
+        entries[i].rule_count = filter_count(b->filter);
+        if (entries[i].rule_count > 0)
+        {
+            entries[i].rules = malloc(entries[i].rule_count * sizeof(char*));
+            if (!entries[i].rules)
+            {
+                perror("malloc(state)");
+                entries[i].rule_count = 0;
+                g_state_dirty = 1;
+            }
+            for (size_t r = 0; entries[i].rules && r < entries[i].rule_count; r++)
+                entries[i].rules[r] = (char*)filter_rule(b->filter, r);
+        }
+    }
+    // saving without the rules would silently widen the backup on the next start
+    if (g_state_dirty || state_save(g_state_path, entries, g_list.backups_count) < 0)
+    {
+        g_state_dirty = 1;
+    }
+    else
+    {
+        for (size_t i = 0; i < g_list.backups_count; i++)
+            g_list.backups[i].saved_synced_ns = entries[i].synced_ns;
+    }
+    g_state_saved_at = time(NULL);
+    for (size_t i = 0; i < g_list.backups_count; i++)
+        free(entries[i].rules);
+    free(entries);
+}
+
+// Rebuilds the registry from the state file and restarts every backup that was
+// active. Workers resume from the existing mirror (see initial_sync), so a warm
+// start costs a metadata walk plus whatever changed while the daemon was down.
+int registry_load(void)
+{
+    if (!g_state_path)
+    {
+        return 0;
+    }
+
+    StateEntry* entries;
+    size_t count;
+    if (state_load(g_state_path, &entries, &count) < 0)
+    {
+        return -1;
+    }
+
+    g_warm_start_ns = stats_now_ns();
+    for (size_t i = 0; i < count; i++)
+    {
+        if (ensure_capacity(&g_list, g_list.backups_count + 1) < 0)
+        {
+            state_free(entries, count);
+            return -1;
+        }
+        Backup* b = &g_list.backups[g_list.backups_count];
+        memset(b, 0, sizeof(*b));
+        // a target some secondary replicates from gets its change log back
+        int primary = 0;
+        for (size_t j = 0; j < count && !primary; j++)
+        {
+            primary = entries[j].upstream && strcmp(entries[j].upstream, entries[i].dst) == 0 &&
+                      strcmp(entries[j].src, entries[i].src) == 0;
+        }
+        b->src = entries[i].src;
+        b->dst = entries[i].dst;
+        b->upstream = entries[i].upstream;
+        entries[i].src = entries[i].dst = entries[i].upstream = NULL;
+        b->tier_log = primary ? tier_log_create() : NULL;
+        b->stats = stats_create();
+        b->pidfd = -1;
+        b->created_at = entries[i].created_at;
+        b->backoff = RESTART_BACKOFF_MIN;
+        b->saved_synced_ns = entries[i].synced_ns;
+        b->filter = build_filter(entries[i].rules, entries[i].rule_count);
+        if (!b->stats || (entries[i].rule_count > 0 && !b->filter) || (primary && !b->tier_log))
+        {
+            fprintf(stderr, "dropping backup src=\"%s\" dst=\"%s\" from the state file\n", b->src, b->dst);
+            free_backup(b);
+            continue;
+        }
+        atomic_store_explicit(&b->stats->synced_ns, entries[i].synced_ns, memory_order_relaxed);
+        atomic_store_explicit(&b->stats->phase, PHASE_STOPPED, memory_order_relaxed);
+        g_list.backups_count++;
+
+        if (entries[i].active)
+        {
+            if (start_worker(g_list.backups_count - 1, 1) < 0)
+            {
+                // retried from the tick like any other failed worker
+                b->restart_at = time(NULL) + b->backoff;
+                continue;
+            }
+            g_warm_pending++;
+        }
+    }
+    state_free(entries, count);
+    if (count > 0)
+    {
+        fprintf(stderr, "loaded %zu backups from %s\n", g_list.backups_count, g_state_path);
+    }
+    return 0;
+}
+
+// the control loop is up; with -t the runtime has to be as well before the
+// registry brings its backups back
+static int daemon_started(void)
+{
+    if (g_threads > 0 &&
+        (tasks_start(g_threads) < 0 || control_watch_fd(tasks_done_fd(), on_tasks_done, NULL) < 0))
+    {
+        return -1;
+    }
+    return registry_load();
+}
+
+// Reports time-to-protected once every resumed worker has caught up and
+// watches its tree: from daemon start to the last of them becoming protected.
+static void warm_start_check(void)
+{
+    long long last = 0;
+    size_t protected_count = 0;
+    for (size_t i = 0; i < g_list.backups_count; i++)
+    {
+        Backup* b = &g_list.backups[i];
+        long long p = atomic_load_explicit(&b->stats->protected_ns, memory_order_relaxed);
+        if (!b->active || p == 0)
+            continue;
+        long long at = atomic_load_explicit(&b->stats->started_ns, memory_order_relaxed) + p;
+        if (at > last)
+            last = at;
+        protected_count++;
+    }
+    if (protected_count < g_warm_pending)
+    {
+        return;
+    }
+    fprintf(stderr, "warm start: %zu backups protected after %.3fs\n", protected_count,
+            (double)(last - g_warm_start_ns) / 1e9);
+    g_warm_pending = 0;
+}
+
+// housekeeping run from the control loop timer
+void supervise_tick(void)
+{
+    enforce_stop_deadlines();
+    restart_due_workers();
+    if (g_warm_pending)
+    {
+        warm_start_check();
+    }
+
+    if (!g_state_path)
+    {
+        return;
+    }
+    int changed = g_state_dirty;
+    for (size_t i = 0; !changed && i < g_list.backups_count; i++)
+    {
+        Backup* b = &g_list.backups[i];
+        changed = atomic_load_explicit(&b->stats->synced_ns, memory_order_relaxed) != b->saved_synced_ns;
+    }
+    if (g_state_dirty || (changed && time(NULL) - g_state_saved_at >= STATE_SAVE_SECONDS))
+    {
+        registry_save();
+    }
+}
+
+// commands
+void cmd_help(void)
+{
+    fprintf(g_out, "Commands:\n");
+    fprintf(g_out, "  add [--tiered] [--exclude pattern] [--include pattern] [--poll pattern] <source> <target1> "
+                   "[target2 ...]\n");
+    fprintf(g_out, "      a target is a directory or a receiver: stream://host:port or unix:/path\n");
+    fprintf(g_out, "      --poll: matching directories are scanned every -p seconds instead of watched\n");
+    fprintf(g_out, "      --tiered: only target1 reads the source, the others replicate from target1\n");
+    fprintf(g_out, "  end <source> <target1> [target2 ...]\n");
+    fprintf(g_out, "  list\n");
+    fprintf(g_out, "  stats [--json]\n");
+    fprintf(g_out, "  latency [--json]\n");
+    fprintf(g_out, "  restore <source> <target>\n");
+    fprintf(g_out, "  verify [--content] [--dry-run] <source> <target>\n");
+    fprintf(g_out, "  exit\n");
+}
+
+void cmd_list()
+{
+    reap_children();
+    if (g_list.backups_count == 0)
+    {
+        fprintf(g_out, "(no active backups)\n");
+        return;
+    }
+
+    for (size_t i = 0; i < g_list.backups_count; i++)
+    {
+        if (g_list.backups[i].active)
+        {
+            fprintf(g_out, "%s ", g_list.backups[i].stop_requested ? "[STOPPING]" : "[ACTIVE]");
+            if (g_list.backups[i].task)
+                fprintf(g_out, "task");
+            else
+                fprintf(g_out, "pid=%d", (int)g_list.backups[i].pid);
+            fprintf(g_out, " src=\"%s\" dst=\"%s\"", g_list.backups[i].src, g_list.backups[i].dst);
+            if (g_list.backups[i].restarts > 0)
+                fprintf(g_out, " restarts=%d", g_list.backups[i].restarts);
+            fputc('\n', g_out);
+        }
+        else if (g_list.backups[i].restart_at)
+        {
+            long wait = (long)(g_list.backups[i].restart_at - time(NULL));
+            fprintf(g_out, "[RESTARTING in %lds] src=\"%s\" dst=\"%s\" restarts=%d\n", wait > 0 ? wait : 0,
+                    g_list.backups[i].src, g_list.backups[i].dst, g_list.backups[i].restarts);
+        }
+        else
+        {
+            fprintf(g_out, "[ENDED] src=\"%s\" dst=\"%s\"\n", g_list.backups[i].src, g_list.backups[i].dst);
+        }
+
+        size_t rules = filter_count(g_list.backups[i].filter);
+        if (rules > 0)
+        {
+            fprintf(g_out, "    rules:");
+            for (size_t r = 0; r < rules; r++)
+                fprintf(g_out, " %s", filter_rule(g_list.backups[i].filter, r));
+            fputc('\n', g_out);
+        }
+    }
+}
+
+void print_json_string(const char* s)
+{
+    fputc('"', g_out);
+    for (const unsigned char* p = (const unsigned char*)s; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            fprintf(g_out, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(g_out, "\\u%04x", *p);
+        else
+            fputc(*p, g_out);
+    }
+    fputc('"', g_out);
 }
 
-// spawning
-static int spawn_backup(char* src, char* dst)
+void cmd_stats(char* argv[], int argc)
 {
-    pid_t pid = fork();
-    if (pid < 0)
+    int json = 0;
+    if (argc == 2 && strcmp(argv[1], "--json") == 0)
     {
-        perror("fork");
-        return -1;
+        json = 1;
+    }
+    else if (argc != 1)
+    {
+        fprintf(g_out, "usage: stats [--json]\n");
+        return;
     }
 
-    if (pid == 0)
+    reap_children();
+    if (!json && g_list.backups_count == 0)
     {
-        child_loop(src, dst);
-        _exit(EXIT_SUCCESS);
+        fprintf(g_out, "(no active backups)\n");
+        return;
     }
 
-    if (ensure_capacity(&g_list, g_list.backups_count + 1) < 0)
+    // --json prints one object per backup per line so that it can be consumed with line based tools
+    for (size_t i = 0; i < g_list.backups_count; i++)
     {
-        if (kill(pid, SIGTERM) < 0)
+        Backup* b = &g_list.backups[i];
+        if (json)
         {
-            perror("kill");
+            fprintf(g_out, "{\"pid\":%d,\"active\":%d,\"src\":", (int)b->pid, b->active);
+            print_json_string(b->src);
+            fprintf(g_out, ",\"dst\":");
+            print_json_string(b->dst);
+            if (b->tier_log || b->upstream)
+            {
+                fprintf(g_out, ",\"tier\":\"%s\",\"upstream\":", b->tier_log ? "primary" : "secondary");
+                if (b->upstream)
+                    print_json_string(b->upstream);
+                else
+                    fprintf(g_out, "null");
+            }
+            fprintf(g_out, ",");
+            stats_print_json(g_out, b->stats);
+            fprintf(g_out, "}\n");
+            continue;
         }
-        return -1;
-    }
 
-    Backup new_backup;
-    new_backup.src = strdup(src);
-    new_backup.dst = strdup(dst);
-    new_backup.pid = pid;
-    new_backup.created_at = time(NULL);
-    new_backup.active = 1;
-
-    g_list.backups[g_list.backups_count++] = new_backup;
-    return 0;
+        if (b->active && b->task)
+            fprintf(g_out, "[ACTIVE] task src=\"%s\" dst=\"%s\"\n", b->src, b->dst);
+        else if (b->active)
+            fprintf(g_out, "[ACTIVE] pid=%d src=\"%s\" dst=\"%s\"\n", (int)b->pid, b->src, b->dst);
+        else
+            fprintf(g_out, "[ENDED] src=\"%s\" dst=\"%s\"\n", b->src, b->dst);
+        if (b->tier_log || b->upstream)
+        {
+            // how far behind the source this tier's target is
+            long long synced = atomic_load_explicit(&b->stats->synced_ns, memory_order_relaxed);
+            if (b->upstream)
+                fprintf(g_out, "    tier: secondary of \"%s\"", b->upstream);
+            else
+                fprintf(g_out, "    tier: primary");
+            if (synced > 0)
+                fprintf(g_out, " lag=%.3fs\n", (double)(stats_realtime_ns() - synced) / 1e9);
+            else
+                fprintf(g_out, " lag=unknown\n");
+        }
+        stats_print(g_out, b->stats);
+    }
 }
 
-// commands
-void cmd_help(void)
+void cmd_latency(char* argv[], int argc)
 {
-    printf("Commands:\n");
-    printf("  add <source> <target1> [target2 ...]\n");
-    printf("  end <source> <target1> [target2 ...]\n");
-    printf("  list\n");
-    printf("  restore <source> <target>\n");
-    printf("  exit\n");
-}
+    int json = 0;
+    if (argc == 2 && strcmp(argv[1], "--json") == 0)
+    {
+        json = 1;
+    }
+    else if (argc != 1)
+    {
+        fprintf(g_out, "usage: latency [--json]\n");
+        return;
+    }
 
-void cmd_list()
-{
     reap_children();
-    if (g_list.backups_count == 0)
+    if (!json && g_list.backups_count == 0)
     {
-        printf("(no active backups)\n");
+        fprintf(g_out, "(no active backups)\n");
         return;
     }
 
     for (size_t i = 0; i < g_list.backups_count; i++)
     {
-        if (g_list.backups[i].active)
+        Backup* b = &g_list.backups[i];
+        if (json)
         {
-            printf("[ACTIVE] pid=%d src=\"%s\" dst=\"%s\"\n", (int)g_list.backups[i].pid, g_list.backups[i].src,
-                   g_list.backups[i].dst);
-        }
-        else
-        {
-            printf("[ENDED] src=\"%s\" dst=\"%s\"\n", g_list.backups[i].src, g_list.backups[i].dst);
+            fprintf(g_out, "{\"pid\":%d,\"active\":%d,\"src\":", (int)b->pid, b->active);
+            print_json_string(b->src);
+            fprintf(g_out, ",\"dst\":");
+            print_json_string(b->dst);
+            fprintf(g_out, ",");
+            stats_print_latency_json(g_out, b->stats);
+            fprintf(g_out, "}\n");
+            continue;
         }
+
+        fprintf(g_out, "%s src=\"%s\" dst=\"%s\"\n", b->active ? "[ACTIVE]" : "[ENDED]", b->src, b->dst);
+        stats_print_latency(g_out, b->stats);
     }
 }
 
-void cmd_add(char* argv[], int argc)
+// argv[0] is the source, the rest are targets; every target gets the same rules.
+// With tiered, the first target is the primary and the others its secondaries.
+void add_targets(char* argv[], int argc, char* rules[], size_t rule_count, int tiered)
 {
-    if (argc < 3)
+    for (size_t r = 0; r < rule_count; r++)
     {
-        printf("usage: add <source> <target1> [target2 ...]\n");
-        return;
+        Filter* check = build_filter(&rules[r], 1);
+        if (!check)
+        {
+            fprintf(g_out, "add: invalid pattern \"%s\"\n", rules[r] + 1);
+            return;
+        }
+        filter_free(check);
     }
 
     char src_norm[PATH_MAX];
-    if (norm_existing_dir(argv[1], src_norm) < 0)
+    if (norm_existing_dir(argv[0], src_norm) < 0)
     {
-        printf("add: invalid source\n");
+        fprintf(g_out, "add: invalid source\n");
         return;
     }
+    static const char* const reserved[] = {QUARANTINE_NAME, TRASH_NAME};
+    for (size_t r = 0; r < sizeof(reserved) / sizeof(reserved[0]); r++)
+    {
+        char path[PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", src_norm, reserved[r]) < (int)sizeof(path) &&
+            lstat(path, &st) == 0)
+        {
+            fprintf(g_out, "add: source holds \"%s\", a name reserved for the target that would not be mirrored\n",
+                    path);
+            return;
+        }
+    }
 
-    for (int i = 2; i < argc; i++)
+    char primary[PATH_MAX] = "";
+    for (int i = 1; i < argc; i++)
     {
+        if (tiered && i > 1 && primary[0] == '\0')
+        {
+            fprintf(g_out, "add: no primary target, the others are not added\n");
+            return;
+        }
         char dst_norm[PATH_MAX];
         if (norm_target_path(argv[i], dst_norm) < 0)
         {
-            printf("add: invalid target \"%s\"\n", argv[i]);
+            fprintf(g_out, "add: invalid target \"%s\"\n", argv[i]);
+            continue;
+        }
+        if (tiered && stream_is_target(dst_norm))
+        {
+            fprintf(g_out, "add: tiered targets have to be directories \"%s\"\n", dst_norm);
             continue;
         }
 
         if (has_prefix_path(dst_norm, src_norm))
         {
-            fprintf(stderr, "add: target is inside source (or same): src=\"%s\" dst=\"%s\"\n", src_norm, dst_norm);
+            fprintf(g_out, "add: target is inside source (or same): src=\"%s\" dst=\"%s\"\n", src_norm, dst_norm);
             continue;
         }
         if (find_backup(src_norm, dst_norm) >= 0)
         {
-            printf("add: already active src=\"%s\" dst=\"%s\"\n", src_norm, dst_norm);
+            fprintf(g_out, "add: already active src=\"%s\" dst=\"%s\"\n", src_norm, dst_norm);
             continue;
         }
-        if (ensure_empty_dir(dst_norm) < 0)
+        if (!stream_is_target(dst_norm) && ensure_empty_dir(dst_norm) < 0)
         {
-            perror("add: target invalid");
+            fprintf(g_out, "add: target invalid \"%s\": %s\n", dst_norm, strerror(errno));
             continue;
         }
-        if (spawn_backup(src_norm, dst_norm) >= 0)
+        int is_primary = tiered && primary[0] == '\0';
+        if (spawn_backup(src_norm, dst_norm, rules, rule_count, is_primary,
+                         tiered && !is_primary ? primary : NULL) >= 0)
         {
-            printf("added src=\"%s\" -> dst=\"%s\"\n", src_norm, dst_norm);
+            g_state_dirty = 1;
+            if (is_primary)
+                snprintf(primary, sizeof(primary), "%s", dst_norm);
+            if (tiered)
+                fprintf(g_out, "added src=\"%s\" -> dst=\"%s\" (%s)\n", src_norm, dst_norm,
+                        is_primary ? "primary" : "secondary");
+            else
+                fprintf(g_out, "added src=\"%s\" -> dst=\"%s\"\n", src_norm, dst_norm);
         }
         else
         {
-            printf("add failed for dst=\"%s\"\n", dst_norm);
+            fprintf(g_out, "add failed for dst=\"%s\"\n", dst_norm);
+        }
+    }
+}
+
+void cmd_add(char* argv[], int argc)
+{
+    // leading --exclude/--include/--poll options become "-pattern"/"+pattern"/"~pattern" rules
+    char* rules[MAX_ARGS];
+    size_t rule_count = 0;
+    int first = 1;
+    int tiered = 0;
+    while (first < argc)
+    {
+        if (strcmp(argv[first], "--tiered") == 0)
+        {
+            tiered = 1;
+            first++;
+            continue;
+        }
+        if (first + 1 >= argc || (strcmp(argv[first], "--exclude") != 0 && strcmp(argv[first], "--include") != 0 &&
+                                  strcmp(argv[first], "--poll") != 0))
+        {
+            break;
+        }
+        size_t len = strlen(argv[first + 1]);
+        char* rule = malloc(len + 2);
+        if (!rule)
+        {
+            perror("malloc(rule)");
+            break;
         }
+        rule[0] = (argv[first][2] == 'e') ? '-' : (argv[first][2] == 'i') ? '+' : '~';
+        memcpy(rule + 1, argv[first + 1], len + 1);
+        rules[rule_count++] = rule;
+        first += 2;
+    }
+
+    if (argc - first < 2)
+        fprintf(g_out, "usage: add [--tiered] [--exclude pattern] [--include pattern] [--poll pattern] <source> "
+                       "<target1> [target2 ...]\n");
+    else
+        add_targets(argv + first, argc - first, rules, rule_count, tiered);
+
+    for (size_t r = 0; r < rule_count; r++)
+        free(rules[r]);
+}
+
+// stops one backup's worker, keeping its target for restore
+static void end_backup(int index)
+{
+    if (!g_list.backups[index].active && g_list.backups[index].restart_at)
+    {
+        g_list.backups[index].restart_at = 0;
+        g_state_dirty = 1;
+        fprintf(g_out, "ended src=\"%s\" dst=\"%s\" (pending restart cancelled)\n", g_list.backups[index].src,
+                g_list.backups[index].dst);
+        return;
+    }
+
+    if (!g_list.backups[index].active)
+    {
+        fprintf(g_out, "end: already ended src=\"%s\" dst=\"%s\"\n", g_list.backups[index].src,
+                g_list.backups[index].dst);
+        return;
+    }
+
+    if (g_list.backups[index].stop_requested)
+    {
+        fprintf(g_out, "end: already ending src=\"%s\" dst=\"%s\"\n", g_list.backups[index].src,
+                g_list.backups[index].dst);
+        return;
+    }
+
+    // the worker is reaped from the control loop once SIGCHLD arrives, so
+    // other clients are not held up while it finishes its current copy
+    if (g_list.backups[index].task)
+    {
+        tasks_cancel(g_list.backups[index].task);
+    }
+    else if (kill(g_list.backups[index].pid, SIGTERM) < 0)
+    {
+        perror("kill");
     }
+    g_list.backups[index].stop_requested = time(NULL);
+    g_state_dirty = 1;
+
+    fprintf(g_out, "ending src=\"%s\" dst=\"%s\" (backup kept for restore)\n", g_list.backups[index].src,
+            g_list.backups[index].dst);
 }
 
 void cmd_end(char* argv[], int argc)
 {
     if (argc < 3)
     {
-        printf("usage: end <source> <target1> <target2> ...\n");
+        fprintf(g_out, "usage: end <source> <target1> <target2> ...\n");
         return;
     }
 
     char src_norm[PATH_MAX];
     if (norm_existing_dir(argv[1], src_norm) < 0)
     {
-        printf("add: invalid source\n");
+        fprintf(g_out, "add: invalid source\n");
         return;
     }
 
@@ -1655,35 +5409,151 @@ void cmd_end(char* argv[], int argc)
         char dst_norm[PATH_MAX];
         if (norm_target_path(argv[i], dst_norm) < 0)
         {
-            printf("add: invalid target \"%s\"\n", argv[i]);
+            fprintf(g_out, "add: invalid target \"%s\"\n", argv[i]);
             continue;
         }
         int index = find_backup(src_norm, dst_norm);
         if (index < 0)
         {
-            printf("end: not found src=\"%s\" dst=\"%s\"\n", src_norm, dst_norm);
+            fprintf(g_out, "end: not found src=\"%s\" dst=\"%s\"\n", src_norm, dst_norm);
             continue;
         }
 
-        if (!g_list.backups[index].active)
+        end_backup(index);
+        // its secondaries would only wait for a primary that no longer runs
+        for (size_t j = 0; j < g_list.backups_count; j++)
         {
-            printf("end: already ended src=\"%s\" dst=\"%s\"\n", g_list.backups[index].src, g_list.backups[index].dst);
-            continue;
+            Backup* b = &g_list.backups[j];
+            if (b->upstream && b->active && !b->stop_requested && strcmp(b->upstream, g_list.backups[index].dst) == 0 &&
+                strcmp(b->src, g_list.backups[index].src) == 0)
+            {
+                end_backup((int)j);
+            }
         }
+    }
+}
 
-        if (kill(g_list.backups[index].pid, SIGTERM) < 0)
+// Answers the client waiting for w's restore once the worker published its
+// outcome or is gone; returns 1 when the restore is no longer pending.
+static int restore_check(Backup* w)
+{
+    char reply[2 * PATH_MAX + 128];
+    if (atomic_load_explicit(&w->stats->restore_done, memory_order_acquire) == w->restore_seq)
+    {
+        if (atomic_load_explicit(&w->stats->restore_failed, memory_order_relaxed))
         {
-            perror("kill");
+            snprintf(reply, sizeof(reply), "restore: failed for src=\"%s\" from backup=\"%s\"\n", w->src,
+                     w->stats->restore_from);
+        }
+        else
+        {
+            snprintf(reply, sizeof(reply), "restored src=\"%s\" from backup=\"%s\" copied=%llu unchanged=%llu\n",
+                     w->src, w->stats->restore_from,
+                     atomic_load_explicit(&w->stats->restore_copied, memory_order_relaxed),
+                     atomic_load_explicit(&w->stats->restore_unchanged, memory_order_relaxed));
+        }
+    }
+    else
+    {
+        // a worker that is gone will not answer; the request is withdrawn
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        int gone = !w->active || atomic_load_explicit(&w->stats->phase, memory_order_relaxed) == PHASE_STOPPED;
+        if (!gone && w->pid > 0)
+        {
+            gone = waitid(P_PID, (id_t)w->pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid != 0;
         }
-        if (waitpid(g_list.backups[index].pid, NULL, 0) < 0)
+        if (!gone)
+        {
+            return 0;
+        }
+        atomic_store_explicit(&w->stats->restore_done, w->restore_seq, memory_order_relaxed);
+        snprintf(reply, sizeof(reply), "restore: the worker of src=\"%s\" dst=\"%s\" stopped, retry\n", w->src,
+                 w->dst);
+    }
+    w->restore_seq = 0;
+    control_resume(w->restore_reply, reply);
+    w->restore_reply = 0;
+    return 1;
+}
+
+static void restore_timer_arm(long long interval_ms)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_nsec = interval_ms * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(g_restore_timer, 0, &its, NULL) < 0)
+    {
+        perror("timerfd_settime(restore)");
+    }
+}
+
+static void on_restore_timer(int fd, void* arg)
+{
+    (void)arg;
+    unsigned long long expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < g_list.backups_count && g_restores_pending > 0; i++)
+    {
+        Backup* w = &g_list.backups[i];
+        if (w->restore_seq && restore_check(w))
         {
-            perror("waitpid");
+            g_restores_pending--;
         }
-        g_list.backups[index].active = 0;
-        g_list.backups[index].pid = 0;
+    }
+    if (g_restores_pending == 0)
+    {
+        restore_timer_arm(0);
+    }
+}
 
-        printf("ended src=\"%s\" dst=\"%s\" (backup kept for restore)\n", g_list.backups[index].src,
-               g_list.backups[index].dst);
+// Hands the restore of src_norm from dst_norm to w, the running worker of the
+// source: the worker runs it between two batches of events and goes on
+// mirroring afterwards, see restore_poll. The client is parked until
+// restore_check sees the outcome, so the daemon keeps serving the others.
+static void restore_live(Backup* w, const char* src_norm, const char* dst_norm)
+{
+    if (atomic_load_explicit(&w->stats->phase, memory_order_relaxed) == PHASE_INITIAL_SYNC)
+    {
+        fprintf(g_out, "restore: src=\"%s\" dst=\"%s\" is still in its initial sync, retry once it is done\n",
+                w->src, w->dst);
+        return;
+    }
+    if (w->restore_seq)
+    {
+        fprintf(g_out, "restore: src=\"%s\" is already being restored, retry once it is done\n", src_norm);
+        return;
+    }
+    if (g_restore_timer < 0)
+    {
+        g_restore_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (g_restore_timer < 0 || control_watch_fd(g_restore_timer, on_restore_timer, NULL) < 0)
+        {
+            perror("restore timer");
+            if (g_restore_timer >= 0)
+            {
+                close(g_restore_timer);
+                g_restore_timer = -1;
+            }
+            return;
+        }
+    }
+    snprintf(w->stats->restore_from, sizeof(w->stats->restore_from), "%s", dst_norm);
+    unsigned seq = atomic_load_explicit(&w->stats->restore_request, memory_order_relaxed) + 1;
+    if (seq == 0)
+    {
+        seq = 1;  // 0 stands for no restore pending
+    }
+    atomic_store_explicit(&w->stats->restore_request, seq, memory_order_release);
+    w->restore_seq = seq;
+    w->restore_reply = control_park();
+    if (g_restores_pending++ == 0)
+    {
+        restore_timer_arm(RESTORE_WAIT_MS);
     }
 }
 
@@ -1691,138 +5561,318 @@ void cmd_restore(char* argv[], int argc)
 {
     if (argc != 3)
     {
-        printf("usage: end <source> <target1> <target2> ...\n");
+        fprintf(g_out, "usage: restore <source> <target>\n");
         return;
     }
 
     char src_norm[PATH_MAX];
     if (norm_existing_dir(argv[1], src_norm) < 0)
     {
-        printf("restore: invalid source\n");
+        fprintf(g_out, "restore: invalid source\n");
         return;
     }
 
     char dst_norm[PATH_MAX];
     if (norm_target_path(argv[2], dst_norm) < 0)
     {
-        printf("restore: invalid target \"%s\"\n", argv[2]);
+        fprintf(g_out, "restore: invalid target \"%s\"\n", argv[2]);
         return;
     }
 
     int index = find_backup(src_norm, dst_norm);
     if (index < 0)
     {
-        printf("restore: backup not found for this pair\n");
+        fprintf(g_out, "restore: backup not found for this pair\n");
+        return;
+    }
+    if (stream_is_target(dst_norm))
+    {
+        fprintf(g_out, "restore: the backup is kept by the receiver at %s\n", dst_norm);
         return;
     }
 
-    time_t created_at = g_list.backups[index].created_at;
-    if (g_list.backups[index].active)
+    // a --tiered secondary is restored by the primary's worker, which watches the source
+    Backup* b = &g_list.backups[index];
+    Backup* w = b;
+    if (b->upstream)
     {
-        pid_t pid = g_list.backups[index].pid;
-        if (kill(pid, SIGTERM) < 0)
-        {
-            perror("kill");
-        }
-        if (waitpid(pid, NULL, 0) < 0)
-        {
-            perror("waitpid");
-        }
-        g_list.backups[index].active = 0;
-        g_list.backups[index].pid = 0;
+        int primary = find_backup(b->src, b->upstream);
+        w = primary >= 0 ? &g_list.backups[primary] : NULL;
+    }
+    if (w && w->active && !w->stop_requested)
+    {
+        restore_live(w, src_norm, dst_norm);
+        return;
+    }
+    if (b->active && !b->upstream)
+    {
+        fprintf(g_out, "restore: src=\"%s\" dst=\"%s\" is ending, retry once it stopped\n", src_norm, dst_norm);
+        return;
     }
 
-    if (check_src_against_backup(src_norm, dst_norm) < 0)
+    // nothing mirrors the source: the restore is run right here
+    RestoreCounts counts = {0};
+    g_filter = b->filter;
+    int ret = restore_source(src_norm, dst_norm, &counts);
+    g_filter = NULL;
+    if (ret < 0)
     {
         return;
     }
-    if (apply_backup(dst_norm, src_norm, dst_norm, src_norm, created_at) < 0)
+    fprintf(g_out, "restored src=\"%s\" from backup=\"%s\" copied=%llu unchanged=%llu\n", src_norm, dst_norm,
+            counts.copied, counts.skipped);
+}
+
+// Hands a scrub to the worker of the pair: it compares the target with the
+// source in the background and repairs what drifted, unless --dry-run. The
+// outcome is reported by "stats" once the scrub is done.
+void cmd_verify(char* argv[], int argc)
+{
+    int flags = SCRUB_RUN | SCRUB_REPAIR;
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
     {
-        perror("apply backup");
+        if (strcmp(argv[i], "--content") == 0)
+            flags |= SCRUB_CONTENT;
+        else if (strcmp(argv[i], "--dry-run") == 0)
+            flags &= ~SCRUB_REPAIR;
+        else
+            break;
+    }
+    if (argc - i != 2)
+    {
+        fprintf(g_out, "usage: verify [--content] [--dry-run] <source> <target>\n");
+        return;
+    }
+
+    char src_norm[PATH_MAX];
+    if (norm_existing_dir(argv[i], src_norm) < 0)
+    {
+        fprintf(g_out, "verify: invalid source\n");
+        return;
+    }
+    char dst_norm[PATH_MAX];
+    if (norm_target_path(argv[i + 1], dst_norm) < 0)
+    {
+        fprintf(g_out, "verify: invalid target \"%s\"\n", argv[i + 1]);
+        return;
+    }
+    int index = find_backup(src_norm, dst_norm);
+    if (index < 0)
+    {
+        fprintf(g_out, "verify: backup not found for this pair\n");
+        return;
+    }
+    Backup* b = &g_list.backups[index];
+    if (stream_is_target(b->dst))
+    {
+        fprintf(g_out, "verify: the backup is kept by the receiver at %s\n", b->dst);
+        return;
+    }
+    // an ended backup is kept as it was; the source has moved on since
+    if (!b->active || b->stop_requested)
+    {
+        fprintf(g_out, "verify: src=\"%s\" dst=\"%s\" is not running\n", b->src, b->dst);
         return;
     }
 
-    printf("restored src=\"%s\" from backup=\"%s\"\n", src_norm, dst_norm);
+    atomic_store_explicit(&b->stats->scrub_request, flags, memory_order_relaxed);
+    fprintf(g_out, "verify queued for src=\"%s\" dst=\"%s\" (%s, %s), see stats\n", b->src, b->dst,
+            (flags & SCRUB_CONTENT) ? "content" : "metadata", (flags & SCRUB_REPAIR) ? "repair" : "dry run");
 }
 
-int main()
+// runs one command line on behalf of the control loop; returns 1 on "exit"
+int execute_command(char* line, FILE* out)
 {
-    install_parent_signals();
-    cmd_help();
+    g_out = out;
+
+    char* argv[MAX_ARGS];
+    char args_buf[MAX_ARGS][PATH_MAX];
+    int argc = 0;
 
-    char line[4096];
-    while (!g_terminate)
+    if (parse_line(line, argv, args_buf, &argc) < 0)
+    {
+        fprintf(g_out, "parse error\n");
+        return 0;
+    }
+    if (argc == 0)
     {
-        reap_children();
+        return 0;
+    }
 
-        printf("> ");
-        fflush(stdout);
+    if (strcmp(argv[0], "help") == 0)
+        cmd_help();
+    else if (strcmp(argv[0], "list") == 0)
+        cmd_list();
+    else if (strcmp(argv[0], "stats") == 0)
+        cmd_stats(argv, argc);
+    else if (strcmp(argv[0], "latency") == 0)
+        cmd_latency(argv, argc);
+    else if (strcmp(argv[0], "add") == 0)
+        cmd_add(argv, argc);
+    else if (strcmp(argv[0], "end") == 0)
+        cmd_end(argv, argc);
+    else if (strcmp(argv[0], "restore") == 0)
+        cmd_restore(argv, argc);
+    else if (strcmp(argv[0], "verify") == 0)
+        cmd_verify(argv, argc);
+    else if (strcmp(argv[0], "exit") == 0)
+        return 1;
+    else
+        fprintf(g_out, "unknown command: %s\n", argv[0]);
 
-        errno = 0;
-        if (!fgets(line, sizeof(line), stdin))
-        {
-            if (errno == EINTR)
-            {
-                printf("\n");
-                continue;
-            }
-            break;
-        }
+    // registry changes reach the disk before the reply does
+    if (g_state_dirty)
+        registry_save();
+    return 0;
+}
 
-        char* argv[MAX_ARGS];
-        char args_buf[MAX_ARGS][PATH_MAX];
-        int argc = 0;
+void usage(const char* name)
+{
+    fprintf(stderr,
+            "USAGE: %s [-s control_socket] [-f state_file] [-c seconds] [-b MiB/s] [-t threads] [-n] [-D MiB] [-L] "
+            "[-p seconds] [-d none|periodic|group] [-G changes] [-W ms] [-r entries/s]\n",
+            name);
+    fprintf(stderr, "  -s path  also accept commands on a unix socket at path; every reply ends with a \".\" line\n");
+    fprintf(stderr, "  -f path  keep the backup registry in path and resume its backups on start\n");
+    fprintf(stderr, "  -c secs  scrub every target against its source (content included) every secs seconds\n");
+    fprintf(stderr, "  -b rate  MiB a scrub may read per second, 0 for no limit (default %llu)\n",
+            SCRUB_DEFAULT_RATE >> 20);
+    fprintf(stderr, "  -t n     run backups as tasks on n shared threads instead of a process each\n");
+    fprintf(stderr, "  -n       initial syncs and restores drop the pages they copy from the page cache\n");
+    fprintf(stderr, "  -D size  initial syncs and restores copy files of at least size MiB with O_DIRECT\n");
+    fprintf(stderr, "  -L       initial syncs copy files in the order they lie on disk\n");
+    fprintf(stderr, "  -p secs  scan --poll subtrees, and those no inotify watch was left for, every secs seconds\n");
+    fprintf(stderr, "           (default %d)\n", POLL_DEFAULT_INTERVAL);
+    fprintf(stderr, "  -d mode  when changes reach the targets' disks: none (default), a periodic syncfs, or\n");
+    fprintf(stderr, "           group: one syncfs per batch of changes; the sync watermark waits for it\n");
+    fprintf(stderr, "  -G n     group: changes per batch (default %d)\n", DURABLE_DEFAULT_BATCH);
+    fprintf(stderr, "  -W ms    group: longest a change waits for its sync (default %d); periodic: between\n",
+            DURABLE_DEFAULT_GROUP_WINDOW_MS);
+    fprintf(stderr, "           syncs (default %d)\n", DURABLE_DEFAULT_PERIOD_MS);
+    fprintf(stderr, "  -r rate  entries a target's deleted directories are removed at per second in the\n");
+    fprintf(stderr, "           background, 0 for no limit (default %d)\n", TRASH_DEFAULT_RATE);
+    fprintf(stderr, "       %s receive <address> <directory>\n", name);
+    fprintf(stderr, "  mirror a stream target into directory; address is stream://host:port or unix:/path,\n");
+    fprintf(stderr, "  the same one given to \"add\" as the target\n");
+    exit(EXIT_FAILURE);
+}
 
-        if (parse_line(line, argv, args_buf, &argc) < 0)
-        {
-            printf("parse error\n");
-            continue;
-        }
-        if (argc == 0)
+int main(int argc, char* argv[])
+{
+    const char* socket_path = NULL;
+    int c;
+    char* end;
+    while ((c = getopt(argc, argv, "s:f:c:b:t:nD:Lp:d:G:W:r:")) != -1)
+    {
+        switch (c)
         {
-            continue;
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'f':
+                g_state_path = optarg;
+                break;
+            case 'c':
+                g_scrub_interval = strtoll(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || g_scrub_interval < 0)
+                    usage(argv[0]);
+                break;
+            case 'b':
+                g_scrub_rate = strtoull(optarg, &end, 10) << 20;
+                if (*optarg == '\0' || *end != '\0' || *optarg == '-')
+                    usage(argv[0]);
+                break;
+            case 't':
+                g_threads = (int)strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || g_threads < 1 || g_threads > TASK_MAX_THREADS)
+                    usage(argv[0]);
+                break;
+            case 'n':
+                g_uncached_drop = 1;
+                break;
+            case 'L':
+                g_layout_order = 1;
+                break;
+            case 'p':
+                g_poll_interval = strtoll(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || g_poll_interval < 1)
+                    usage(argv[0]);
+                break;
+            case 'd':
+                g_durable_mode = durable_parse(optarg);
+                if (g_durable_mode < 0)
+                    usage(argv[0]);
+                break;
+            case 'G':
+                g_durable_batch = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || g_durable_batch < 1)
+                    usage(argv[0]);
+                break;
+            case 'W':
+                g_durable_window_ms = strtoll(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || g_durable_window_ms < 1)
+                    usage(argv[0]);
+                break;
+            case 'r':
+                g_trash_rate = strtoull(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || *optarg == '-')
+                    usage(argv[0]);
+                break;
+            case 'D':
+                g_uncached_direct_min = strtoull(optarg, &end, 10) << 20;
+                if (*optarg == '\0' || *end != '\0' || *optarg == '-' || g_uncached_direct_min == 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
         }
-
-        if (strcmp(argv[0], "help") == 0)
-            cmd_help();
-        else if (strcmp(argv[0], "list") == 0)
-            cmd_list();
-        else if (strcmp(argv[0], "add") == 0)
-            cmd_add(argv, argc);
-        else if (strcmp(argv[0], "end") == 0)
-            cmd_end(argv, argc);
-        else if (strcmp(argv[0], "restore") == 0)
-            cmd_restore(argv, argc);
-        else if (strcmp(argv[0], "exit") == 0)
-            break;
-        else
-            printf("unknown command: %s\n", argv[0]);
     }
+    if (optind < argc && strcmp(argv[optind], "receive") == 0)
+    {
+        if (argc - optind != 3)
+            usage(argv[0]);
+        return (receive_main(argv[optind + 1], argv[optind + 2]) < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (optind != argc)
+        usage(argv[0]);
+
+    g_out = stdout;
+    cmd_help();
+
+    ControlHooks hooks = {execute_command, reap_children, supervise_tick, daemon_started};
+    int ret = control_run(socket_path, &hooks);
 
     for (size_t i = 0; i < g_list.backups_count; i++)
     {
-        if (g_list.backups[i].active)
+        if (g_list.backups[i].active && !g_list.backups[i].task)
         {
             kill(g_list.backups[i].pid, SIGTERM);
         }
     }
+    if (g_threads > 0)
+    {
+        tasks_shutdown();
+        tasks_reap(task_discard);
+    }
 
     for (size_t i = 0; i < g_list.backups_count; i++)
     {
-        if (g_list.backups[i].active)
+        if (g_list.backups[i].active && !g_list.backups[i].task)
         {
             if (waitpid(g_list.backups[i].pid, NULL, 0) < 0)
             {
                 perror("waitpid");
             }
-            g_list.backups[i].active = 0;
-            g_list.backups[i].pid = 0;
         }
     }
+    // workers stopped by exit are still wanted, they come back on the next start
+    registry_save();
 
     for (size_t i = 0; i < g_list.backups_count; i++)
         free_backup(&g_list.backups[i]);
     free(g_list.backups);
+    pidmap_free(&g_pids);
 
-    return 0;
+    return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include "moves.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// pool links, wheel heads and hash slots hold entry + 1 so that a zeroed
+// PendingMoves is an empty one
+#define NONE 0
+#define INDEX_DELETED ((size_t)-1)
+
+static size_t cookie_slot(uint32_t cookie, size_t capacity)
+{
+    return (size_t)(((unsigned long long)cookie * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+static long long wheel_tick(long long now_ns) { return now_ns / 1000000LL / MOVE_WHEEL_TICK_MS; }
+
+static int pool_grow(PendingMoves* pm)
+{
+    size_t new_capacity = pm->pool_capacity ? pm->pool_capacity * 2 : 64;
+    PendingMove* moves = realloc(pm->moves, new_capacity * sizeof(*moves));
+    if (!moves)
+    {
+        perror("realloc(pending moves)");
+        return -1;
+    }
+    pm->moves = moves;
+    size_t* next = realloc(pm->next, new_capacity * sizeof(*next));
+    if (!next)
+    {
+        perror("realloc(pending moves)");
+        return -1;
+    }
+    pm->next = next;
+    size_t* prev = realloc(pm->prev, new_capacity * sizeof(*prev));
+    if (!prev)
+    {
+        perror("realloc(pending moves)");
+        return -1;
+    }
+    pm->prev = prev;
+    long long* deadline = realloc(pm->deadline, new_capacity * sizeof(*deadline));
+    if (!deadline)
+    {
+        perror("realloc(pending moves)");
+        return -1;
+    }
+    pm->deadline = deadline;
+
+    for (size_t i = pm->pool_capacity; i < new_capacity; i++)
+    {
+        pm->next[i] = (i + 1 < new_capacity) ? i + 2 : pm->free_head;
+    }
+    pm->free_head = pm->pool_capacity + 1;
+    pm->pool_capacity = new_capacity;
+    return 0;
+}
+
+// hash slot holding cookie, or (size_t)-1
+static size_t index_find(const PendingMoves* pm, uint32_t cookie)
+{
+    if (pm->index_capacity == 0)
+        return (size_t)-1;
+    size_t s = cookie_slot(cookie, pm->index_capacity);
+    while (pm->index[s] != NONE)
+    {
+        if (pm->index[s] != INDEX_DELETED && pm->moves[pm->index[s] - 1].cookie == cookie)
+            return s;
+        s = (s + 1) & (pm->index_capacity - 1);
+    }
+    return (size_t)-1;
+}
+
+// rehashes into a table big enough for the live entries, dropping deleted slots
+static int index_grow(PendingMoves* pm)
+{
+    size_t new_capacity = pm->index_capacity ? pm->index_capacity : 64;
+    if ((pm->count + 1) * 2 > new_capacity)
+        new_capacity *= 2;
+
+    size_t* index = calloc(new_capacity, sizeof(*index));
+    if (!index)
+    {
+        perror("calloc(pending moves)");
+        return -1;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < pm->index_capacity; i++)
+    {
+        if (pm->index[i] == NONE || pm->index[i] == INDEX_DELETED)
+            continue;
+        size_t s = cookie_slot(pm->moves[pm->index[i] - 1].cookie, new_capacity);
+        while (index[s] != NONE)
+            s = (s + 1) & (new_capacity - 1);
+        index[s] = pm->index[i];
+        used++;
+    }
+
+    free(pm->index);
+    pm->index = index;
+    pm->index_capacity = new_capacity;
+    pm->index_used = used;
+    return 0;
+}
+
+static void wheel_unlink(PendingMoves* pm, size_t e)
+{
+    size_t slot = (size_t)(pm->deadline[e] % MOVE_WHEEL_SLOTS);
+    if (pm->prev[e] != NONE)
+        pm->next[pm->prev[e] - 1] = pm->next[e];
+    else
+        pm->wheel[slot] = pm->next[e];
+    if (pm->next[e] != NONE)
+        pm->prev[pm->next[e] - 1] = pm->prev[e];
+}
+
+// unlinks entry e everywhere and returns it to the free list; its paths now
+// belong to whoever copied the entry out
+static void entry_drop(PendingMoves* pm, size_t e, size_t index_slot)
+{
+    wheel_unlink(pm, e);
+    pm->index[index_slot] = INDEX_DELETED;
+    pm->next[e] = pm->free_head;
+    pm->free_head = e + 1;
+    pm->count--;
+}
+
+int pm_add(PendingMoves* pm, uint32_t cookie, int is_dir, const char* src_old, const char* dst_old, long long read_ns,
+           long long wall_ns, long long now_ns)
+{
+    PendingMove stale;
+    if (pm_take(pm, cookie, &stale))
+        pm_release(&stale);
+
+    if (pm->free_head == NONE && pool_grow(pm) < 0)
+        return -1;
+    // keep at least a quarter of the slots empty so probes stay short
+    if ((pm->index_used + 1) * 4 > pm->index_capacity * 3 && index_grow(pm) < 0)
+        return -1;
+
+    char* src_copy = strdup(src_old);
+    char* dst_copy = strdup(dst_old);
+    if (!src_copy || !dst_copy)
+    {
+        perror("strdup(pending move)");
+        free(src_copy);
+        free(dst_copy);
+        return -1;
+    }
+
+    size_t e = pm->free_head - 1;
+    pm->free_head = pm->next[e];
+    pm->moves[e] = (PendingMove){cookie, is_dir, read_ns, wall_ns, src_copy, dst_copy};
+
+    long long now_tick = wheel_tick(now_ns);
+    if (pm->count == 0)
+        pm->tick = now_tick;
+    // one tick more than the timeout, since the move was read somewhere inside now_tick
+    pm->deadline[e] = now_tick + MOVE_PAIR_TIMEOUT_MS / MOVE_WHEEL_TICK_MS + 1;
+    size_t slot = (size_t)(pm->deadline[e] % MOVE_WHEEL_SLOTS);
+    pm->prev[e] = NONE;
+    pm->next[e] = pm->wheel[slot];
+    if (pm->wheel[slot] != NONE)
+        pm->prev[pm->wheel[slot] - 1] = e + 1;
+    pm->wheel[slot] = e + 1;
+
+    size_t s = cookie_slot(cookie, pm->index_capacity);
+    while (pm->index[s] != NONE && pm->index[s] != INDEX_DELETED)
+        s = (s + 1) & (pm->index_capacity - 1);
+    if (pm->index[s] == NONE)
+        pm->index_used++;
+    pm->index[s] = e + 1;
+    pm->count++;
+    return 0;
+}
+
+int pm_take(PendingMoves* pm, uint32_t cookie, PendingMove* out)
+{
+    size_t s = index_find(pm, cookie);
+    if (s == (size_t)-1)
+        return 0;
+    size_t e = pm->index[s] - 1;
+    *out = pm->moves[e];
+    entry_drop(pm, e, s);
+    return 1;
+}
+
+void pm_release(PendingMove* move)
+{
+    free(move->src_old);
+    free(move->dst_old);
+    move->src_old = NULL;
+    move->dst_old = NULL;
+}
+
+void pm_expire(PendingMoves* pm, long long now_ns, void (*expired)(PendingMove* move, void* arg), void* arg)
+{
+    long long now_tick = wheel_tick(now_ns);
+    // after a long stall every slot is visited once instead of every missed tick
+    if (now_tick - pm->tick >= MOVE_WHEEL_SLOTS)
+        pm->tick = now_tick - MOVE_WHEEL_SLOTS + 1;
+
+    while (pm->count > 0 && pm->tick <= now_tick)
+    {
+        size_t slot = (size_t)(pm->tick % MOVE_WHEEL_SLOTS);
+        size_t link = pm->wheel[slot];
+        while (link != NONE)
+        {
+            size_t e = link - 1;
+            link = pm->next[e];
+            if (pm->deadline[e] > now_tick)
+                continue;
+
+            PendingMove move = pm->moves[e];
+            entry_drop(pm, e, index_find(pm, move.cookie));
+            expired(&move, arg);
+            pm_release(&move);
+        }
+        pm->tick++;
+    }
+}
+
+void pm_free(PendingMoves* pm)
+{
+    for (size_t i = 0; i < pm->index_capacity; i++)
+    {
+        if (pm->index[i] != NONE && pm->index[i] != INDEX_DELETED)
+            pm_release(&pm->moves[pm->index[i] - 1]);
+    }
+    free(pm->moves);
+    free(pm->next);
+    free(pm->prev);
+    free(pm->deadline);
+    free(pm->index);
+    memset(pm, 0, sizeof(*pm));
+}
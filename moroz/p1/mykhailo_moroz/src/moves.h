@@ -0,0 +1,55 @@
+#ifndef MOVES_H
+#define MOVES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// IN_MOVED_FROM halves waiting for their IN_MOVED_TO. Entries are found by
+// cookie through an open-addressing hash and expire through a timer wheel, so
+// neither pairing nor expiry scans the whole table however many renames are
+// in flight.
+typedef struct
+{
+    uint32_t cookie;
+    int is_dir;
+    long long read_ns;  // when IN_MOVED_FROM was read, for latency accounting
+    long long wall_ns;  // the same moment on the realtime clock
+    char* src_old;
+    char* dst_old;
+} PendingMove;
+
+// a move is given up on this long after its IN_MOVED_FROM was read
+#define MOVE_PAIR_TIMEOUT_MS 1000
+#define MOVE_WHEEL_TICK_MS 125
+// must cover the timeout plus one tick
+#define MOVE_WHEEL_SLOTS 16
+
+typedef struct
+{
+    PendingMove* moves;  // entry pool
+    size_t* next;        // wheel slot chains and the free list, indices into moves
+    size_t* prev;
+    long long* deadline;  // wheel tick an entry expires at
+    size_t pool_capacity;
+    size_t free_head;
+    size_t* index;  // cookie hash: entry + 1, 0 = empty, (size_t)-1 = deleted
+    size_t index_capacity;
+    size_t index_used;
+    size_t wheel[MOVE_WHEEL_SLOTS];  // chain heads
+    long long tick;                  // next wheel tick to expire
+    size_t count;
+} PendingMoves;
+
+// now_ns is stats_now_ns(); the paths are copied
+int pm_add(PendingMoves* pm, uint32_t cookie, int is_dir, const char* src_old, const char* dst_old, long long read_ns,
+           long long wall_ns, long long now_ns);
+// returns 1 and moves the entry into *out if the cookie is pending; release it
+// with pm_release()
+int pm_take(PendingMoves* pm, uint32_t cookie, PendingMove* out);
+void pm_release(PendingMove* move);
+// hands every move older than MOVE_PAIR_TIMEOUT_MS to expired(), in deadline
+// order, and drops it
+void pm_expire(PendingMoves* pm, long long now_ns, void (*expired)(PendingMove* move, void* arg), void* arg);
+void pm_free(PendingMoves* pm);
+
+#endif
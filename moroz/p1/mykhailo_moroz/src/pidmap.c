@@ -0,0 +1,122 @@
+#include "pidmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PIDMAP_EMPTY 0
+#define PIDMAP_DELETED (-1)
+
+static size_t pid_slot(pid_t pid, size_t capacity)
+{
+    // pids are sequential, a multiplicative hash spreads neighbours apart
+    return (size_t)(((unsigned long long)pid * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+// rehashes into a table big enough for the live entries, dropping deleted slots
+static int pidmap_grow(PidMap* map)
+{
+    size_t live = 0;
+    for (size_t i = 0; i < map->capacity; i++)
+    {
+        if (map->keys[i] != PIDMAP_EMPTY && map->keys[i] != PIDMAP_DELETED)
+            live++;
+    }
+    size_t new_capacity = map->capacity ? map->capacity : 16;
+    if ((live + 1) * 2 > new_capacity)
+        new_capacity *= 2;
+
+    pid_t* keys = calloc(new_capacity, sizeof(*keys));
+    size_t* values = calloc(new_capacity, sizeof(*values));
+    if (!keys || !values)
+    {
+        perror("calloc(pidmap)");
+        free(keys);
+        free(values);
+        return -1;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < map->capacity; i++)
+    {
+        if (map->keys[i] == PIDMAP_EMPTY || map->keys[i] == PIDMAP_DELETED)
+            continue;
+        size_t s = pid_slot(map->keys[i], new_capacity);
+        while (keys[s] != PIDMAP_EMPTY)
+            s = (s + 1) & (new_capacity - 1);
+        keys[s] = map->keys[i];
+        values[s] = map->values[i];
+        used++;
+    }
+
+    free(map->keys);
+    free(map->values);
+    map->keys = keys;
+    map->values = values;
+    map->capacity = new_capacity;
+    map->used = used;
+    return 0;
+}
+
+// slot holding pid, or (size_t)-1
+static size_t pidmap_find(const PidMap* map, pid_t pid)
+{
+    if (map->capacity == 0)
+        return (size_t)-1;
+    size_t s = pid_slot(pid, map->capacity);
+    while (map->keys[s] != PIDMAP_EMPTY)
+    {
+        if (map->keys[s] == pid)
+            return s;
+        s = (s + 1) & (map->capacity - 1);
+    }
+    return (size_t)-1;
+}
+
+int pidmap_put(PidMap* map, pid_t pid, size_t index)
+{
+    size_t s = pidmap_find(map, pid);
+    if (s != (size_t)-1)
+    {
+        map->values[s] = index;
+        return 0;
+    }
+
+    // keep at least a quarter of the slots empty so probes stay short
+    if ((map->used + 1) * 4 > map->capacity * 3 && pidmap_grow(map) < 0)
+        return -1;
+
+    s = pid_slot(pid, map->capacity);
+    while (map->keys[s] != PIDMAP_EMPTY && map->keys[s] != PIDMAP_DELETED)
+        s = (s + 1) & (map->capacity - 1);
+    if (map->keys[s] == PIDMAP_EMPTY)
+        map->used++;
+    map->keys[s] = pid;
+    map->values[s] = index;
+    return 0;
+}
+
+int pidmap_get(const PidMap* map, pid_t pid, size_t* index)
+{
+    size_t s = pidmap_find(map, pid);
+    if (s == (size_t)-1)
+        return -1;
+    *index = map->values[s];
+    return 0;
+}
+
+void pidmap_del(PidMap* map, pid_t pid)
+{
+    size_t s = pidmap_find(map, pid);
+    if (s != (size_t)-1)
+        map->keys[s] = PIDMAP_DELETED;
+}
+
+void pidmap_free(PidMap* map)
+{
+    free(map->keys);
+    free(map->values);
+    map->keys = NULL;
+    map->values = NULL;
+    map->capacity = 0;
+    map->used = 0;
+}
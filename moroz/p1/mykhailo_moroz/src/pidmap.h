@@ -0,0 +1,24 @@
+#ifndef PIDMAP_H
+#define PIDMAP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Open-addressing hash map from worker pid to its index in the backup list, so
+// an exit notification finds its backup without scanning every entry. The task
+// runtime keys it by watch descriptor, which is just as small and sequential.
+typedef struct
+{
+    pid_t* keys;  // 0 = empty slot, -1 = deleted
+    size_t* values;
+    size_t capacity;  // power of two
+    size_t used;      // live + deleted slots
+} PidMap;
+
+int pidmap_put(PidMap* map, pid_t pid, size_t index);
+// returns 0 and fills *index if pid is known, -1 otherwise
+int pidmap_get(const PidMap* map, pid_t pid, size_t* index);
+void pidmap_del(PidMap* map, pid_t pid);
+void pidmap_free(PidMap* map);
+
+#endif
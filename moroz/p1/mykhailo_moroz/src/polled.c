@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "polled.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// whether path is prefix itself or somewhere below it
+static int path_within(const char* path, const char* prefix)
+{
+    size_t n = strlen(prefix);
+    return strncmp(path, prefix, n) == 0 && (path[n] == '\0' || path[n] == '/');
+}
+
+PolledDir* poll_add(PollSet* set, const char* path, int reason, long long since_ns)
+{
+    for (size_t i = 0; i < set->count; i++)
+    {
+        if (strcmp(set->dirs[i].path, path) == 0)
+        {
+            if (since_ns < set->dirs[i].since_ns)
+                set->dirs[i].since_ns = since_ns;
+            return &set->dirs[i];
+        }
+    }
+    if (set->count == set->capacity)
+    {
+        size_t capacity = set->capacity ? set->capacity * 2 : 16;
+        PolledDir* dirs = realloc(set->dirs, capacity * sizeof(*dirs));
+        if (!dirs)
+        {
+            perror("realloc(polled)");
+            return NULL;
+        }
+        set->dirs = dirs;
+        set->capacity = capacity;
+    }
+    char* copy = strdup(path);
+    if (!copy)
+    {
+        perror("strdup(polled)");
+        return NULL;
+    }
+    set->dirs[set->count] = (PolledDir){.path = copy, .reason = reason, .next_ns = 0, .since_ns = since_ns};
+    return &set->dirs[set->count++];
+}
+
+void poll_remove(PollSet* set, size_t i)
+{
+    free(set->dirs[i].path);
+    set->dirs[i] = set->dirs[--set->count];
+}
+
+long long poll_forget_below(PollSet* set, const char* path)
+{
+    long long oldest = LLONG_MAX;
+    for (size_t i = set->count; i-- > 0;)
+    {
+        if (!path_within(set->dirs[i].path, path))
+            continue;
+        if (set->dirs[i].since_ns < oldest)
+            oldest = set->dirs[i].since_ns;
+        poll_remove(set, i);
+    }
+    return oldest;
+}
+
+void poll_moved(PollSet* set, const char* old_path, const char* new_path)
+{
+    size_t old_len = strlen(old_path);
+    size_t new_len = strlen(new_path);
+    for (size_t i = 0; i < set->count; i++)
+    {
+        PolledDir* d = &set->dirs[i];
+        if (!path_within(d->path, old_path))
+            continue;
+        size_t rest = strlen(d->path + old_len);
+        char* moved = malloc(new_len + rest + 1);
+        if (!moved)
+        {
+            // left at the old path, which its next scan finds gone
+            perror("malloc(polled)");
+            continue;
+        }
+        memcpy(moved, new_path, new_len);
+        memcpy(moved + new_len, d->path + old_len, rest + 1);
+        free(d->path);
+        d->path = moved;
+    }
+}
+
+size_t poll_due(const PollSet* set, long long now_ns)
+{
+    size_t best = SIZE_MAX;
+    for (size_t i = 0; i < set->count; i++)
+    {
+        if (set->dirs[i].next_ns <= now_ns && (best == SIZE_MAX || set->dirs[i].next_ns < set->dirs[best].next_ns))
+            best = i;
+    }
+    return best;
+}
+
+long long poll_synced_ns(const PollSet* set)
+{
+    long long oldest = LLONG_MAX;
+    for (size_t i = 0; i < set->count; i++)
+    {
+        if (set->dirs[i].since_ns < oldest)
+            oldest = set->dirs[i].since_ns;
+    }
+    return oldest;
+}
+
+void poll_free(PollSet* set)
+{
+    for (size_t i = 0; i < set->count; i++)
+        free(set->dirs[i].path);
+    free(set->dirs);
+    free(set->heat);
+    memset(set, 0, sizeof(*set));
+}
+
+void poll_heat(PollSet* set, const WatchTree* map, uint32_t node)
+{
+    if (node >= set->heat_capacity)
+    {
+        uint32_t capacity = map->nodes_capacity > node ? map->nodes_capacity : node + 1;
+        uint32_t* heat = realloc(set->heat, capacity * sizeof(*heat));
+        if (!heat)
+            return;  // not counted; the subtree stays on inotify
+        memset(heat + set->heat_capacity, 0, (capacity - set->heat_capacity) * sizeof(*heat));
+        set->heat = heat;
+        set->heat_capacity = capacity;
+    }
+    for (uint32_t n = node; n; n = map->nodes[n].parent)
+    {
+        if (n < set->heat_capacity && set->heat[n] < UINT32_MAX)
+            set->heat[n]++;
+    }
+}
+
+static uint32_t heat_of(const PollSet* set, uint32_t node)
+{
+    return node < set->heat_capacity ? set->heat[node] : 0;
+}
+
+static size_t collect_hot(const PollSet* set, const WatchTree* map, uint32_t node, uint32_t* out, size_t max,
+                          size_t n)
+{
+    int hot_child = 0;
+    for (uint32_t c = map->nodes[node].first_child; c && n < max; c = map->nodes[c].next_sibling)
+    {
+        if (heat_of(set, c) >= POLL_HOT_EVENTS)
+        {
+            hot_child = 1;
+            n = collect_hot(set, map, c, out, max, n);
+        }
+    }
+    if (!hot_child && node != map->root && n < max)
+        out[n++] = node;
+    return n;
+}
+
+size_t poll_hot_nodes(PollSet* set, const WatchTree* map, long long now_ns, uint32_t* out, size_t max)
+{
+    if (now_ns - set->window_ns < POLL_HOT_WINDOW_MS * 1000000LL)
+        return 0;
+    size_t n = 0;
+    // the root counts every event, so below the threshold there nothing is hot
+    if (map->root && heat_of(set, map->root) >= POLL_HOT_EVENTS)
+        n = collect_hot(set, map, map->root, out, max, 0);
+    if (set->heat)
+        memset(set->heat, 0, set->heat_capacity * sizeof(*set->heat));
+    set->window_ns = now_ns;
+    return n;
+}
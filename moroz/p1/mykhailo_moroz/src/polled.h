@@ -0,0 +1,83 @@
+#ifndef POLLED_H
+#define POLLED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "watchtree.h"
+
+// Subtrees of a source tracked by periodic scans instead of inotify watches.
+//
+// A directory ends up here for one of three reasons: a "--poll" rule of the
+// backup names it (huge or cold trees that are not worth a watch per
+// directory), the kernel refused a watch for it (fs.inotify.max_user_watches
+// is used up, so the part that did not fit is scanned instead of left
+// unprotected), or its events came faster than POLL_HOT_EVENTS per window
+// (build directories and the like, where a batched rescan is cheaper than
+// applying every event; it goes back to inotify once it has calmed down).
+//
+// A scan compares the subtree against the target only where the source
+// changed since the previous one: a directory whose mtime and ctime are older
+// than that scan has the same entries as then, so its target side is not
+// read at all, and files in it cost a single lstat each.
+
+#define POLL_DEFAULT_INTERVAL 30     // -p: seconds between scans of a rule or budget subtree
+#define POLL_HOT_INTERVAL_MS 2000    // between rescans of a hot subtree
+#define POLL_HOT_WINDOW_MS 1000      // events are counted per window of this length
+#define POLL_HOT_EVENTS 2000         // events per window that make a subtree hot
+#define POLL_QUIET_SCANS 5           // hot rescans in a row finding nothing before it is watched again
+#define POLL_TICK_BUDGET_MS 200      // scans one tick may run before events get their turn again
+
+typedef enum
+{
+    POLL_RULE = 0,  // matched a "--poll" rule
+    POLL_BUDGET,    // out of inotify watches
+    POLL_HOT,       // too many events
+    POLL_REASON_COUNT
+} PollReason;
+
+typedef struct
+{
+    char* path;          // absolute source path of the subtree root
+    int reason;          // PollReason
+    long long next_ns;   // monotonic time the next scan is due
+    long long since_ns;  // realtime the target matched the subtree as of, start of the last complete scan
+    int quiet;           // POLL_HOT: rescans in a row that found nothing to do
+} PolledDir;
+
+typedef struct
+{
+    PolledDir* dirs;
+    size_t count;
+    size_t capacity;
+    // events per watch node in the current window, each event also counted
+    // for every directory above its own
+    uint32_t* heat;
+    uint32_t heat_capacity;
+    long long window_ns;  // monotonic start of the window
+} PollSet;
+
+// Starts polling the subtree at path, scanned for changes since since_ns
+// (realtime), and due right away. A path already polled keeps its entry, with
+// the older of the two watermarks. Returns the entry, NULL when out of memory.
+PolledDir* poll_add(PollSet* set, const char* path, int reason, long long since_ns);
+void poll_remove(PollSet* set, size_t i);
+// drops the entries of path and of everything below it; returns the oldest
+// since_ns among them, LLONG_MAX if there were none
+long long poll_forget_below(PollSet* set, const char* path);
+// a directory was renamed: entries at or below old_path move along
+void poll_moved(PollSet* set, const char* old_path, const char* new_path);
+// the entry due first if it is due at now_ns (monotonic), SIZE_MAX otherwise
+size_t poll_due(const PollSet* set, long long now_ns);
+// oldest since_ns of all entries; LLONG_MAX when there are none
+long long poll_synced_ns(const PollSet* set);
+void poll_free(PollSet* set);
+
+// counts one event on node and on all its ancestors
+void poll_heat(PollSet* set, const WatchTree* map, uint32_t node);
+// Once a window is over: writes up to max nodes that took at least
+// POLL_HOT_EVENTS events in it while none of their children did, the root
+// never among them, and starts a new window. Returns how many were written.
+size_t poll_hot_nodes(PollSet* set, const WatchTree* map, long long now_ns, uint32_t* out, size_t max);
+
+#endif
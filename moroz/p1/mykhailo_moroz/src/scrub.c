@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include "scrub.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// from linux/ioprio.h, which older headers do not ship
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+#define SCRUB_NICE 10
+
+void budget_init(IoBudget* budget, unsigned long long rate, volatile sig_atomic_t* stop)
+{
+    budget->rate = rate;
+    budget->tokens = (long long)rate;
+    budget->refilled_ns = stats_now_ns();
+    budget->stop = stop;
+}
+
+int budget_charge(IoBudget* budget, unsigned long long bytes)
+{
+    if (*budget->stop)
+        return -1;
+    if (budget->rate == 0)
+        return 0;
+
+    long long now = stats_now_ns();
+    long long earned = (long long)((double)(now - budget->refilled_ns) * (double)budget->rate / 1e9);
+    budget->tokens += earned;
+    if (budget->tokens > (long long)budget->rate)
+        budget->tokens = (long long)budget->rate;
+    budget->refilled_ns = now;
+
+    budget->tokens -= (long long)bytes;
+    if (budget->tokens >= 0)
+        return 0;
+
+    // the signal that sets stop also cuts the sleep short
+    long long wait_ns = (long long)((double)-budget->tokens * 1e9 / (double)budget->rate);
+    struct timespec ts = {wait_ns / 1000000000LL, wait_ns % 1000000000LL};
+    nanosleep(&ts, NULL);
+    return *budget->stop ? -1 : 0;
+}
+
+// reads exactly n bytes at off; a file that got shorter meanwhile counts as different
+static int read_block(int fd, unsigned char* buf, size_t n, off_t off)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        ssize_t r = pread(fd, buf + done, n - done, off + (off_t)done);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("pread(scrub)");
+            return -1;
+        }
+        if (r == 0)
+            return 0;
+        done += (size_t)r;
+    }
+    return 1;
+}
+
+int scrub_same_content(const char* a, const char* b, size_t size, IoBudget* budget)
+{
+    if (size == 0)
+        return 1;
+
+    int fa = open(a, O_RDONLY);
+    if (fa < 0)
+    {
+        perror("open(scrub)");
+        return -1;
+    }
+    int fb = open(b, O_RDONLY);
+    if (fb < 0)
+    {
+        perror("open(scrub)");
+        close(fa);
+        return -1;
+    }
+    size_t block = (size < SCRUB_BLOCK) ? size : SCRUB_BLOCK;
+    unsigned char* ba = malloc(2 * block);
+    if (!ba)
+    {
+        perror("malloc(scrub)");
+        close(fa);
+        close(fb);
+        return -1;
+    }
+    unsigned char* bb = ba + block;
+    posix_fadvise(fa, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fb, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int same = 1;
+    for (size_t off = 0; same == 1 && off < size; off += block)
+    {
+        size_t n = (size - off < block) ? size - off : block;
+        if (budget_charge(budget, 2 * (unsigned long long)n) < 0)
+        {
+            same = -1;
+            break;
+        }
+        stats_add(STAT_SCRUB_BYTES, 2 * (unsigned long long)n);
+        int ra = read_block(fa, ba, n, (off_t)off);
+        int rb = (ra == 1) ? read_block(fb, bb, n, (off_t)off) : ra;
+        if (ra < 0 || rb < 0)
+            same = -1;
+        else if (ra == 0 || rb == 0 || memcmp(ba, bb, n) != 0)
+            same = 0;
+        // nobody else reads the mirror, so its pages would only push out what
+        // the applications use; the source's may be theirs and are left alone
+        posix_fadvise(fb, (off_t)off, (off_t)n, POSIX_FADV_DONTNEED);
+    }
+
+    free(ba);
+    close(fa);
+    close(fb);
+    return same;
+}
+
+void scrub_lower_priority(void)
+{
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+        perror("ioprio_set");
+    errno = 0;
+    if (nice(SCRUB_NICE) < 0 && errno != 0)
+        perror("nice");
+}
@@ -0,0 +1,45 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include <signal.h>
+#include <stddef.h>
+
+// what a scrub run is asked to do; "verify" passes these to the worker
+// through WorkerStats.scrub_request
+#define SCRUB_RUN 1
+#define SCRUB_CONTENT 2  // compare file data, not only metadata
+#define SCRUB_REPAIR 4   // fix what differs instead of only reporting it
+
+// bytes per second a scrub may read when -b is not given
+#define SCRUB_DEFAULT_RATE (32ULL << 20)
+// what looking at one entry (lstat on both sides, a readdir slot) is charged
+#define SCRUB_ENTRY_COST 4096ULL
+// content is compared in blocks of this size, so a difference near the start of
+// a big file is found without reading the rest
+#define SCRUB_BLOCK (1ULL << 20)
+
+// Token bucket limiting how fast a scrub reads. Tokens are bytes, refilled at
+// rate per second up to one second's worth; a charge that overdraws the bucket
+// sleeps until it is paid back. rate 0 means unlimited.
+typedef struct
+{
+    unsigned long long rate;
+    long long tokens;
+    long long refilled_ns;
+    volatile sig_atomic_t* stop;  // set from a signal handler when the scrub has to end
+} IoBudget;
+
+void budget_init(IoBudget* budget, unsigned long long rate, volatile sig_atomic_t* stop);
+// -1 once the scrub was told to stop, 0 otherwise
+int budget_charge(IoBudget* budget, unsigned long long bytes);
+
+// 1 if the source file a and its mirror b hold the same size bytes, 0 if they differ,
+// -1 on error or when stopped. Both are read and compared block by block, stopping at the
+// first block that differs; every block read is charged to budget on both sides.
+int scrub_same_content(const char* a, const char* b, size_t size, IoBudget* budget);
+
+// puts the calling process in the idle I/O class and lowers its CPU priority,
+// so the disk serves everyone else first
+void scrub_lower_priority(void);
+
+#endif
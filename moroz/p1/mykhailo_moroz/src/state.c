@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+#include "state.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define STATE_MAGIC "sop-backup-state 1"
+// "add" takes at most MAX_ARGS words, so a backup never has more rules than this
+#define STATE_MAX_RULES 64
+
+// paths may hold any byte but NUL; whitespace, '%' and control bytes are
+// written as %XX so one backup stays one line of space separated fields
+static void put_path(FILE* f, const char* path)
+{
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++)
+    {
+        if (*p <= ' ' || *p == '%' || *p == 0x7f)
+            fprintf(f, "%%%02X", *p);
+        else
+            fputc(*p, f);
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// decodes in place
+static int get_path(char* s)
+{
+    char* out = s;
+    for (char* p = s; *p; p++)
+    {
+        if (*p != '%')
+        {
+            *out++ = *p;
+            continue;
+        }
+        int hi = hex_value(p[1]);
+        int lo = (hi < 0) ? -1 : hex_value(p[2]);
+        if (lo < 0 || (hi == 0 && lo == 0))
+            return -1;
+        *out++ = (char)(hi * 16 + lo);
+        p += 2;
+    }
+    *out = '\0';
+    return 0;
+}
+
+static int fsync_parent_dir(const char* path)
+{
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir))
+        return -1;
+    char* slash = strrchr(dir, '/');
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        perror("open(state dir)");
+        return -1;
+    }
+    int ret = fsync(fd);
+    if (ret < 0)
+        perror("fsync(state dir)");
+    close(fd);
+    return ret;
+}
+
+int state_save(const char* path, const StateEntry* entries, size_t count)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        fprintf(stderr, "state path too long\n");
+        return -1;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        perror("open(state)");
+        return -1;
+    }
+    FILE* f = fdopen(fd, "w");
+    if (!f)
+    {
+        perror("fdopen(state)");
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    fprintf(f, "%s\n", STATE_MAGIC);
+    for (size_t i = 0; i < count; i++)
+    {
+        fprintf(f, "%d %lld %lld ", entries[i].active, (long long)entries[i].created_at, entries[i].synced_ns);
+        put_path(f, entries[i].src);
+        fputc(' ', f);
+        put_path(f, entries[i].dst);
+        if (entries[i].upstream)
+        {
+            fputs(" @", f);
+            put_path(f, entries[i].upstream);
+        }
+        for (size_t r = 0; r < entries[i].rule_count; r++)
+        {
+            fputc(' ', f);
+            put_path(f, entries[i].rules[r]);
+        }
+        fputc('\n', f);
+    }
+
+    if (fflush(f) != 0 || fsync(fd) < 0)
+    {
+        perror("write(state)");
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    if (fclose(f) != 0)
+    {
+        perror("fclose(state)");
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, path) < 0)
+    {
+        perror("rename(state)");
+        unlink(tmp);
+        return -1;
+    }
+    return fsync_parent_dir(path);
+}
+
+int state_load(const char* path, StateEntry** entries, size_t* count)
+{
+    *entries = NULL;
+    *count = 0;
+
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        if (errno == ENOENT)
+            return 0;
+        perror("fopen(state)");
+        return -1;
+    }
+
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    size_t capacity = 0;
+    int lineno = 0;
+    int ret = 0;
+    while ((len = getline(&line, &line_cap, f)) > 0)
+    {
+        lineno++;
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (lineno == 1)
+        {
+            if (strcmp(line, STATE_MAGIC) != 0)
+            {
+                fprintf(stderr, "%s: not a sop-backup state file\n", path);
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        int active;
+        long long created_at, synced_ns;
+        int consumed = 0;
+        if (sscanf(line, "%d %lld %lld %n", &active, &created_at, &synced_ns, &consumed) != 3 || consumed == 0)
+        {
+            fprintf(stderr, "%s:%d: malformed entry skipped\n", path, lineno);
+            continue;
+        }
+        // src, dst, "@upstream" of a secondary and then the backup's rules, all escaped
+        char* fields[3 + STATE_MAX_RULES];
+        size_t nfields = 0;
+        int bad = 0;
+        for (char* save = NULL, *tok = strtok_r(line + consumed, " ", &save); tok; tok = strtok_r(NULL, " ", &save))
+        {
+            if (nfields == sizeof(fields) / sizeof(fields[0]) || get_path(tok) < 0)
+            {
+                bad = 1;
+                break;
+            }
+            fields[nfields++] = tok;
+        }
+        if (bad || nfields < 2 || fields[0][0] != '/' || fields[1][0] != '/')
+        {
+            fprintf(stderr, "%s:%d: malformed entry skipped\n", path, lineno);
+            continue;
+        }
+
+        if (*count == capacity)
+        {
+            size_t new_capacity = capacity ? capacity * 2 : 8;
+            StateEntry* tmp = realloc(*entries, new_capacity * sizeof(*tmp));
+            if (!tmp)
+            {
+                perror("realloc(state)");
+                ret = -1;
+                break;
+            }
+            *entries = tmp;
+            capacity = new_capacity;
+        }
+        StateEntry* e = &(*entries)[*count];
+        memset(e, 0, sizeof(*e));
+        e->src = strdup(fields[0]);
+        e->dst = strdup(fields[1]);
+        size_t first_rule = 2;
+        if (nfields > 2 && fields[2][0] == '@')
+            e->upstream = strdup(fields[first_rule++] + 1);
+        e->rule_count = nfields - first_rule;
+        if (e->rule_count > 0 && !(e->rules = calloc(e->rule_count, sizeof(char*))))
+            e->rule_count = 0;
+        int ok = e->src && e->dst && e->rule_count == nfields - first_rule && (first_rule == 2 || e->upstream);
+        for (size_t r = 0; ok && r < e->rule_count; r++)
+            ok = (e->rules[r] = strdup(fields[first_rule + r])) != NULL;
+        if (!ok)
+        {
+            perror("strdup(state)");
+            (*count)++;
+            ret = -1;
+            break;
+        }
+        e->created_at = (time_t)created_at;
+        e->synced_ns = synced_ns;
+        e->active = active;
+        (*count)++;
+    }
+
+    free(line);
+    fclose(f);
+    if (ret < 0)
+    {
+        state_free(*entries, *count);
+        *entries = NULL;
+        *count = 0;
+    }
+    return ret;
+}
+
+void state_free(StateEntry* entries, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        free(entries[i].src);
+        free(entries[i].dst);
+        free(entries[i].upstream);
+        for (size_t r = 0; r < entries[i].rule_count; r++)
+            free(entries[i].rules[r]);
+        free(entries[i].rules);
+    }
+    free(entries);
+}
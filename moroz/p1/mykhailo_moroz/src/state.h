@@ -0,0 +1,30 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <stddef.h>
+#include <time.h>
+
+// One backup as it is kept in the state file between daemon runs.
+typedef struct
+{
+    char* src;
+    char* dst;
+    time_t created_at;
+    long long synced_ns;  // sync watermark of the target (CLOCK_REALTIME), 0 if unknown
+    int active;           // 0 once "end" was issued, the target is then only kept for restore
+    char* upstream;       // "add --tiered" secondary: the primary target it replicates from, else NULL
+    char** rules;         // include/exclude rules, "-pattern" or "+pattern"
+    size_t rule_count;
+} StateEntry;
+
+// Replaces the state file atomically: the new contents are written and fsynced
+// to path.tmp, renamed over path and the directory is fsynced, so a crash
+// leaves either the old or the new registry, never a torn one.
+int state_save(const char* path, const StateEntry* entries, size_t count);
+
+// Reads the registry; a missing file is an empty registry. Entries are
+// allocated, release them with state_free.
+int state_load(const char* path, StateEntry** entries, size_t* count);
+void state_free(StateEntry* entries, size_t count);
+
+#endif
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+_Thread_local WorkerStats* g_stats = NULL;
+
+static const char* const phase_names[PHASE_COUNT] = {"starting",  "initial-sync", "idle",
+                                                     "applying",  "restoring",    "stopped"};
+static const char* const op_names[LAT_OP_COUNT] = {"copy", "delete", "rename", "mkdir"};
+
+WorkerStats* stats_create(void)
+{
+    WorkerStats* stats = mmap(NULL, sizeof(WorkerStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED)
+    {
+        perror("mmap(stats)");
+        return NULL;
+    }
+    // anonymous mappings are zero-filled, which is a valid initial state for the atomics
+    atomic_store(&stats->phase, PHASE_STARTING);
+    return stats;
+}
+
+void stats_destroy(WorkerStats* stats)
+{
+    if (!stats)
+        return;
+    if (munmap(stats, sizeof(WorkerStats)) < 0)
+        perror("munmap(stats)");
+}
+
+void stats_worker_started(WorkerStats* stats)
+{
+    atomic_store_explicit(&stats->phase, PHASE_STARTING, memory_order_relaxed);
+    atomic_store_explicit(&stats->started_ns, stats_now_ns(), memory_order_relaxed);
+    atomic_store_explicit(&stats->protected_ns, 0, memory_order_relaxed);
+}
+
+const char* stats_phase_name(int phase)
+{
+    if (phase < 0 || phase >= PHASE_COUNT)
+        return "unknown";
+    return phase_names[phase];
+}
+
+static unsigned long long load(const WorkerStats* stats, StatCounter c)
+{
+    return atomic_load_explicit(&stats->counters[c], memory_order_relaxed);
+}
+
+static long long last_event_age_ms(const WorkerStats* stats)
+{
+    long long last = atomic_load_explicit(&stats->last_event_ns, memory_order_relaxed);
+    if (last == 0)
+        return -1;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long now = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    return (now > last) ? (now - last) / 1000000LL : 0;
+}
+
+void stats_print(FILE* out, const WorkerStats* stats)
+{
+    if (!stats)
+    {
+        fprintf(out, "    (no stats)\n");
+        return;
+    }
+
+    int phase = atomic_load_explicit(&stats->phase, memory_order_relaxed);
+    fprintf(out, "    phase=%s events_read=%llu events_applied=%llu queue=%llu files=%llu unchanged=%llu bytes=%llu",
+            stats_phase_name(phase), load(stats, STAT_EVENTS_READ), load(stats, STAT_EVENTS_APPLIED),
+            load(stats, STAT_QUEUE_DEPTH), load(stats, STAT_FILES_COPIED), load(stats, STAT_FILES_UNCHANGED),
+            load(stats, STAT_BYTES_COPIED));
+
+    long long age = last_event_age_ms(stats);
+    if (age < 0)
+        fprintf(out, " last_event=never");
+    else
+        fprintf(out, " last_event=%lld.%03llds ago", age / 1000, age % 1000);
+
+    long long protected_ns = atomic_load_explicit(&stats->protected_ns, memory_order_relaxed);
+    if (protected_ns > 0)
+        fprintf(out, " protected_in=%lld.%03llds\n", protected_ns / 1000000000LL, protected_ns / 1000000LL % 1000);
+    else
+        fprintf(out, " protected_in=-\n");
+
+    unsigned long long skipped_paths = load(stats, STAT_SKIPPED_PATHS);
+    unsigned long long skipped_watches = load(stats, STAT_SKIPPED_WATCHES);
+    unsigned long long skipped_events = load(stats, STAT_SKIPPED_EVENTS);
+    if (skipped_paths || skipped_watches || skipped_events)
+        fprintf(out, "    skipped: paths=%llu bytes=%llu watches=%llu events=%llu\n", skipped_paths,
+                load(stats, STAT_SKIPPED_BYTES), skipped_watches, skipped_events);
+
+    unsigned long long quarantined = load(stats, STAT_QUARANTINED);
+    unsigned long long reclaimed = load(stats, STAT_RECLAIMED);
+    if (quarantined || reclaimed)
+        fprintf(out, "    quarantine: dirs=%llu bytes=%llu reclaimed=%llu\n", quarantined,
+                load(stats, STAT_QUARANTINE_BYTES), reclaimed);
+
+    unsigned long long polled = load(stats, STAT_POLLED);
+    unsigned long long poll_scans = load(stats, STAT_POLL_SCANS);
+    if (polled || poll_scans)
+        fprintf(out, "    polled: subtrees=%llu scans=%llu changes=%llu unwatchable=%llu hot=%llu\n", polled,
+                poll_scans, load(stats, STAT_POLL_CHANGES), load(stats, STAT_POLL_BUDGET), load(stats, STAT_POLL_HOT));
+
+    unsigned long long tier_applied = load(stats, STAT_TIER_APPLIED);
+    unsigned long long tier_resyncs = load(stats, STAT_TIER_RESYNCS);
+    if (tier_applied || tier_resyncs)
+        fprintf(out, "    tier: applied=%llu behind=%llu resyncs=%llu\n", tier_applied, load(stats, STAT_TIER_BEHIND),
+                tier_resyncs);
+
+    unsigned long long durable_syncs = load(stats, STAT_DURABLE_SYNCS);
+    unsigned long long durable_pending = load(stats, STAT_DURABLE_PENDING);
+    unsigned long long durable_failures = load(stats, STAT_DURABLE_FAILURES);
+    if (durable_syncs || durable_pending || durable_failures)
+        fprintf(out, "    durable: syncs=%llu changes=%llu pending=%llu sync_time=%.3fs failed=%llu\n", durable_syncs,
+                load(stats, STAT_DURABLE_CHANGES), durable_pending, (double)load(stats, STAT_DURABLE_WAIT_NS) / 1e9,
+                durable_failures);
+
+    unsigned long long tail_appends = load(stats, STAT_TAIL_APPENDS);
+    unsigned long long tail_truncates = load(stats, STAT_TAIL_TRUNCATES);
+    if (tail_appends || tail_truncates)
+        fprintf(out, "    tails: appended=%llu truncated=%llu saved=%llu\n", tail_appends, tail_truncates,
+                load(stats, STAT_TAIL_BYTES_SAVED));
+
+    unsigned long long trash_dirs = load(stats, STAT_TRASH_DIRS);
+    unsigned long long trash_unlinked = load(stats, STAT_TRASH_UNLINKED);
+    if (trash_dirs || trash_unlinked)
+        fprintf(out, "    trash: dirs=%llu unlinked=%llu\n", trash_dirs, trash_unlinked);
+
+    unsigned long long restores = load(stats, STAT_RESTORES);
+    if (restores)
+        fprintf(out, "    restore: runs=%llu echoes=%llu\n", restores, load(stats, STAT_RESTORE_ECHOES));
+
+    unsigned long long overflows = load(stats, STAT_OVERFLOWS);
+    if (overflows)
+        fprintf(out, "    overflow: rescans=%llu\n", overflows);
+
+    long long scrub_started = atomic_load_explicit(&stats->scrub_started_ns, memory_order_relaxed);
+    if (scrub_started)
+    {
+        long long scrub_done = atomic_load_explicit(&stats->scrub_done_ns, memory_order_relaxed);
+        fprintf(out, "    scrub: runs=%llu checked=%llu read=%llu diverged=%llu repaired=%llu",
+                load(stats, STAT_SCRUB_RUNS), load(stats, STAT_SCRUB_CHECKED), load(stats, STAT_SCRUB_BYTES),
+                load(stats, STAT_SCRUB_DIVERGED), load(stats, STAT_SCRUB_REPAIRED));
+        if (scrub_done < scrub_started)
+            fprintf(out, " running\n");
+        else
+            fprintf(out, " took=%.3fs\n", (double)(scrub_done - scrub_started) / 1e9);
+    }
+}
+
+void stats_print_json(FILE* out, const WorkerStats* stats)
+{
+    if (!stats)
+    {
+        fprintf(out, "\"phase\":\"unknown\"");
+        return;
+    }
+
+    int phase = atomic_load_explicit(&stats->phase, memory_order_relaxed);
+    long long last = atomic_load_explicit(&stats->last_event_ns, memory_order_relaxed);
+    fprintf(out,
+            "\"phase\":\"%s\",\"events_read\":%llu,\"events_applied\":%llu,\"queue_depth\":%llu,"
+            "\"files_copied\":%llu,\"files_unchanged\":%llu,\"bytes_copied\":%llu,\"last_event_ns\":%lld,"
+            "\"protected_ns\":%lld,\"synced_ns\":%lld,\"skipped_paths\":%llu,\"skipped_bytes\":%llu,\"skipped_watches\":%llu,"
+            "\"skipped_events\":%llu,\"quarantined\":%llu,\"quarantine_bytes\":%llu,\"reclaimed\":%llu,"
+            "\"scrub_runs\":%llu,\"scrub_checked\":%llu,\"scrub_bytes\":%llu,\"scrub_diverged\":%llu,"
+            "\"scrub_repaired\":%llu,\"scrub_started_ns\":%lld,\"scrub_done_ns\":%lld,\"polled\":%llu,"
+            "\"poll_unwatchable\":%llu,\"poll_hot\":%llu,\"poll_scans\":%llu,\"poll_changes\":%llu,"
+            "\"tier_applied\":%llu,\"tier_behind\":%llu,\"tier_resyncs\":%llu,\"durable_syncs\":%llu,"
+            "\"durable_changes\":%llu,\"durable_pending\":%llu,\"durable_wait_ns\":%llu,\"durable_failures\":%llu,"
+            "\"tail_appends\":%llu,\"tail_truncates\":%llu,\"tail_bytes_saved\":%llu,\"trash_dirs\":%llu,\"trash_unlinked\":%llu,"
+            "\"restores\":%llu,\"restore_echoes\":%llu,\"overflows\":%llu",
+            stats_phase_name(phase), load(stats, STAT_EVENTS_READ), load(stats, STAT_EVENTS_APPLIED),
+            load(stats, STAT_QUEUE_DEPTH), load(stats, STAT_FILES_COPIED), load(stats, STAT_FILES_UNCHANGED),
+            load(stats, STAT_BYTES_COPIED), last,
+            atomic_load_explicit(&stats->protected_ns, memory_order_relaxed),
+            atomic_load_explicit(&stats->synced_ns, memory_order_relaxed), load(stats, STAT_SKIPPED_PATHS),
+            load(stats, STAT_SKIPPED_BYTES), load(stats, STAT_SKIPPED_WATCHES), load(stats, STAT_SKIPPED_EVENTS),
+            load(stats, STAT_QUARANTINED), load(stats, STAT_QUARANTINE_BYTES), load(stats, STAT_RECLAIMED),
+            load(stats, STAT_SCRUB_RUNS), load(stats, STAT_SCRUB_CHECKED), load(stats, STAT_SCRUB_BYTES),
+            load(stats, STAT_SCRUB_DIVERGED), load(stats, STAT_SCRUB_REPAIRED),
+            atomic_load_explicit(&stats->scrub_started_ns, memory_order_relaxed),
+            atomic_load_explicit(&stats->scrub_done_ns, memory_order_relaxed), load(stats, STAT_POLLED),
+            load(stats, STAT_POLL_BUDGET), load(stats, STAT_POLL_HOT), load(stats, STAT_POLL_SCANS),
+            load(stats, STAT_POLL_CHANGES), load(stats, STAT_TIER_APPLIED), load(stats, STAT_TIER_BEHIND),
+            load(stats, STAT_TIER_RESYNCS), load(stats, STAT_DURABLE_SYNCS), load(stats, STAT_DURABLE_CHANGES),
+            load(stats, STAT_DURABLE_PENDING), load(stats, STAT_DURABLE_WAIT_NS),
+            load(stats, STAT_DURABLE_FAILURES), load(stats, STAT_TAIL_APPENDS),
+            load(stats, STAT_TAIL_TRUNCATES), load(stats, STAT_TAIL_BYTES_SAVED), load(stats, STAT_TRASH_DIRS),
+            load(stats, STAT_TRASH_UNLINKED), load(stats, STAT_RESTORES), load(stats, STAT_RESTORE_ECHOES),
+            load(stats, STAT_OVERFLOWS));
+}
+
+const char* stats_op_name(int op)
+{
+    if (op < 0 || op >= LAT_OP_COUNT)
+        return "unknown";
+    return op_names[op];
+}
+
+// human readable duration, picks the largest unit that keeps the value >= 1
+static void format_ns(char* buf, size_t size, unsigned long long ns)
+{
+    if (ns < 1000ULL)
+        snprintf(buf, size, "%lluns", ns);
+    else if (ns < 1000000ULL)
+        snprintf(buf, size, "%.1fus", (double)ns / 1e3);
+    else if (ns < 1000000000ULL)
+        snprintf(buf, size, "%.1fms", (double)ns / 1e6);
+    else
+        snprintf(buf, size, "%.2fs", (double)ns / 1e9);
+}
+
+void stats_print_latency(FILE* out, const WorkerStats* stats)
+{
+    if (!stats)
+    {
+        fprintf(out, "    (no stats)\n");
+        return;
+    }
+
+    for (int op = 0; op < LAT_OP_COUNT; op++)
+    {
+        const Histogram* h = &stats->latency[op];
+        unsigned long long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+        if (count == 0)
+        {
+            fprintf(out, "    %-6s n=0\n", stats_op_name(op));
+            continue;
+        }
+
+        char p50[32], p99[32], p999[32], max[32];
+        format_ns(p50, sizeof(p50), hist_percentile(h, 0.50));
+        format_ns(p99, sizeof(p99), hist_percentile(h, 0.99));
+        format_ns(p999, sizeof(p999), hist_percentile(h, 0.999));
+        format_ns(max, sizeof(max), atomic_load_explicit(&h->max, memory_order_relaxed));
+        fprintf(out, "    %-6s n=%llu p50=%s p99=%s p999=%s max=%s\n", stats_op_name(op), count, p50, p99, p999,
+                max);
+    }
+}
+
+void stats_print_latency_json(FILE* out, const WorkerStats* stats)
+{
+    fprintf(out, "\"latency_ns\":{");
+    for (int op = 0; stats && op < LAT_OP_COUNT; op++)
+    {
+        const Histogram* h = &stats->latency[op];
+        fprintf(out, "%s\"%s\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+                op ? "," : "", stats_op_name(op), atomic_load_explicit(&h->count, memory_order_relaxed),
+                hist_percentile(h, 0.50), hist_percentile(h, 0.99), hist_percentile(h, 0.999),
+                atomic_load_explicit(&h->max, memory_order_relaxed));
+    }
+    fprintf(out, "}");
+}
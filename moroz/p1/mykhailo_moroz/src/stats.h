@@ -0,0 +1,192 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "histogram.h"
+
+// Counters live in a MAP_SHARED page created by the parent before fork, so the
+// worker can update them with plain atomics and the parent can read them at any
+// time. They have to be lock-free, otherwise they are not safe across processes.
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64-bit atomics must be lock-free");
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "int atomics must be lock-free");
+
+typedef enum
+{
+    PHASE_STARTING = 0,
+    PHASE_INITIAL_SYNC,
+    PHASE_IDLE,
+    PHASE_APPLYING,
+    PHASE_RESTORING,  // running a live restore of the source, see cmd_restore
+    PHASE_STOPPED,
+    PHASE_COUNT
+} WorkerPhase;
+
+typedef enum
+{
+    STAT_EVENTS_READ = 0,
+    STAT_EVENTS_APPLIED,
+    STAT_BYTES_COPIED,
+    STAT_FILES_COPIED,
+    STAT_FILES_UNCHANGED,  // left alone by a resume because the quick check matched
+    STAT_QUEUE_DEPTH,
+    STAT_SKIPPED_PATHS,    // entries left out of a sync walk by the backup's rules
+    STAT_SKIPPED_BYTES,    // size of the regular files among them
+    STAT_SKIPPED_WATCHES,  // excluded directories that got no inotify watch
+    STAT_SKIPPED_EVENTS,   // events on excluded paths that were dropped
+    STAT_QUARANTINED,       // directories parked in the target's quarantine area
+    STAT_QUARANTINE_BYTES,  // size of the files in them
+    STAT_RECLAIMED,         // directories moved back out of quarantine instead of recopied
+    STAT_SCRUB_RUNS,        // scrubs finished, see scrub.h; the ones below count the last run only
+    STAT_SCRUB_CHECKED,     // entries compared
+    STAT_SCRUB_BYTES,       // file data read to compare contents, both sides
+    STAT_SCRUB_DIVERGED,    // entries whose mirror did not match the source
+    STAT_SCRUB_REPAIRED,    // ... and were copied or removed again
+    STAT_POLLED,            // subtrees scanned instead of watched right now, see polled.h
+    STAT_POLL_BUDGET,       // directories that got no watch because none were left
+    STAT_POLL_HOT,          // times a subtree had too many events and went over to rescans
+    STAT_POLL_SCANS,        // scans of polled subtrees done
+    STAT_POLL_CHANGES,      // entries those scans copied or removed
+    STAT_TIER_APPLIED,      // secondary target: primary changes replayed, see tierlog.h
+    STAT_TIER_BEHIND,       // ... bytes of the primary's log not replayed yet
+    STAT_TIER_RESYNCS,      // ... full compares against the primary target
+    STAT_DURABLE_SYNCS,     // target syncs done for -d, see durable.h
+    STAT_DURABLE_CHANGES,   // changes they made durable
+    STAT_DURABLE_PENDING,   // changes applied but not synced yet
+    STAT_DURABLE_WAIT_NS,   // time spent in those syncs
+    STAT_DURABLE_FAILURES,  // syncs that failed, each followed by a recopy of what they covered
+    STAT_TAIL_APPENDS,      // files updated by copying only what was appended, see tails.h
+    STAT_TAIL_TRUNCATES,    // files updated by truncating them
+    STAT_TAIL_BYTES_SAVED,  // bytes those did not have to copy again
+    STAT_TRASH_DIRS,        // directories deleted by moving them to the trash, see trash.h
+    STAT_TRASH_UNLINKED,    // entries the reclaimer removed from it
+    STAT_RESTORES,          // live restores the worker ran
+    STAT_RESTORE_ECHOES,    // events they caused that were dropped as their own, see echoes.h
+    STAT_OVERFLOWS,         // inotify queue overflows, each made good by a rescan of the tree
+    STAT_COUNT
+} StatCounter;
+
+// kind of target operation an event turned into, for the latency histograms
+typedef enum
+{
+    LAT_COPY = 0,
+    LAT_DELETE,
+    LAT_RENAME,
+    LAT_MKDIR,
+    LAT_OP_COUNT
+} LatencyOp;
+
+typedef struct
+{
+    atomic_ullong counters[STAT_COUNT];
+    atomic_llong last_event_ns;  // CLOCK_REALTIME of the last inotify read, 0 if none yet
+    atomic_int phase;
+    atomic_llong started_ns;    // CLOCK_MONOTONIC when the current worker was forked
+    atomic_llong protected_ns;  // time from fork until the target was synced and watched, 0 until then
+    atomic_llong synced_ns;     // CLOCK_REALTIME up to which the target matches the source, 0 if unknown
+    atomic_int scrub_request;     // SCRUB_* flags set by "verify", taken by the worker
+    atomic_llong scrub_started_ns;  // CLOCK_REALTIME when the current or last scrub began, 0 if never
+    atomic_llong scrub_done_ns;     // CLOCK_REALTIME when the last scrub ended, 0 if never or still running
+    // "restore" of a running backup: the daemon writes restore_from and bumps
+    // restore_request, the worker runs it and publishes the outcome by setting
+    // restore_done to the same value
+    atomic_uint restore_request;
+    atomic_uint restore_done;
+    atomic_int restore_failed;
+    atomic_ullong restore_copied;
+    atomic_ullong restore_unchanged;
+    char restore_from[PATH_MAX];
+    Histogram latency[LAT_OP_COUNT];  // inotify read -> target write done, in ns
+} WorkerStats;
+
+// set in the worker right after fork, or while a pool thread runs a task's
+// step; NULL in the parent so shared helpers (copy_file is also used by
+// restore) do not account anything there
+extern _Thread_local WorkerStats* g_stats;
+
+WorkerStats* stats_create(void);
+void stats_destroy(WorkerStats* stats);
+// called by the parent right before it forks a (new) worker for these stats
+void stats_worker_started(WorkerStats* stats);
+const char* stats_phase_name(int phase);
+void stats_print(FILE* out, const WorkerStats* stats);
+void stats_print_json(FILE* out, const WorkerStats* stats);
+const char* stats_op_name(int op);
+void stats_print_latency(FILE* out, const WorkerStats* stats);
+void stats_print_latency_json(FILE* out, const WorkerStats* stats);
+
+// hot path helpers: relaxed atomics only, no syscalls
+static inline void stats_add(StatCounter c, unsigned long long n)
+{
+    if (g_stats)
+        atomic_fetch_add_explicit(&g_stats->counters[c], n, memory_order_relaxed);
+}
+
+static inline void stats_set(StatCounter c, unsigned long long v)
+{
+    if (g_stats)
+        atomic_store_explicit(&g_stats->counters[c], v, memory_order_relaxed);
+}
+
+static inline void stats_set_phase(WorkerPhase phase)
+{
+    if (g_stats)
+        atomic_store_explicit(&g_stats->phase, (int)phase, memory_order_relaxed);
+}
+
+// CLOCK_REALTIME_COARSE is served by the vDSO, so this does not enter the kernel
+static inline void stats_touch_event(void)
+{
+    if (!g_stats)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    atomic_store_explicit(&g_stats->last_event_ns, (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec,
+                          memory_order_relaxed);
+}
+
+// CLOCK_MONOTONIC is a vDSO call as well; used for event-to-mirror latency
+static inline long long stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline long long stats_realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// the target reflects every change made in the source before realtime_ns
+static inline void stats_mark_synced(long long realtime_ns)
+{
+    if (g_stats)
+        atomic_store_explicit(&g_stats->synced_ns, realtime_ns, memory_order_relaxed);
+}
+
+// initial or resume sync is done and the tree is watched
+static inline void stats_mark_protected(void)
+{
+    if (!g_stats)
+        return;
+    long long d = stats_now_ns() - atomic_load_explicit(&g_stats->started_ns, memory_order_relaxed);
+    atomic_store_explicit(&g_stats->protected_ns, d > 0 ? d : 1, memory_order_relaxed);
+}
+
+// start_ns is the stats_now_ns() taken when the event was read from inotify
+static inline void stats_record_latency(LatencyOp op, long long start_ns)
+{
+    if (!g_stats || start_ns <= 0)
+        return;
+    long long d = stats_now_ns() - start_ns;
+    hist_record(&g_stats->latency[op], (unsigned long long)(d > 0 ? d : 0));
+}
+
+#endif
@@ -0,0 +1,923 @@
+#define _GNU_SOURCE
+#include "stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// Wire format: a 40 byte little-endian header, then path_len bytes of path and
+// len - path_len bytes of data.
+//   0 len   4 op   5 flags   6 path_len   8 seq   16 a   24 b   32 mode   36 unused
+// a is the offset (WRITE) or size (FILE_END) or session (HELLO), b the mtime,
+// or the unpacked length of a packed WRITE.
+#define HEADER_SIZE 40
+#define FRAME_MAX (64u << 20)
+#define FLAG_PACKED 1       // WRITE data is PackBits encoded
+#define FLAG_NEW_SESSION 1  // in the ACK answering a HELLO: the receiver did not know the session
+#define HELLO_TIMEOUT_MS 5000
+
+typedef struct
+{
+    uint32_t len;
+    uint8_t op;
+    uint8_t flags;
+    uint16_t path_len;
+    uint64_t seq;
+    uint64_t a;
+    uint64_t b;
+    uint32_t mode;
+} Header;
+
+struct StreamConn
+{
+    char* target;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int compress;
+    int fd;  // -1 while disconnected
+    uint64_t session;
+    uint64_t next_seq;
+    int introduced;  // the receiver knew the session once; losing it later means a resync
+    int resync;
+    // frames not acknowledged yet: [head, sent) is on the wire, [sent, len) queued
+    unsigned char* buf;
+    size_t head;
+    size_t sent;
+    size_t len;
+    size_t cap;
+    unsigned char acks[HEADER_SIZE * 16];
+    size_t acks_len;
+    unsigned char* chunk;  // file data read for a WRITE, and its packed form
+    unsigned char* packed;
+    volatile sig_atomic_t* stop;
+};
+
+static void put_u16(unsigned char* p, uint16_t v)
+{
+    for (int i = 0; i < 2; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_u32(unsigned char* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_u64(unsigned char* p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char* p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void header_encode(unsigned char* p, const Header* h)
+{
+    memset(p, 0, HEADER_SIZE);
+    put_u32(p, h->len);
+    p[4] = h->op;
+    p[5] = h->flags;
+    put_u16(p + 6, h->path_len);
+    put_u64(p + 8, h->seq);
+    put_u64(p + 16, h->a);
+    put_u64(p + 24, h->b);
+    put_u32(p + 32, h->mode);
+}
+
+static void header_decode(const unsigned char* p, Header* h)
+{
+    h->len = (uint32_t)get_le(p, 4);
+    h->op = p[4];
+    h->flags = p[5];
+    h->path_len = (uint16_t)get_le(p + 6, 2);
+    h->seq = get_le(p + 8, 8);
+    h->a = get_le(p + 16, 8);
+    h->b = get_le(p + 24, 8);
+    h->mode = (uint32_t)get_le(p + 32, 4);
+}
+
+// PackBits: a control byte c < 128 is followed by c + 1 literal bytes, c >= 128
+// by one byte repeated 257 - c times. Cheap, and enough for the zero-filled and
+// repetitive blocks that make up most compressible files. out must hold
+// n + n / 128 + 1 bytes.
+static size_t pack(const unsigned char* in, size_t n, unsigned char* out)
+{
+    size_t i = 0, o = 0;
+    while (i < n)
+    {
+        size_t run = 1;
+        while (i + run < n && run < 128 && in[i + run] == in[i])
+            run++;
+        if (run >= 3)
+        {
+            out[o++] = (unsigned char)(257 - run);
+            out[o++] = in[i];
+            i += run;
+            continue;
+        }
+        size_t start = i;
+        size_t literal = 0;
+        while (i < n && literal < 128 && !(i + 2 < n && in[i] == in[i + 1] && in[i] == in[i + 2]))
+        {
+            i++;
+            literal++;
+        }
+        out[o++] = (unsigned char)(literal - 1);
+        memcpy(out + o, in + start, literal);
+        o += literal;
+    }
+    return o;
+}
+
+static long long unpack(const unsigned char* in, size_t n, unsigned char* out, size_t cap)
+{
+    size_t i = 0, o = 0;
+    while (i < n)
+    {
+        unsigned c = in[i++];
+        if (c < 128)
+        {
+            size_t k = c + 1;
+            if (i + k > n || o + k > cap)
+                return -1;
+            memcpy(out + o, in + i, k);
+            i += k;
+            o += k;
+        }
+        else
+        {
+            size_t k = 257 - c;
+            if (i >= n || o + k > cap)
+                return -1;
+            memset(out + o, in[i++], k);
+            o += k;
+        }
+    }
+    return (long long)o;
+}
+
+int stream_is_target(const char* target)
+{
+    return strncmp(target, "stream://", 9) == 0 || strncmp(target, "unix:", 5) == 0;
+}
+
+// "stream://host:port" or "unix:/path", each optionally followed by "?compress"
+static int parse_address(const char* target, int passive, struct sockaddr_storage* addr, socklen_t* addr_len,
+                         int* compress)
+{
+    char buf[512];
+    if (snprintf(buf, sizeof(buf), "%s", target) >= (int)sizeof(buf))
+        return -1;
+    *compress = 0;
+    char* query = strchr(buf, '?');
+    if (query)
+    {
+        if (strcmp(query + 1, "compress") != 0)
+            return -1;
+        *compress = 1;
+        *query = '\0';
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    if (strncmp(buf, "unix:", 5) == 0)
+    {
+        struct sockaddr_un* un = (struct sockaddr_un*)addr;
+        const char* path = buf + 5;
+        if (*path == '\0' || strlen(path) >= sizeof(un->sun_path))
+            return -1;
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path, strlen(path) + 1);
+        *addr_len = sizeof(*un);
+        return 0;
+    }
+    if (strncmp(buf, "stream://", 9) != 0)
+        return -1;
+
+    char* host = buf + 9;
+    char* colon = strrchr(host, ':');
+    if (!colon || colon == host || colon[1] == '\0')
+        return -1;
+    *colon = '\0';
+    char* port = colon + 1;
+    size_t host_len = strlen(host);
+    if (host[0] == '[' && host[host_len - 1] == ']')
+    {
+        host[host_len - 1] = '\0';
+        host++;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | (passive ? AI_PASSIVE : 0);
+    struct addrinfo* res;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0)
+    {
+        fprintf(stderr, "%s: %s\n", target, gai_strerror(err));
+        return -1;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int send_all(int fd, const unsigned char* p, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// sender
+
+static void conn_drop(StreamConn* c)
+{
+    if (c->fd < 0)
+        return;
+    close(c->fd);
+    c->fd = -1;
+    c->acks_len = 0;
+    // whatever was on the wire and not acknowledged goes again
+    c->sent = c->head;
+    fprintf(stderr, "stream %s: disconnected, %zu bytes not acknowledged\n", c->target, c->len - c->head);
+}
+
+// frames up to seq were applied, their bytes can go
+static void conn_acked(StreamConn* c, uint64_t seq)
+{
+    while (c->head < c->sent)
+    {
+        Header h;
+        header_decode(c->buf + c->head, &h);
+        if (h.seq > seq)
+            break;
+        c->head += HEADER_SIZE + h.len;
+    }
+    if (c->head == c->len)
+        c->head = c->sent = c->len = 0;
+}
+
+// -1 once the receiver hung up or sent garbage
+static int conn_read_acks(StreamConn* c)
+{
+    while (1)
+    {
+        ssize_t r = recv(c->fd, c->acks + c->acks_len, sizeof(c->acks) - c->acks_len, MSG_DONTWAIT);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (r == 0)
+            return -1;
+        c->acks_len += (size_t)r;
+
+        size_t off = 0;
+        while (c->acks_len - off >= HEADER_SIZE)
+        {
+            Header h;
+            header_decode(c->acks + off, &h);
+            if (h.op != STREAM_OP_ACK || h.len != 0)
+                return -1;
+            conn_acked(c, h.seq);
+            off += HEADER_SIZE;
+        }
+        memmove(c->acks, c->acks + off, c->acks_len - off);
+        c->acks_len -= off;
+    }
+}
+
+static int conn_connect(StreamConn* c)
+{
+    int fd = socket(c->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket(stream)");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&c->addr, c->addr_len) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (c->addr.ss_family != AF_UNIX)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    unsigned char hello[HEADER_SIZE];
+    Header h = {0, STREAM_OP_HELLO, 0, 0, 0, c->session, 0, 0};
+    header_encode(hello, &h);
+    if (send_all(fd, hello, sizeof(hello)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    size_t got = 0;
+    while (got < HEADER_SIZE)
+    {
+        // a receiver busy with another sender does not answer; try again later
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, HELLO_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR && !*c->stop)
+            continue;
+        ssize_t r = (ready > 0) ? recv(fd, hello + got, HEADER_SIZE - got, 0) : -1;
+        if (r <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        got += (size_t)r;
+    }
+    header_decode(hello, &h);
+    if (h.op != STREAM_OP_ACK)
+    {
+        close(fd);
+        return -1;
+    }
+
+    c->fd = fd;
+    if (!(h.flags & FLAG_NEW_SESSION))
+    {
+        conn_acked(c, h.seq);
+    }
+    else if (c->introduced)
+    {
+        // the receiver restarted: what it holds is unknown, queued changes alone would not do
+        fprintf(stderr, "stream %s: receiver lost the session, sending everything again\n", c->target);
+        c->head = c->sent = c->len = 0;
+        c->resync = 1;
+    }
+    c->introduced = 1;
+    c->sent = c->head;
+    fprintf(stderr, "stream %s: connected, resending %zu bytes\n", c->target, c->len - c->head);
+    return 0;
+}
+
+// Moves queued frames to the socket and acknowledgements from it, reconnecting
+// when needed. With want_room it returns once the unacknowledged bytes are
+// down to half the window, otherwise once everything queued is written.
+static int conn_pump(StreamConn* c, int want_room)
+{
+    while (!*c->stop)
+    {
+        if (c->fd < 0 && conn_connect(c) < 0)
+        {
+            poll(NULL, 0, STREAM_RETRY_MS);
+            continue;
+        }
+        if (want_room ? c->len - c->head <= STREAM_WINDOW / 2 : c->sent == c->len)
+            return 0;
+
+        struct pollfd pfd = {c->fd, (short)(POLLIN | (c->sent < c->len ? POLLOUT : 0)), 0};
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("poll(stream)");
+                conn_drop(c);
+            }
+            continue;
+        }
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && conn_read_acks(c) < 0)
+        {
+            conn_drop(c);
+            continue;
+        }
+        if (pfd.revents & POLLOUT)
+        {
+            ssize_t w = send(c->fd, c->buf + c->sent, c->len - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (w >= 0)
+                c->sent += (size_t)w;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                conn_drop(c);
+        }
+    }
+    return -1;
+}
+
+static int conn_reserve(StreamConn* c, size_t n)
+{
+    if (c->len + n <= c->cap)
+        return 0;
+    if (c->head > 0)
+    {
+        memmove(c->buf, c->buf + c->head, c->len - c->head);
+        c->len -= c->head;
+        c->sent -= c->head;
+        c->head = 0;
+        if (c->len + n <= c->cap)
+            return 0;
+    }
+    size_t cap = c->cap ? c->cap : (1u << 16);
+    while (cap < c->len + n)
+        cap *= 2;
+    unsigned char* buf = realloc(c->buf, cap);
+    if (!buf)
+    {
+        perror("realloc(stream)");
+        return -1;
+    }
+    c->buf = buf;
+    c->cap = cap;
+    return 0;
+}
+
+static int frame_append(StreamConn* c, Header* h, const char* path, const void* data, size_t data_len)
+{
+    // a receiver that falls behind holds the sender back instead of its memory growing
+    if (c->len - c->head > STREAM_WINDOW && conn_pump(c, 1) < 0)
+        return -1;
+
+    size_t path_len = strlen(path);
+    if (path_len > UINT16_MAX || path_len + data_len > FRAME_MAX)
+    {
+        fprintf(stderr, "stream %s: operation on \"%s\" too large\n", c->target, path);
+        return 0;
+    }
+    if (conn_reserve(c, HEADER_SIZE + path_len + data_len) < 0)
+        return -1;
+
+    h->len = (uint32_t)(path_len + data_len);
+    h->path_len = (uint16_t)path_len;
+    h->seq = c->next_seq++;
+    header_encode(c->buf + c->len, h);
+    memcpy(c->buf + c->len + HEADER_SIZE, path, path_len);
+    if (data_len > 0)
+        memcpy(c->buf + c->len + HEADER_SIZE + path_len, data, data_len);
+    c->len += HEADER_SIZE + path_len + data_len;
+    return 0;
+}
+
+static uint64_t mtime_ns(const struct stat* st)
+{
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + (uint64_t)st->st_mtim.tv_nsec;
+}
+
+StreamConn* stream_open(const char* target, volatile sig_atomic_t* stop)
+{
+    StreamConn* c = calloc(1, sizeof(*c));
+    if (!c)
+    {
+        perror("calloc(stream)");
+        return NULL;
+    }
+    c->fd = -1;
+    c->stop = stop;
+    c->next_seq = 1;
+    c->session = ((uint64_t)getpid() << 40) ^ (uint64_t)stats_realtime_ns();
+    c->target = strdup(target);
+    c->chunk = malloc(STREAM_CHUNK);
+    c->packed = malloc(STREAM_CHUNK + STREAM_CHUNK / 128 + 1);
+    if (!c->target || !c->chunk || !c->packed ||
+        parse_address(target, 0, &c->addr, &c->addr_len, &c->compress) < 0)
+    {
+        fprintf(stderr, "stream: cannot use target \"%s\"\n", target);
+        stream_close(c);
+        return NULL;
+    }
+    if (conn_connect(c) < 0)
+    {
+        fprintf(stderr, "stream %s: receiver not reachable yet, retrying\n", target);
+    }
+    return c;
+}
+
+void stream_close(StreamConn* c)
+{
+    if (!c)
+        return;
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c->target);
+    free(c->buf);
+    free(c->chunk);
+    free(c->packed);
+    free(c);
+}
+
+int stream_mkdir(StreamConn* c, const char* rel, const struct stat* st)
+{
+    Header h = {0, STREAM_OP_MKDIR, 0, 0, 0, 0, mtime_ns(st), st->st_mode};
+    return frame_append(c, &h, rel, NULL, 0);
+}
+
+int stream_send_file(StreamConn* c, const char* rel, const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        // gone again already; its IN_DELETE follows
+        return 0;
+    }
+    // taken before reading, as in copy_file
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        perror("fstat(stream)");
+        close(fd);
+        return 0;
+    }
+
+    Header h = {0, STREAM_OP_FILE_BEGIN, 0, 0, 0, 0, 0, 0};
+    int ret = frame_append(c, &h, rel, NULL, 0);
+    uint64_t off = 0;
+    while (ret == 0)
+    {
+        ssize_t r = read(fd, c->chunk, STREAM_CHUNK);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            if (r < 0)
+                perror("read(stream)");
+            break;
+        }
+        Header w = {0, STREAM_OP_WRITE, 0, 0, 0, off, 0, 0};
+        size_t packed_len = c->compress ? pack(c->chunk, (size_t)r, c->packed) : (size_t)r;
+        if (c->compress && packed_len < (size_t)r)
+        {
+            w.flags = FLAG_PACKED;
+            w.b = (uint64_t)r;
+            ret = frame_append(c, &w, rel, c->packed, packed_len);
+        }
+        else
+        {
+            ret = frame_append(c, &w, rel, c->chunk, (size_t)r);
+        }
+        off += (uint64_t)r;
+        stats_add(STAT_BYTES_COPIED, (unsigned long long)r);
+    }
+    close(fd);
+    if (ret < 0)
+        return -1;
+
+    Header end = {0, STREAM_OP_FILE_END, 0, 0, 0, off, mtime_ns(&st), st.st_mode};
+    stats_add(STAT_FILES_COPIED, 1);
+    return frame_append(c, &end, rel, NULL, 0);
+}
+
+int stream_symlink(StreamConn* c, const char* rel, const char* link_target, const struct stat* st)
+{
+    Header h = {0, STREAM_OP_SYMLINK, 0, 0, 0, 0, mtime_ns(st), 0};
+    return frame_append(c, &h, rel, link_target, strlen(link_target) + 1);
+}
+
+int stream_rename(StreamConn* c, const char* from, const char* to)
+{
+    Header h = {0, STREAM_OP_RENAME, 0, 0, 0, 0, 0, 0};
+    return frame_append(c, &h, from, to, strlen(to) + 1);
+}
+
+int stream_delete(StreamConn* c, const char* rel)
+{
+    Header h = {0, STREAM_OP_DELETE, 0, 0, 0, 0, 0, 0};
+    return frame_append(c, &h, rel, NULL, 0);
+}
+
+int stream_prune(StreamConn* c, const char* rel, const char* names, size_t names_len)
+{
+    Header h = {0, STREAM_OP_PRUNE, 0, 0, 0, 0, 0, 0};
+    return frame_append(c, &h, rel, names, names_len);
+}
+
+int stream_flush(StreamConn* c)
+{
+    if (conn_pump(c, 0) < 0)
+        return -1;
+    if (c->resync)
+    {
+        c->resync = 0;
+        return STREAM_RESYNC;
+    }
+    return 0;
+}
+
+int stream_fd(const StreamConn* c) { return c->fd; }
+
+void stream_read_acks(StreamConn* c)
+{
+    if (c->fd >= 0 && conn_read_acks(c) < 0)
+        conn_drop(c);
+}
+
+size_t stream_unacked(const StreamConn* c) { return c->len - c->head; }
+
+// receiver
+
+// a path from the wire stays below the target root: relative, no "..", no empty components
+static int rel_path_ok(const char* p, size_t n, int root_ok)
+{
+    if (n == 0)
+        return root_ok;
+    if (memchr(p, '\0', n) || p[0] == '/' || p[n - 1] == '/')
+        return 0;
+    const char* end = p + n;
+    while (p < end)
+    {
+        const char* slash = memchr(p, '/', (size_t)(end - p));
+        size_t len = slash ? (size_t)(slash - p) : (size_t)(end - p);
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return 0;
+        p += len + 1;
+    }
+    return 1;
+}
+
+// NUL terminated data holding one path or name list; every name a plain file name
+static int names_ok(const char* data, size_t len)
+{
+    if (len == 0)
+        return 1;
+    if (data[len - 1] != '\0')
+        return 0;
+    for (const char* name = data; name < data + len; name += strlen(name) + 1)
+    {
+        if (!rel_path_ok(name, strlen(name), 0) || strchr(name, '/'))
+            return 0;
+    }
+    return 1;
+}
+
+typedef struct
+{
+    uint64_t session;
+    uint64_t last;  // highest sequence number applied in the session
+    unsigned char* plain;
+    int (*apply)(const StreamOp* op, void* arg);
+    void* arg;
+} Receiver;
+
+// -1 for a frame no sender of ours would produce; the connection is dropped
+static int receive_frame(Receiver* rc, const Header* h, const unsigned char* payload)
+{
+    if (h->seq <= rc->last)
+        return 0;  // applied before the reconnect
+
+    char path[PATH_MAX];
+    if (h->path_len >= sizeof(path) || h->path_len > h->len)
+        return -1;
+    memcpy(path, payload, h->path_len);
+    path[h->path_len] = '\0';
+
+    StreamOp op = {(StreamOpCode)h->op, path, (const char*)payload + h->path_len, h->len - h->path_len,
+                   h->a, h->a, (long long)h->b, h->mode};
+    int root_ok = (op.op == STREAM_OP_MKDIR || op.op == STREAM_OP_PRUNE);
+    if (!rel_path_ok(path, h->path_len, root_ok))
+        return -1;
+
+    switch (op.op)
+    {
+        case STREAM_OP_WRITE:
+            if (h->flags & FLAG_PACKED)
+            {
+                if (h->b > STREAM_CHUNK)
+                    return -1;
+                long long n = unpack((const unsigned char*)op.data, op.data_len, rc->plain, STREAM_CHUNK);
+                if (n != (long long)h->b)
+                    return -1;
+                op.data = (const char*)rc->plain;
+                op.data_len = (size_t)n;
+            }
+            break;
+        case STREAM_OP_RENAME:
+            if (op.data_len == 0 || op.data[op.data_len - 1] != '\0' || !rel_path_ok(op.data, op.data_len - 1, 0))
+                return -1;
+            break;
+        case STREAM_OP_SYMLINK:
+            if (op.data_len == 0 || memchr(op.data, '\0', op.data_len) != op.data + op.data_len - 1)
+                return -1;
+            break;
+        case STREAM_OP_PRUNE:
+            if (!names_ok(op.data, op.data_len))
+                return -1;
+            break;
+        case STREAM_OP_MKDIR:
+        case STREAM_OP_FILE_BEGIN:
+        case STREAM_OP_FILE_END:
+        case STREAM_OP_DELETE:
+            break;
+        default:
+            return -1;
+    }
+
+    rc->apply(&op, rc->arg);
+    rc->last = h->seq;
+    return 0;
+}
+
+static int send_ack(int fd, uint64_t seq, int flags)
+{
+    unsigned char frame[HEADER_SIZE];
+    Header h = {0, STREAM_OP_ACK, (uint8_t)flags, 0, seq, 0, 0, 0};
+    header_encode(frame, &h);
+    return send_all(fd, frame, sizeof(frame));
+}
+
+static void receive_serve(Receiver* rc, int fd, volatile sig_atomic_t* stop)
+{
+    unsigned char* buf = NULL;
+    size_t len = 0, cap = 0;
+    int hello = 0;
+    uint64_t acked = 0;
+
+    while (!*stop)
+    {
+        // everything readable is applied first, then acknowledged in one go
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 0) == 0 && hello && acked != rc->last)
+        {
+            if (send_ack(fd, rc->last, 0) < 0)
+                break;
+            acked = rc->last;
+        }
+
+        if (cap - len < STREAM_CHUNK)
+        {
+            size_t new_cap = cap ? cap * 2 : (1u << 20);
+            unsigned char* grown = realloc(buf, new_cap);
+            if (!grown)
+            {
+                perror("realloc(receive)");
+                break;
+            }
+            buf = grown;
+            cap = new_cap;
+        }
+        ssize_t r = recv(fd, buf + len, cap - len, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        len += (size_t)r;
+
+        size_t off = 0;
+        int bad = 0;
+        while (len - off >= HEADER_SIZE)
+        {
+            Header h;
+            header_decode(buf + off, &h);
+            if (h.len > FRAME_MAX)
+            {
+                bad = 1;
+                break;
+            }
+            if (len - off < HEADER_SIZE + h.len)
+            {
+                // grow so the whole frame fits; the next recv fills it
+                while (cap - off < HEADER_SIZE + h.len + STREAM_CHUNK)
+                    cap *= 2;
+                unsigned char* grown = realloc(buf, cap);
+                if (!grown)
+                {
+                    perror("realloc(receive)");
+                    bad = 1;
+                }
+                else
+                {
+                    buf = grown;
+                }
+                break;
+            }
+
+            if (h.op == STREAM_OP_HELLO)
+            {
+                int known = (h.a == rc->session);
+                if (!known)
+                {
+                    rc->session = h.a;
+                    rc->last = 0;
+                }
+                hello = 1;
+                acked = rc->last;
+                bad = send_ack(fd, rc->last, known ? 0 : FLAG_NEW_SESSION) < 0;
+                fprintf(stderr, "receive: %s session, applied up to %llu\n", known ? "resumed" : "new",
+                        (unsigned long long)rc->last);
+            }
+            else if (h.op == STREAM_OP_ACK || !hello)
+            {
+                bad = 1;
+            }
+            else
+            {
+                bad = receive_frame(rc, &h, buf + off + HEADER_SIZE) < 0;
+            }
+            if (bad)
+                break;
+            off += HEADER_SIZE + h.len;
+        }
+        if (bad)
+        {
+            fprintf(stderr, "receive: malformed frame, dropping the connection\n");
+            break;
+        }
+        memmove(buf, buf + off, len - off);
+        len -= off;
+    }
+    free(buf);
+}
+
+static int listen_on(const char* address, struct sockaddr_storage* addr)
+{
+    socklen_t addr_len;
+    int compress;
+    if (parse_address(address, 1, addr, &addr_len, &compress) < 0)
+    {
+        fprintf(stderr, "receive: cannot listen on \"%s\"\n", address);
+        return -1;
+    }
+    int fd = socket(addr->ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket(receive)");
+        return -1;
+    }
+    if (addr->ss_family == AF_UNIX)
+    {
+        unlink(((struct sockaddr_un*)addr)->sun_path);
+    }
+    else
+    {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(fd, (struct sockaddr*)addr, addr_len) < 0 || listen(fd, 4) < 0)
+    {
+        perror("bind/listen(receive)");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int stream_receive(const char* address, int (*apply)(const StreamOp* op, void* arg), void* arg,
+                   volatile sig_atomic_t* stop)
+{
+    struct sockaddr_storage addr;
+    int lfd = listen_on(address, &addr);
+    if (lfd < 0)
+        return -1;
+    Receiver rc = {0, 0, malloc(STREAM_CHUNK), apply, arg};
+    if (!rc.plain)
+    {
+        perror("malloc(receive)");
+        close(lfd);
+        return -1;
+    }
+    fprintf(stderr, "receiving on %s\n", address);
+
+    int ret = 0;
+    while (!*stop)
+    {
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept4(receive)");
+            ret = -1;
+            break;
+        }
+        receive_serve(&rc, fd, stop);
+        close(fd);
+    }
+
+    free(rc.plain);
+    close(lfd);
+    if (addr.ss_family == AF_UNIX)
+        unlink(((struct sockaddr_un*)&addr)->sun_path);
+    return ret;
+}
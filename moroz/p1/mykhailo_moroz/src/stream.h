@@ -0,0 +1,89 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Mirror operations sent to a receiver ("sop-backup receive") instead of being
+// applied to a local target. A target is "stream://host:port" over TCP or
+// "unix:/path" over a Unix socket; "?compress" after either packs file data.
+//
+// Every operation is a frame with a sequence number. The sender keeps writing
+// without waiting; the receiver applies frames in order and acknowledges the
+// highest one applied whenever it runs out of input. Frames not acknowledged
+// yet are kept and sent again after a reconnect, and since every frame can be
+// applied twice (file data goes to a part file, at its offset) nothing has to
+// be tracked beyond the last acknowledged number.
+
+#define STREAM_WINDOW (16u << 20)  // unacknowledged bytes before the sender waits for the receiver
+#define STREAM_CHUNK (64u << 10)   // file data per frame
+#define STREAM_RETRY_MS 1000       // between connection attempts
+#define STREAM_PART_SUFFIX ".sop-part"
+
+typedef enum
+{
+    STREAM_OP_HELLO = 1,  // opens or resumes a session
+    STREAM_OP_ACK,        // receiver -> sender
+    STREAM_OP_MKDIR,
+    STREAM_OP_FILE_BEGIN,  // empties the part file of path
+    STREAM_OP_WRITE,       // data at offset into the part file
+    STREAM_OP_FILE_END,    // part file gets size, mode, mtime and replaces path
+    STREAM_OP_SYMLINK,
+    STREAM_OP_RENAME,
+    STREAM_OP_DELETE,
+    STREAM_OP_PRUNE,  // the directory at path holds only the listed names
+} StreamOpCode;
+
+// one decoded operation as handed to the receiver's apply callback; paths are
+// relative to the target root, checked not to leave it, "" is the root itself
+typedef struct
+{
+    StreamOpCode op;
+    const char* path;
+    const char* data;  // WRITE: file data, RENAME: new path, SYMLINK: link target, PRUNE: NUL terminated names
+    size_t data_len;
+    uint64_t offset;  // WRITE
+    uint64_t size;    // FILE_END
+    long long mtime_ns;
+    uint32_t mode;
+} StreamOp;
+
+int stream_is_target(const char* target);
+
+typedef struct StreamConn StreamConn;
+
+// NULL only if target is malformed; a receiver that cannot be reached yet is
+// retried by stream_flush. stop is checked whenever the sender has to wait.
+StreamConn* stream_open(const char* target, volatile sig_atomic_t* stop);
+void stream_close(StreamConn* c);
+
+// queue one operation; -1 means stopped or out of memory
+int stream_mkdir(StreamConn* c, const char* rel, const struct stat* st);
+int stream_send_file(StreamConn* c, const char* rel, const char* path);
+int stream_symlink(StreamConn* c, const char* rel, const char* link_target, const struct stat* st);
+int stream_rename(StreamConn* c, const char* from, const char* to);
+int stream_delete(StreamConn* c, const char* rel);
+int stream_prune(StreamConn* c, const char* rel, const char* names, size_t names_len);
+
+// Writes out everything queued, reconnecting as often as it takes. Returns 0,
+// STREAM_RESYNC when it had to reconnect to a receiver that no longer knows
+// the session (its state is unknown, so the whole tree has to be sent again),
+// or -1 when stopped.
+#define STREAM_RESYNC 1
+int stream_flush(StreamConn* c);
+// to poll for acknowledgements, -1 while disconnected
+int stream_fd(const StreamConn* c);
+// takes in the acknowledgements that arrived, without blocking
+void stream_read_acks(StreamConn* c);
+// bytes sent or queued that the receiver has not confirmed
+size_t stream_unacked(const StreamConn* c);
+
+// Receive mode: serves senders on address, one at a time, passing every new
+// operation to apply, until *stop is set. The session survives reconnects of
+// the same sender; a new one starts from scratch.
+int stream_receive(const char* address, int (*apply)(const StreamOp* op, void* arg), void* arg,
+                   volatile sig_atomic_t* stop);
+
+#endif
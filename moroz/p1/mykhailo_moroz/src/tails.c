@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include "tails.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static size_t tail_slot(dev_t dev, ino_t ino, size_t capacity)
+{
+    unsigned long long h = ((unsigned long long)ino ^ ((unsigned long long)dev << 40)) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (capacity - 1);
+}
+
+static TailEntry* tail_find(Tails* tails, dev_t dev, ino_t ino)
+{
+    size_t s = tail_slot(dev, ino, tails->capacity);
+    while (tails->slots[s].ino != 0)
+    {
+        if (tails->slots[s].ino == ino && tails->slots[s].dev == dev)
+            return &tails->slots[s];
+        s = (s + 1) & (tails->capacity - 1);
+    }
+    return &tails->slots[s];
+}
+
+static int tails_grow(Tails* tails)
+{
+    size_t capacity = tails->capacity ? tails->capacity * 2 : 256;
+    TailEntry* slots = calloc(capacity, sizeof(*slots));
+    if (!slots)
+    {
+        perror("calloc(tails)");
+        return -1;
+    }
+    TailEntry* old = tails->slots;
+    size_t old_capacity = tails->capacity;
+    tails->slots = slots;
+    tails->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i].ino != 0)
+            *tail_find(tails, old[i].dev, old[i].ino) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+TailEntry* tails_get(Tails* tails, dev_t dev, ino_t ino)
+{
+    if (tails->used == 0 || ino == 0)
+        return NULL;
+    TailEntry* e = tail_find(tails, dev, ino);
+    return e->ino != 0 ? e : NULL;
+}
+
+int tails_put(Tails* tails, const TailEntry* e)
+{
+    if (e->ino == 0)
+        return 0;
+    TailEntry* slot = tails->used ? tail_find(tails, e->dev, e->ino) : NULL;
+    if (slot && slot->ino != 0)
+    {
+        *slot = *e;
+        return 0;
+    }
+    // entries of files that are gone are never removed one by one; a full
+    // table is simply forgotten, which costs each file one more full copy
+    if (tails->used >= TAILS_MAX)
+    {
+        memset(tails->slots, 0, tails->capacity * sizeof(*tails->slots));
+        tails->used = 0;
+    }
+    if ((tails->used + 1) * 2 > tails->capacity && tails_grow(tails) < 0)
+        return -1;
+    *tail_find(tails, e->dev, e->ino) = *e;
+    tails->used++;
+    return 0;
+}
+
+void tails_free(Tails* tails)
+{
+    free(tails->slots);
+    memset(tails, 0, sizeof(*tails));
+}
+
+static uint64_t tail_mix(uint64_t h, uint64_t w)
+{
+    h ^= w * 0x9E3779B97F4A7C15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xC2B2AE3D27D4EB4FULL;
+}
+
+void tails_hash_init(TailHash* th)
+{
+    th->h = 0xCBF29CE484222325ULL;
+    th->word = 0;
+    th->fill = 0;
+}
+
+void tails_hash_update(TailHash* th, const void* data, size_t n)
+{
+    const unsigned char* p = data;
+    // finish the word a previous piece left open
+    while (n > 0 && th->fill != 0)
+    {
+        th->word |= (uint64_t)*p++ << (8 * th->fill);
+        n--;
+        if (++th->fill == 8)
+        {
+            th->h = tail_mix(th->h, th->word);
+            th->word = 0;
+            th->fill = 0;
+        }
+    }
+    while (n >= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        th->h = tail_mix(th->h, le64toh(w));
+        p += 8;
+        n -= 8;
+    }
+    while (n > 0)
+    {
+        th->word |= (uint64_t)*p++ << (8 * th->fill++);
+        n--;
+    }
+}
+
+uint64_t tails_hash_value(const TailHash* th)
+{
+    // the top byte of an open word is always free for its length
+    return tail_mix(th->h, th->word | ((uint64_t)th->fill << 56));
+}
+
+int tails_hash_fd(int fd, off_t size, TailHash* th)
+{
+    unsigned char buf[65536];
+    tails_hash_init(th);
+    off_t off = 0;
+    while (off < size)
+    {
+        size_t n = size - off < (off_t)sizeof(buf) ? (size_t)(size - off) : sizeof(buf);
+        ssize_t r = pread(fd, buf, n, off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        tails_hash_update(th, buf, (size_t)r);
+        off += r;
+    }
+    return 0;
+}
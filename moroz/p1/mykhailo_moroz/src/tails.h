@@ -0,0 +1,64 @@
+#ifndef TAILS_H
+#define TAILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// What a worker last copied of each file, so a file that only grew or shrank
+// since is brought up to date by appending or truncating instead of copying
+// it whole again: an append-only log otherwise costs its full size on every
+// close, O(n^2) bytes over its lifetime.
+//
+// An entry holds the size of the target after the last copy and a hash of
+// all of those bytes. The source still starts with them when the hash of its
+// first size bytes matches, and then only what follows has to be copied; the
+// hash of the target is carried forward over the appended bytes, so the
+// target is never read back. Anything else is a rewrite and gets a full copy,
+// and so does a file that kept its size. An append still reads the old part
+// of the source once, which a file that is being appended to mostly has in
+// the page cache, but writes only what is new. The table lives in the
+// worker's memory: after a restart every file is copied whole once more
+// before appends are recognised again.
+
+#define TAILS_MAX (1u << 16)  // files tracked at most; the table starts over when it is full
+
+// running hash of a byte stream; feeding it the same bytes in any pieces
+// gives the same state
+typedef struct
+{
+    uint64_t h;
+    uint64_t word;  // bytes not mixed in yet, first one lowest
+    unsigned fill;  // how many of them, 0 to 7
+} TailHash;
+
+typedef struct
+{
+    dev_t dev;  // of the source file; ino 0 marks an empty slot
+    ino_t ino;
+    ino_t dst_ino;  // the target file the entry describes
+    off_t size;
+    TailHash hash;  // of those size bytes
+} TailEntry;
+
+typedef struct
+{
+    TailEntry* slots;
+    size_t capacity;  // power of two
+    size_t used;
+} Tails;
+
+// the entry of the source file dev:ino, NULL if there is none
+TailEntry* tails_get(Tails* tails, dev_t dev, ino_t ino);
+// adds or replaces the entry of e->dev:e->ino
+int tails_put(Tails* tails, const TailEntry* e);
+void tails_free(Tails* tails);
+
+void tails_hash_init(TailHash* th);
+void tails_hash_update(TailHash* th, const void* data, size_t n);
+// the hash of everything fed so far
+uint64_t tails_hash_value(const TailHash* th);
+// starts th over with the first size bytes of fd; -1 if they cannot be read
+int tails_hash_fd(int fd, off_t size, TailHash* th);
+
+#endif
@@ -0,0 +1,687 @@
+#define _GNU_SOURCE
+#include "tasks.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pidmap.h"
+
+// steps waiting to run, Task.work
+#define TASK_START 1
+#define TASK_EVENTS 2
+#define TASK_TICK 4
+#define TASK_CANCEL 8
+
+// bytes the reader takes from inotify at once
+#define TASK_READ_SIZE (64u << 10)
+
+struct Task
+{
+    const TaskOps* ops;
+    void* arg;
+    volatile sig_atomic_t cancel;
+    // the rest is guarded by g_rt.lock
+    int work;
+    int queued;   // on the run queue
+    int running;  // a pool thread has it
+    int started;  // start succeeded, stop is owed
+    int ended;
+    int failed;
+    int tick_ms;  // 0 = no ticks
+    long long tick_at_ns;
+    char* events;  // routed, not handed to the task yet
+    size_t events_len;
+    size_t events_cap;
+    Task* next;   // run queue or done list
+    size_t slot;  // in g_rt.live
+};
+
+// one task holding a watch; the holders of a wd are chained from by_wd
+typedef struct
+{
+    Task* task;
+    size_t next;  // 0 = end of chain; also chains the free entries
+} Holder;
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // the run queue got a task, or shutting down
+    pthread_cond_t gone;  // a task ended
+    int inotify_fd;
+    int epoll_fd;
+    int wake_fd;  // makes the reader look at its state again
+    int done_fd;
+    pthread_t reader;
+    pthread_t* pool;
+    int threads;
+    int starting;  // tasks in their start step, at most threads - 1 of them
+    int stopping;
+    Task* hog;  // has TASK_QUEUE_MAX bytes waiting, the reader holds off until it drains
+    long long drained_ns;
+    Task* run_head;
+    Task* run_tail;
+    Task* done;
+    Task** live;
+    size_t live_count;
+    size_t live_capacity;
+    PidMap by_wd;  // wd -> first Holder
+    Holder* holders;  // [0] unused
+    size_t holders_capacity;
+    size_t holders_used;
+    size_t holders_free;
+} g_rt = {.lock = PTHREAD_MUTEX_INITIALIZER,
+          .work = PTHREAD_COND_INITIALIZER,
+          .gone = PTHREAD_COND_INITIALIZER,
+          .inotify_fd = -1,
+          .epoll_fd = -1,
+          .wake_fd = -1,
+          .done_fd = -1};
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void eventfd_post(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("write(eventfd)");
+}
+
+static void eventfd_clear(int fd)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read(eventfd)");
+}
+
+// the run queue, under the lock
+
+static void schedule(Task* t, int work)
+{
+    t->work |= work;
+    if (t->queued || t->running || t->ended)
+        return;
+    t->queued = 1;
+    t->next = NULL;
+    if (g_rt.run_tail)
+        g_rt.run_tail->next = t;
+    else
+        g_rt.run_head = t;
+    g_rt.run_tail = t;
+    pthread_cond_signal(&g_rt.work);
+}
+
+// the first queued task that may run now; a start is a whole initial sync, so
+// one thread is kept for the events of everyone else while they run
+static Task* pick(void)
+{
+    int start_limit = g_rt.threads > 1 ? g_rt.threads - 1 : 1;
+    Task* prev = NULL;
+    for (Task* t = g_rt.run_head; t; prev = t, t = t->next)
+    {
+        if ((t->work & TASK_START) && !t->cancel && g_rt.starting >= start_limit)
+            continue;
+        if (prev)
+            prev->next = t->next;
+        else
+            g_rt.run_head = t->next;
+        if (g_rt.run_tail == t)
+            g_rt.run_tail = prev;
+        t->queued = 0;
+        return t;
+    }
+    return NULL;
+}
+
+// watch holders, under the lock
+
+static int holder_new(Task* t, size_t next, size_t* out)
+{
+    if (!g_rt.holders_free && g_rt.holders_used >= g_rt.holders_capacity)
+    {
+        size_t capacity = g_rt.holders_capacity ? g_rt.holders_capacity * 2 : 256;
+        Holder* holders = realloc(g_rt.holders, capacity * sizeof(*holders));
+        if (!holders)
+        {
+            perror("realloc(holders)");
+            return -1;
+        }
+        g_rt.holders = holders;
+        g_rt.holders_capacity = capacity;
+    }
+    size_t h = g_rt.holders_free;
+    if (h)
+        g_rt.holders_free = g_rt.holders[h].next;
+    else
+        h = g_rt.holders_used++;
+    g_rt.holders[h] = (Holder){t, next};
+    *out = h;
+    return 0;
+}
+
+static void holder_free(size_t h)
+{
+    g_rt.holders[h].task = NULL;
+    g_rt.holders[h].next = g_rt.holders_free;
+    g_rt.holders_free = h;
+}
+
+// drops t (every task if t is NULL) from the holders of wd; the kernel watch
+// goes once nobody holds it, unless the kernel already dropped it
+static void release_wd(int wd, Task* t, int kernel_dropped)
+{
+    size_t head;
+    if (pidmap_get(&g_rt.by_wd, wd, &head) < 0)
+        return;
+    size_t* link = &head;
+    while (*link)
+    {
+        size_t h = *link;
+        if (!t || g_rt.holders[h].task == t)
+        {
+            *link = g_rt.holders[h].next;
+            holder_free(h);
+        }
+        else
+        {
+            link = &g_rt.holders[h].next;
+        }
+    }
+    if (head)
+    {
+        pidmap_put(&g_rt.by_wd, wd, head);
+        return;
+    }
+    pidmap_del(&g_rt.by_wd, wd);
+    if (!kernel_dropped && inotify_rm_watch(g_rt.inotify_fd, wd) < 0 && errno != EINVAL)
+        perror("inotify_rm_watch");
+}
+
+// routing, under the lock
+
+static void deliver(Task* t, const struct inotify_event* ev, size_t size)
+{
+    if (t->ended)
+        return;
+    if (t->events_len + size > t->events_cap)
+    {
+        size_t capacity = t->events_cap ? t->events_cap * 2 : TASK_BATCH;
+        while (capacity < t->events_len + size)
+            capacity *= 2;
+        char* events = realloc(t->events, capacity);
+        if (!events)
+        {
+            // the task would silently miss a change; a restart resyncs it instead
+            perror("realloc(task events)");
+            t->cancel = 1;
+            t->failed = 1;
+            schedule(t, TASK_CANCEL);
+            return;
+        }
+        t->events = events;
+        t->events_cap = capacity;
+    }
+    memcpy(t->events + t->events_len, ev, size);
+    t->events_len += size;
+    if (t->events_len >= TASK_QUEUE_MAX)
+        g_rt.hog = t;
+    schedule(t, TASK_EVENTS);
+}
+
+static void route(const char* buf, ssize_t len)
+{
+    for (ssize_t i = 0; i < len;)
+    {
+        const struct inotify_event* ev = (const struct inotify_event*)&buf[i];
+        size_t size = sizeof(*ev) + ev->len;
+        i += (ssize_t)size;
+
+        if (ev->wd < 0)
+        {
+            // queue overflow: everyone may have missed something and rescans
+            for (size_t k = 0; k < g_rt.live_count; k++)
+                deliver(g_rt.live[k], ev, size);
+            continue;
+        }
+        size_t h;
+        if (pidmap_get(&g_rt.by_wd, ev->wd, &h) < 0)
+            continue;
+        for (; h; h = g_rt.holders[h].next)
+            deliver(g_rt.holders[h].task, ev, size);
+        if (ev->mask & IN_IGNORED)
+            release_wd(ev->wd, NULL, 1);
+    }
+}
+
+// queues the ticks that are due and returns the time until the next one
+static int schedule_ticks(void)
+{
+    long long now = monotonic_ns();
+    long long next = now + 1000LL * 1000000LL;
+    for (size_t i = 0; i < g_rt.live_count; i++)
+    {
+        Task* t = g_rt.live[i];
+        if (t->tick_ms <= 0)
+            continue;
+        if (t->tick_at_ns <= now)
+        {
+            schedule(t, TASK_TICK);
+            t->tick_at_ns = now + t->tick_ms * 1000000LL;
+        }
+        if (t->tick_at_ns < next)
+            next = t->tick_at_ns;
+    }
+    int ms = (int)((next - now) / 1000000LL);
+    return ms < TASK_TICK_GRAIN_MS ? TASK_TICK_GRAIN_MS : ms;
+}
+
+static void* reader_main(void* unused)
+{
+    char* buf = malloc(TASK_READ_SIZE);
+    if (!buf)
+    {
+        perror("malloc(reader)");
+        return NULL;
+    }
+    int reading = 1;
+
+    pthread_mutex_lock(&g_rt.lock);
+    while (!g_rt.stopping)
+    {
+        int timeout = schedule_ticks();
+        // while one task is that far behind the kernel queue holds the rest
+        int want = g_rt.hog == NULL;
+        pthread_mutex_unlock(&g_rt.lock);
+
+        if (want != reading)
+        {
+            struct epoll_event ev = {want ? EPOLLIN : 0, {.fd = g_rt.inotify_fd}};
+            if (epoll_ctl(g_rt.epoll_fd, EPOLL_CTL_MOD, g_rt.inotify_fd, &ev) < 0)
+                perror("epoll_ctl(reader)");
+            reading = want;
+        }
+
+        struct epoll_event evs[2];
+        int n = epoll_wait(g_rt.epoll_fd, evs, 2, timeout);
+        if (n < 0 && errno != EINTR)
+            perror("epoll_wait(reader)");
+        for (int i = 0; i < n; i++)
+        {
+            if (evs[i].data.fd == g_rt.wake_fd)
+            {
+                eventfd_clear(g_rt.wake_fd);
+                continue;
+            }
+            ssize_t len = read(g_rt.inotify_fd, buf, TASK_READ_SIZE);
+            if (len < 0 && errno != EAGAIN && errno != EINTR)
+                perror("read(inotify)");
+            if (len > 0)
+            {
+                pthread_mutex_lock(&g_rt.lock);
+                route(buf, len);
+                pthread_mutex_unlock(&g_rt.lock);
+            }
+        }
+
+        // taken before looking at the queue: whatever happened earlier was
+        // read and routed already if the queue turns out empty
+        long long stamp = realtime_ns();
+        int queued = 0;
+        if (reading && ioctl(g_rt.inotify_fd, FIONREAD, &queued) < 0)
+            queued = -1;
+        pthread_mutex_lock(&g_rt.lock);
+        if (reading && queued == 0)
+            g_rt.drained_ns = stamp;
+    }
+    pthread_mutex_unlock(&g_rt.lock);
+    free(buf);
+    return NULL;
+}
+
+// under the lock: t has run its last step
+static void task_end(Task* t, int failed)
+{
+    t->ended = 1;
+    t->failed = t->failed || failed;
+    t->work = 0;
+    free(t->events);
+    t->events = NULL;
+    t->events_len = t->events_cap = 0;
+    if (g_rt.hog == t)
+    {
+        g_rt.hog = NULL;
+        eventfd_post(g_rt.wake_fd);
+    }
+
+    for (size_t i = 0; i < g_rt.by_wd.capacity; i++)
+    {
+        pid_t wd = g_rt.by_wd.keys[i];
+        if (wd > 0)
+            release_wd(wd, t, 0);
+    }
+
+    g_rt.live[t->slot] = g_rt.live[--g_rt.live_count];
+    g_rt.live[t->slot]->slot = t->slot;
+    t->next = g_rt.done;
+    g_rt.done = t;
+    eventfd_post(g_rt.done_fd);
+    pthread_cond_broadcast(&g_rt.gone);
+}
+
+// takes whole records worth at most TASK_BATCH bytes (at least one) off the
+// task's queue into batch
+static size_t take_batch(Task* t, char* batch)
+{
+    size_t n = 0;
+    while (n < t->events_len)
+    {
+        const struct inotify_event* ev = (const struct inotify_event*)(t->events + n);
+        size_t size = sizeof(*ev) + ev->len;
+        if (n > 0 && n + size > TASK_BATCH)
+            break;
+        n += size;
+    }
+    memcpy(batch, t->events, n);
+    memmove(t->events, t->events + n, t->events_len - n);
+    t->events_len -= n;
+    if (t->events_len == 0)
+    {
+        free(t->events);
+        t->events = NULL;
+        t->events_cap = 0;
+    }
+    else
+    {
+        t->work |= TASK_EVENTS;
+    }
+    if (g_rt.hog == t && t->events_len < TASK_QUEUE_MAX / 2)
+    {
+        g_rt.hog = NULL;
+        eventfd_post(g_rt.wake_fd);
+    }
+    return n;
+}
+
+static void* pool_main(void* unused)
+{
+    char* batch = malloc(TASK_BATCH + sizeof(struct inotify_event) + NAME_MAX + 1);
+    if (!batch)
+    {
+        perror("malloc(pool)");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_rt.lock);
+    for (;;)
+    {
+        Task* t = pick();
+        if (!t)
+        {
+            if (g_rt.stopping && g_rt.live_count == 0)
+                break;
+            pthread_cond_wait(&g_rt.work, &g_rt.lock);
+            continue;
+        }
+
+        int work = t->work;
+        t->work = 0;
+        t->running = 1;
+        size_t len = (work & TASK_EVENTS) ? take_batch(t, batch) : 0;
+        if (work & TASK_START)
+            g_rt.starting++;
+        pthread_mutex_unlock(&g_rt.lock);
+
+        int ret = 0;
+        if ((work & TASK_START) && !t->cancel)
+        {
+            ret = t->ops->start(t, t->arg);
+            t->started = ret == 0;
+        }
+        else if ((work & TASK_START))
+        {
+            ret = 1;
+        }
+        if (ret == 0 && len > 0)
+            ret = t->ops->events(t, t->arg, batch, len);
+        if (ret == 0 && (work & TASK_TICK))
+            ret = t->ops->tick(t, t->arg);
+        if (ret == 0 && t->cancel)
+            ret = 1;
+        if (ret != 0 && t->started)
+            t->ops->stop(t, t->arg);
+
+        pthread_mutex_lock(&g_rt.lock);
+        t->running = 0;
+        if (work & TASK_START)
+        {
+            g_rt.starting--;
+            // a start held back by the limit may go now
+            pthread_cond_signal(&g_rt.work);
+        }
+        if (ret != 0)
+            task_end(t, ret < 0);
+        else if (t->work)
+            schedule(t, 0);
+    }
+    pthread_mutex_unlock(&g_rt.lock);
+    free(batch);
+    return NULL;
+}
+
+int tasks_start(int threads)
+{
+    g_rt.threads = threads;
+    g_rt.holders_used = 1;
+    g_rt.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    g_rt.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    g_rt.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    g_rt.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    g_rt.pool = calloc((size_t)threads, sizeof(*g_rt.pool));
+    if (g_rt.inotify_fd < 0 || g_rt.epoll_fd < 0 || g_rt.wake_fd < 0 || g_rt.done_fd < 0 || !g_rt.pool)
+    {
+        perror("tasks_start");
+        return -1;
+    }
+    struct epoll_event ev = {EPOLLIN, {.fd = g_rt.inotify_fd}};
+    struct epoll_event wake = {EPOLLIN, {.fd = g_rt.wake_fd}};
+    if (epoll_ctl(g_rt.epoll_fd, EPOLL_CTL_ADD, g_rt.inotify_fd, &ev) < 0 ||
+        epoll_ctl(g_rt.epoll_fd, EPOLL_CTL_ADD, g_rt.wake_fd, &wake) < 0)
+    {
+        perror("epoll_ctl(tasks)");
+        return -1;
+    }
+
+    // signals are the control loop's business, none may land on these threads
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&g_rt.reader, NULL, reader_main, NULL);
+    for (int i = 0; !err && i < threads; i++)
+    {
+        err = pthread_create(&g_rt.pool[i], NULL, pool_main, NULL);
+        if (err)
+            g_rt.threads = i;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+void tasks_shutdown(void)
+{
+    if (!g_rt.pool)
+        return;
+    pthread_mutex_lock(&g_rt.lock);
+    g_rt.stopping = 1;
+    for (size_t i = 0; i < g_rt.live_count; i++)
+    {
+        g_rt.live[i]->cancel = 1;
+        schedule(g_rt.live[i], TASK_CANCEL);
+    }
+    while (g_rt.live_count > 0)
+        pthread_cond_wait(&g_rt.gone, &g_rt.lock);
+    pthread_cond_broadcast(&g_rt.work);
+    pthread_mutex_unlock(&g_rt.lock);
+    eventfd_post(g_rt.wake_fd);
+
+    pthread_join(g_rt.reader, NULL);
+    for (int i = 0; i < g_rt.threads; i++)
+        pthread_join(g_rt.pool[i], NULL);
+    free(g_rt.pool);
+    g_rt.pool = NULL;
+    free(g_rt.live);
+    free(g_rt.holders);
+    pidmap_free(&g_rt.by_wd);
+    close(g_rt.inotify_fd);
+    close(g_rt.epoll_fd);
+    close(g_rt.wake_fd);
+}
+
+Task* tasks_spawn(const TaskOps* ops, void* arg)
+{
+    Task* t = calloc(1, sizeof(*t));
+    if (!t)
+    {
+        perror("calloc(task)");
+        return NULL;
+    }
+    t->ops = ops;
+    t->arg = arg;
+
+    pthread_mutex_lock(&g_rt.lock);
+    if (g_rt.live_count == g_rt.live_capacity)
+    {
+        size_t capacity = g_rt.live_capacity ? g_rt.live_capacity * 2 : 64;
+        Task** live = realloc(g_rt.live, capacity * sizeof(*live));
+        if (!live)
+        {
+            pthread_mutex_unlock(&g_rt.lock);
+            perror("realloc(tasks)");
+            free(t);
+            return NULL;
+        }
+        g_rt.live = live;
+        g_rt.live_capacity = capacity;
+    }
+    t->slot = g_rt.live_count;
+    g_rt.live[g_rt.live_count++] = t;
+    schedule(t, TASK_START);
+    pthread_mutex_unlock(&g_rt.lock);
+    return t;
+}
+
+void tasks_cancel(Task* task)
+{
+    pthread_mutex_lock(&g_rt.lock);
+    task->cancel = 1;
+    schedule(task, TASK_CANCEL);
+    pthread_mutex_unlock(&g_rt.lock);
+}
+
+int tasks_done_fd(void) { return g_rt.done_fd; }
+
+void tasks_reap(void (*finished)(void* arg, int failed))
+{
+    pthread_mutex_lock(&g_rt.lock);
+    Task* done = g_rt.done;
+    g_rt.done = NULL;
+    eventfd_clear(g_rt.done_fd);
+    pthread_mutex_unlock(&g_rt.lock);
+
+    while (done)
+    {
+        Task* t = done;
+        done = t->next;
+        finished(t->arg, t->failed);
+        free(t);
+    }
+}
+
+volatile sig_atomic_t* task_cancel_flag(Task* task) { return &task->cancel; }
+
+void task_set_tick(Task* task, int ms)
+{
+    pthread_mutex_lock(&g_rt.lock);
+    long long at = monotonic_ns() + ms * 1000000LL;
+    if (task->tick_ms <= 0 || at < task->tick_at_ns)
+        task->tick_at_ns = at;
+    task->tick_ms = ms;
+    pthread_mutex_unlock(&g_rt.lock);
+}
+
+int task_watch(Task* task, const char* path, uint32_t mask)
+{
+    // under the lock, so a release cannot remove the kernel watch between the
+    // add handing out its wd and the task being recorded as a holder
+    pthread_mutex_lock(&g_rt.lock);
+    int wd = inotify_add_watch(g_rt.inotify_fd, path, mask);
+    if (wd < 0)
+    {
+        pthread_mutex_unlock(&g_rt.lock);
+        return -1;
+    }
+    size_t head = 0;
+    pidmap_get(&g_rt.by_wd, wd, &head);
+    for (size_t h = head; h; h = g_rt.holders[h].next)
+    {
+        if (g_rt.holders[h].task == task)
+        {
+            pthread_mutex_unlock(&g_rt.lock);
+            return wd;
+        }
+    }
+    size_t h = 0;
+    if (holder_new(task, head, &h) < 0 || pidmap_put(&g_rt.by_wd, wd, h) < 0)
+    {
+        if (h)
+            holder_free(h);
+        if (!head)
+            inotify_rm_watch(g_rt.inotify_fd, wd);
+        pthread_mutex_unlock(&g_rt.lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_unlock(&g_rt.lock);
+    return wd;
+}
+
+void task_unwatch(Task* task, int wd)
+{
+    pthread_mutex_lock(&g_rt.lock);
+    release_wd(wd, task, 0);
+    pthread_mutex_unlock(&g_rt.lock);
+}
+
+long long task_drained_ns(Task* task)
+{
+    pthread_mutex_lock(&g_rt.lock);
+    long long ns = task->events_len == 0 ? g_rt.drained_ns : 0;
+    pthread_mutex_unlock(&g_rt.lock);
+    return ns;
+}
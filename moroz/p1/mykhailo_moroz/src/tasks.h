@@ -0,0 +1,67 @@
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// In-process runtime for backups (-t): a backup is a task inside the daemon
+// instead of a forked worker with its own inotify instance.
+//
+// One reader thread owns a single inotify instance shared by every task and
+// routes each event by watch descriptor to the tasks holding that watch; two
+// backups of the same tree share the kernel watch. A pool of threads runs the
+// tasks round-robin, handing a task at most TASK_BATCH bytes of events per
+// turn before it goes to the back of the queue, so one busy backup cannot
+// starve the rest. A task runs on one thread at a time, so its steps need no
+// locking of their own. It is stopped through its cancel flag, which long
+// loops poll the way a forked worker polls its SIGTERM flag.
+
+#define TASK_BATCH 4096                // events handed to a task per turn
+#define TASK_QUEUE_MAX (1u << 20)      // routed events one task may have waiting before the reader holds off
+#define TASK_TICK_GRAIN_MS 50          // ticks are due at this resolution
+#define TASK_MAX_THREADS 256
+
+typedef struct Task Task;
+
+// every step runs on a pool thread with arg as given to tasks_spawn
+typedef struct
+{
+    // first step; nonzero ends the task right away, -1 as failed, and the
+    // step is expected to have cleaned up after itself
+    int (*start)(Task* task, void* arg);
+    // whole inotify_event records routed to the task; nonzero ends it
+    int (*events)(Task* task, void* arg, char* buf, size_t len);
+    // due every task_set_tick() milliseconds; nonzero ends it
+    int (*tick)(Task* task, void* arg);
+    // last step after a successful start, whatever ended the task
+    void (*stop)(Task* task, void* arg);
+} TaskOps;
+
+// starts the reader and threads pool threads
+int tasks_start(int threads);
+// cancels every task, waits for all of them to stop and joins the threads;
+// ended tasks are still handed out by tasks_reap
+void tasks_shutdown(void);
+
+Task* tasks_spawn(const TaskOps* ops, void* arg);
+// asks the task to stop; it ends after its current step
+void tasks_cancel(Task* task);
+
+// readable while ended tasks wait for tasks_reap
+int tasks_done_fd(void);
+// hands every ended task to finished (failed: a step returned -1) and frees it
+void tasks_reap(void (*finished)(void* arg, int failed));
+
+// for use from the task's own steps
+volatile sig_atomic_t* task_cancel_flag(Task* task);
+void task_set_tick(Task* task, int ms);
+// inotify_add_watch on the shared instance; the task gets the events of the
+// returned wd until task_unwatch or until it ends
+int task_watch(Task* task, const char* path, uint32_t mask);
+void task_unwatch(Task* task, int wd);
+// CLOCK_REALTIME up to which every event meant for the task has been handed
+// to it, 0 while some are still waiting
+long long task_drained_ns(Task* task);
+
+#endif
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include "tierlog.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// a record: this header, then path and path2 with their NULs, padded to 8 bytes
+typedef struct
+{
+    uint32_t len;  // of the whole record
+    uint32_t op;
+    int64_t ns;
+} RecordHeader;
+
+static void ring_put(TierLog* log, uint64_t at, const void* src, size_t n)
+{
+    size_t off = (size_t)(at % TIER_LOG_SIZE);
+    size_t first = n < TIER_LOG_SIZE - off ? n : TIER_LOG_SIZE - off;
+    memcpy(log->data + off, src, first);
+    memcpy(log->data, (const unsigned char*)src + first, n - first);
+}
+
+static void ring_get(const TierLog* log, uint64_t at, void* dst, size_t n)
+{
+    size_t off = (size_t)(at % TIER_LOG_SIZE);
+    size_t first = n < TIER_LOG_SIZE - off ? n : TIER_LOG_SIZE - off;
+    memcpy(dst, log->data + off, first);
+    memcpy((unsigned char*)dst + first, log->data, n - first);
+}
+
+TierLog* tier_log_create(void)
+{
+    TierLog* log = mmap(NULL, sizeof(TierLog), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (log == MAP_FAILED)
+    {
+        perror("mmap(tier log)");
+        return NULL;
+    }
+    // zero-filled, a valid empty log at epoch 0, which no primary is ready for
+    return log;
+}
+
+void tier_log_destroy(TierLog* log)
+{
+    if (log && munmap(log, sizeof(TierLog)) < 0)
+        perror("munmap(tier log)");
+}
+
+void tier_log_begin(TierLog* log) { atomic_fetch_add_explicit(&log->epoch, 1, memory_order_acq_rel); }
+
+void tier_log_ready(TierLog* log)
+{
+    atomic_store_explicit(&log->ready_epoch, atomic_load_explicit(&log->epoch, memory_order_relaxed),
+                          memory_order_release);
+}
+
+void tier_log_append(TierLog* log, TierOp op, const char* path, const char* path2)
+{
+    size_t len1 = strlen(path) + 1;
+    size_t len2 = path2 ? strlen(path2) + 1 : 1;
+    if (len1 + len2 > sizeof(((TierRecord*)0)->buf))
+        return;
+    RecordHeader h = {0};
+    h.len = (uint32_t)((sizeof(h) + len1 + len2 + 7) & ~(size_t)7);
+    h.op = (uint32_t)op;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h.ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    uint64_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    // readers still at the bytes about to be overwritten see this and give up
+    atomic_store_explicit(&log->reserved, head + h.len, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    ring_put(log, head, &h, sizeof(h));
+    ring_put(log, head + sizeof(h), path, len1);
+    ring_put(log, head + sizeof(h) + len1, path2 ? path2 : "", len2);
+    atomic_store_explicit(&log->head, head + h.len, memory_order_release);
+}
+
+void tier_log_synced(TierLog* log, long long realtime_ns)
+{
+    atomic_store_explicit(&log->synced_ns, realtime_ns, memory_order_release);
+}
+
+int tier_log_next(TierLog* log, uint64_t* pos, TierRecord* rec)
+{
+    uint64_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+    if (head == *pos)
+        return 0;
+    if (head - *pos > TIER_LOG_SIZE)
+        return -1;
+
+    RecordHeader h;
+    ring_get(log, *pos, &h, sizeof(h));
+    size_t body = h.len > sizeof(h) ? h.len - sizeof(h) : 0;
+    int sane = h.len >= sizeof(h) + 2 && h.len <= head - *pos && body <= sizeof(rec->buf);
+    if (sane)
+        ring_get(log, *pos + sizeof(h), rec->buf, body);
+
+    // whatever was read is only good if the writer did not get to it meanwhile
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t reserved = atomic_load_explicit(&log->reserved, memory_order_relaxed);
+    if (!sane || reserved - *pos > TIER_LOG_SIZE)
+        return -1;
+
+    rec->op = (TierOp)h.op;
+    rec->ns = h.ns;
+    rec->path = rec->buf;
+    rec->path2 = rec->buf + strnlen(rec->buf, body) + 1;
+    if (rec->path2 >= rec->buf + body)
+        return -1;
+    *pos += h.len;
+    return 1;
+}
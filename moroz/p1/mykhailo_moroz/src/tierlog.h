@@ -0,0 +1,72 @@
+#ifndef TIERLOG_H
+#define TIERLOG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Change log of a primary target for the secondary targets replicating from
+// it ("add --tiered"). Only the primary's worker reads the source; after every
+// change it applies to its target it appends what it touched, and the
+// secondaries' workers replay those paths by copying from the primary target,
+// whose pages the primary has usually just written. A slow secondary only
+// delays itself.
+//
+// The log is a ring in memory shared by the daemon and the workers, written by
+// one primary worker at a time. A secondary that falls more than the ring
+// behind, or whose primary restarted (a new epoch: the primary resyncs without
+// logging), compares its whole target against the primary's instead.
+
+#define TIER_LOG_SIZE (4u << 20)
+#define TIER_POLL_MS 20  // a caught up secondary looks at the log this often
+
+typedef enum
+{
+    TIER_UPDATE = 1,  // path was created or changed, a directory with all below it
+    TIER_DELETE,
+    TIER_RENAME,  // path was renamed to path2
+} TierOp;
+
+typedef struct
+{
+    // bytes ever appended; records before head are complete
+    atomic_ullong head;
+    // head once the record being written is done, so a reader can tell it
+    // raced with the writer
+    atomic_ullong reserved;
+    // bumped whenever a primary worker starts: records from an older epoch
+    // may not describe its target any more
+    atomic_uint epoch;
+    atomic_uint ready_epoch;  // the primary target is complete for this epoch
+    // the primary's sync watermark, published after the records it covers
+    atomic_llong synced_ns;
+    unsigned char data[TIER_LOG_SIZE];
+} TierLog;
+
+// shared with the workers forked after it; NULL on failure
+TierLog* tier_log_create(void);
+void tier_log_destroy(TierLog* log);
+
+// primary side
+void tier_log_begin(TierLog* log);
+void tier_log_ready(TierLog* log);
+// paths are absolute paths in the primary target; path2 only for TIER_RENAME
+void tier_log_append(TierLog* log, TierOp op, const char* path, const char* path2);
+void tier_log_synced(TierLog* log, long long realtime_ns);
+
+// one decoded record; the paths point into buf
+typedef struct
+{
+    TierOp op;
+    long long ns;  // realtime it was appended
+    const char* path;
+    const char* path2;
+    char buf[2 * 4096 + 2];
+} TierRecord;
+
+// Reads the record at *pos and moves *pos past it. Returns 1 for a record, 0
+// when there is none yet and -1 when the writer has overwritten *pos: the
+// reader lost track and has to start over from the current head.
+int tier_log_next(TierLog* log, uint64_t* pos, TierRecord* rec);
+
+#endif
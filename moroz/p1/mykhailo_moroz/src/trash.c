@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include "trash.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+int trash_open(Trash* trash, const char* dst_real)
+{
+    memset(trash, 0, sizeof(*trash));
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s/%s", dst_real, TRASH_NAME) >= (int)sizeof(dir))
+    {
+        fprintf(stderr, "Name too long(trash)\n");
+        return -1;
+    }
+    trash->root = strdup(dst_real);
+    trash->dir = strdup(dir);
+    if (!trash->root || !trash->dir)
+    {
+        perror("strdup(trash)");
+        trash_close(trash);
+        return -1;
+    }
+    struct stat st;
+    trash->pending = lstat(dir, &st) == 0;
+    return 0;
+}
+
+void trash_close(Trash* trash)
+{
+    free(trash->root);
+    free(trash->dir);
+    memset(trash, 0, sizeof(*trash));
+}
+
+int trash_put(Trash* trash, const char* path)
+{
+    if (!trash->dir)
+        return -1;
+    size_t n = strlen(trash->root);
+    if (strncmp(path, trash->root, n) != 0 || path[n] != '/' || strncmp(path, trash->dir, strlen(trash->dir)) == 0)
+        return -1;
+    struct stat st;
+    if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+        return -1;
+
+    if (mkdir(trash->dir, 0700) < 0 && errno != EEXIST)
+    {
+        perror("mkdir(trash)");
+        return -1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    char dst[PATH_MAX];
+    if (snprintf(dst, sizeof(dst), "%s/%lld.%09ld-%d-%llu", trash->dir, (long long)ts.tv_sec, ts.tv_nsec,
+                 (int)getpid(), trash->seq++) >= (int)sizeof(dst))
+    {
+        fprintf(stderr, "Name too long(trash)\n");
+        return -1;
+    }
+    if (rename(path, dst) < 0)
+    {
+        // EXDEV: a mount point inside the target, the tree is deleted where it is
+        if (errno != EXDEV)
+            perror("rename(trash)");
+        return -1;
+    }
+    trash->pending = 1;
+    stats_add(STAT_TRASH_DIRS, 1);
+    return 0;
+}
+
+// removes everything below the directory open at fd and closes it
+static int empty_dir(int fd, IoBudget* budget)
+{
+    DIR* d = fdopendir(fd);
+    if (!d)
+    {
+        perror("fdopendir(trash)");
+        close(fd);
+        return -1;
+    }
+    int ret = 0;
+    struct dirent* e;
+    while (ret == 0 && (e = readdir(d)) != NULL)
+    {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        if (budget_charge(budget, 1) < 0)
+        {
+            ret = -1;
+            break;
+        }
+        int is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            is_dir = fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir)
+        {
+            int child = openat(dirfd(d), e->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child < 0)
+            {
+                perror("openat(trash)");
+                ret = -1;
+                break;
+            }
+            ret = empty_dir(child, budget);
+        }
+        if (ret == 0 && unlinkat(dirfd(d), e->d_name, is_dir ? AT_REMOVEDIR : 0) < 0 && errno != ENOENT)
+        {
+            perror("unlinkat(trash)");
+            ret = -1;
+        }
+        if (ret == 0)
+            stats_add(STAT_TRASH_UNLINKED, 1);
+    }
+    closedir(d);
+    return ret;
+}
+
+int trash_reclaim(const char* dir, IoBudget* budget)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        perror("open(trash)");
+        return -1;
+    }
+    return empty_dir(fd, budget);
+}
@@ -0,0 +1,45 @@
+#ifndef TRASH_H
+#define TRASH_H
+
+#include <sys/types.h>
+
+#include "scrub.h"
+
+// Deleting a directory from a target is a rename into the target's trash
+// area, whatever its size: removing a tree of millions of files one unlink at
+// a time would hold up the worker's event loop for minutes, long enough for
+// inotify to overflow. A reclaimer process forked off the worker empties the
+// trash in the background at a bounded rate (-r), with unlinkat on directory
+// descriptors and at idle I/O priority. Whatever it did not get to is picked up
+// by the next worker of the target.
+//
+// The trash is part of no backup: restore, verify and the scrub skip it.
+
+#define TRASH_NAME ".sop-trash"
+#define TRASH_DEFAULT_RATE 20000  // -r: entries the reclaimer removes per second, 0 = no limit
+#define TRASH_RETRY_MS 5000       // before a reclaimer that failed is started again
+
+typedef struct
+{
+    char* root;  // the target; only what is below it goes to the trash
+    char* dir;   // root/TRASH_NAME
+    unsigned long long seq;
+    int pending;       // something was put in the trash since the reclaimer last started
+    pid_t reclaimer;   // 0 when none runs
+    long long next_ns;  // monotonic time a reclaimer may be started again
+} Trash;
+
+// the trash of dst_real; what an earlier worker left in it is pending
+int trash_open(Trash* trash, const char* dst_real);
+// the reclaimer, if one runs, is the caller's to stop first
+void trash_close(Trash* trash);
+// Moves the directory at path into the trash. Returns 0 when it is gone from
+// path, -1 when it has to be deleted in place: it is no directory, not below
+// the target or the rename failed.
+int trash_put(Trash* trash, const char* path);
+
+// The reclaimer's work: removes everything in the trash directory dir, charging
+// every entry to budget. Returns 0 once it is empty, -1 on failure or when stopped.
+int trash_reclaim(const char* dir, IoBudget* budget);
+
+#endif
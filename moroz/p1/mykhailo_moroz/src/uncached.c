@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include "uncached.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int g_uncached_drop = 0;
+unsigned long long g_uncached_direct_min = 0;
+
+static _Thread_local int t_bulk = 0;
+
+// copied files whose last chunk may still be dirty; dropping their pages has
+// to wait for the writeback, which by the time the queue wraps is long done
+typedef struct
+{
+    int fd;
+    off_t off;  // start of the last chunk
+} PendingDrop;
+
+static _Thread_local PendingDrop t_queue[UNCACHED_QUEUE];
+static _Thread_local int t_queue_used = 0;
+static _Thread_local int t_queue_next = 0;
+
+static pthread_mutex_t g_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void* g_pool[UNCACHED_POOL_MAX];
+static int g_pool_used = 0;
+
+static size_t page_size(void)
+{
+    static size_t size = 0;
+    if (size == 0)
+    {
+        long ps = sysconf(_SC_PAGESIZE);
+        size = ps > 0 ? (size_t)ps : 4096;
+    }
+    return size;
+}
+
+// len 0 means up to the end of the file, past whatever folio holds the last byte
+static void drop_written(int fd, off_t off, size_t len)
+{
+    sync_file_range(fd, off, (off_t)len,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, off, (off_t)len, POSIX_FADV_DONTNEED);
+}
+
+static void queue_flush_one(int i)
+{
+    drop_written(t_queue[i].fd, t_queue[i].off, 0);
+    close(t_queue[i].fd);
+}
+
+void uncached_begin(void)
+{
+    t_bulk++;
+}
+
+void uncached_end(void)
+{
+    if (t_bulk > 0)
+        t_bulk--;
+    if (t_bulk > 0)
+        return;
+    int first = (t_queue_next - t_queue_used + UNCACHED_QUEUE) % UNCACHED_QUEUE;
+    for (int n = 0; n < t_queue_used; n++)
+        queue_flush_one((first + n) % UNCACHED_QUEUE);
+    t_queue_used = 0;
+    t_queue_next = 0;
+}
+
+int uncached_active(void)
+{
+    return t_bulk > 0 && (g_uncached_drop || g_uncached_direct_min > 0);
+}
+
+void* uncached_buffer_get(void)
+{
+    void* buf = NULL;
+    pthread_mutex_lock(&g_pool_mutex);
+    if (g_pool_used > 0)
+        buf = g_pool[--g_pool_used];
+    pthread_mutex_unlock(&g_pool_mutex);
+    if (buf)
+        return buf;
+    if (posix_memalign(&buf, UNCACHED_ALIGN, UNCACHED_CHUNK) != 0)
+        return NULL;
+    return buf;
+}
+
+void uncached_buffer_put(void* buf)
+{
+    if (!buf)
+        return;
+    pthread_mutex_lock(&g_pool_mutex);
+    if (g_pool_used < UNCACHED_POOL_MAX)
+    {
+        g_pool[g_pool_used++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&g_pool_mutex);
+    free(buf);
+}
+
+void uncached_source_open(UncachedSource* s, int fd, off_t size)
+{
+    s->cached = NULL;
+    s->pages = 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+    if (size <= 0)
+        return;
+    size_t ps = page_size();
+    size_t pages = ((size_t)size + ps - 1) / ps;
+    // PROT_NONE: only mincore looks at the mapping, nothing faults pages in
+    void* map = mmap(NULL, (size_t)size, PROT_NONE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return;
+    unsigned char* cached = calloc((pages + 7) / 8, 1);
+    unsigned char vec[256];
+    for (size_t p = 0; cached && p < pages; p += sizeof(vec))
+    {
+        size_t n = pages - p < sizeof(vec) ? pages - p : sizeof(vec);
+        if (mincore((char*)map + p * ps, n * ps, vec) != 0)
+        {
+            free(cached);
+            cached = NULL;
+            break;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            if (vec[i] & 1)
+                cached[(p + i) / 8] |= (unsigned char)(1u << ((p + i) % 8));
+        }
+    }
+    munmap(map, (size_t)size);
+    s->cached = cached;
+    s->pages = pages;
+}
+
+static int source_page_cached(const UncachedSource* s, size_t page)
+{
+    return page >= s->pages || (s->cached[page / 8] >> (page % 8)) & 1;
+}
+
+void uncached_source_after(UncachedSource* s, int fd, off_t off, size_t len)
+{
+    // unknown residency counts as cached: better to leave pages behind than
+    // to drop a working set somebody else relies on
+    if (!s->cached)
+        return;
+    size_t ps = page_size();
+    size_t first = (size_t)off / ps;
+    size_t last = ((size_t)off + len + ps - 1) / ps;
+    // drop runs of pages that were not resident before the copy
+    size_t i = first;
+    while (i < last)
+    {
+        if (source_page_cached(s, i))
+        {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < last && !source_page_cached(s, j))
+            j++;
+        // the last run goes to the end of the file, whatever folio holds the last byte
+        off_t run_len = j == s->pages ? 0 : (off_t)((j - i) * ps);
+        posix_fadvise(fd, (off_t)(i * ps), run_len, POSIX_FADV_DONTNEED);
+        i = j;
+    }
+}
+
+void uncached_source_close(UncachedSource* s)
+{
+    free(s->cached);
+    s->cached = NULL;
+    s->pages = 0;
+}
+
+void uncached_target_written(int fd, off_t off, size_t len)
+{
+    // the previous chunk was queued for writeback one chunk ago; wait for it
+    // and drop it while this one goes out
+    if (off >= (off_t)UNCACHED_CHUNK)
+        drop_written(fd, off - (off_t)UNCACHED_CHUNK, UNCACHED_CHUNK);
+    sync_file_range(fd, off, (off_t)len, SYNC_FILE_RANGE_WRITE);
+}
+
+void uncached_target_close(int fd)
+{
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end <= 0 || t_bulk == 0)
+    {
+        if (end > 0)
+            drop_written(fd, 0, 0);
+        close(fd);
+        return;
+    }
+    // only the last chunk can still be in the cache, everything before it
+    // was dropped by uncached_target_written
+    off_t tail = ((end - 1) / UNCACHED_CHUNK) * UNCACHED_CHUNK;
+    if (t_queue_used == UNCACHED_QUEUE)
+    {
+        queue_flush_one(t_queue_next);
+        t_queue_used--;
+    }
+    t_queue[t_queue_next] = (PendingDrop){.fd = fd, .off = tail};
+    t_queue_next = (t_queue_next + 1) % UNCACHED_QUEUE;
+    t_queue_used++;
+}
@@ -0,0 +1,58 @@
+#ifndef UNCACHED_H
+#define UNCACHED_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Copy mode for the bulk phases (initial sync, resume, restore). They stream
+// whole trees through the page cache once, and without it that pushes the
+// applications' working set out for hours. Live mirroring keeps normal caching.
+//
+// With -n source pages are read with SEQUENTIAL/NOREUSE hints and dropped
+// behind the copy unless they were cached before it read them, and target
+// pages are written back early and dropped once they are on disk. Files of at
+// least -D MiB bypass the cache altogether with O_DIRECT.
+
+// Bytes per read, write and drop. Readahead fills the cache with folios of up
+// to 2 MiB and DONTNEED passes over any folio its range only partly covers, so
+// drops go in aligned multiples of that.
+#define UNCACHED_CHUNK (4u << 20)
+#define UNCACHED_ALIGN 4096  // O_DIRECT buffer, offset and length alignment
+#define UNCACHED_POOL_MAX 4  // idle buffers kept for the next copy
+#define UNCACHED_QUEUE 32    // copied files still being written back before their pages are dropped
+
+// -n: drop pages behind bulk copies
+extern int g_uncached_drop;
+// -D: O_DIRECT for files of at least this many bytes in bulk copies, 0 = never
+extern unsigned long long g_uncached_direct_min;
+
+// marks the calling thread as running a bulk phase; uncached_end drops what
+// its last copies still hold in the cache
+void uncached_begin(void);
+void uncached_end(void);
+// the calling thread is in a bulk phase and -n or -D asks for uncached copies
+int uncached_active(void);
+
+// UNCACHED_CHUNK bytes aligned to UNCACHED_ALIGN, reused across copies and threads
+void* uncached_buffer_get(void);
+void uncached_buffer_put(void* buf);
+
+// which pages of a source file were cached before the copy started reading;
+// taken for the whole file at once, since readahead runs ahead of any chunk
+typedef struct
+{
+    unsigned char* cached;  // one bit per page, NULL: unknown, all count as cached
+    size_t pages;
+} UncachedSource;
+
+void uncached_source_open(UncachedSource* s, int fd, off_t size);
+// after reading [off, off + len): drops the pages of that range nobody had cached
+void uncached_source_after(UncachedSource* s, int fd, off_t off, size_t len);
+void uncached_source_close(UncachedSource* s);
+
+// starts writing back [off, off + len) and drops the chunk before it once it is on disk
+void uncached_target_written(int fd, off_t off, size_t len);
+// takes over fd: it is closed once its last pages are written back and dropped
+void uncached_target_close(int fd);
+
+#endif
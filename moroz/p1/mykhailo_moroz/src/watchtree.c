@@ -0,0 +1,548 @@
+#include "watchtree.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOT_EMPTY 0
+#define SLOT_DELETED UINT32_MAX
+#define NOT_FOUND ((size_t)-1)
+
+// the arena is only compacted once this much of it is unused
+#define NAMES_COMPACT_MIN (64 * 1024)
+
+typedef struct
+{
+    uint32_t refs;
+    uint32_t len;
+    char name[];
+} NameRecord;
+
+typedef struct
+{
+    const char* name;
+    size_t len;
+} NameKey;
+
+typedef struct
+{
+    uint32_t parent;
+    uint32_t name;
+    size_t name_hash;
+} ChildKey;
+
+static NameRecord* record(const char* names, uint32_t off) { return (NameRecord*)(void*)(names + off); }
+
+static size_t record_size(size_t len) { return (sizeof(NameRecord) + len + 1 + 3) & ~(size_t)3; }
+
+static size_t hash_mix(unsigned long long x) { return (size_t)((x * 0x9E3779B97F4A7C15ULL) >> 32); }
+
+static size_t hash_name(const char* name, size_t len)
+{
+    unsigned long long h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+// children are hashed by the name's text rather than its offset, so moving
+// records when the arena is compacted leaves the index valid
+static size_t hash_child(uint32_t parent, size_t name_hash) { return hash_mix(parent) ^ name_hash; }
+
+// hash of whatever a slot value stands for, used when rehashing
+typedef size_t (*ValueHash)(const WatchTree* t, uint32_t value);
+typedef int (*ValueMatch)(const WatchTree* t, uint32_t value, const void* key);
+
+static size_t wd_hash(const WatchTree* t, uint32_t node) { return hash_mix((unsigned int)t->nodes[node].wd); }
+
+static size_t child_hash(const WatchTree* t, uint32_t node)
+{
+    const NameRecord* rec = record(t->names, t->nodes[node].name);
+    return hash_child(t->nodes[node].parent, hash_name(rec->name, rec->len));
+}
+
+static size_t interned_hash(const WatchTree* t, uint32_t off)
+{
+    const NameRecord* rec = record(t->names, off);
+    return hash_name(rec->name, rec->len);
+}
+
+static int wd_match(const WatchTree* t, uint32_t node, const void* key)
+{
+    return t->nodes[node].wd == *(const int*)key;
+}
+
+static int child_match(const WatchTree* t, uint32_t node, const void* key)
+{
+    const ChildKey* k = key;
+    return t->nodes[node].parent == k->parent && t->nodes[node].name == k->name;
+}
+
+static int interned_match(const WatchTree* t, uint32_t off, const void* key)
+{
+    const NameKey* k = key;
+    const NameRecord* rec = record(t->names, off);
+    return rec->len == k->len && memcmp(rec->name, k->name, k->len) == 0;
+}
+
+// slot holding the value matching key, or (size_t)-1
+static size_t index_find(const WatchTree* t, const WatchIndex* idx, size_t hash, ValueMatch match, const void* key)
+{
+    if (idx->capacity == 0)
+        return NOT_FOUND;
+    size_t s = hash & (idx->capacity - 1);
+    while (idx->slots[s] != SLOT_EMPTY)
+    {
+        if (idx->slots[s] != SLOT_DELETED && match(t, idx->slots[s] - 1, key))
+            return s;
+        s = (s + 1) & (idx->capacity - 1);
+    }
+    return NOT_FOUND;
+}
+
+// slot holding exactly value, or (size_t)-1
+static size_t index_find_value(const WatchIndex* idx, size_t hash, uint32_t value)
+{
+    if (idx->capacity == 0)
+        return NOT_FOUND;
+    size_t s = hash & (idx->capacity - 1);
+    while (idx->slots[s] != SLOT_EMPTY)
+    {
+        if (idx->slots[s] == value + 1)
+            return s;
+        s = (s + 1) & (idx->capacity - 1);
+    }
+    return NOT_FOUND;
+}
+
+// rehashes into a table big enough for the live entries, dropping deleted slots
+static int index_grow(const WatchTree* t, WatchIndex* idx, ValueHash hash)
+{
+    size_t live = 0;
+    for (size_t i = 0; i < idx->capacity; i++)
+    {
+        if (idx->slots[i] != SLOT_EMPTY && idx->slots[i] != SLOT_DELETED)
+            live++;
+    }
+    size_t new_capacity = idx->capacity ? idx->capacity : 64;
+    if ((live + 1) * 2 > new_capacity)
+        new_capacity *= 2;
+
+    uint32_t* slots = calloc(new_capacity, sizeof(*slots));
+    if (!slots)
+    {
+        perror("calloc(watch index)");
+        return -1;
+    }
+    for (size_t i = 0; i < idx->capacity; i++)
+    {
+        if (idx->slots[i] == SLOT_EMPTY || idx->slots[i] == SLOT_DELETED)
+            continue;
+        size_t s = hash(t, idx->slots[i] - 1) & (new_capacity - 1);
+        while (slots[s] != SLOT_EMPTY)
+            s = (s + 1) & (new_capacity - 1);
+        slots[s] = idx->slots[i];
+    }
+
+    free(idx->slots);
+    idx->slots = slots;
+    idx->capacity = new_capacity;
+    idx->used = live;
+    return 0;
+}
+
+static int index_insert(const WatchTree* t, WatchIndex* idx, ValueHash hash, uint32_t value)
+{
+    // keep at least a quarter of the slots empty so probes stay short
+    if ((idx->used + 1) * 4 > idx->capacity * 3 && index_grow(t, idx, hash) < 0)
+        return -1;
+    size_t s = hash(t, value) & (idx->capacity - 1);
+    while (idx->slots[s] != SLOT_EMPTY && idx->slots[s] != SLOT_DELETED)
+        s = (s + 1) & (idx->capacity - 1);
+    if (idx->slots[s] == SLOT_EMPTY)
+        idx->used++;
+    idx->slots[s] = value + 1;
+    return 0;
+}
+
+static void index_delete(WatchIndex* idx, size_t hash, uint32_t value)
+{
+    size_t s = index_find_value(idx, hash, value);
+    if (s != NOT_FOUND)
+        idx->slots[s] = SLOT_DELETED;
+}
+
+static void index_free(WatchIndex* idx)
+{
+    free(idx->slots);
+    memset(idx, 0, sizeof(*idx));
+}
+
+// offset of name's record, or UINT32_MAX if it was never interned
+static uint32_t names_lookup(const WatchTree* t, const char* name, size_t len)
+{
+    NameKey key = {name, len};
+    size_t s = index_find(t, &t->interned, hash_name(name, len), interned_match, &key);
+    return (s == NOT_FOUND) ? UINT32_MAX : t->interned.slots[s] - 1;
+}
+
+static int names_append(char** names, size_t* size, size_t* capacity, const char* name, size_t len,
+                        uint32_t* off)
+{
+    size_t need = record_size(len);
+    if (*size + need > UINT32_MAX)
+    {
+        fprintf(stderr, "watch name arena full\n");
+        return -1;
+    }
+    if (*size + need > *capacity)
+    {
+        size_t new_capacity = *capacity ? *capacity * 2 : 4096;
+        while (new_capacity < *size + need)
+            new_capacity *= 2;
+        char* grown = realloc(*names, new_capacity);
+        if (!grown)
+        {
+            perror("realloc(watch names)");
+            return -1;
+        }
+        *names = grown;
+        *capacity = new_capacity;
+    }
+    NameRecord* rec = record(*names, (uint32_t)*size);
+    rec->refs = 1;
+    rec->len = (uint32_t)len;
+    memcpy(rec->name, name, len);
+    rec->name[len] = '\0';
+    *off = (uint32_t)*size;
+    *size += need;
+    return 0;
+}
+
+// copies the names still in use into a fresh arena; on failure the old one stays
+static void names_compact(WatchTree* t)
+{
+    size_t capacity = t->names_size - t->names_dead;
+    char* names = malloc(capacity ? capacity : 1);
+    uint32_t* moved = calloc(t->names_size / 4 + 1, sizeof(*moved));
+    WatchIndex interned = {calloc(t->interned.capacity, sizeof(uint32_t)), t->interned.capacity, t->interned.used};
+    if (!names || !moved || !interned.slots)
+    {
+        free(names);
+        free(moved);
+        free(interned.slots);
+        return;
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < t->interned.capacity; i++)
+    {
+        // every slot keeps its place, deleted ones included, so probe chains
+        // stay as they were
+        uint32_t v = t->interned.slots[i];
+        interned.slots[i] = v;
+        if (v == SLOT_EMPTY || v == SLOT_DELETED)
+            continue;
+        const NameRecord* old = record(t->names, v - 1);
+        uint32_t off = 0;
+        names_append(&names, &size, &capacity, old->name, old->len, &off);
+        record(names, off)->refs = old->refs;
+        moved[(v - 1) / 4] = off;
+        interned.slots[i] = off + 1;
+    }
+    for (uint32_t n = 1; n <= t->nodes_used; n++)
+    {
+        if (t->nodes[n].wd != -1)
+            t->nodes[n].name = moved[t->nodes[n].name / 4];
+    }
+
+    free(moved);
+    free(t->names);
+    free(t->interned.slots);
+    t->names = names;
+    t->names_size = size;
+    t->names_capacity = capacity;
+    t->names_dead = 0;
+    t->interned = interned;
+}
+
+// offset of name's record with one more reference, UINT32_MAX on failure.
+// May compact the arena, so offsets held across the call go stale.
+static uint32_t names_intern(WatchTree* t, const char* name)
+{
+    size_t len = strlen(name);
+    uint32_t off = names_lookup(t, name, len);
+    if (off != UINT32_MAX)
+    {
+        record(t->names, off)->refs++;
+        return off;
+    }
+
+    if (t->names_dead > NAMES_COMPACT_MIN && t->names_dead * 2 > t->names_size)
+        names_compact(t);
+    if (names_append(&t->names, &t->names_size, &t->names_capacity, name, len, &off) < 0)
+        return UINT32_MAX;
+    if (index_insert(t, &t->interned, interned_hash, off) < 0)
+    {
+        t->names_size -= record_size(len);
+        return UINT32_MAX;
+    }
+    return off;
+}
+
+static void names_release(WatchTree* t, uint32_t off)
+{
+    NameRecord* rec = record(t->names, off);
+    if (--rec->refs > 0)
+        return;
+    index_delete(&t->interned, hash_name(rec->name, rec->len), off);
+    t->names_dead += record_size(rec->len);
+}
+
+static uint32_t child_lookup(const WatchTree* t, uint32_t parent, uint32_t name)
+{
+    const NameRecord* rec = record(t->names, name);
+    ChildKey key = {parent, name, hash_name(rec->name, rec->len)};
+    size_t s = index_find(t, &t->by_name, hash_child(parent, key.name_hash), child_match, &key);
+    return (s == NOT_FOUND) ? 0 : t->by_name.slots[s] - 1;
+}
+
+static uint32_t node_alloc(WatchTree* t)
+{
+    if (t->free_head != 0)
+    {
+        uint32_t n = t->free_head;
+        t->free_head = t->nodes[n].next_sibling;
+        return n;
+    }
+    if (t->nodes_used + 1 >= t->nodes_capacity)
+    {
+        uint32_t new_capacity = t->nodes_capacity ? t->nodes_capacity * 2 : 64;
+        WatchNode* nodes = realloc(t->nodes, new_capacity * sizeof(*nodes));
+        if (!nodes)
+        {
+            perror("realloc(watch nodes)");
+            return 0;
+        }
+        t->nodes = nodes;
+        t->nodes_capacity = new_capacity;
+    }
+    return ++t->nodes_used;
+}
+
+static void node_link(WatchTree* t, uint32_t n, uint32_t parent)
+{
+    WatchNode* node = &t->nodes[n];
+    node->parent = parent;
+    node->prev_sibling = 0;
+    node->next_sibling = parent ? t->nodes[parent].first_child : 0;
+    if (node->next_sibling)
+        t->nodes[node->next_sibling].prev_sibling = n;
+    if (parent)
+        t->nodes[parent].first_child = n;
+}
+
+static void node_unlink(WatchTree* t, uint32_t n)
+{
+    WatchNode* node = &t->nodes[n];
+    if (node->prev_sibling)
+        t->nodes[node->prev_sibling].next_sibling = node->next_sibling;
+    else if (node->parent)
+        t->nodes[node->parent].first_child = node->next_sibling;
+    if (node->next_sibling)
+        t->nodes[node->next_sibling].prev_sibling = node->prev_sibling;
+    node->prev_sibling = node->next_sibling = 0;
+}
+
+// a leaf that is already unlinked goes back to the free list
+static void node_free(WatchTree* t, uint32_t n)
+{
+    WatchNode* node = &t->nodes[n];
+    int wd = node->wd;
+    index_delete(&t->by_wd, wd_hash(t, n), n);
+    if (node->parent)
+        index_delete(&t->by_name, child_hash(t, n), n);
+    names_release(t, node->name);
+    if (t->root == n)
+        t->root = 0;
+    node->wd = -1;
+    node->first_child = 0;
+    node->next_sibling = t->free_head;
+    t->free_head = n;
+    t->count--;
+    if (t->dropped)
+        t->dropped(wd, t->dropped_arg);
+}
+
+static int is_within(const WatchTree* t, uint32_t n, uint32_t ancestor)
+{
+    for (; n; n = t->nodes[n].parent)
+    {
+        if (n == ancestor)
+            return 1;
+    }
+    return 0;
+}
+
+uint32_t wt_add(WatchTree* t, int wd, uint32_t parent, const char* name)
+{
+    uint32_t n = wt_find_wd(t, wd);
+    if (n)
+        return (wt_move(t, n, parent, name) < 0) ? 0 : n;
+
+    if (!parent && t->root)
+        wt_remove(t, t->root);
+    uint32_t off = names_intern(t, name);
+    if (off == UINT32_MAX)
+        return 0;
+    uint32_t occupant = parent ? child_lookup(t, parent, off) : 0;
+    if (occupant)
+        wt_remove(t, occupant);
+
+    n = node_alloc(t);
+    if (!n)
+    {
+        names_release(t, off);
+        return 0;
+    }
+    t->nodes[n] = (WatchNode){.wd = wd, .name = off};
+    node_link(t, n, parent);
+    t->count++;
+    if (index_insert(t, &t->by_wd, wd_hash, n) < 0 || (parent && index_insert(t, &t->by_name, child_hash, n) < 0))
+    {
+        node_unlink(t, n);
+        node_free(t, n);
+        return 0;
+    }
+    if (!parent)
+        t->root = n;
+    return n;
+}
+
+uint32_t wt_find_wd(const WatchTree* t, int wd)
+{
+    size_t s = index_find(t, &t->by_wd, hash_mix((unsigned int)wd), wd_match, &wd);
+    return (s == NOT_FOUND) ? 0 : t->by_wd.slots[s] - 1;
+}
+
+uint32_t wt_find_child(const WatchTree* t, uint32_t parent, const char* name)
+{
+    uint32_t off = names_lookup(t, name, strlen(name));
+    return (off == UINT32_MAX) ? 0 : child_lookup(t, parent, off);
+}
+
+uint32_t wt_find_path(const WatchTree* t, const char* path)
+{
+    if (!t->root)
+        return 0;
+    const NameRecord* root = record(t->names, t->nodes[t->root].name);
+    if (strncmp(path, root->name, root->len) != 0 || (path[root->len] != '\0' && path[root->len] != '/'))
+        return 0;
+
+    uint32_t n = t->root;
+    const char* p = path + root->len;
+    while (*p)
+    {
+        while (*p == '/')
+            p++;
+        size_t len = strcspn(p, "/");
+        if (len == 0)
+            break;
+        uint32_t off = names_lookup(t, p, len);
+        if (off == UINT32_MAX)
+            return 0;
+        n = child_lookup(t, n, off);
+        if (!n)
+            return 0;
+        p += len;
+    }
+    return n;
+}
+
+int wt_path(const WatchTree* t, uint32_t node, char* buf, size_t size)
+{
+    size_t len = 0;
+    for (uint32_t n = node; n; n = t->nodes[n].parent)
+        len += record(t->names, t->nodes[n].name)->len + (t->nodes[n].parent ? 1 : 0);
+    if (len + 1 > size)
+        return -1;
+
+    buf[len] = '\0';
+    for (uint32_t n = node; n; n = t->nodes[n].parent)
+    {
+        const NameRecord* rec = record(t->names, t->nodes[n].name);
+        len -= rec->len;
+        memcpy(buf + len, rec->name, rec->len);
+        if (t->nodes[n].parent)
+            buf[--len] = '/';
+    }
+    return 0;
+}
+
+int wt_move(WatchTree* t, uint32_t node, uint32_t new_parent, const char* new_name)
+{
+    if (!node || is_within(t, new_parent, node))
+        return -1;
+    uint32_t off = names_intern(t, new_name);
+    if (off == UINT32_MAX)
+        return -1;
+    uint32_t occupant = new_parent ? child_lookup(t, new_parent, off) : 0;
+    if (occupant && occupant != node)
+    {
+        if (is_within(t, node, occupant))
+        {
+            names_release(t, off);
+            return -1;
+        }
+        wt_remove(t, occupant);
+    }
+
+    WatchNode* n = &t->nodes[node];
+    if (n->parent)
+        index_delete(&t->by_name, child_hash(t, node), node);
+    node_unlink(t, node);
+    names_release(t, n->name);
+    n->name = off;
+    node_link(t, node, new_parent);
+    if (!new_parent)
+        t->root = node;
+    if (new_parent && index_insert(t, &t->by_name, child_hash, node) < 0)
+        return -1;
+    return 0;
+}
+
+void wt_remove(WatchTree* t, uint32_t node)
+{
+    if (!node)
+        return;
+    node_unlink(t, node);
+    // children first, so every node is a leaf by the time it is freed
+    uint32_t n = node;
+    while (n)
+    {
+        if (t->nodes[n].first_child)
+        {
+            n = t->nodes[n].first_child;
+            continue;
+        }
+        uint32_t up = (n == node) ? 0 : t->nodes[n].parent;
+        if (up)
+            node_unlink(t, n);
+        node_free(t, n);
+        n = up;
+    }
+}
+
+void wt_free(WatchTree* t)
+{
+    index_free(&t->by_wd);
+    index_free(&t->by_name);
+    index_free(&t->interned);
+    free(t->nodes);
+    free(t->names);
+    memset(t, 0, sizeof(*t));
+}
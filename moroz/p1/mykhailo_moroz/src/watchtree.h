@@ -0,0 +1,77 @@
+#ifndef WATCHTREE_H
+#define WATCHTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// identifies a source directory across renames; gen is the inode generation,
+// or the birth time where the filesystem does not expose one
+typedef struct
+{
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long gen;
+} DirId;
+
+// Watched directories as a tree of parent pointers. A node holds its watch
+// descriptor and its own name, interned in a shared arena, so a watch costs a
+// few dozen bytes whatever its depth, renaming a directory re-links a single
+// node, and a full path is only built when an event needs one. Nodes are
+// numbered from 1; 0 means none. The root's name is the whole root path.
+typedef struct
+{
+    int wd;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;  // also chains the free nodes
+    uint32_t prev_sibling;
+    uint32_t name;  // offset of the name record in the arena
+    DirId id;
+} WatchNode;
+
+// open-addressing hash of node numbers or name offsets: value + 1, 0 = empty,
+// UINT32_MAX = deleted
+typedef struct
+{
+    uint32_t* slots;
+    size_t capacity;  // power of two
+    size_t used;      // live + deleted slots
+} WatchIndex;
+
+typedef struct
+{
+    WatchNode* nodes;  // nodes[0] is unused
+    uint32_t nodes_capacity;
+    uint32_t nodes_used;  // high-water mark
+    uint32_t free_head;
+    uint32_t count;
+    uint32_t root;
+    WatchIndex by_wd;
+    WatchIndex by_name;  // children by (parent, interned name)
+    WatchIndex interned;
+    char* names;  // name records: refcount, length, the name and its NUL, 4-byte aligned
+    size_t names_size;
+    size_t names_capacity;
+    size_t names_dead;  // bytes of records nothing refers to any more
+    // told about every watch the tree drops, so the caller can remove it
+    void (*dropped)(int wd, void* arg);
+    void* dropped_arg;
+} WatchTree;
+
+// adds the watch wd for the directory name inside parent, or the root when
+// parent is 0. A wd already in the tree is moved there instead, and whatever
+// was at that place before is dropped. Returns the node, 0 on failure.
+uint32_t wt_add(WatchTree* t, int wd, uint32_t parent, const char* name);
+uint32_t wt_find_wd(const WatchTree* t, int wd);
+uint32_t wt_find_child(const WatchTree* t, uint32_t parent, const char* name);
+// node of an absolute path below (or at) the root, 0 if it is not watched
+uint32_t wt_find_path(const WatchTree* t, const char* path);
+// writes the full path of node; -1 if it does not fit
+int wt_path(const WatchTree* t, uint32_t node, char* buf, size_t size);
+// a rename: node now lives under new_parent as new_name
+int wt_move(WatchTree* t, uint32_t node, uint32_t new_parent, const char* new_name);
+// drops node and everything below it
+void wt_remove(WatchTree* t, uint32_t node);
+void wt_free(WatchTree* t);
+
+#endif
@@ -0,0 +1,198 @@
+// Two directories compared in one pass: every name once, in name order, with
+// the kind the stats on both sides give it; a missing target directory, a
+// callback stopping the walk, one changing the directories under it, and
+// listings that take more than one getdents64 batch.
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "dirdiff.h"
+
+typedef struct
+{
+    char names[4096][64];
+    DiffKind kinds[4096];
+    int count;
+    // set by the tests that change the trees from the callback
+    const char* unlink_at_first;
+    const char* stop_at;
+} Seen;
+
+static char root[64];
+
+static void write_file(const char* dir, const char* name, const char* data)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/%s", root, dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    CHECK(write(fd, data, strlen(data)) == (ssize_t)strlen(data));
+    close(fd);
+}
+
+static void make_dir(const char* dir, const char* name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/%s", root, dir, name);
+    CHECK(mkdir(path, 0755) == 0);
+}
+
+// copies size and mtime, which is what makes two files the same
+static void same_times(const char* name)
+{
+    char from[512], to[512];
+    snprintf(from, sizeof(from), "%s/from/%s", root, name);
+    snprintf(to, sizeof(to), "%s/to/%s", root, name);
+    struct stat st;
+    CHECK(stat(from, &st) == 0);
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    CHECK(utimensat(AT_FDCWD, to, times, 0) == 0);
+}
+
+static int record(const DiffEntry* e, void* arg)
+{
+    Seen* s = arg;
+    CHECK(s->count < 4096 && strlen(e->name) < 64);
+    if (s->count > 0)
+        CHECK(strcmp(s->names[s->count - 1], e->name) < 0);
+    snprintf(s->names[s->count], sizeof(s->names[0]), "%s", e->name);
+    s->kinds[s->count++] = e->kind;
+    if (e->kind != DIFF_REMOVED)
+        CHECK(e->from.st_ino != 0);
+    if (e->kind != DIFF_ADDED)
+        CHECK(e->to.st_ino != 0);
+
+    if (s->unlink_at_first && s->count == 1)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", root, s->unlink_at_first);
+        CHECK(unlink(path) == 0);
+    }
+    if (s->stop_at && strcmp(e->name, s->stop_at) == 0)
+        return -7;
+    return 0;
+}
+
+static DiffKind kind_of(const Seen* s, const char* name)
+{
+    for (int i = 0; i < s->count; i++)
+    {
+        if (strcmp(s->names[i], name) == 0)
+            return s->kinds[i];
+    }
+    CHECK(!"name not reported");
+    return DIFF_SAME;
+}
+
+static void rm_rf(const char* path)
+{
+    char cmd[600];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", path);
+    CHECK(system(cmd) == 0);
+}
+
+int main(void)
+{
+    snprintf(root, sizeof(root), "/tmp/dirdiff-test-XXXXXX");
+    CHECK(mkdtemp(root) != NULL);
+    make_dir("", "from");
+    make_dir("", "to");
+
+    write_file("from", "a-added", "1");
+    make_dir("from", "b-type");
+    write_file("to", "b-type", "now a file");
+    write_file("from", "c-size", "123");
+    write_file("to", "c-size", "12");
+    write_file("from", "d-same", "same");
+    write_file("to", "d-same", "same");
+    same_times("d-same");
+    write_file("from", "e-mtime", "same");
+    write_file("to", "e-mtime", "same");
+    make_dir("from", "g-dir");
+    make_dir("to", "g-dir");
+    write_file("from/g-dir", "inside", "not looked at");
+    write_file("to", "f-removed", "x");
+    char link[512];
+    snprintf(link, sizeof(link), "%s/from/h-link", root);
+    CHECK(symlink("d-same", link) == 0);
+
+    char from[128], to[128];
+    snprintf(from, sizeof(from), "%s/from", root);
+    snprintf(to, sizeof(to), "%s/to", root);
+    struct timespec old[2] = {{1000, 0}, {1000, 0}};
+    char path[512];
+    snprintf(path, sizeof(path), "%s/e-mtime", to);
+    CHECK(utimensat(AT_FDCWD, path, old, 0) == 0);
+
+    Seen* s = calloc(1, sizeof(*s));
+    CHECK(dir_diff(from, to, record, s) == 0);
+    CHECK(s->count == 8);
+    CHECK(kind_of(s, "a-added") == DIFF_ADDED);
+    CHECK(kind_of(s, "b-type") == DIFF_CHANGED);
+    CHECK(kind_of(s, "c-size") == DIFF_CHANGED);
+    CHECK(kind_of(s, "d-same") == DIFF_SAME);
+    CHECK(kind_of(s, "e-mtime") == DIFF_CHANGED);
+    CHECK(kind_of(s, "f-removed") == DIFF_REMOVED);
+    CHECK(kind_of(s, "g-dir") == DIFF_SAME);
+    CHECK(kind_of(s, "h-link") == DIFF_ADDED);
+
+    // no target directory yet: everything is added
+    memset(s, 0, sizeof(*s));
+    snprintf(path, sizeof(path), "%s/missing", root);
+    CHECK(dir_diff(from, path, record, s) == 0);
+    CHECK(s->count == 7);
+    for (int i = 0; i < s->count; i++)
+        CHECK(s->kinds[i] == DIFF_ADDED);
+    // but the source has to be there
+    CHECK(dir_diff(path, to, record, s) == -1);
+
+    // the callback's return stops the walk and comes back from it
+    memset(s, 0, sizeof(*s));
+    s->stop_at = "c-size";
+    CHECK(dir_diff(from, to, record, s) == -7);
+    CHECK(s->count == 3);
+
+    // listed first, looked at when reported: an entry deleted meanwhile is
+    // skipped, or counts as missing on the side it went from
+    memset(s, 0, sizeof(*s));
+    s->unlink_at_first = "from/h-link";
+    CHECK(dir_diff(from, to, record, s) == 0);
+    CHECK(s->count == 7);
+    memset(s, 0, sizeof(*s));
+    s->unlink_at_first = "to/d-same";
+    CHECK(dir_diff(from, to, record, s) == 0);
+    CHECK(kind_of(s, "d-same") == DIFF_ADDED);
+
+    // more names than one 64 KiB getdents64 batch holds
+    rm_rf(from);
+    rm_rf(to);
+    make_dir("", "from");
+    make_dir("", "to");
+    char name[64];
+    for (int i = 0; i < 3000; i++)
+    {
+        snprintf(name, sizeof(name), "entry-with-a-longer-name-%05d", i);
+        write_file(i % 3 == 0 ? "to" : "from", name, "");
+        if (i % 3 == 1)
+            write_file("to", name, "x");
+    }
+    memset(s, 0, sizeof(*s));
+    CHECK(dir_diff(from, to, record, s) == 0);
+    CHECK(s->count == 3000);
+    for (int i = 0; i < 3000; i++)
+    {
+        snprintf(name, sizeof(name), "entry-with-a-longer-name-%05d", i);
+        CHECK(strcmp(s->names[i], name) == 0);
+        CHECK(s->kinds[i] == (i % 3 == 0 ? DIFF_REMOVED : i % 3 == 1 ? DIFF_CHANGED : DIFF_ADDED));
+    }
+
+    free(s);
+    rm_rf(root);
+    printf("dirdiff: ok\n");
+    return 0;
+}
@@ -0,0 +1,173 @@
+// Include/exclude rules as filter.h describes them: literal names and plain
+// extensions (looked up in hash tables) against the glob patterns matched one
+// by one, the last matching rule winning across both, anchoring, directory
+// only rules, "**", classes, and the "~pattern" rules kept apart from it all.
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "filter.h"
+
+typedef struct
+{
+    const char* path;
+    int is_dir;
+    int excluded;
+} Case;
+
+static Filter* rules(const char* const* list)
+{
+    Filter* f = filter_new();
+    CHECK(f != NULL);
+    for (; *list; list++)
+        CHECK(filter_add(f, *list) == 0);
+    return f;
+}
+
+static void expect(const char* const* list, const Case* cases)
+{
+    Filter* f = rules(list);
+    for (; cases->path; cases++)
+    {
+        int got = filter_excluded(f, cases->path, cases->is_dir);
+        if (got != cases->excluded)
+            fprintf(stderr, "rules starting with \"%s\": %s\n", list[0], cases->path);
+        CHECK(got == cases->excluded);
+    }
+    filter_free(f);
+}
+
+static void literal_and_extension(void)
+{
+    const char* r[] = {"-node_modules", "-*.tmp", "+keep.tmp", NULL};
+    const Case c[] = {
+        {"node_modules", 1, 1},  {"a/b/node_modules", 1, 1}, {"node_modules", 0, 1},
+        {"node_modules_x", 1, 0}, {"x.tmp", 0, 1},            {"a/b/x.tmp", 0, 1},
+        {"tmp", 0, 0},            {"x.tmp.gz", 0, 0},          {"x.TMP", 0, 0},
+        {"keep.tmp", 0, 0},       {"a/keep.tmp", 0, 0},        {"a.b.tmp", 0, 1},
+        {NULL, 0, 0},
+    };
+    expect(r, c);
+}
+
+static void last_match_wins(void)
+{
+    // indexed and generic rules in both orders
+    const char* r1[] = {"-*.tmp", "+x*", NULL};
+    const Case c1[] = {{"x.tmp", 0, 0}, {"y.tmp", 0, 1}, {"x", 0, 0}, {NULL, 0, 0}};
+    expect(r1, c1);
+    const char* r2[] = {"+x*", "-*.tmp", NULL};
+    const Case c2[] = {{"x.tmp", 0, 1}, {"x", 0, 0}, {NULL, 0, 0}};
+    expect(r2, c2);
+    const char* r3[] = {"-*.log", "+important.log", "-important.log", NULL};
+    const Case c3[] = {{"important.log", 0, 1}, {"other.log", 0, 1}, {NULL, 0, 0}};
+    expect(r3, c3);
+    const char* r4[] = {"-build", "+build", NULL};
+    const Case c4[] = {{"build", 1, 0}, {NULL, 0, 0}};
+    expect(r4, c4);
+}
+
+static void directories_and_anchors(void)
+{
+    const char* r[] = {"-build/", "-/out", "-docs/**/*.md", "-cache/**", "-a/*/c", NULL};
+    const Case c[] = {
+        {"build", 1, 1},       {"build", 0, 0},          {"src/build", 1, 1},
+        {"out", 1, 1},         {"out", 0, 1},            {"src/out", 1, 0},
+        {"docs/a.md", 0, 1},   {"docs/x/y/a.md", 0, 1},  {"src/docs/a.md", 0, 0},
+        {"docs/a.txt", 0, 0},  {"cache", 1, 0},          {"cache/x", 0, 1},
+        {"cache/x/y", 1, 1},   {"a/b/c", 0, 1},          {"a/b/b/c", 0, 0},
+        {"a/c", 0, 0},         {NULL, 0, 0},
+    };
+    expect(r, c);
+}
+
+static void globs(void)
+{
+    const char* r[] = {"-[ab]?.c", "-[!a]*.o", "-*~", "-core.[0-9]*", "-we\\*ird", NULL};
+    const Case c[] = {
+        {"ax.c", 0, 1},   {"bx.c", 0, 1},      {"cx.c", 0, 0},    {"a.c", 0, 0},
+        {"b.o", 0, 1},    {"a.o", 0, 0},       {"x/bb.o", 0, 1},  {"notes~", 0, 1},
+        {"~notes", 0, 0}, {"core.123", 0, 1},  {"core.x", 0, 0},  {"we*ird", 0, 1},
+        {"weXird", 0, 0}, {NULL, 0, 0},
+    };
+    expect(r, c);
+
+    // '*' stays inside its component
+    const char* r2[] = {"-src/*.c", NULL};
+    const Case c2[] = {{"src/a.c", 0, 1}, {"src/x/a.c", 0, 0}, {NULL, 0, 0}};
+    expect(r2, c2);
+}
+
+static void rules_as_added(void)
+{
+    Filter* f = filter_new();
+    CHECK(filter_add(f, "") < 0);
+    CHECK(filter_add(f, "-") < 0);
+    CHECK(filter_add(f, "+/") < 0);
+    CHECK(filter_add(f, "node_modules") < 0);
+    CHECK(filter_count(f) == 0);
+    CHECK(filter_excluded(f, "anything", 0) == 0);
+
+    CHECK(filter_add(f, "-*.o") == 0);
+    CHECK(filter_add(f, "~vendor") == 0);
+    CHECK(filter_add(f, "+main.o") == 0);
+    CHECK(filter_count(f) == 3);
+    CHECK(strcmp(filter_rule(f, 0), "-*.o") == 0);
+    CHECK(strcmp(filter_rule(f, 1), "~vendor") == 0);
+    CHECK(strcmp(filter_rule(f, 2), "+main.o") == 0);
+
+    // polled directories are mirrored, not excluded
+    CHECK(filter_polled(f, "vendor") == 1);
+    CHECK(filter_polled(f, "lib/vendor") == 1);
+    CHECK(filter_polled(f, "vendors") == 0);
+    CHECK(filter_excluded(f, "vendor", 1) == 0);
+    CHECK(filter_excluded(f, "x.o", 0) == 1);
+    CHECK(filter_excluded(f, "main.o", 0) == 0);
+    filter_free(f);
+
+    CHECK(filter_excluded(NULL, "x", 0) == 0);
+    CHECK(filter_polled(NULL, "x") == 0);
+    CHECK(filter_count(NULL) == 0);
+}
+
+// enough rules to grow both hash tables and the generic list several times
+static void many_rules(void)
+{
+    Filter* f = filter_new();
+    char rule[64];
+    for (int i = 0; i < 500; i++)
+    {
+        snprintf(rule, sizeof(rule), "-name%d", i);
+        CHECK(filter_add(f, rule) == 0);
+        snprintf(rule, sizeof(rule), "-*.ext%d", i);
+        CHECK(filter_add(f, rule) == 0);
+        snprintf(rule, sizeof(rule), "-g%d*", i);
+        CHECK(filter_add(f, rule) == 0);
+    }
+    char path[64];
+    for (int i = 0; i < 500; i++)
+    {
+        snprintf(path, sizeof(path), "d/name%d", i);
+        CHECK(filter_excluded(f, path, 0) == 1);
+        snprintf(path, sizeof(path), "d/file.ext%d", i);
+        CHECK(filter_excluded(f, path, 0) == 1);
+        snprintf(path, sizeof(path), "d/g%dtail", i);
+        CHECK(filter_excluded(f, path, 0) == 1);
+    }
+    CHECK(filter_excluded(f, "d/name500", 0) == 0);
+    CHECK(filter_excluded(f, "d/file.ext500", 0) == 0);
+    CHECK(filter_excluded(f, "d/h1", 0) == 0);
+    filter_free(f);
+}
+
+int main(void)
+{
+    literal_and_extension();
+    last_match_wins();
+    directories_and_anchors();
+    globs();
+    rules_as_added();
+    many_rules();
+    printf("filter: ok\n");
+    return 0;
+}
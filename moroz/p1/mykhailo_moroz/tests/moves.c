@@ -0,0 +1,138 @@
+// Pairing IN_MOVED_FROM halves by cookie and expiring the ones whose
+// IN_MOVED_TO never came: found while pending, gone once taken, replaced when
+// a cookie comes again, and expired on the tick the timeout ends on, oldest
+// deadline first, also after a stall longer than the wheel.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "moves.h"
+
+#define MS 1000000LL
+
+typedef struct
+{
+    uint32_t cookies[8192];
+    size_t count;
+} Expired;
+
+static void collect(PendingMove* move, void* arg)
+{
+    Expired* ex = arg;
+    CHECK(ex->count < sizeof(ex->cookies) / sizeof(ex->cookies[0]));
+    CHECK(move->src_old && move->dst_old);
+    ex->cookies[ex->count++] = move->cookie;
+}
+
+static void add(PendingMoves* pm, uint32_t cookie, long long now_ns)
+{
+    char src[64], dst[64];
+    snprintf(src, sizeof(src), "/src/%u", cookie);
+    snprintf(dst, sizeof(dst), "/dst/%u", cookie);
+    CHECK(pm_add(pm, cookie, (int)(cookie & 1), src, dst, now_ns, now_ns + 7, now_ns) == 0);
+}
+
+static void pairing(void)
+{
+    PendingMoves pm = {0};
+    for (uint32_t c = 1; c <= 1000; c++)
+        add(&pm, c * 7919u, 0);
+    CHECK(pm.count == 1000);
+
+    PendingMove m;
+    CHECK(pm_take(&pm, 500 * 7919u, &m) == 1);
+    CHECK(m.cookie == 500 * 7919u && m.is_dir == 0 && m.read_ns == 0 && m.wall_ns == 7);
+    CHECK(strcmp(m.src_old, "/src/3959500") == 0 && strcmp(m.dst_old, "/dst/3959500") == 0);
+    pm_release(&m);
+    CHECK(m.src_old == NULL && m.dst_old == NULL);
+    CHECK(pm_take(&pm, 500 * 7919u, &m) == 0);
+    CHECK(pm_take(&pm, 12345, &m) == 0);
+    CHECK(pm.count == 999);
+
+    // a cookie seen again replaces the pending half
+    CHECK(pm_add(&pm, 7919u, 1, "/again", "/again-dst", 1, 2, 3) == 0);
+    CHECK(pm.count == 999);
+    CHECK(pm_take(&pm, 7919u, &m) == 1 && m.is_dir == 1 && strcmp(m.src_old, "/again") == 0);
+    pm_release(&m);
+
+    // taking and adding in turns leaves deleted slots behind; every pending
+    // cookie has to stay reachable past them
+    for (uint32_t c = 2; c <= 1000; c++)
+    {
+        if (c == 500)
+            continue;
+        CHECK(pm_take(&pm, c * 7919u, &m) == 1 && m.cookie == c * 7919u);
+        pm_release(&m);
+        add(&pm, c * 7919u + 1, 0);
+    }
+    CHECK(pm.count == 998);
+    for (uint32_t c = 2; c <= 1000; c++)
+    {
+        if (c == 500)
+            continue;
+        CHECK(pm_take(&pm, c * 7919u, &m) == 0);
+        CHECK(pm_take(&pm, c * 7919u + 1, &m) == 1);
+        pm_release(&m);
+    }
+    CHECK(pm.count == 0);
+
+    // whatever is still pending is freed with the table
+    add(&pm, 1, 0);
+    add(&pm, 2, 0);
+    pm_free(&pm);
+    CHECK(pm.count == 0 && pm.moves == NULL);
+}
+
+static void expiry(void)
+{
+    PendingMoves pm = {0};
+    Expired ex = {0};
+    for (uint32_t c = 1; c <= 100; c++)
+        add(&pm, c, 10 * MS);
+    for (uint32_t c = 101; c <= 200; c++)
+        add(&pm, c, 510 * MS);
+
+    // nothing is given up on before its timeout
+    pm_expire(&pm, 10 * MS + MOVE_PAIR_TIMEOUT_MS * MS - 1, collect, &ex);
+    CHECK(ex.count == 0 && pm.count == 200);
+    // and everything is once the tick after it has passed
+    pm_expire(&pm, 10 * MS + (MOVE_PAIR_TIMEOUT_MS + MOVE_WHEEL_TICK_MS) * MS, collect, &ex);
+    CHECK(ex.count == 100 && pm.count == 100);
+    for (size_t i = 0; i < ex.count; i++)
+        CHECK(ex.cookies[i] >= 1 && ex.cookies[i] <= 100);
+
+    PendingMove m;
+    CHECK(pm_take(&pm, 50, &m) == 0);
+    CHECK(pm_take(&pm, 150, &m) == 1);
+    pm_release(&m);
+    pm_expire(&pm, 510 * MS + (MOVE_PAIR_TIMEOUT_MS + MOVE_WHEEL_TICK_MS) * MS, collect, &ex);
+    CHECK(ex.count == 199 && pm.count == 0);
+    pm_free(&pm);
+
+    // a stall much longer than the wheel: every slot is still visited once,
+    // in deadline order
+    memset(&ex, 0, sizeof(ex));
+    for (uint32_t c = 1; c <= 50; c++)
+        add(&pm, c, 0);
+    for (uint32_t c = 51; c <= 100; c++)
+        add(&pm, c, 600 * MS);
+    pm_expire(&pm, 60000 * MS, collect, &ex);
+    CHECK(ex.count == 100 && pm.count == 0);
+    for (size_t i = 0; i < ex.count; i++)
+        CHECK((i < 50) == (ex.cookies[i] <= 50));
+
+    // the table keeps working after it emptied
+    add(&pm, 4242, 70000 * MS);
+    CHECK(pm_take(&pm, 4242, &m) == 1);
+    pm_release(&m);
+    pm_free(&pm);
+}
+
+int main(void)
+{
+    pairing();
+    expiry();
+    printf("moves: ok\n");
+    return 0;
+}
@@ -0,0 +1,394 @@
+// Stream framing end to end over a Unix socket, with the receiver in a child
+// process writing down every operation it applies:
+//  - what the sender queues arrives once and in order, file data split into
+//    chunks and packed or not as it pays off;
+//  - frames written by hand in the documented wire format: a resumed session
+//    is answered with the last frame applied, frames sent again after a
+//    reconnect are not applied twice, and a path leaving the target drops the
+//    connection without being applied;
+//  - a receiver that lost the session makes the sender start over.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "stream.h"
+
+#define HEADER_SIZE 40
+
+// what the receiver writes down for one operation
+typedef struct
+{
+    int op;
+    uint32_t mode;
+    uint64_t offset;
+    uint64_t size;
+    long long mtime_ns;
+    uint64_t data_len;
+    uint64_t data_hash;
+    char path[128];
+    char data[128];  // the start of it, NUL terminated
+} Applied;
+
+static char dir[64];
+static char address[128];
+static volatile sig_atomic_t stop = 0;
+
+static uint64_t hash(const void* p, size_t n)
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < n; i++)
+    {
+        h ^= ((const unsigned char*)p)[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static int apply(const StreamOp* op, void* arg)
+{
+    Applied a = {0};
+    a.op = (int)op->op;
+    a.mode = op->mode;
+    a.offset = op->offset;
+    a.size = op->size;
+    a.mtime_ns = op->mtime_ns;
+    a.data_len = op->data_len;
+    a.data_hash = hash(op->data, op->data_len);
+    snprintf(a.path, sizeof(a.path), "%s", op->path);
+    memcpy(a.data, op->data, op->data_len < sizeof(a.data) - 1 ? op->data_len : sizeof(a.data) - 1);
+    CHECK(write(*(int*)arg, &a, sizeof(a)) == (ssize_t)sizeof(a));
+    return 0;
+}
+
+static void on_term(int sig) { stop = 1; }
+
+static pid_t receiver_start(const char* log_name)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, log_name);
+    char sock[128];
+    snprintf(sock, sizeof(sock), "%s/sock", dir);
+    unlink(sock);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_term;  // no SA_RESTART, so accept and recv return
+        sigaction(SIGTERM, &sa, NULL);
+        int out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        int null = open("/dev/null", O_WRONLY);
+        CHECK(out >= 0 && null >= 0);
+        dup2(null, STDERR_FILENO);
+        _exit(stream_receive(address, apply, &out, &stop) == 0 ? 0 : 1);
+    }
+    // listening once the socket shows up
+    struct stat st;
+    for (int i = 0; i < 500 && stat(sock, &st) < 0; i++)
+        usleep(10000);
+    CHECK(stat(sock, &st) == 0);
+    return pid;
+}
+
+static void receiver_stop(pid_t pid, int sig)
+{
+    CHECK(kill(pid, sig) == 0);
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    if (sig == SIGTERM)
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static Applied* applied(const char* log_name, size_t* count)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, log_name);
+    int fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    struct stat st;
+    CHECK(fstat(fd, &st) == 0 && st.st_size % sizeof(Applied) == 0);
+    Applied* a = malloc((size_t)st.st_size + 1);
+    CHECK(read(fd, a, (size_t)st.st_size) == st.st_size);
+    close(fd);
+    *count = (size_t)st.st_size / sizeof(Applied);
+    return a;
+}
+
+static void wait_acked(StreamConn* c)
+{
+    for (int i = 0; i < 500 && stream_unacked(c) > 0; i++)
+    {
+        struct pollfd pfd = {stream_fd(c), POLLIN, 0};
+        poll(&pfd, 1, 10);
+        stream_read_acks(c);
+    }
+    CHECK(stream_unacked(c) == 0);
+}
+
+static void make_file(const char* name, const unsigned char* data, size_t n, struct stat* st)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    CHECK(fd >= 0 && write(fd, data, n) == (ssize_t)n);
+    CHECK(fstat(fd, st) == 0);
+    close(fd);
+}
+
+// checks the FILE_BEGIN, WRITE..., FILE_END run at a[*i] against data
+static void expect_file(const Applied* a, size_t count, size_t* i, const char* path, const unsigned char* data,
+                        size_t n, const struct stat* st)
+{
+    CHECK(*i < count && a[*i].op == STREAM_OP_FILE_BEGIN && strcmp(a[*i].path, path) == 0);
+    (*i)++;
+    uint64_t off = 0;
+    while (*i < count && a[*i].op == STREAM_OP_WRITE)
+    {
+        CHECK(strcmp(a[*i].path, path) == 0);
+        CHECK(a[*i].offset == off && a[*i].data_len > 0 && a[*i].data_len <= STREAM_CHUNK);
+        CHECK(a[*i].data_hash == hash(data + off, a[*i].data_len));
+        off += a[*i].data_len;
+        (*i)++;
+    }
+    CHECK(off == n);
+    CHECK(*i < count && a[*i].op == STREAM_OP_FILE_END && strcmp(a[*i].path, path) == 0);
+    CHECK(a[*i].size == n && a[*i].mode == st->st_mode);
+    CHECK(a[*i].mtime_ns == st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec);
+    (*i)++;
+}
+
+static void sender_round_trip(void)
+{
+    pid_t pid = receiver_start("applied-1");
+    char target[160];
+    snprintf(target, sizeof(target), "%s?compress", address);
+    StreamConn* c = stream_open(target, &stop);
+    CHECK(c != NULL && stream_fd(c) >= 0);
+
+    // runs and zeros pack well, noise does not; both span several chunks
+    size_t packable_len = 3 * STREAM_CHUNK + 1234;
+    unsigned char* packable = calloc(1, packable_len);
+    for (size_t i = 0; i < packable_len; i += 4096)
+        memset(packable + i, (int)(i / 4096), 1000);
+    size_t noise_len = STREAM_CHUNK + 77;
+    unsigned char* noise = malloc(noise_len);
+    srand(7);
+    for (size_t i = 0; i < noise_len; i++)
+        noise[i] = (unsigned char)rand();
+    struct stat packable_st, noise_st, dir_st;
+    make_file("packable", packable, packable_len, &packable_st);
+    make_file("noise", noise, noise_len, &noise_st);
+    CHECK(stat(dir, &dir_st) == 0);
+
+    char path[128];
+    CHECK(stream_mkdir(c, "", &dir_st) == 0);
+    CHECK(stream_mkdir(c, "d", &dir_st) == 0);
+    snprintf(path, sizeof(path), "%s/packable", dir);
+    CHECK(stream_send_file(c, "d/packable", path) == 0);
+    snprintf(path, sizeof(path), "%s/noise", dir);
+    CHECK(stream_send_file(c, "d/noise", path) == 0);
+    snprintf(path, sizeof(path), "%s/gone", dir);
+    CHECK(stream_send_file(c, "d/gone", path) == 0);  // vanished: nothing is sent
+    CHECK(stream_symlink(c, "d/link", "packable", &dir_st) == 0);
+    CHECK(stream_rename(c, "d/packable", "d/renamed") == 0);
+    CHECK(stream_delete(c, "d/noise") == 0);
+    const char names[] = "renamed\0link";
+    CHECK(stream_prune(c, "d", names, sizeof(names)) == 0);
+    CHECK(stream_flush(c) == 0);
+    wait_acked(c);
+    stream_close(c);
+    receiver_stop(pid, SIGTERM);
+
+    size_t count;
+    Applied* a = applied("applied-1", &count);
+    size_t i = 0;
+    CHECK(count > 0 && a[i].op == STREAM_OP_MKDIR && a[i].path[0] == '\0' && a[i].mode == dir_st.st_mode);
+    i++;
+    CHECK(a[i].op == STREAM_OP_MKDIR && strcmp(a[i].path, "d") == 0);
+    i++;
+    expect_file(a, count, &i, "d/packable", packable, packable_len, &packable_st);
+    expect_file(a, count, &i, "d/noise", noise, noise_len, &noise_st);
+    CHECK(i < count && a[i].op == STREAM_OP_SYMLINK && strcmp(a[i].path, "d/link") == 0);
+    CHECK(a[i].data_len == strlen("packable") + 1 && strcmp(a[i].data, "packable") == 0);
+    i++;
+    CHECK(i < count && a[i].op == STREAM_OP_RENAME && strcmp(a[i].path, "d/packable") == 0);
+    CHECK(strcmp(a[i].data, "d/renamed") == 0);
+    i++;
+    CHECK(i < count && a[i].op == STREAM_OP_DELETE && strcmp(a[i].path, "d/noise") == 0);
+    i++;
+    CHECK(i < count && a[i].op == STREAM_OP_PRUNE && strcmp(a[i].path, "d") == 0);
+    CHECK(a[i].data_len == sizeof(names) && a[i].data_hash == hash(names, sizeof(names)));
+    i++;
+    CHECK(i == count);
+    free(a);
+    free(packable);
+    free(noise);
+}
+
+// the wire format as stream.c documents it
+static void put_le(unsigned char* p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char* p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void send_frame(int fd, int op, uint64_t seq, uint64_t a, const char* path)
+{
+    unsigned char frame[HEADER_SIZE + 128] = {0};
+    size_t path_len = strlen(path);
+    put_le(frame, path_len, 4);
+    frame[4] = (unsigned char)op;
+    put_le(frame + 6, path_len, 2);
+    put_le(frame + 8, seq, 8);
+    put_le(frame + 16, a, 8);
+    memcpy(frame + HEADER_SIZE, path, path_len);
+    CHECK(send(fd, frame, HEADER_SIZE + path_len, MSG_NOSIGNAL) == (ssize_t)(HEADER_SIZE + path_len));
+}
+
+// reads acknowledgements until one covers seq; returns the flags of the last
+static int read_ack(int fd, uint64_t seq)
+{
+    for (;;)
+    {
+        unsigned char ack[HEADER_SIZE];
+        size_t got = 0;
+        while (got < sizeof(ack))
+        {
+            ssize_t r = recv(fd, ack + got, sizeof(ack) - got, 0);
+            CHECK(r > 0);
+            got += (size_t)r;
+        }
+        CHECK(get_le(ack, 4) == 0 && ack[4] == STREAM_OP_ACK);
+        CHECK(get_le(ack + 8, 8) <= seq);
+        if (get_le(ack + 8, 8) == seq)
+            return ack[5];
+    }
+}
+
+static int raw_connect(void)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    struct sockaddr_un un = {0};
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s/sock", dir);
+    CHECK(connect(fd, (struct sockaddr*)&un, sizeof(un)) == 0);
+    return fd;
+}
+
+static void hand_written_frames(void)
+{
+    pid_t pid = receiver_start("applied-2");
+    int fd = raw_connect();
+    send_frame(fd, STREAM_OP_HELLO, 0, 42, "");
+    CHECK(read_ack(fd, 0) == 1);  // a session it did not know
+    send_frame(fd, STREAM_OP_DELETE, 1, 0, "x");
+    send_frame(fd, STREAM_OP_DELETE, 2, 0, "y");
+    read_ack(fd, 2);
+    close(fd);
+
+    // the same session again: it says how far it got, repeats are skipped
+    fd = raw_connect();
+    send_frame(fd, STREAM_OP_HELLO, 0, 42, "");
+    CHECK(read_ack(fd, 2) == 0);
+    send_frame(fd, STREAM_OP_DELETE, 2, 0, "y");
+    send_frame(fd, STREAM_OP_DELETE, 3, 0, "z");
+    read_ack(fd, 3);
+
+    // a path out of the target ends the connection and is not applied
+    send_frame(fd, STREAM_OP_DELETE, 4, 0, "a/../../etc");
+    char c;
+    CHECK(recv(fd, &c, 1, 0) == 0);
+    close(fd);
+
+    // so does anything before the HELLO
+    fd = raw_connect();
+    send_frame(fd, STREAM_OP_DELETE, 5, 0, "w");
+    CHECK(recv(fd, &c, 1, 0) == 0);
+    close(fd);
+    receiver_stop(pid, SIGTERM);
+
+    size_t count;
+    Applied* a = applied("applied-2", &count);
+    CHECK(count == 3);
+    CHECK(a[0].op == STREAM_OP_DELETE && strcmp(a[0].path, "x") == 0);
+    CHECK(a[1].op == STREAM_OP_DELETE && strcmp(a[1].path, "y") == 0);
+    CHECK(a[2].op == STREAM_OP_DELETE && strcmp(a[2].path, "z") == 0);
+    free(a);
+}
+
+static void lost_session(void)
+{
+    pid_t pid = receiver_start("applied-3");
+    StreamConn* c = stream_open(address, &stop);
+    CHECK(c != NULL);
+    struct stat st;
+    CHECK(stat(dir, &st) == 0);
+    CHECK(stream_mkdir(c, "kept", &st) == 0);
+    CHECK(stream_flush(c) == 0);
+    wait_acked(c);
+
+    // a new receiver knows nothing of what the old one applied
+    receiver_stop(pid, SIGKILL);
+    pid = receiver_start("applied-4");
+    CHECK(stream_delete(c, "kept") == 0);
+    CHECK(stream_flush(c) == STREAM_RESYNC);
+    CHECK(stream_unacked(c) == 0);
+    // and the connection is usable for the resync
+    CHECK(stream_mkdir(c, "again", &st) == 0);
+    CHECK(stream_flush(c) == 0);
+    wait_acked(c);
+    stream_close(c);
+    receiver_stop(pid, SIGTERM);
+
+    size_t count;
+    Applied* a = applied("applied-3", &count);
+    CHECK(count == 1 && a[0].op == STREAM_OP_MKDIR && strcmp(a[0].path, "kept") == 0);
+    free(a);
+    a = applied("applied-4", &count);
+    CHECK(count == 1 && a[0].op == STREAM_OP_MKDIR && strcmp(a[0].path, "again") == 0);
+    free(a);
+}
+
+int main(void)
+{
+    snprintf(dir, sizeof(dir), "/tmp/stream-test-XXXXXX");
+    CHECK(mkdtemp(dir) != NULL);
+    snprintf(address, sizeof(address), "unix:%s/sock", dir);
+    signal(SIGPIPE, SIG_IGN);
+
+    CHECK(stream_is_target(address) && !stream_is_target("/plain/dir"));
+    CHECK(stream_open("unix:", &stop) == NULL);
+    CHECK(stream_open("stream://no-port", &stop) == NULL);
+    CHECK(stream_open("unix:/x?gzip", &stop) == NULL);
+
+    sender_round_trip();
+    hand_written_frames();
+    lost_session();
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+    CHECK(system(cmd) == 0);
+    printf("stream: ok\n");
+    return 0;
+}
@@ -0,0 +1,146 @@
+// The primary's change log as the secondaries read it: records come back as
+// written, also where they wrap around the end of the ring; a reader more than
+// the ring behind is told it lost track; and a reader racing a writer in
+// another process, which is how the workers use it, gets every record whole
+// and in order or is told to start over, never a torn one.
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "tierlog.h"
+
+static void path_of(unsigned long n, char* buf, size_t size)
+{
+    // lengths vary so records end at every alignment of the ring
+    char pad[200];
+    size_t len = n % sizeof(pad);
+    memset(pad, 'x', len);
+    snprintf(buf, size, "/primary/dir-%lu/%.*s", n, (int)len, pad);
+}
+
+static void round_trip(void)
+{
+    TierLog* log = tier_log_create();
+    CHECK(log != NULL);
+    CHECK(atomic_load(&log->epoch) == 0 && atomic_load(&log->ready_epoch) == 0);
+    tier_log_begin(log);
+    CHECK(atomic_load(&log->epoch) == 1 && atomic_load(&log->ready_epoch) == 0);
+    tier_log_ready(log);
+    CHECK(atomic_load(&log->ready_epoch) == 1);
+    tier_log_synced(log, 123456789LL);
+    CHECK(atomic_load(&log->synced_ns) == 123456789LL);
+
+    uint64_t pos = 0;
+    TierRecord* rec = malloc(sizeof(*rec));
+    CHECK(tier_log_next(log, &pos, rec) == 0);
+
+    tier_log_append(log, TIER_UPDATE, "/primary/a", NULL);
+    tier_log_append(log, TIER_RENAME, "/primary/b", "/primary/c");
+    tier_log_append(log, TIER_DELETE, "/primary/d", NULL);
+    CHECK(tier_log_next(log, &pos, rec) == 1);
+    CHECK(rec->op == TIER_UPDATE && strcmp(rec->path, "/primary/a") == 0 && rec->path2[0] == '\0');
+    long long first_ns = rec->ns;
+    CHECK(first_ns > 0);
+    CHECK(pos % 8 == 0);
+    CHECK(tier_log_next(log, &pos, rec) == 1);
+    CHECK(rec->op == TIER_RENAME && strcmp(rec->path, "/primary/b") == 0 && strcmp(rec->path2, "/primary/c") == 0);
+    CHECK(rec->ns >= first_ns);
+    CHECK(tier_log_next(log, &pos, rec) == 1);
+    CHECK(rec->op == TIER_DELETE && strcmp(rec->path, "/primary/d") == 0);
+    CHECK(tier_log_next(log, &pos, rec) == 0);
+    CHECK(pos == atomic_load(&log->head));
+
+    // too long for a record: left out rather than cut short
+    char* huge = malloc(sizeof(rec->buf) + 1);
+    memset(huge, 'h', sizeof(rec->buf));
+    huge[sizeof(rec->buf)] = '\0';
+    tier_log_append(log, TIER_UPDATE, huge, NULL);
+    CHECK(tier_log_next(log, &pos, rec) == 0);
+    free(huge);
+
+    // a reader keeping up goes around the ring several times
+    char want[512];
+    unsigned long n = 0;
+    while (atomic_load(&log->head) < 3ull * TIER_LOG_SIZE)
+    {
+        path_of(n, want, sizeof(want));
+        tier_log_append(log, TIER_UPDATE, want, n % 2 ? want : NULL);
+        CHECK(tier_log_next(log, &pos, rec) == 1);
+        CHECK(strcmp(rec->path, want) == 0);
+        CHECK(strcmp(rec->path2, n % 2 ? want : "") == 0);
+        n++;
+    }
+
+    // one that fell a whole ring behind has lost track
+    uint64_t behind = pos;
+    while (atomic_load(&log->head) - behind <= TIER_LOG_SIZE)
+        tier_log_append(log, TIER_DELETE, "/primary/filler", NULL);
+    CHECK(tier_log_next(log, &behind, rec) == -1);
+
+    free(rec);
+    tier_log_destroy(log);
+}
+
+// the writer appends numbered records as fast as it can; whatever the reader
+// gets must be the next number, unless it was told to start over
+static void racing_reader(void)
+{
+    TierLog* log = tier_log_create();
+    CHECK(log != NULL);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0)
+    {
+        char path[512];
+        for (unsigned long n = 0;; n++)
+        {
+            path_of(n, path, sizeof(path));
+            tier_log_append(log, TIER_UPDATE, path, NULL);
+        }
+    }
+
+    TierRecord* rec = malloc(sizeof(*rec));
+    uint64_t pos = 0;
+    long expect = 0;  // -1 after starting over: any number will do
+    unsigned long records = 0, restarts = 0;
+    char want[512];
+    while (records < 300000 && restarts < 100000)
+    {
+        int r = tier_log_next(log, &pos, rec);
+        if (r < 0)
+        {
+            pos = atomic_load(&log->head);
+            expect = -1;
+            restarts++;
+            continue;
+        }
+        if (r == 0)
+            continue;
+        unsigned long n;
+        CHECK(sscanf(rec->path, "/primary/dir-%lu/", &n) == 1);
+        if (expect >= 0)
+            CHECK(n == (unsigned long)expect);
+        path_of(n, want, sizeof(want));
+        CHECK(rec->op == TIER_UPDATE && strcmp(rec->path, want) == 0 && rec->path2[0] == '\0');
+        expect = (long)n + 1;
+        records++;
+    }
+    kill(pid, SIGKILL);
+    CHECK(waitpid(pid, NULL, 0) == pid);
+    CHECK(records > 0);
+    free(rec);
+    tier_log_destroy(log);
+}
+
+int main(void)
+{
+    round_trip();
+    racing_reader();
+    printf("tierlog: ok\n");
+    return 0;
+}
@@ -0,0 +1,244 @@
+// The watch tree against a plain model: every live watch descriptor with the
+// wd of its parent and its name. Random adds, moves and removes over a handful
+// of names keep running into occupied places, and every drop the tree reports
+// is taken out of the model, so after each step every watch has to be found
+// by wd and by path, with the path the model builds for it.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "watchtree.h"
+
+#define MAX_WD 4096
+#define ROOT_WD 1
+#define ROOT "/src"
+
+typedef struct
+{
+    int live;
+    int parent;  // wd, 0 for the root
+    char name[64];
+} ModelWatch;
+
+static ModelWatch model[MAX_WD];
+static int model_live = 0;
+static int drops = 0;
+
+static void dropped(int wd, void* arg)
+{
+    (void)arg;
+    CHECK(wd > 0 && wd < MAX_WD && model[wd].live);
+    model[wd].live = 0;
+    model_live--;
+    drops++;
+}
+
+static void model_path(int wd, char* buf, size_t size)
+{
+    if (model[wd].parent == 0)
+    {
+        snprintf(buf, size, "%s", model[wd].name);
+        return;
+    }
+    char parent[4096];
+    model_path(model[wd].parent, parent, sizeof(parent));
+    snprintf(buf, size, "%s/%s", parent, model[wd].name);
+}
+
+static int model_within(int wd, int ancestor)
+{
+    for (; wd; wd = model[wd].parent)
+    {
+        if (wd == ancestor)
+            return 1;
+    }
+    return 0;
+}
+
+static void verify(const WatchTree* t)
+{
+    CHECK(t->count == (uint32_t)model_live);
+    for (int wd = 1; wd < MAX_WD; wd++)
+    {
+        uint32_t node = wt_find_wd(t, wd);
+        if (!model[wd].live)
+        {
+            CHECK(node == 0);
+            continue;
+        }
+        CHECK(node != 0);
+        char want[4096], got[4096];
+        model_path(wd, want, sizeof(want));
+        CHECK(wt_path(t, node, got, sizeof(got)) == 0);
+        CHECK(strcmp(want, got) == 0);
+        CHECK(wt_find_path(t, want) == node);
+        if (model[wd].parent)
+            CHECK(wt_find_child(t, wt_find_wd(t, model[wd].parent), model[wd].name) == node);
+    }
+}
+
+static int random_live(void)
+{
+    for (;;)
+    {
+        int wd = 1 + rand() % (MAX_WD - 1);
+        if (model[wd].live)
+            return wd;
+    }
+}
+
+static void basics(void)
+{
+    WatchTree t = {0};
+    uint32_t root = wt_add(&t, 10, 0, ROOT);
+    uint32_t a = wt_add(&t, 11, root, "a");
+    uint32_t b = wt_add(&t, 12, a, "b");
+    uint32_t c = wt_add(&t, 13, root, "c");
+    CHECK(root && a && b && c);
+    CHECK(t.root == root && t.count == 4);
+
+    CHECK(wt_find_path(&t, ROOT) == root);
+    CHECK(wt_find_path(&t, ROOT "/a/b") == b);
+    CHECK(wt_find_path(&t, ROOT "//a/b/") == b);
+    CHECK(wt_find_path(&t, ROOT "/a/x") == 0);
+    CHECK(wt_find_path(&t, ROOT "x/a") == 0);
+    CHECK(wt_find_path(&t, "/other") == 0);
+    CHECK(wt_find_child(&t, a, "b") == b);
+    CHECK(wt_find_child(&t, root, "b") == 0);
+    CHECK(wt_find_child(&t, a, "never seen") == 0);
+
+    char buf[64];
+    CHECK(wt_path(&t, b, buf, sizeof(buf)) == 0 && strcmp(buf, ROOT "/a/b") == 0);
+    CHECK(wt_path(&t, b, buf, strlen(ROOT "/a/b")) < 0);
+    CHECK(wt_path(&t, b, buf, strlen(ROOT "/a/b") + 1) == 0);
+
+    // a rename re-links one node; what was below it follows
+    uint32_t d = wt_add(&t, 14, b, "d");
+    CHECK(wt_move(&t, b, c, "b2") == 0);
+    CHECK(wt_find_path(&t, ROOT "/c/b2/d") == d);
+    CHECK(wt_find_path(&t, ROOT "/a/b") == 0);
+    CHECK(wt_find_child(&t, a, "b") == 0);
+    // not into itself
+    CHECK(wt_move(&t, c, d, "loop") < 0);
+    CHECK(wt_move(&t, b, b, "self") < 0);
+    CHECK(wt_find_path(&t, ROOT "/c/b2/d") == d);
+
+    // the same wd added again is a move
+    CHECK(wt_add(&t, 14, root, "d2") == d);
+    CHECK(wt_find_path(&t, ROOT "/d2") == d && t.count == 5);
+    wt_free(&t);
+}
+
+static void random_ops(void)
+{
+    WatchTree t = {0};
+    t.dropped = dropped;
+    CHECK(wt_add(&t, ROOT_WD, 0, ROOT) != 0);
+    model[ROOT_WD] = (ModelWatch){1, 0, ROOT};
+    model_live = 1;
+
+    static const char* names[] = {"a", "b", "c", "dir", "x y", ".hidden"};
+    const int name_count = (int)(sizeof(names) / sizeof(names[0]));
+    srand(12345);
+    for (int step = 0; step < 20000; step++)
+    {
+        int op = rand() % 10;
+        const char* name = names[rand() % name_count];
+        if (op < 5 && model_live < MAX_WD / 2)
+        {
+            int wd;
+            do
+                wd = 2 + rand() % (MAX_WD - 2);
+            while (model[wd].live);
+            int parent = random_live();
+            uint32_t node = wt_add(&t, wd, wt_find_wd(&t, parent), name);
+            CHECK(node != 0);
+            // the parent survives: only what was at the new place is dropped
+            CHECK(model[parent].live);
+            model[wd] = (ModelWatch){1, parent, ""};
+            snprintf(model[wd].name, sizeof(model[wd].name), "%s", name);
+            model_live++;
+        }
+        else if (op < 8)
+        {
+            int wd = random_live();
+            int parent = random_live();
+            if (wd == ROOT_WD)
+                continue;
+            // refused into its own subtree, or onto a directory it is in
+            int occupant = 0;
+            for (int o = 1; o < MAX_WD; o++)
+            {
+                if (model[o].live && o != wd && model[o].parent == parent && strcmp(model[o].name, name) == 0)
+                    occupant = o;
+            }
+            int refused = model_within(parent, wd) || (occupant && model_within(wd, occupant));
+            int ret = wt_move(&t, wt_find_wd(&t, wd), wt_find_wd(&t, parent), name);
+            CHECK(refused ? ret < 0 : ret == 0);
+            if (ret == 0)
+            {
+                CHECK(model[wd].live && model[parent].live && !model[occupant].live);
+                model[wd].parent = parent;
+                snprintf(model[wd].name, sizeof(model[wd].name), "%s", name);
+            }
+        }
+        else
+        {
+            int wd = random_live();
+            if (wd == ROOT_WD)
+                continue;
+            int before = drops;
+            wt_remove(&t, wt_find_wd(&t, wd));
+            CHECK(drops > before && !model[wd].live);
+        }
+        if (step % 97 == 0)
+            verify(&t);
+    }
+    verify(&t);
+    wt_free(&t);
+    memset(model, 0, sizeof(model));
+    model_live = 0;
+}
+
+// names are refcounted in one arena, which is compacted once most of it is
+// dead; offsets move then, lookups must not notice
+static void name_churn(void)
+{
+    WatchTree t = {0};
+    uint32_t root = wt_add(&t, 1, 0, ROOT);
+    char name[128];
+    for (int round = 0; round < 4; round++)
+    {
+        for (int i = 0; i < 3000; i++)
+        {
+            snprintf(name, sizeof(name), "round-%d-directory-with-a-long-name-%d", round, i);
+            CHECK(wt_add(&t, 2 + i, root, name) != 0);
+        }
+        for (int i = 0; i < 3000; i += 2)
+            wt_remove(&t, wt_find_wd(&t, 2 + i));
+        for (int i = 1; i < 3000; i += 2)
+        {
+            snprintf(name, sizeof(name), "round-%d-directory-with-a-long-name-%d", round, i);
+            uint32_t node = wt_find_child(&t, root, name);
+            CHECK(node != 0 && node == wt_find_wd(&t, 2 + i));
+            char path[256], want[256];
+            snprintf(want, sizeof(want), ROOT "/%s", name);
+            CHECK(wt_path(&t, node, path, sizeof(path)) == 0 && strcmp(path, want) == 0);
+        }
+        for (int i = 1; i < 3000; i += 2)
+            wt_remove(&t, wt_find_wd(&t, 2 + i));
+        CHECK(t.count == 1);
+    }
+    wt_free(&t);
+}
+
+int main(void)
+{
+    basics();
+    random_ops();
+    name_churn();
+    printf("watchtree: ok\n");
+    return 0;
+}
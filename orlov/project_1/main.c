@@ -1,63 +1,590 @@
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE // syscall() for pidfd_open
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_BACKUPS 256
-#define MAX_WATCHES 8192
 #define EVENT_BUF_LEN (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
 #define MAX_ARGS 64
+#define MAX_PENDING_MOVES 128
+// an IN_MOVED_FROM without its IN_MOVED_TO after this long was a move out of
+// the source
+#define MOVE_PAIR_TIMEOUT_MS 500
+
+// A directory deleted from a target is renamed into TRASH_NAME there, at once
+// whatever its size, instead of being removed entry by entry while events
+// queue up behind it. A reclaimer process forked off the worker empties the
+// trash in the background, at most TRASH_RATE entries a second. Restore never
+// looks inside it.
+#define TRASH_NAME ".sop-trash"
+#define TRASH_RATE 20000
+#define TRASH_POLL_MS 1000  // how often a worker checks on its reclaimer
+#define TRASH_RETRY_MS 5000 // before a failed reclaimer is started again
+// a worker that fails is started again after 1, 2, 4 ... s, at most a
+// minute; one that stayed up for a minute starts over at 1 s
+#define RESTART_BACKOFF_MIN_MS 1000
+#define RESTART_BACKOFF_MAX_MS 60000
+#define RESTART_STABLE_MS 60000
+#define STOP_GRACE_MS 5000 // after "end", before a worker still running is killed
 
 #define ERR(msg) perror(msg)
 
-int debug_info = 0;
+// Logging. A record is not formatted where it is made: the format string
+// pointer and the raw arguments go as one binary entry into a ring owned by
+// the calling thread, and a background thread formats the entries at or
+// above log_level and writes them to stderr in batches. Every entry stays in
+// the ring until newer ones overwrite it, whatever its level, so a crash or
+// the "dump" command can print what led up to it (the flight recorder)
+// without the debug output being written all the time.
+//
+// Levels below LOG_COMPILE_LEVEL are compiled out altogether.
+#define LOG_LVL_DEBUG 0
+#define LOG_LVL_INFO 1
+#define LOG_LVL_ERROR 2
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LVL_DEBUG
+#endif
+
+#define LOG_RING_SIZE (256 * 1024) // per thread, a power of two
+#define LOG_RECORD_MAX 2048
+#define LOG_STR_MAX 512 // longer %s arguments are cut
+#define LOG_FLUSH_MS 50 // how often the writer thread drains the rings
+#define LOG_OUT_BUF (64 * 1024)
+
+#define log_debug(...)                                                         \
+  do {                                                                         \
+    if (LOG_LVL_DEBUG >= LOG_COMPILE_LEVEL)                                    \
+      log_record(LOG_LVL_DEBUG, __VA_ARGS__);                                  \
+  } while (0)
+#define log_info(...)                                                          \
+  do {                                                                         \
+    if (LOG_LVL_INFO >= LOG_COMPILE_LEVEL)                                     \
+      log_record(LOG_LVL_INFO, __VA_ARGS__);                                   \
+  } while (0)
+#define log_error(...) log_record(LOG_LVL_ERROR, __VA_ARGS__)
+
+// entries are 8-byte aligned; one that would not fit before the end of the
+// ring leaves a pad entry (fmt NULL) there and starts over at the beginning.
+// A pad too short for a header is not written: readers skip such a remainder
+// as if it were one (see log_entry_at)
+struct LogEntry {
+  uint32_t len; // whole entry, padded
+  uint32_t level;
+  long long time_ns;
+  const char *fmt;
+  // arguments follow: 8 bytes per number, %s as a length and its bytes
+};
 
-static void log_info(const char *fmt, ...) {
-  if (!debug_info)
-    return;
-  va_list ap; // create a pointer to go through a list of optional variables.
-  va_start(ap, fmt);
-  printf("[INFO] ");
-  vprintf(fmt, ap); // use this print to embed arguments into string
-  printf("\n");
-  va_end(ap);
+struct LogRing {
+  char buf[LOG_RING_SIZE];
+  _Atomic unsigned long long head; // bytes ever written by the owner
+  _Atomic unsigned long long tail; // bytes the writer thread is done with
+  unsigned long long oldest;       // first entry still intact, owner only
+  _Atomic unsigned long long dropped;
+  struct LogRing *next;
+};
+
+// written only by the records' level check; default is what the old
+// log_error printed, the rest only shows up in dumps
+static _Atomic int log_level = LOG_LVL_ERROR;
+static _Atomic(struct LogRing *) log_rings = NULL;
+static _Thread_local struct LogRing *log_ring = NULL;
+static pthread_t log_thread;
+static int log_thread_running = 0;
+static _Atomic int log_thread_stop = 0;
+static volatile sig_atomic_t log_dump_requested = 0;
+// by signal number; the crash signals are all below 32
+static struct sigaction log_crash_prev[32];
+
+static const char *log_level_name(int level) {
+  switch (level) {
+  case LOG_LVL_DEBUG:
+    return "DEBUG";
+  case LOG_LVL_INFO:
+    return "INFO";
+  default:
+    return "ERROR";
+  }
+}
+
+// walks one conversion spec at fmt (just after the '%'); returns where it
+// ends and sets the conversion character and its length modifier
+static const char *log_spec(const char *fmt, char *conv, char *length) {
+  while (*fmt && strchr("-+ #0", *fmt))
+    fmt++;
+  while (*fmt >= '0' && *fmt <= '9')
+    fmt++;
+  if (*fmt == '.') {
+    fmt++;
+    while (*fmt >= '0' && *fmt <= '9')
+      fmt++;
+  }
+  *length = 0;
+  while (*fmt && strchr("hlzjtL", *fmt)) {
+    // 'l' twice is "ll", everything else is as wide as its single letter
+    *length = (*length == 'l' && *fmt == 'l') ? 'q' : *fmt;
+    fmt++;
+  }
+  *conv = *fmt;
+  return *fmt ? fmt + 1 : fmt;
+}
+
+static struct LogRing *log_ring_get(void) {
+  if (log_ring)
+    return log_ring;
+  struct LogRing *ring = calloc(1, sizeof(*ring));
+  if (!ring)
+    return NULL;
+  ring->next = atomic_load(&log_rings);
+  while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring)) {
+  }
+  log_ring = ring;
+  return ring;
+}
+
+// where the entry at or after pos starts: a remainder of the ring too short
+// for a header holds none and is skipped
+static unsigned long long log_entry_at(unsigned long long pos) {
+  size_t left = LOG_RING_SIZE - pos % LOG_RING_SIZE;
+  return left < sizeof(struct LogEntry) ? pos + left : pos;
+}
+
+// makes room for len bytes at the head of ring, overwriting only entries
+// the writer thread is done with; NULL when it has not caught up
+static char *log_reserve(struct LogRing *ring, uint32_t len) {
+  unsigned long long head = atomic_load_explicit(&ring->head,
+                                                 memory_order_relaxed);
+  unsigned long long tail = atomic_load_explicit(&ring->tail,
+                                                 memory_order_acquire);
+  size_t pos = head % LOG_RING_SIZE;
+  uint32_t pad = LOG_RING_SIZE - pos < len ? LOG_RING_SIZE - pos : 0;
+  if (head + pad + len - tail > LOG_RING_SIZE)
+    return NULL;
+  while (head + pad + len - ring->oldest > LOG_RING_SIZE) {
+    unsigned long long at = log_entry_at(ring->oldest);
+    if (at != ring->oldest) {
+      ring->oldest = at;
+      continue;
+    }
+    struct LogEntry *old =
+        (struct LogEntry *)(ring->buf + ring->oldest % LOG_RING_SIZE);
+    ring->oldest += old->len;
+  }
+  if (pad) {
+    if (pad >= sizeof(struct LogEntry)) {
+      struct LogEntry *p = (struct LogEntry *)(ring->buf + pos);
+      p->len = pad;
+      p->fmt = NULL;
+    }
+    atomic_store_explicit(&ring->head, head + pad, memory_order_release);
+    pos = 0;
+  }
+  return ring->buf + pos;
 }
 
-static void log_error(const char *fmt, ...) {
+__attribute__((format(printf, 2, 3))) static void
+log_record(int level, const char *fmt, ...) {
+  struct LogRing *ring = log_ring_get();
+  if (!ring)
+    return;
+  char rec[LOG_RECORD_MAX];
+  struct LogEntry *e = (struct LogEntry *)rec;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  e->level = (uint32_t)level;
+  e->time_ns = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  e->fmt = fmt;
+  size_t len = sizeof(*e);
+
   va_list ap;
   va_start(ap, fmt);
-  fprintf(stderr, "[ERROR] ");
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
+  for (const char *p = fmt; *p; p++) {
+    if (*p != '%')
+      continue;
+    if (p[1] == '%') {
+      p++;
+      continue;
+    }
+    char conv, length;
+    p = log_spec(p + 1, &conv, &length) - 1;
+    if (len + 8 > sizeof(rec))
+      break;
+    if (conv == 's') {
+      const char *s = va_arg(ap, const char *);
+      size_t n = s ? strnlen(s, LOG_STR_MAX) : 0;
+      if (len + 8 + n > sizeof(rec))
+        n = sizeof(rec) - len - 8;
+      uint64_t n64 = n;
+      memcpy(rec + len, &n64, 8);
+      if (n)
+        memcpy(rec + len + 8, s, n);
+      len += 8 + ((n + 7) & ~(size_t)7);
+      continue;
+    }
+    uint64_t v = 0;
+    if (strchr("fFeEgGaA", conv)) {
+      double d = va_arg(ap, double);
+      memcpy(&v, &d, 8);
+    } else if (conv == 'p') {
+      v = (uint64_t)(uintptr_t)va_arg(ap, void *);
+    } else if (length == 'l') {
+      v = (uint64_t)va_arg(ap, long);
+    } else if (length == 'q' || length == 'j') {
+      v = (uint64_t)va_arg(ap, long long);
+    } else if (length == 'z' || length == 't') {
+      v = (uint64_t)va_arg(ap, size_t);
+    } else {
+      v = (uint64_t)va_arg(ap, int);
+    }
+    memcpy(rec + len, &v, 8);
+    len += 8;
+  }
   va_end(ap);
+
+  e->len = (uint32_t)((len + 7) & ~(size_t)7);
+  char *dst = log_reserve(ring, e->len);
+  if (!dst) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  memcpy(dst, rec, e->len);
+  atomic_store_explicit(
+      &ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) +
+                       e->len,
+      memory_order_release);
+}
+
+// formats entry e as one line into out, at most cap bytes; returns the length
+static size_t log_format(const struct LogEntry *e, int with_time, char *out,
+                         size_t cap) {
+  size_t n = 0;
+  char spec[32];
+  if (with_time) {
+    time_t sec = (time_t)(e->time_ns / 1000000000LL);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    n += (size_t)snprintf(out, cap, "%02d:%02d:%02d.%06lld ", tm.tm_hour,
+                          tm.tm_min, tm.tm_sec,
+                          (e->time_ns % 1000000000LL) / 1000);
+  }
+  n += (size_t)snprintf(out + n, cap - n, "[%s] ", log_level_name(e->level));
+  const char *arg = (const char *)(e + 1);
+  const char *end = (const char *)e + e->len;
+  for (const char *p = e->fmt; *p && n + 1 < cap; p++) {
+    if (*p != '%') {
+      out[n++] = *p;
+      continue;
+    }
+    if (p[1] == '%') {
+      out[n++] = '%';
+      p++;
+      continue;
+    }
+    char conv, length;
+    const char *spec_end = log_spec(p + 1, &conv, &length);
+    size_t spec_len = (size_t)(spec_end - p);
+    if (spec_len >= sizeof(spec) || arg + 8 > end)
+      break;
+    memcpy(spec, p, spec_len);
+    spec[spec_len] = '\0';
+    p = spec_end - 1;
+    uint64_t v;
+    memcpy(&v, arg, 8);
+    arg += 8;
+    int w;
+    if (conv == 's') {
+      size_t len = (size_t)v;
+      if (arg + len > end)
+        break;
+      // the stored bytes are not terminated; precision bounds the read, the
+      // spec's own one only if it is shorter. Flags and width are kept
+      size_t shown = len;
+      char *dot = strchr(spec, '.');
+      if (dot && (size_t)atoi(dot + 1) < shown)
+        shown = (size_t)atoi(dot + 1);
+      if (dot)
+        *dot = '\0';
+      else
+        spec[spec_len - 1] = '\0';
+      char bounded[48];
+      snprintf(bounded, sizeof(bounded), "%s.*s", spec);
+      w = snprintf(out + n, cap - n, bounded, (int)shown, arg);
+      arg += (len + 7) & ~(size_t)7;
+    } else if (strchr("fFeEgGaA", conv)) {
+      double d;
+      memcpy(&d, &v, 8);
+      w = snprintf(out + n, cap - n, spec, d);
+    } else if (conv == 'p') {
+      w = snprintf(out + n, cap - n, spec, (void *)(uintptr_t)v);
+    } else if (length == 'l') {
+      w = snprintf(out + n, cap - n, spec, (long)v);
+    } else if (length == 'q' || length == 'j') {
+      w = snprintf(out + n, cap - n, spec, (long long)v);
+    } else if (length == 'z' || length == 't') {
+      w = snprintf(out + n, cap - n, spec, (size_t)v);
+    } else if (length == 'h' || length == 0) {
+      w = snprintf(out + n, cap - n, spec, (int)v);
+    } else {
+      break;
+    }
+    if (w < 0)
+      break;
+    n += (size_t)w < cap - n ? (size_t)w : cap - n - 1;
+  }
+  if (n + 1 >= cap)
+    n = cap - 2;
+  out[n++] = '\n';
+  return n;
+}
+
+static void log_write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(fd, buf, len);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    buf += w;
+    len -= (size_t)w;
+  }
+}
+
+// formats what every ring holds beyond its tail at or above log_level and
+// writes it out in one go per buffer
+static void log_drain(void) {
+  static char out[LOG_OUT_BUF];
+  size_t used = 0;
+  int level = atomic_load_explicit(&log_level, memory_order_relaxed);
+  for (struct LogRing *r = atomic_load(&log_rings); r; r = r->next) {
+    unsigned long long tail = atomic_load_explicit(&r->tail,
+                                                   memory_order_relaxed);
+    unsigned long long head = atomic_load_explicit(&r->head,
+                                                   memory_order_acquire);
+    while (tail < head) {
+      if (log_entry_at(tail) != tail) {
+        tail = log_entry_at(tail);
+        continue;
+      }
+      const struct LogEntry *e =
+          (const struct LogEntry *)(r->buf + tail % LOG_RING_SIZE);
+      if (e->fmt && (int)e->level >= level) {
+        if (LOG_OUT_BUF - used < LOG_RECORD_MAX + 128) {
+          log_write_all(STDERR_FILENO, out, used);
+          used = 0;
+        }
+        used += log_format(e, 0, out + used, LOG_OUT_BUF - used);
+      }
+      tail += e->len;
+    }
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+    unsigned long long dropped =
+        atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+    if (dropped)
+      used += (size_t)snprintf(out + used, LOG_OUT_BUF - used,
+                               "[ERROR] %llu log records dropped\n", dropped);
+  }
+  if (used)
+    log_write_all(STDERR_FILENO, out, used);
+}
+
+// The flight recorder: every entry still in the rings, oldest first, to fd.
+// Also called from the crash handler, so it only formats into a stack buffer
+// and writes; an entry being overwritten meanwhile can come out garbled.
+static void log_dump(int fd) {
+  char line[LOG_RECORD_MAX + 128];
+  int n = snprintf(line, sizeof(line), "---- flight recorder, pid %d ----\n",
+                   (int)getpid());
+  log_write_all(fd, line, (size_t)n);
+  for (struct LogRing *r = atomic_load(&log_rings); r; r = r->next) {
+    unsigned long long head = atomic_load_explicit(&r->head,
+                                                   memory_order_acquire);
+    for (unsigned long long pos = r->oldest; pos < head;) {
+      if (log_entry_at(pos) != pos) {
+        pos = log_entry_at(pos);
+        continue;
+      }
+      const struct LogEntry *e =
+          (const struct LogEntry *)(r->buf + pos % LOG_RING_SIZE);
+      if (e->len == 0 || e->len > LOG_RING_SIZE)
+        break;
+      if (e->fmt)
+        log_write_all(fd, line, log_format(e, 1, line, sizeof(line)));
+      pos += e->len;
+    }
+  }
+  log_write_all(fd, "---- end ----\n", 14);
+}
+
+static void *log_thread_main(void *arg) {
+  (void)arg;
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+  while (!atomic_load(&log_thread_stop)) {
+    struct timespec ts = {0, LOG_FLUSH_MS * 1000000L};
+    nanosleep(&ts, NULL);
+    log_drain();
+    if (log_dump_requested) {
+      log_dump_requested = 0;
+      log_dump(STDERR_FILENO);
+    }
+  }
+  log_drain();
+  return NULL;
+}
+
+static void log_on_crash(int sig) {
+  log_dump(STDERR_FILENO);
+  // hand over to whatever handled it before (the sanitizers, or the default
+  // action) and let it fire again
+  sigaction(sig, &log_crash_prev[sig], NULL);
+  raise(sig);
+}
+
+static void log_on_dump(int sig) {
+  (void)sig;
+  log_dump_requested = 1;
+}
+
+// "log <level>" reaches the workers as SIGUSR2 with the level as its value
+static void log_on_level(int sig, siginfo_t *info, void *ctx) {
+  (void)sig;
+  (void)ctx;
+  atomic_store(&log_level, info->si_value.sival_int);
+}
+
+// starts the writer thread; called once in the daemon and again in every
+// forked worker, which inherits the rings but not the thread
+static void log_start(void) {
+  for (struct LogRing *r = atomic_load(&log_rings); r; r = r->next) {
+    // what is still pending belongs to the parent's writer
+    atomic_store(&r->tail, atomic_load(&r->head));
+  }
+  log_thread_running = 0;
+  atomic_store(&log_thread_stop, 0);
+  if (pthread_create(&log_thread, NULL, log_thread_main, NULL) == 0)
+    log_thread_running = 1;
+
+  // a forked worker keeps the handlers; installing them again would make
+  // the crash handler its own predecessor
+  static int handlers_installed = 0;
+  if (handlers_installed)
+    return;
+  handlers_installed = 1;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = log_on_dump;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_sigaction = log_on_level;
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigaction(SIGUSR2, &sa, NULL);
+  int crash[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+  sa.sa_handler = log_on_crash;
+  sa.sa_flags = SA_RESETHAND;
+  for (size_t i = 0; i < sizeof(crash) / sizeof(crash[0]); i++)
+    sigaction(crash[i], &sa, &log_crash_prev[crash[i]]);
+}
+
+// writes out what is left and stops the writer thread
+static void log_stop(void) {
+  if (!log_thread_running) {
+    log_drain();
+    return;
+  }
+  atomic_store(&log_thread_stop, 1);
+  pthread_join(log_thread, NULL);
+  log_thread_running = 0;
 }
 
 struct Backup {
   char source[PATH_MAX];
   char target[PATH_MAX];
-  pid_t pid;
+  pid_t pid;     // 0 while the worker waits to be restarted
+  int pidfd;     // readable once the worker exits, -1 if pidfd_open failed
+  int req_fd; // a byte written here asks the worker to run a restore
+  int rep_fd; // where it answers with a struct RestoreReply
+  int restoring; // a restore was handed to the worker and is not answered yet
+  long long started_ms;    // when the current worker was forked
+  long long restart_at_ms; // when a failed worker is forked again, 0 if none
+  int backoff_ms;          // wait before the next restart
+  int restarts;
+  // after "end": when the worker is killed if it did not stop by then,
+  // LLONG_MAX once it was; 0 while the backup runs
+  long long kill_at_ms;
+};
+
+// what a worker sends back once it ran the restore it was asked for
+struct RestoreReply {
+  int ok;
+  size_t copied;
+  size_t skipped;
 };
 
+// a watched directory is stored as its own name and the entry of the
+// directory it is in, so renaming a directory only touches its entry and full
+// paths are built when an event needs one. Entry 0 is the source root, whose
+// name is its whole path
 struct Watch {
-  int wd;              // inotify watch descriptor
-  char path[PATH_MAX]; // absolute path
+  int wd;        // inotify watch descriptor, -1 for a free entry
+  int parent;    // entry of the parent directory, -1 for the root
+  uint32_t name; // offset of the name in the arena
 };
 
 struct WatchMap {
-  struct Watch list[MAX_WATCHES]; // watch map is needed to store multiple
+  struct Watch *list; // watch map is needed to store multiple
+  int count;          // entries used so far, free ones included
+  int capacity;
+  int live;
+  int free_head; // free entries, chained through parent
+  char *names;   // every name once, NUL-terminated
+  size_t names_len;
+  size_t names_cap;
+  size_t names_kept; // arena size after the last rebuild
+  uint32_t *name_index; // offset + 1 of each name, 0 for an empty slot
+  size_t index_cap;
+  size_t index_used;
+  // entry + 1 of each live watch, 0 for an empty slot, found by the
+  // (parent, name) and by the wd of the entry; both have slots_cap slots
+  int *child_slots;
+  int *wd_slots;
+  size_t slots_cap;
+};
+
+// first half of a rename, kept until the IN_MOVED_TO with the same cookie
+// shows up (possibly in the next read) or it times out
+struct PendingMove {
+  uint32_t cookie;
+  int is_dir;
+  long long at_ms;
+  char src_path[PATH_MAX];
+  char dst_path[PATH_MAX];
+};
+
+struct PendingMoves {
+  struct PendingMove list[MAX_PENDING_MOVES]; // oldest first
   int count;
 };
 
@@ -70,6 +597,7 @@ static void on_term(int sig) {
   stop_flag = 1;
 }
 static void free_args(char **argv, int argc);
+static void restore_answer(struct Backup *b);
 
 static void usage(void) {
   printf("Commands:\n");
@@ -77,6 +605,8 @@ static void usage(void) {
   printf("  end <source> <target1> [target2 ...]\n");
   printf("  list\n");
   printf("  restore <source> <target>\n");
+  printf("  log <debug|info|error>\n");
+  printf("  dump\n");
   printf("  exit\n");
 }
 
@@ -93,14 +623,14 @@ static int path_is_prefix(const char *base, const char *path) {
 }
 
 static int ensure_dir(const char *path) {
-  log_info("Ensuring directory: %s", path);
+  log_debug("Ensuring directory: %s", path);
   struct stat st;
   if (stat(path, &st) == 0) {
     if (!S_ISDIR(st.st_mode)) {
       log_error("not a directory: %s", path);
       return -1;
     }
-    log_info("Directory already exists: %s", path);
+    log_debug("Directory already exists: %s", path);
     return 0;
   }
   if (errno != ENOENT) {
@@ -123,26 +653,26 @@ static int ensure_dir(const char *path) {
     *slash = '/';
   }
 
-  log_info("Creating directory: %s", path);
+  log_debug("Creating directory: %s", path);
   if (mkdir(path, 0755) < 0) {
     log_error("mkdir failed for %s: %s", path, strerror(errno));
     return -1;
   }
-  log_info("Directory created: %s", path);
+  log_debug("Directory created: %s", path);
   return 0;
 }
 
 // wrapper around ensure_dir. Ensure dir would not work correctly if we path a
 // file to it, so we separate parent dirs and path them to ensure_dir
 static int ensure_parent_dirs(const char *path) {
-  log_info("Ensuring parent directories for: %s", path);
+  log_debug("Ensuring parent directories for: %s", path);
   char tmp[PATH_MAX];
   strncpy(tmp, path, sizeof(tmp));
   tmp[sizeof(tmp) - 1] = '\0';
 
   char *slash = strrchr(tmp, '/');
   if (!slash || slash == tmp) {
-    log_info("No parent directories needed for: %s", path);
+    log_debug("No parent directories needed for: %s", path);
     return 0;
   }
   *slash = '\0';
@@ -150,7 +680,7 @@ static int ensure_parent_dirs(const char *path) {
 }
 
 static int is_empty_dir(const char *path) {
-  log_info("Checking if directory is empty: %s", path);
+  log_debug("Checking if directory is empty: %s", path);
   DIR *dir = opendir(path);
   if (!dir) {
     log_error("opendir failed for %s: %s", path, strerror(errno));
@@ -160,22 +690,206 @@ static int is_empty_dir(const char *path) {
   while ((e = readdir(dir)) != NULL) { // iterate through each entry inside dir
     if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
       closedir(dir);
-      log_info("Directory not empty: %s", path);
+      log_debug("Directory not empty: %s", path);
       return 0;
     }
   }
   closedir(dir);
-  log_info("Directory is empty: %s", path);
+  log_debug("Directory is empty: %s", path);
   return 1;
 }
 
+// the size + mtime quick check used by restore and reconciliation: copies
+// carry the source mtime, so an equal size and nanosecond mtime means the file
+// did not change since it was copied
+static int same_file_quick(const struct stat *a, const struct stat *b) {
+  return a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// One directory of two trees compared in a single pass, under restore,
+// the initial sync and the refresh of renamed copies. Both listings are read
+// in full, sorted by name and merged, so every entry is looked at once with
+// fstatat on the open directories instead of an lstat per side and path, and
+// the callback may change either directory while the diff runs.
+enum DiffKind {
+  DIFF_ADDED,   // only in from
+  DIFF_REMOVED, // only in to
+  DIFF_CHANGED, // in both, of another type or, not a directory, failing the
+                // quick check
+  DIFF_SAME,    // in both; a directory is the same whatever is in it
+};
+
+struct DiffEntry {
+  const char *name;
+  enum DiffKind kind;
+  struct stat from; // unless DIFF_REMOVED
+  struct stat to;   // unless DIFF_ADDED
+};
+
+// a negative return stops the diff, which then returns it
+typedef int (*diff_fn)(const struct DiffEntry *e, void *arg);
+
+struct Listing {
+  char **names; // sorted once the listing is read
+  size_t count;
+  size_t cap;
+};
+
+static int name_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void listing_free(struct Listing *l) {
+  for (size_t i = 0; i < l->count; i++) {
+    free(l->names[i]);
+  }
+  free(l->names);
+}
+
+static int listing_read(DIR *dir, struct Listing *l) {
+  struct dirent *e;
+  errno = 0;
+  while ((e = readdir(dir)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+      continue;
+    }
+    if (l->count == l->cap) {
+      size_t cap = l->cap ? l->cap * 2 : 64;
+      char **grown = realloc(l->names, cap * sizeof(*grown));
+      if (!grown) {
+        log_error("Failed to grow a directory listing");
+        return -1;
+      }
+      l->names = grown;
+      l->cap = cap;
+    }
+    if (!(l->names[l->count] = strdup(e->d_name))) {
+      log_error("Failed to copy a directory entry name");
+      return -1;
+    }
+    l->count++;
+    errno = 0;
+  }
+  if (errno != 0) {
+    log_error("readdir failed: %s", strerror(errno));
+    return -1;
+  }
+  if (l->count > 1) {
+    qsort(l->names, l->count, sizeof(*l->names), name_cmp);
+  }
+  return 0;
+}
+
+// 1 if name is in dir, 0 if not (or dir is NULL), -1 on errors
+static int diff_stat(DIR *dir, const char *name, struct stat *st) {
+  if (!dir) {
+    return 0;
+  }
+  if (fstatat(dirfd(dir), name, st, AT_SYMLINK_NOFOLLOW) == 0) {
+    return 1;
+  }
+  if (errno == ENOENT) {
+    return 0;
+  }
+  log_error("fstatat failed for %s: %s", name, strerror(errno));
+  return -1;
+}
+
+// reports every entry of from_dir and to_dir once, in name order; a to_dir
+// that does not exist is empty and entries gone by the time they are looked at
+// are skipped
+static int dir_diff(const char *from_dir, const char *to_dir, diff_fn fn,
+                    void *arg) {
+  DIR *from = opendir(from_dir);
+  if (!from) {
+    log_error("opendir failed for %s: %s", from_dir, strerror(errno));
+    return -1;
+  }
+  DIR *to = opendir(to_dir);
+  if (!to && errno != ENOENT) {
+    log_error("opendir failed for %s: %s", to_dir, strerror(errno));
+    closedir(from);
+    return -1;
+  }
+
+  struct Listing fl = {0}, tl = {0};
+  int ret = listing_read(from, &fl);
+  if (ret == 0 && to) {
+    ret = listing_read(to, &tl);
+  }
+
+  size_t i = 0, j = 0;
+  while (ret == 0 && (i < fl.count || j < tl.count)) {
+    int c = i == fl.count   ? 1
+            : j == tl.count ? -1
+                            : strcmp(fl.names[i], tl.names[j]);
+    struct DiffEntry e;
+    e.name = c <= 0 ? fl.names[i] : tl.names[j];
+    int has_from = c <= 0 ? diff_stat(from, e.name, &e.from) : 0;
+    int has_to = c >= 0 ? diff_stat(to, e.name, &e.to) : 0;
+    i += c <= 0;
+    j += c >= 0;
+    if (has_from < 0 || has_to < 0) {
+      ret = -1;
+      break;
+    }
+    if (has_from && has_to) {
+      int same = (e.from.st_mode & S_IFMT) == (e.to.st_mode & S_IFMT) &&
+                 (S_ISDIR(e.from.st_mode) || same_file_quick(&e.from, &e.to));
+      e.kind = same ? DIFF_SAME : DIFF_CHANGED;
+    } else if (has_from) {
+      e.kind = DIFF_ADDED;
+    } else if (has_to) {
+      e.kind = DIFF_REMOVED;
+    } else {
+      continue;
+    }
+    int r = fn(&e, arg);
+    if (r < 0) {
+      ret = r;
+    }
+  }
+
+  listing_free(&fl);
+  listing_free(&tl);
+  closedir(from);
+  if (to) {
+    closedir(to);
+  }
+  return ret;
+}
+
+// gives a copy the mode, atime/mtime and, when running as root, the owner of
+// the original
+static void copy_metadata(int fd, const char *dst, const struct stat *st) {
+  if (geteuid() == 0 && fchown(fd, st->st_uid, st->st_gid) < 0) {
+    log_error("fchown failed for %s: %s", dst, strerror(errno));
+  }
+  if (fchmod(fd, st->st_mode & 07777) < 0) {
+    log_error("fchmod failed for %s: %s", dst, strerror(errno));
+  }
+  struct timespec times[2] = {st->st_atim, st->st_mtim};
+  if (futimens(fd, times) < 0) {
+    log_error("futimens failed for %s: %s", dst, strerror(errno));
+  }
+}
+
 static int copy_file(const char *src, const char *dst, mode_t mode) {
-  log_info("Copying file %s -> %s", src, dst);
+  log_debug("Copying file %s -> %s", src, dst);
   int in_fd = open(src, O_RDONLY);
   if (in_fd < 0) {
     log_error("open source failed for %s: %s", src, strerror(errno));
     return -1;
   }
+  // taken before reading, so a change made during the copy shows up as a
+  // different mtime
+  struct stat st;
+  if (fstat(in_fd, &st) < 0) {
+    log_error("fstat failed for %s: %s", src, strerror(errno));
+    close(in_fd);
+    return -1;
+  }
   if (ensure_parent_dirs(dst) < 0) {
     close(in_fd);
     return -1;
@@ -214,25 +928,23 @@ static int copy_file(const char *src, const char *dst, mode_t mode) {
     return -1;
   }
 
-  if (fchmod(out_fd, mode) < 0) {
-    log_error("fchmod failed for %s: %s", dst, strerror(errno));
-  }
+  copy_metadata(out_fd, dst, &st);
 
   close(in_fd);
   close(out_fd);
-  log_info("Copied file %s -> %s", src, dst);
+  log_debug("Copied file %s -> %s", src, dst);
   return 0;
 }
 
 // overwriting existing symlinks , clean before copying
 static int unlink_if_exists(const char *path) {
-  log_info("Unlinking path if exists: %s", path);
+  log_debug("Unlinking path if exists: %s", path);
   if (unlink(path) == 0) {
-    log_info("Path removed: %s", path);
+    log_debug("Path removed: %s", path);
     return 0;
   }
   if (errno == ENOENT) {
-    log_info("Path did not exist: %s", path);
+    log_debug("Path did not exist: %s", path);
     return 0;
   }
   log_error("unlink failed for %s: %s", path, strerror(errno));
@@ -241,7 +953,7 @@ static int unlink_if_exists(const char *path) {
 
 static int copy_symlink(const char *src, const char *dst, const char *from_root,
                         const char *to_root) {
-  log_info("Copying symlink %s -> %s", src, dst);
+  log_debug("Copying symlink %s -> %s", src, dst);
   char link_target[PATH_MAX];
   ssize_t len =
       readlink(src, link_target,
@@ -281,13 +993,21 @@ static int copy_symlink(const char *src, const char *dst, const char *from_root,
               strerror(errno));
     return -1;
   }
-  log_info("Created symlink %s -> %s", dst, adjusted);
+  struct stat st;
+  if (lstat(src, &st) == 0) {
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+    if (geteuid() == 0) {
+      lchown(dst, st.st_uid, st.st_gid);
+    }
+  }
+  log_debug("Created symlink %s -> %s", dst, adjusted);
   return 0;
 }
 
 // basically works the same as rm -rf
 static int remove_path(const char *path) {
-  log_info("Removing path: %s", path);
+  log_debug("Removing path: %s", path);
   struct stat st;
   if (lstat(path, &st) < 0) {
     if (errno == ENOENT) {
@@ -327,16 +1047,62 @@ static int remove_path(const char *path) {
       return -1;
     }
   }
-  log_info("Removed path: %s", path);
+  log_debug("Removed path: %s", path);
+  return 0;
+}
+
+// worker only: <target>/TRASH_NAME, empty where directories are removed in
+// place (the daemon, restore)
+static char trash_dir[PATH_MAX];
+static unsigned long trash_seq = 0;
+static int trash_pending = 0; // put there since the reclaimer last started
+static pid_t trash_pid = 0;   // the running reclaimer, 0 if none
+static long long trash_retry_ms = 0;
+
+// moves the directory at path into the trash; -1 if it is to be removed in
+// place instead
+static int trash_put(const char *path) {
+  struct stat st;
+  if (trash_dir[0] == '\0' || path_is_prefix(trash_dir, path) ||
+      lstat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    return -1;
+  }
+  if (mkdir(trash_dir, 0700) < 0 && errno != EEXIST) {
+    log_error("mkdir failed for %s: %s", trash_dir, strerror(errno));
+    return -1;
+  }
+  char dst[PATH_MAX];
+  if (snprintf(dst, sizeof(dst), "%s/%lld-%d-%lu", trash_dir,
+               (long long)time(NULL), (int)getpid(),
+               trash_seq++) >= (int)sizeof(dst)) {
+    return -1;
+  }
+  if (rename(path, dst) < 0) {
+    // EXDEV: something is mounted there, it is removed where it is
+    if (errno != EXDEV) {
+      log_error("rename failed for %s: %s", path, strerror(errno));
+    }
+    return -1;
+  }
+  trash_pending = 1;
+  log_debug("Moved %s to the trash as %s", path, dst);
   return 0;
 }
 
+// removes path from the target; a directory only has to be renamed
+static int discard_path(const char *path) {
+  if (trash_put(path) == 0) {
+    return 0;
+  }
+  return remove_path(path);
+}
+
 static int copy_entry(const char *src, const char *dst, const char *from_root,
                       const char *to_root);
 
 static int copy_dir(const char *src, const char *dst, const char *from_root,
                     const char *to_root) {
-  log_info("Copying directory %s -> %s", src, dst);
+  log_debug("Copying directory %s -> %s", src, dst);
   struct stat st;
   if (lstat(src, &st) < 0) {
     log_error("lstat failed for %s: %s", src, strerror(errno));
@@ -360,6 +1126,9 @@ static int copy_dir(const char *src, const char *dst, const char *from_root,
     if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
       continue;
     }
+    if (strcmp(src, from_root) == 0 && strcmp(e->d_name, TRASH_NAME) == 0) {
+      continue; // would end up in the target's own trash
+    }
     char sub_src[PATH_MAX];
     char sub_dst[PATH_MAX];
     snprintf(sub_src, sizeof(sub_src), "%s/%s", src, e->d_name);
@@ -370,7 +1139,7 @@ static int copy_dir(const char *src, const char *dst, const char *from_root,
     }
   }
   closedir(dir);
-  log_info("Copied directory %s -> %s", src, dst);
+  log_debug("Copied directory %s -> %s", src, dst);
   return 0;
 }
 
@@ -378,7 +1147,7 @@ static int copy_dir(const char *src, const char *dst, const char *from_root,
 // entry
 static int copy_entry(const char *src, const char *dst, const char *from_root,
                       const char *to_root) {
-  log_info("Copying entry %s -> %s", src, dst);
+  log_debug("Copying entry %s -> %s", src, dst);
   struct stat st;
   if (lstat(src, &st) < 0) {
     log_error("lstat failed for %s: %s", src, strerror(errno));
@@ -394,46 +1163,137 @@ static int copy_entry(const char *src, const char *dst, const char *from_root,
   }
 
   if (S_ISREG(st.st_mode)) {
+    // a restarted worker finds most of its files already in the target
+    struct stat dst_st;
+    if (lstat(dst, &dst_st) == 0 && S_ISREG(dst_st.st_mode) &&
+        same_file_quick(&st, &dst_st)) {
+      log_debug("Unchanged, not copying %s", src);
+      return 0;
+    }
     return copy_file(src, dst, st.st_mode & 0777);
   }
 
-  log_info("Skipping unsupported file: %s", src);
+  log_debug("Skipping unsupported file: %s", src);
   return 0;
 }
 
 static int restore_dir(const char *backup_dir, const char *src_dir,
                        const char *backup_root, const char *source_root);
 
-static int restore_entry(const char *backup_path, const char *src_path,
-                         const char *backup_root, const char *source_root) {
-  log_info("Restoring entry %s -> %s", backup_path, src_path);
+// what the last restore did, reported when it finishes
+static size_t restore_copied = 0;
+static size_t restore_skipped = 0;
+
+// The restore of a running backup is run by its worker between two reads of
+// events, so nothing is applied while the source is being written. What it
+// wrote is remembered: an event on an entry that is still exactly as the
+// restore left it is the restore's own echo, the target already holds that
+// entry, and it is dropped. Anything changed since is applied as usual. The
+// set is forgotten as soon as no event is queued any more, by then every echo
+// was read.
+struct Echo {
+  dev_t dev;
+  ino_t ino;
+  mode_t type;
+  off_t size;
+  struct timespec mtime;
+};
+
+static struct Echo *echoes = NULL; // sorted by dev and ino once sealed
+static size_t echo_count = 0;
+static size_t echo_cap = 0;
+static int echo_recording = 0; // set in the worker while it restores
+
+static void echo_note(const char *path) {
   struct stat st;
-  if (lstat(backup_path, &st) < 0) {
-    log_error("lstat failed for %s: %s", backup_path, strerror(errno));
-    return -1;
+  if (!echo_recording || lstat(path, &st) < 0) {
+    return;
   }
+  if (echo_count == echo_cap) {
+    size_t cap = echo_cap ? echo_cap * 2 : 256;
+    struct Echo *grown = realloc(echoes, cap * sizeof(*grown));
+    if (!grown) {
+      log_error("Failed to grow the restore echoes");
+      return;
+    }
+    echoes = grown;
+    echo_cap = cap;
+  }
+  struct Echo *e = &echoes[echo_count++];
+  e->dev = st.st_dev;
+  e->ino = st.st_ino;
+  e->type = st.st_mode & S_IFMT;
+  e->size = st.st_size;
+  e->mtime = st.st_mtim;
+}
 
-  struct stat dst_st;
-  int dst_exists = lstat(src_path, &dst_st);
+static int echo_cmp(const void *a, const void *b) {
+  const struct Echo *x = a, *y = b;
+  if (x->dev != y->dev) {
+    return x->dev < y->dev ? -1 : 1;
+  }
+  if (x->ino != y->ino) {
+    return x->ino < y->ino ? -1 : 1;
+  }
+  return 0;
+}
 
-  if (S_ISDIR(st.st_mode)) {
-    if (dst_exists == 0 && !S_ISDIR(dst_st.st_mode)) {
-      if (remove_path(src_path) < 0) {
-        return -1;
-      }
+// whether st is an entry exactly as the last restore left it; a directory only
+// keeps its mtime until something is added, which has events of its own
+static int echo_has(const struct stat *st) {
+  if (echo_count == 0) {
+    return 0;
+  }
+  struct Echo key = {.dev = st->st_dev, .ino = st->st_ino};
+  const struct Echo *e =
+      bsearch(&key, echoes, echo_count, sizeof(*echoes), echo_cmp);
+  if (!e || e->type != (st->st_mode & S_IFMT)) {
+    return 0;
+  }
+  return S_ISDIR(st->st_mode) ||
+         (e->size == st->st_size && e->mtime.tv_sec == st->st_mtim.tv_sec &&
+          e->mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+static int echo_of(const char *path) {
+  struct stat st;
+  return echo_count > 0 && lstat(path, &st) == 0 && echo_has(&st);
+}
+
+static void echo_forget(void) {
+  free(echoes);
+  echoes = NULL;
+  echo_count = 0;
+  echo_cap = 0;
+}
+
+// brings src_path in line with the backup entry backup_path, described by st;
+// dst_st describes what src_path is now, NULL if nothing
+static int restore_entry(const char *backup_path, const char *src_path,
+                         const struct stat *st, const struct stat *dst_st,
+                         const char *backup_root, const char *source_root) {
+  log_debug("Restoring entry %s -> %s", backup_path, src_path);
+  if (dst_st && (dst_st->st_mode & S_IFMT) != (st->st_mode & S_IFMT)) {
+    if (remove_path(src_path) < 0) {
+      return -1;
     }
+    dst_st = NULL;
+  }
+
+  if (S_ISDIR(st->st_mode)) {
     if (ensure_dir(src_path) < 0) {
       return -1;
     }
-    if (chmod(src_path, st.st_mode & 0777) < 0) {
+    if (chmod(src_path, st->st_mode & 0777) < 0) {
       ERR("chmod");
     }
+    echo_note(src_path);
     return restore_dir(backup_path, src_path, backup_root, source_root);
   }
 
-  if (S_ISLNK(st.st_mode)) {
+  if (S_ISLNK(st->st_mode)) {
     char current[PATH_MAX];
-    if (dst_exists == 0 && S_ISLNK(dst_st.st_mode)) {
+    if (dst_st) {
       ssize_t len = readlink(src_path, current, sizeof(current) - 1);
       if (len >= 0) {
         current[len] = '\0';
@@ -447,121 +1307,511 @@ static int restore_entry(const char *backup_path, const char *src_path,
         }
       }
     }
-    return copy_symlink(backup_path, src_path, backup_root, source_root);
+    if (copy_symlink(backup_path, src_path, backup_root, source_root) < 0) {
+      return -1;
+    }
+    echo_note(src_path);
+    return 0;
   }
 
-  if (S_ISREG(st.st_mode)) {
-    if (dst_exists == 0 && S_ISREG(dst_st.st_mode) &&
-        dst_st.st_size == st.st_size && dst_st.st_mtime >= st.st_mtime) {
+  if (S_ISREG(st->st_mode)) {
+    if (dst_st && same_file_quick(st, dst_st)) {
+      restore_skipped++;
       return 0;
     }
-    return copy_file(backup_path, src_path, st.st_mode & 0777);
+    restore_copied++;
+    if (copy_file(backup_path, src_path, st->st_mode & 0777) < 0) {
+      return -1;
+    }
+    echo_note(src_path);
+    return 0;
   }
 
   return 0;
 }
 
+struct RestoreWalk {
+  const char *backup_dir;
+  const char *src_dir;
+  const char *backup_root;
+  const char *source_root;
+  int at_root;
+};
+
+static int restore_diff_entry(const struct DiffEntry *e, void *arg) {
+  const struct RestoreWalk *w = arg;
+  // the trash of the backup is no part of it
+  if (w->at_root && strcmp(e->name, TRASH_NAME) == 0) {
+    return 0;
+  }
+  char sub_backup[PATH_MAX];
+  char sub_src[PATH_MAX];
+  snprintf(sub_backup, sizeof(sub_backup), "%s/%s", w->backup_dir, e->name);
+  snprintf(sub_src, sizeof(sub_src), "%s/%s", w->src_dir, e->name);
+  if (e->kind == DIFF_REMOVED) {
+    return remove_path(sub_src);
+  }
+  return restore_entry(sub_backup, sub_src, &e->from,
+                       e->kind == DIFF_ADDED ? NULL : &e->to, w->backup_root,
+                       w->source_root);
+}
+
 static int restore_dir(const char *backup_dir, const char *src_dir,
                        const char *backup_root, const char *source_root) {
-  log_info("Restoring directory %s -> %s", backup_dir, src_dir);
-  DIR *dir = opendir(backup_dir);
-  if (!dir) {
-    log_error("opendir failed for %s: %s", backup_dir, strerror(errno));
+  log_debug("Restoring directory %s -> %s", backup_dir, src_dir);
+  struct RestoreWalk w = {backup_dir, src_dir, backup_root, source_root,
+                          strcmp(backup_dir, backup_root) == 0};
+  if (dir_diff(backup_dir, src_dir, restore_diff_entry, &w) < 0) {
     return -1;
   }
+  log_debug("Restored directory %s -> %s", backup_dir, src_dir);
+  return 0;
+}
 
-  struct dirent *e;
-  while ((e = readdir(dir)) != NULL) {
-    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+// restores the source_root from the backup at backup_root
+static int restore_tree(const char *backup_root, const char *source_root) {
+  struct stat st, dst_st;
+  if (lstat(backup_root, &st) < 0) {
+    log_error("lstat failed for %s: %s", backup_root, strerror(errno));
+    return -1;
+  }
+  int dst_exists = lstat(source_root, &dst_st) == 0;
+  return restore_entry(backup_root, source_root, &st,
+                       dst_exists ? &dst_st : NULL, backup_root, source_root);
+}
+
+static uint32_t watch_name_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) {
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  }
+  return h;
+}
+
+// offset of name in the arena, or -1 if it was never interned
+static long watch_name_find(struct WatchMap *map, const char *name) {
+  if (map->index_cap == 0) {
+    return -1;
+  }
+  size_t slot = watch_name_hash(name) & (map->index_cap - 1);
+  while (map->name_index[slot] != 0) {
+    uint32_t off = map->name_index[slot] - 1;
+    if (strcmp(map->names + off, name) == 0) {
+      return (long)off;
+    }
+    slot = (slot + 1) & (map->index_cap - 1);
+  }
+  return -1;
+}
+
+static int watch_name_index_grow(struct WatchMap *map) {
+  size_t cap = map->index_cap ? map->index_cap * 2 : 256;
+  uint32_t *index = calloc(cap, sizeof(*index));
+  if (!index) {
+    log_error("Failed to grow the watch name index");
+    return -1;
+  }
+  for (size_t i = 0; i < map->index_cap; i++) {
+    if (map->name_index[i] == 0) {
       continue;
     }
-    char sub_backup[PATH_MAX];
-    char sub_src[PATH_MAX];
-    snprintf(sub_backup, sizeof(sub_backup), "%s/%s", backup_dir, e->d_name);
-    snprintf(sub_src, sizeof(sub_src), "%s/%s", src_dir, e->d_name);
-    if (restore_entry(sub_backup, sub_src, backup_root, source_root) < 0) {
-      closedir(dir);
+    size_t j =
+        watch_name_hash(map->names + map->name_index[i] - 1) & (cap - 1);
+    while (index[j] != 0) {
+      j = (j + 1) & (cap - 1);
+    }
+    index[j] = map->name_index[i];
+  }
+  free(map->name_index);
+  map->name_index = index;
+  map->index_cap = cap;
+  return 0;
+}
+
+// offset of name in the arena, adding it the first time it is seen; -1 when
+// out of memory
+static long watch_name_intern(struct WatchMap *map, const char *name) {
+  long found = watch_name_find(map, name);
+  if (found >= 0) {
+    return found;
+  }
+  // keep the index at most half full so probes stay short
+  if ((map->index_used + 1) * 2 > map->index_cap &&
+      watch_name_index_grow(map) < 0) {
+    return -1;
+  }
+
+  size_t len = strlen(name);
+  if (map->names_len + len + 1 > map->names_cap) {
+    size_t cap = map->names_cap ? map->names_cap * 2 : 4096;
+    while (cap < map->names_len + len + 1) {
+      cap *= 2;
+    }
+    char *names = cap <= UINT32_MAX ? realloc(map->names, cap) : NULL;
+    if (!names) {
+      log_error("Failed to grow the watch name arena");
       return -1;
     }
+    map->names = names;
+    map->names_cap = cap;
   }
-  closedir(dir);
+  uint32_t off = (uint32_t)map->names_len;
+  memcpy(map->names + off, name, len + 1);
+  map->names_len += len + 1;
+
+  size_t slot = watch_name_hash(name) & (map->index_cap - 1);
+  while (map->name_index[slot] != 0) {
+    slot = (slot + 1) & (map->index_cap - 1);
+  }
+  map->name_index[slot] = off + 1;
+  map->index_used++;
+  return (long)off;
+}
+
+static size_t watch_child_hash(int parent, uint32_t name) {
+  uint64_t key = ((uint64_t)(uint32_t)parent << 32) | name;
+  return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static size_t watch_wd_hash(int wd) {
+  return (size_t)(((uint64_t)(uint32_t)wd * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static size_t watch_slot_hash(const struct WatchMap *map, const int *slots,
+                              int i) {
+  const struct Watch *w = &map->list[i];
+  return slots == map->wd_slots ? watch_wd_hash(w->wd)
+                                : watch_child_hash(w->parent, w->name);
+}
+
+static void watch_slots_insert(struct WatchMap *map, int *slots, int i) {
+  size_t mask = map->slots_cap - 1;
+  size_t s = watch_slot_hash(map, slots, i) & mask;
+  while (slots[s] != 0) {
+    s = (s + 1) & mask;
+  }
+  slots[s] = i + 1;
+}
+
+// takes entry i out while its key still is what it was inserted with; the
+// entries probed past it move back so no lookup stops short of them
+static void watch_slots_erase(struct WatchMap *map, int *slots, int i) {
+  size_t mask = map->slots_cap - 1;
+  size_t s = watch_slot_hash(map, slots, i) & mask;
+  while (slots[s] != i + 1) {
+    if (slots[s] == 0) {
+      return;
+    }
+    s = (s + 1) & mask;
+  }
+  for (size_t j = (s + 1) & mask; slots[j] != 0; j = (j + 1) & mask) {
+    size_t home = watch_slot_hash(map, slots, slots[j] - 1) & mask;
+    // moves back unless its home lies cyclically in (s, j]
+    if (s <= j ? (home <= s || home > j) : (home <= s && home > j)) {
+      slots[s] = slots[j];
+      s = j;
+    }
+  }
+  slots[s] = 0;
+}
 
-  DIR *src = opendir(src_dir);
-  if (!src) {
-    log_error("opendir failed for %s: %s", src_dir, strerror(errno));
+// builds both indexes again with cap slots from the live entries
+static int watch_slots_rebuild(struct WatchMap *map, size_t cap) {
+  int *child = calloc(cap, sizeof(*child));
+  int *wds = calloc(cap, sizeof(*wds));
+  if (!child || !wds) {
+    log_error("Failed to grow the watch index");
+    free(child);
+    free(wds);
     return -1;
   }
-  while ((e = readdir(src)) != NULL) {
-    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
-      continue;
+  free(map->child_slots);
+  free(map->wd_slots);
+  map->child_slots = child;
+  map->wd_slots = wds;
+  map->slots_cap = cap;
+  for (int i = 0; i < map->count; i++) {
+    if (map->list[i].wd >= 0) {
+      watch_slots_insert(map, child, i);
+      watch_slots_insert(map, wds, i);
     }
-    char check_backup[PATH_MAX];
-    snprintf(check_backup, sizeof(check_backup), "%s/%s", backup_dir,
-             e->d_name);
-    struct stat st;
-    if (lstat(check_backup, &st) < 0 && errno == ENOENT) {
-      char extra_path[PATH_MAX];
-      snprintf(extra_path, sizeof(extra_path), "%s/%s", src_dir, e->d_name);
-      if (remove_path(extra_path) < 0) {
-        closedir(src);
-        return -1;
-      }
+  }
+  return 0;
+}
+
+// names are never freed one by one; once the arena has doubled since it was
+// last rebuilt it is rebuilt from the live watches, dropping the names of
+// directories that are gone. Nothing changes unless all of it can be done
+static void watch_names_compact(struct WatchMap *map) {
+  if (map->names_len < 64 * 1024 || map->names_len < 2 * map->names_kept) {
+    return;
+  }
+  struct WatchMap fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  // the entries are found by their name offsets, which are about to change
+  fresh.child_slots = calloc(map->slots_cap, sizeof(*fresh.child_slots));
+  int ok = fresh.child_slots != NULL;
+  for (int i = 0; ok && i < map->count; i++) {
+    if (map->list[i].wd >= 0 &&
+        watch_name_intern(&fresh, map->names + map->list[i].name) < 0) {
+      ok = 0;
+    }
+  }
+  if (!ok) {
+    free(fresh.names);
+    free(fresh.name_index);
+    free(fresh.child_slots);
+    return;
+  }
+  for (int i = 0; i < map->count; i++) {
+    if (map->list[i].wd >= 0) {
+      map->list[i].name =
+          (uint32_t)watch_name_find(&fresh, map->names + map->list[i].name);
+    }
+  }
+  free(map->names);
+  free(map->name_index);
+  free(map->child_slots);
+  map->names = fresh.names;
+  map->names_len = fresh.names_len;
+  map->names_cap = fresh.names_cap;
+  map->names_kept = fresh.names_len;
+  map->name_index = fresh.name_index;
+  map->index_cap = fresh.index_cap;
+  map->index_used = fresh.index_used;
+  map->child_slots = fresh.child_slots;
+  for (int i = 0; i < map->count; i++) {
+    if (map->list[i].wd >= 0) {
+      watch_slots_insert(map, map->child_slots, i);
+    }
+  }
+  log_info("Watch names compacted to %zu bytes", map->names_len);
+}
+
+// entry of the directory name inside parent, or -1
+static int watch_map_child(struct WatchMap *map, int parent, uint32_t name) {
+  if (map->slots_cap == 0) {
+    return -1;
+  }
+  size_t mask = map->slots_cap - 1;
+  for (size_t s = watch_child_hash(parent, name) & mask;
+       map->child_slots[s] != 0; s = (s + 1) & mask) {
+    int i = map->child_slots[s] - 1;
+    if (map->list[i].parent == parent && map->list[i].name == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// entry watching path, or -1; paths below the source root are resolved one
+// component at a time
+static int watch_map_lookup(struct WatchMap *map, const char *path) {
+  if (map->count == 0 || map->list[0].wd < 0) {
+    return -1;
+  }
+  const char *root = map->names + map->list[0].name;
+  size_t root_len = strlen(root);
+  if (strncmp(path, root, root_len) != 0 ||
+      (path[root_len] != '\0' && path[root_len] != '/')) {
+    return -1;
+  }
+  int cur = 0;
+  const char *p = path + root_len;
+  while (*p) {
+    while (*p == '/') {
+      p++;
+    }
+    size_t len = strcspn(p, "/");
+    if (len == 0) {
+      break;
+    }
+    char name[NAME_MAX + 1];
+    if (len > NAME_MAX) {
+      return -1;
+    }
+    memcpy(name, p, len);
+    name[len] = '\0';
+    // a name never interned cannot be watched
+    long off = watch_name_find(map, name);
+    if (off < 0) {
+      return -1;
+    }
+    cur = watch_map_child(map, cur, (uint32_t)off);
+    if (cur < 0) {
+      return -1;
+    }
+    p += len;
+  }
+  return cur;
+}
+
+// entry of the directory path is in, with name pointed at its last component;
+// -1 if that directory is not watched
+static int watch_map_parent(struct WatchMap *map, const char *path,
+                            const char **name) {
+  const char *slash = strrchr(path, '/');
+  char dir[PATH_MAX];
+  if (!slash || (size_t)(slash - path) >= sizeof(dir)) {
+    return -1;
+  }
+  memcpy(dir, path, (size_t)(slash - path));
+  dir[slash - path] = '\0';
+  *name = slash + 1;
+  return watch_map_lookup(map, dir);
+}
+
+// writes the absolute path of entry i, built from the names up to the root;
+// -1 if it does not fit
+static int watch_map_path(struct WatchMap *map, int i, char *buf,
+                          size_t size) {
+  size_t len = 0;
+  for (int n = i; n >= 0; n = map->list[n].parent) {
+    len += strlen(map->names + map->list[n].name) +
+           (map->list[n].parent >= 0 ? 1 : 0);
+  }
+  if (len + 1 > size) {
+    return -1;
+  }
+  buf[len] = '\0';
+  for (int n = i; n >= 0; n = map->list[n].parent) {
+    const char *name = map->names + map->list[n].name;
+    size_t name_len = strlen(name);
+    len -= name_len;
+    memcpy(buf + len, name, name_len);
+    if (map->list[n].parent >= 0) {
+      buf[--len] = '/';
+    }
+  }
+  return 0;
+}
+
+static int watch_is_under(struct WatchMap *map, int i, int top) {
+  for (int n = i; n >= 0; n = map->list[n].parent) {
+    if (n == top) {
+      return 1;
     }
   }
-  closedir(src);
-  log_info("Restored directory %s -> %s", backup_dir, src_dir);
   return 0;
 }
 
-static void watch_map_remove(struct WatchMap *map, int wd) {
-  log_info("Removing watch wd=%d", wd);
+// stops watching entry top and everything below it
+static void watch_map_remove_at(int fd, struct WatchMap *map, int top) {
+  // marked first and freed after, since freeing reuses the parent links
   for (int i = 0; i < map->count; i++) {
-    if (map->list[i].wd == wd) {
-      map->list[i] = map->list[map->count - 1];
-      map->count--;
-      return;
+    if (map->list[i].wd >= 0 && watch_is_under(map, i, top)) {
+      inotify_rm_watch(fd, map->list[i].wd);
+      watch_slots_erase(map, map->child_slots, i);
+      watch_slots_erase(map, map->wd_slots, i);
+      map->list[i].wd = -2;
+    }
+  }
+  for (int i = 0; i < map->count; i++) {
+    if (map->list[i].wd == -2) {
+      map->list[i].wd = -1;
+      map->list[i].parent = map->free_head;
+      map->free_head = i;
+      map->live--;
     }
   }
+  watch_names_compact(map);
 }
 
-// convert ID number (watch descriptor) back into a string path after reading
+// convert ID number (watch descriptor) back into its entry after reading
 // event from inotify
-static struct Watch *watch_map_find(struct WatchMap *map, int wd) {
-  log_info("Looking up watch wd=%d", wd);
-  for (int i = 0; i < map->count; i++) {
+static int watch_map_find(struct WatchMap *map, int wd) {
+  log_debug("Looking up watch wd=%d", wd);
+  if (map->slots_cap == 0) {
+    return -1;
+  }
+  size_t mask = map->slots_cap - 1;
+  for (size_t s = watch_wd_hash(wd) & mask; map->wd_slots[s] != 0;
+       s = (s + 1) & mask) {
+    int i = map->wd_slots[s] - 1;
     if (map->list[i].wd == wd) {
-      return &map->list[i];
+      return i;
     }
   }
-  return NULL;
+  return -1;
 }
 
-// basic add of inotify entry to monitor specific function
-static int add_watch_entry(int fd, struct WatchMap *map, const char *path,
-                           uint32_t mask) {
-  log_info("Adding watch for %s", path);
-  if (map->count >= MAX_WATCHES) {
-    fprintf(stderr, "too many watches\n");
-    return -1;
+static void watch_map_remove(int fd, struct WatchMap *map, int wd) {
+  log_debug("Removing watch wd=%d", wd);
+  int i = watch_map_find(map, wd);
+  if (i >= 0) {
+    watch_map_remove_at(fd, map, i);
   }
+}
+
+// basic add of inotify entry to monitor specific function; returns the entry
+static int add_watch_entry(int fd, struct WatchMap *map, int parent,
+                           const char *name, const char *path,
+                           uint32_t mask) {
+  log_debug("Adding watch for %s", path);
   int wd = inotify_add_watch(fd, path, mask);
   if (wd < 0) {
     log_error("inotify_add_watch failed for %s: %s", path, strerror(errno));
     return -1;
   }
-  log_info("Watch added for %s (wd=%d)", path, wd);
-  map->list[map->count].wd = wd;
-  strncpy(map->list[map->count].path, path, sizeof(map->list[map->count].path));
-  map->list[map->count].path[sizeof(map->list[map->count].path) - 1] = '\0';
-  map->count++;
-  return 0;
+  log_debug("Watch added for %s (wd=%d)", path, wd);
+  // an entry left at this name belongs to a directory that was replaced;
+  // removed before interning, which may move the names around
+  int i = watch_map_find(map, wd);
+  long off = watch_name_find(map, name);
+  int stale = off >= 0 ? watch_map_child(map, parent, (uint32_t)off) : -1;
+  if (stale >= 0 && stale != i) {
+    watch_map_remove_at(fd, map, stale);
+  }
+  off = watch_name_intern(map, name);
+  if (off < 0) {
+    inotify_rm_watch(fd, wd);
+    return -1;
+  }
+
+  // the same directory added again keeps its entry
+  if (i >= 0) {
+    watch_slots_erase(map, map->child_slots, i);
+    map->list[i].parent = parent;
+    map->list[i].name = (uint32_t)off;
+    watch_slots_insert(map, map->child_slots, i);
+    return i;
+  }
+  // keep the indexes at most half full so probes stay short
+  if ((size_t)(map->live + 1) * 2 > map->slots_cap &&
+      watch_slots_rebuild(map, map->slots_cap ? map->slots_cap * 2 : 128) <
+          0) {
+    inotify_rm_watch(fd, wd);
+    return -1;
+  }
+
+  if (map->free_head >= 0) {
+    i = map->free_head;
+    map->free_head = map->list[i].parent;
+  } else {
+    if (map->count == map->capacity) {
+      int cap = map->capacity ? map->capacity * 2 : 64;
+      struct Watch *list = realloc(map->list, (size_t)cap * sizeof(*list));
+      if (!list) {
+        log_error("Failed to grow the watch map");
+        inotify_rm_watch(fd, wd);
+        return -1;
+      }
+      map->list = list;
+      map->capacity = cap;
+    }
+    i = map->count++;
+  }
+  map->list[i].wd = wd;
+  map->list[i].parent = parent;
+  map->list[i].name = (uint32_t)off;
+  watch_slots_insert(map, map->child_slots, i);
+  watch_slots_insert(map, map->wd_slots, i);
+  map->live++;
+  return i;
 }
 
-// opens the directory, loops through its contents, and calls itself for every
-// subdirectory
-static int add_watch_recursive(int fd, struct WatchMap *map, const char *path,
-                               uint32_t mask) {
-  log_info("Recursively adding watch for %s", path);
+static int add_watch_tree(int fd, struct WatchMap *map, int parent,
+                          const char *name, const char *path, uint32_t mask) {
   struct stat st;
   if (lstat(path, &st) < 0) {
     log_error("lstat failed for watch path %s: %s", path, strerror(errno));
@@ -571,7 +1821,8 @@ static int add_watch_recursive(int fd, struct WatchMap *map, const char *path,
     return 0;
   }
 
-  if (add_watch_entry(fd, map, path, mask) < 0) {
+  int self = add_watch_entry(fd, map, parent, name, path, mask);
+  if (self < 0) {
     return -1;
   }
 
@@ -587,7 +1838,7 @@ static int add_watch_recursive(int fd, struct WatchMap *map, const char *path,
     }
     char sub_path[PATH_MAX];
     snprintf(sub_path, sizeof(sub_path), "%s/%s", path, e->d_name);
-    if (add_watch_recursive(fd, map, sub_path, mask) < 0) {
+    if (add_watch_tree(fd, map, self, e->d_name, sub_path, mask) < 0) {
       closedir(dir);
       return -1;
     }
@@ -596,46 +1847,472 @@ static int add_watch_recursive(int fd, struct WatchMap *map, const char *path,
   return 0;
 }
 
+// the first call watches the source root; later ones a directory whose parent
+// is already watched. Calls itself for every subdirectory
+static int add_watch_recursive(int fd, struct WatchMap *map, const char *path,
+                               uint32_t mask) {
+  log_debug("Recursively adding watch for %s", path);
+  if (map->count == 0) {
+    return add_watch_tree(fd, map, -1, path, path, mask);
+  }
+  const char *name;
+  int parent = watch_map_parent(map, path, &name);
+  if (parent < 0) {
+    log_error("no watch for the parent of %s", path);
+    return -1;
+  }
+  return add_watch_tree(fd, map, parent, name, path, mask);
+}
+
 // ff a directory in the source is deleted or moved we stop watching it and all
 // its subfolders
 static void remove_watches_under(int fd, struct WatchMap *map,
                                  const char *path) {
-  log_info("Removing watches under path %s", path);
-  for (int i = 0; i < map->count;) {
-    if (path_is_prefix(path, map->list[i].path)) {
-      inotify_rm_watch(fd, map->list[i].wd);
-      map->list[i] = map->list[map->count - 1];
-      map->count--;
+  log_debug("Removing watches under path %s", path);
+  int top = watch_map_lookup(map, path);
+  if (top >= 0) {
+    watch_map_remove_at(fd, map, top);
+  }
+  log_debug("Watches remaining: %d", map->live);
+}
+
+static void watch_map_free(struct WatchMap *map) {
+  free(map->list);
+  free(map->names);
+  free(map->name_index);
+  free(map->child_slots);
+  free(map->wd_slots);
+  free(map);
+}
+
+static long long monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// a watched directory was renamed: only its own entry changes, the ones
+// below it follow through their parent links
+static void watch_map_rename(int fd, struct WatchMap *map,
+                             const char *old_path, const char *new_path) {
+  log_debug("Renaming watches %s -> %s", old_path, new_path);
+  int i = watch_map_lookup(map, old_path);
+  const char *name;
+  int parent = watch_map_parent(map, new_path, &name);
+  if (i < 0 || parent < 0 || watch_is_under(map, parent, i)) {
+    log_error("no watch to rename for %s", old_path);
+    return;
+  }
+  long off = watch_name_find(map, name);
+  int stale = off >= 0 ? watch_map_child(map, parent, (uint32_t)off) : -1;
+  if (stale >= 0 && stale != i) {
+    watch_map_remove_at(fd, map, stale);
+  }
+  off = watch_name_intern(map, name);
+  if (off < 0) {
+    return;
+  }
+  watch_slots_erase(map, map->child_slots, i);
+  map->list[i].parent = parent;
+  map->list[i].name = (uint32_t)off;
+  watch_slots_insert(map, map->child_slots, i);
+}
+
+// set when an event named a source path that was already gone, usually because
+// its directory was renamed right after; the next rename then looks for what
+// was missed
+static int missed_sources = 0;
+
+// brings a copy up to date without recopying it: only entries that are
+// missing or fail the quick check are copied, and what is no longer in the
+// source is discarded. With a map, every source directory it comes across
+// that is not watched yet gets its watches; NULL before anything is watched
+static int refresh_entry(int fd, struct WatchMap *map, const char *src,
+                         const char *dst, const char *from_root,
+                         const char *to_root, uint32_t mask);
+
+// A source entry named like the target's trash is never mirrored: "add"
+// refuses such sources, and one that shows up later is reported when skipped
+static void report_reserved(const char *dir) {
+  log_error("%s/%s has the name of the target's trash, not mirrored", dir,
+            TRASH_NAME);
+}
+
+struct RefreshWalk {
+  int fd;
+  struct WatchMap *map;
+  uint32_t mask;
+  const char *src;
+  const char *dst;
+  const char *from_root;
+  const char *to_root;
+  int at_root;
+};
+
+static int refresh_diff_entry(const struct DiffEntry *e, void *arg) {
+  const struct RefreshWalk *w = arg;
+  if (w->at_root && strcmp(e->name, TRASH_NAME) == 0) {
+    if (e->kind != DIFF_REMOVED) {
+      report_reserved(w->src);
+    }
+    return 0; // the target's own trash, or would end up in it
+  }
+  char sub_src[PATH_MAX];
+  char sub_dst[PATH_MAX];
+  snprintf(sub_src, sizeof(sub_src), "%s/%s", w->src, e->name);
+  snprintf(sub_dst, sizeof(sub_dst), "%s/%s", w->dst, e->name);
+  if (e->kind == DIFF_REMOVED) {
+    discard_path(sub_dst);
+    return 0;
+  }
+  if (e->kind == DIFF_SAME) {
+    return S_ISDIR(e->from.st_mode)
+               ? refresh_entry(w->fd, w->map, sub_src, sub_dst, w->from_root,
+                               w->to_root, w->mask)
+               : 0;
+  }
+  if (e->kind == DIFF_CHANGED &&
+      (e->from.st_mode & S_IFMT) != (e->to.st_mode & S_IFMT)) {
+    discard_path(sub_dst);
+  }
+  if (S_ISDIR(e->from.st_mode)) {
+    // watched first, so what changes in it while it is copied is not missed
+    if (w->map && add_watch_recursive(w->fd, w->map, sub_src, w->mask) < 0) {
+      return -1;
+    }
+    return copy_dir(sub_src, sub_dst, w->from_root, w->to_root);
+  }
+  if (S_ISLNK(e->from.st_mode)) {
+    return copy_symlink(sub_src, sub_dst, w->from_root, w->to_root);
+  }
+  if (S_ISREG(e->from.st_mode)) {
+    return copy_file(sub_src, sub_dst, e->from.st_mode & 0777);
+  }
+  return 0;
+}
+
+static int refresh_entry(int fd, struct WatchMap *map, const char *src,
+                         const char *dst, const char *from_root,
+                         const char *to_root, uint32_t mask) {
+  struct stat st, dst_buf;
+  if (lstat(src, &st) < 0) {
+    return 0;
+  }
+  // what dst is now, NULL if nothing of the same kind
+  const struct stat *dst_st = lstat(dst, &dst_buf) == 0 ? &dst_buf : NULL;
+  if (dst_st && (st.st_mode & S_IFMT) != (dst_st->st_mode & S_IFMT)) {
+    discard_path(dst);
+    dst_st = NULL;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    if (S_ISREG(st.st_mode) && dst_st && same_file_quick(&st, dst_st)) {
+      return 0;
+    }
+    return copy_entry(src, dst, from_root, to_root);
+  }
+
+  if (map && watch_map_lookup(map, src) < 0 &&
+      add_watch_recursive(fd, map, src, mask) < 0) {
+    return -1;
+  }
+  if (ensure_dir(dst) < 0) {
+    return -1;
+  }
+  struct RefreshWalk w = {fd,  map,     mask,    src,
+                          dst, from_root, to_root, strcmp(src, from_root) == 0};
+  return dir_diff(src, dst, refresh_diff_entry, &w);
+}
+
+// new entry in the source: copy it and watch it if it is a directory
+static void mirror_create(int fd, struct WatchMap *map, const char *src_path,
+                          const char *dst_path, const char *source,
+                          const char *target, uint32_t mask, int is_dir) {
+  struct stat st;
+  if (lstat(src_path, &st) < 0) {
+    if (errno == ENOENT) {
+      missed_sources = 1;
+    }
+    return;
+  }
+  if (is_dir) {
+    log_debug("Directory created/moved at %s", src_path);
+    copy_dir(src_path, dst_path, source, target);
+    add_watch_recursive(fd, map, src_path, mask);
+  } else {
+    log_debug("Entry created/moved at %s", src_path);
+    copy_entry(src_path, dst_path, source, target);
+  }
+}
+
+// the entry left the source, so its copy goes as well
+static void drop_move(int fd, struct WatchMap *map,
+                      const struct PendingMove *mv) {
+  if (mv->is_dir) {
+    remove_watches_under(fd, map, mv->src_path);
+  }
+  log_debug("Removing %s -> %s, moved out of the source", mv->src_path,
+           mv->dst_path);
+  discard_path(mv->dst_path);
+}
+
+// drops moves older than the pairing timeout, or every one with all set
+static void expire_moves(int fd, struct WatchMap *map, struct PendingMoves *pm,
+                         int all) {
+  long long now = monotonic_ms();
+  int kept = 0;
+  for (int i = 0; i < pm->count; i++) {
+    if (all || now - pm->list[i].at_ms >= MOVE_PAIR_TIMEOUT_MS) {
+      drop_move(fd, map, &pm->list[i]);
     } else {
-      i++;
+      if (kept != i) {
+        pm->list[kept] = pm->list[i];
+      }
+      kept++;
+    }
+  }
+  pm->count = kept;
+}
+
+static void remember_move(int fd, struct WatchMap *map,
+                          struct PendingMoves *pm, uint32_t cookie, int is_dir,
+                          const char *src_path, const char *dst_path) {
+  if (pm->count == MAX_PENDING_MOVES) {
+    drop_move(fd, map, &pm->list[0]);
+    memmove(&pm->list[0], &pm->list[1],
+            (size_t)(pm->count - 1) * sizeof(pm->list[0]));
+    pm->count--;
+  }
+  struct PendingMove *mv = &pm->list[pm->count++];
+  mv->cookie = cookie;
+  mv->is_dir = is_dir;
+  mv->at_ms = monotonic_ms();
+  snprintf(mv->src_path, sizeof(mv->src_path), "%s", src_path);
+  snprintf(mv->dst_path, sizeof(mv->dst_path), "%s", dst_path);
+}
+
+// returns 1 and fills out if a move with this cookie is pending
+static int take_move(struct PendingMoves *pm, uint32_t cookie,
+                     struct PendingMove *out) {
+  for (int i = 0; i < pm->count; i++) {
+    if (pm->list[i].cookie == cookie) {
+      *out = pm->list[i];
+      memmove(&pm->list[i], &pm->list[i + 1],
+              (size_t)(pm->count - i - 1) * sizeof(pm->list[0]));
+      pm->count--;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// both halves of a rename inside the source: the copy is renamed the same way
+// instead of being deleted and copied again
+static void mirror_rename(int fd, struct WatchMap *map,
+                          const struct PendingMove *mv, const char *src_path,
+                          const char *dst_path, const char *source,
+                          const char *target, uint32_t mask) {
+  log_debug("Renaming %s -> %s", mv->dst_path, dst_path);
+  int ok = ensure_parent_dirs(dst_path) == 0;
+  if (ok && rename(mv->dst_path, dst_path) < 0) {
+    // a directory or a different kind of entry is in the way
+    ok = (errno == ENOTEMPTY || errno == EEXIST || errno == EISDIR ||
+          errno == ENOTDIR) &&
+         discard_path(dst_path) == 0 && rename(mv->dst_path, dst_path) == 0;
+  }
+  if (!ok) {
+    log_error("rename %s -> %s failed, copying instead", mv->dst_path,
+              dst_path);
+    drop_move(fd, map, mv);
+    mirror_create(fd, map, src_path, dst_path, source, target, mask,
+                  mv->is_dir);
+    return;
+  }
+  if (mv->is_dir) {
+    watch_map_rename(fd, map, mv->src_path, src_path);
+  }
+  if (missed_sources) {
+    missed_sources = 0;
+    refresh_entry(fd, map, src_path, dst_path, source, target, mask);
+  }
+}
+
+static volatile sig_atomic_t worker_stop = 0;
+static void worker_term(int sig) {
+  (void)sig;
+  worker_stop = 1;
+}
+
+// how far the reclaimer got; it sleeps whenever it is ahead of TRASH_RATE
+struct TrashPace {
+  long long start_ms;
+  unsigned long long done;
+};
+
+static int trash_pace(struct TrashPace *pace) {
+  if (worker_stop) {
+    return -1;
+  }
+  pace->done++;
+  long long ahead = (long long)(pace->done * 1000 / TRASH_RATE) -
+                    (monotonic_ms() - pace->start_ms);
+  if (ahead > 0) {
+    struct timespec ts = {ahead / 1000, (ahead % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+  }
+  return worker_stop ? -1 : 0;
+}
+
+// removes everything below the directory open at fd and closes it
+static int trash_empty(int fd, struct TrashPace *pace) {
+  DIR *dir = fdopendir(fd);
+  if (!dir) {
+    log_error("fdopendir failed: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  int ret = 0;
+  struct dirent *e;
+  while (ret == 0 && (e = readdir(dir)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+      continue;
+    }
+    if (trash_pace(pace) < 0) {
+      ret = -1;
+      break;
+    }
+    struct stat st;
+    if (fstatat(dirfd(dir), e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      if (errno == ENOENT) {
+        continue;
+      }
+      log_error("fstatat failed for %s: %s", e->d_name, strerror(errno));
+      ret = -1;
+      break;
+    }
+    int is_dir = S_ISDIR(st.st_mode);
+    if (is_dir) {
+      int sub = openat(dirfd(dir), e->d_name,
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (sub < 0) {
+        log_error("openat failed for %s: %s", e->d_name, strerror(errno));
+        ret = -1;
+        break;
+      }
+      ret = trash_empty(sub, pace);
+    }
+    if (ret == 0 &&
+        unlinkat(dirfd(dir), e->d_name, is_dir ? AT_REMOVEDIR : 0) < 0 &&
+        errno != ENOENT) {
+      log_error("unlinkat failed for %s: %s", e->d_name, strerror(errno));
+      ret = -1;
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+// reaps the reclaimer once it is done and starts another one when something
+// was put in the trash meanwhile
+static void trash_poll(void) {
+  if (trash_pid > 0) {
+    int status;
+    pid_t r = waitpid(trash_pid, &status, WNOHANG);
+    if (r == 0) {
+      return;
+    }
+    trash_pid = 0;
+    if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      trash_pending = 1;
+      trash_retry_ms = monotonic_ms() + TRASH_RETRY_MS;
+    } else if (!trash_pending) {
+      rmdir(trash_dir); // ENOTEMPTY: a put raced with the reclaimer's end
+    }
+  }
+  if (!trash_pending || monotonic_ms() < trash_retry_ms) {
+    return;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    log_error("fork failed: %s", strerror(errno));
+    trash_retry_ms = monotonic_ms() + TRASH_RETRY_MS;
+    return;
+  }
+  if (pid == 0) {
+    log_start();
+    nice(19);
+    struct TrashPace pace = {monotonic_ms(), 0};
+    int ret = 0;
+    int fd = open(trash_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+      ret = trash_empty(fd, &pace);
+    } else if (errno != ENOENT) {
+      log_error("open failed for %s: %s", trash_dir, strerror(errno));
+      ret = -1;
     }
+    log_debug("Reclaimed %llu entries from %s", pace.done, trash_dir);
+    log_stop();
+    _exit(ret < 0 ? 1 : 0);
   }
-  log_info("Watches remaining: %d", map->count);
+  trash_pending = 0;
+  trash_pid = pid;
 }
 
-static volatile sig_atomic_t worker_stop = 0;
-static void worker_term(int sig) {
-  (void)sig;
-  worker_stop = 1;
+// what the reclaimer did not get to is left for the next worker
+static void trash_stop(void) {
+  if (trash_pid <= 0) {
+    return;
+  }
+  kill(trash_pid, SIGTERM);
+  waitpid(trash_pid, NULL, 0);
+  trash_pid = 0;
 }
 
-static int run_worker(const char *source, const char *target) {
-  log_info("Worker starting for %s -> %s", source, target);
-  if (copy_entry(source, target, source, target) < 0) {
-    log_error("Initial copy failed for %s -> %s", source, target);
-    return 1;
+// runs the restore the daemon asked for and answers it; -1 once the daemon
+// is gone
+static int restore_serve(int req_fd, int rep_fd, const char *source,
+                         const char *target) {
+  char c;
+  ssize_t n = read(req_fd, &c, 1);
+  if (n < 0 && errno == EINTR) {
+    return 0;
   }
-  log_info("Initial sync complete for %s -> %s", source, target);
+  if (n <= 0) {
+    return -1;
+  }
+  log_info("Restoring %s from %s", source, target);
+  echo_forget();
+  echo_recording = 1;
+  restore_copied = 0;
+  restore_skipped = 0;
+  struct RestoreReply reply;
+  reply.ok = restore_tree(target, source) == 0;
+  reply.copied = restore_copied;
+  reply.skipped = restore_skipped;
+  echo_recording = 0;
+  qsort(echoes, echo_count, sizeof(*echoes), echo_cmp);
+  log_debug("Restore wrote %zu entries, their events are dropped", echo_count);
+  if (write(rep_fd, &reply, sizeof(reply)) != (ssize_t)sizeof(reply)) {
+    log_error("Failed to answer the restore: %s", strerror(errno));
+  }
+  return 0;
+}
 
-  struct sigaction sa;
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = worker_term;
-  if (sigaction(SIGTERM, &sa, NULL) < 0) {
-    ERR("sigaction");
-    return 1;
+// bytes of events the kernel has queued that were not read yet
+static int inotify_queued(int fd) {
+  int queued = 0;
+  if (ioctl(fd, FIONREAD, &queued) < 0) {
+    return -1;
   }
-  sa.sa_handler = SIG_IGN;
-  sigaction(SIGINT, &sa, NULL);
+  return queued;
+}
+
+static int run_worker(const char *source, const char *target, int req_fd,
+                      int rep_fd) {
+  log_info("Worker starting for %s -> %s", source, target);
+  long long started_ms = monotonic_ms();
+  snprintf(trash_dir, sizeof(trash_dir), "%s/%s", target, TRASH_NAME);
+  struct stat trash_st;
+  trash_pending = lstat(trash_dir, &trash_st) == 0; // left by an earlier worker
 
   int fd = inotify_init();
   if (fd < 0) {
@@ -649,38 +2326,107 @@ static int run_worker(const char *source, const char *target) {
     close(fd);
     return 1;
   }
+  map->free_head = -1;
 
   // create mask to decide which operations should be tracked by inotify
   uint32_t mask = IN_CREATE | IN_MODIFY | IN_DELETE | IN_MOVED_FROM |
                   IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF |
                   IN_CLOSE_WRITE;
 
+  // watched before the sync, so what changes while it runs is queued and
+  // replayed afterwards instead of lost
   if (add_watch_recursive(fd, map, source, mask) < 0) {
-    free(map);
+    watch_map_free(map);
+    close(fd);
+    return 1;
+  }
+  // a restarted or resumed worker finds most of the source already in the
+  // target
+  if (refresh_entry(fd, map, source, target, source, target, mask) < 0) {
+    log_error("Initial copy failed for %s -> %s", source, target);
+    watch_map_free(map);
+    close(fd);
+    return 1;
+  }
+  log_info("Initial sync complete for %s -> %s", source, target);
+  log_info("Protected %s -> %s after %lld ms", source, target,
+           monotonic_ms() - started_ms);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = worker_term;
+  if (sigaction(SIGTERM, &sa, NULL) < 0) {
+    ERR("sigaction");
+    watch_map_free(map);
+    close(fd);
+    return 1;
+  }
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGINT, &sa, NULL);
+
+  struct PendingMoves *moves = calloc(1, sizeof(*moves));
+  if (!moves) {
+    log_error("Failed to allocate pending moves");
+    watch_map_free(map);
     close(fd);
     return 1;
   }
 
-  log_info("Watching %s recursively (%d watches)", source, map->count);
+  log_info("Watching %s recursively (%d watches)", source, map->live);
 
   char buffer[EVENT_BUF_LEN];
+  int ret = 0;
   while (!worker_stop) {
+    trash_poll();
+    // both halves of a rename are queued together, so when nothing arrives
+    // for a while the remaining IN_MOVED_FROMs were moves out of the source;
+    // a running reclaimer is checked on every so often as well
+    int timeout = -1;
+    if (moves->count > 0) {
+      timeout = MOVE_PAIR_TIMEOUT_MS;
+    } else if (trash_pid > 0 || trash_pending) {
+      timeout = TRASH_POLL_MS;
+    }
+    struct pollfd pfd[2] = {{fd, POLLIN, 0}, {req_fd, POLLIN, 0}};
+    int ready = poll(pfd, 2, timeout);
+    if (ready == 0) {
+      expire_moves(fd, map, moves, 1);
+      continue;
+    }
+    if (ready < 0 && errno != EINTR) {
+      log_error("poll failed: %s", strerror(errno));
+      ret = 1;
+      break;
+    }
+    if (ready < 0) {
+      continue;
+    }
+    // a restore waits for no event: those queued meanwhile see its result
+    if (pfd[1].revents && restore_serve(req_fd, rep_fd, source, target) < 0) {
+      close(req_fd);
+      req_fd = -1;
+    }
+    if (!(pfd[0].revents & POLLIN)) {
+      continue;
+    }
     ssize_t len = read(fd, buffer, sizeof(buffer));
     if (len < 0) {
       if (errno == EINTR) {
         continue;
       }
       log_error("read failed: %s", strerror(errno));
+      ret = 1;
       break;
     }
-    log_info("Read %zd bytes from inotify", len);
+    log_debug("Read %zd bytes from inotify", len);
 
     // process events one by one
     ssize_t i = 0;
     while (i < len) {
       struct inotify_event *ev = (struct inotify_event *)&buffer[i];
-      struct Watch *w = watch_map_find(map, ev->wd);
-      if (!w) {
+      int w = watch_map_find(map, ev->wd);
+      char dir_path[PATH_MAX];
+      if (w < 0 || watch_map_path(map, w, dir_path, sizeof(dir_path)) < 0) {
         i += sizeof(struct inotify_event) + ev->len;
         continue;
       }
@@ -688,9 +2434,9 @@ static int run_worker(const char *source, const char *target) {
       char src_path[PATH_MAX * 2];
       if (ev->len >
           0) { // check if event hapenned to file/dir inside monitored dir
-        snprintf(src_path, sizeof(src_path), "%s/%s", w->path, ev->name);
+        snprintf(src_path, sizeof(src_path), "%s/%s", dir_path, ev->name);
       } else { // in case it happend to monitered dir itself
-        strncpy(src_path, w->path, sizeof(src_path));
+        strncpy(src_path, dir_path, sizeof(src_path));
         src_path[sizeof(src_path) - 1] = '\0';
       }
 
@@ -704,89 +2450,276 @@ static int run_worker(const char *source, const char *target) {
                  rel); // concat target root folder and path from source
       }
       dst_path[sizeof(dst_path) - 1] = '\0';
+      if (path_is_prefix(trash_dir, dst_path) && !(ev->mask & IN_IGNORED)) {
+        if (strcmp(trash_dir, dst_path) == 0 &&
+            (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+          report_reserved(source);
+        }
+        i += sizeof(struct inotify_event) + ev->len;
+        continue;
+      }
 
-      log_info("Event mask 0x%x for %s", ev->mask, src_path);
+      log_debug("Event mask 0x%x for %s", ev->mask, src_path);
       //        //Deleticase if
       if (ev->mask & IN_IGNORED) {
-        watch_map_remove(map, ev->wd);
+        watch_map_remove(fd, map, ev->wd);
         i += sizeof(struct inotify_event) + ev->len;
         continue;
       }
 
       if ((ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) &&
-          strcmp(w->path, source) == 0) {
+          map->list[w].parent < 0) {
         worker_stop = 1;
         break;
       }
 
-      if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+      struct PendingMove mv;
+      if (ev->mask & IN_MOVED_FROM) {
+        // kept until its IN_MOVED_TO tells where the entry went
+        remember_move(fd, map, moves, ev->cookie, (ev->mask & IN_ISDIR) != 0,
+                      src_path, dst_path);
+      } else if ((ev->mask & IN_MOVED_TO) &&
+                 take_move(moves, ev->cookie, &mv)) {
+        mirror_rename(fd, map, &mv, src_path, dst_path, source, target, mask);
+      } else if (ev->mask & IN_DELETE) {
         if (ev->mask & IN_ISDIR) {
           remove_watches_under(fd, map, src_path);
         }
-        log_info("Removing %s -> %s due to delete/move", src_path, dst_path);
-        remove_path(dst_path);
+        // a restore replaced it with an entry of another type, which the
+        // target holds already
+        if (!echo_of(src_path)) {
+          log_debug("Removing %s -> %s due to delete", src_path, dst_path);
+          discard_path(dst_path);
+        }
       } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
-        struct stat st;
-        if (lstat(src_path, &st) == 0 && (ev->mask & IN_ISDIR)) {
-          log_info("Directory created/moved at %s", src_path);
-          copy_dir(src_path, dst_path, source, target);
-          add_watch_recursive(fd, map, src_path, mask);
-        } else {
-          log_info("Entry created/moved at %s", src_path);
-          copy_entry(src_path, dst_path, source, target);
+        // a restored directory still needs its watches; its copy is
+        // quick-checked entry by entry
+        if ((ev->mask & IN_ISDIR) || !echo_of(src_path)) {
+          mirror_create(fd, map, src_path, dst_path, source, target, mask,
+                        (ev->mask & IN_ISDIR) != 0);
         }
       } else if (ev->mask & (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB)) {
         struct stat st;
         if (lstat(src_path, &st) == 0) {
-          if (S_ISDIR(st.st_mode)) {
-            log_info("Directory attributes_changed %s", src_path);
+          if (echo_has(&st)) {
+            log_debug("Dropping the restore's echo at %s", src_path);
+          } else if (S_ISDIR(st.st_mode)) {
+            log_debug("Directory attributes_changed %s", src_path);
             chmod(dst_path, st.st_mode & 0777);
           } else {
-            log_info("File modified/attrib %s", src_path);
+            log_debug("File modified/attrib %s", src_path);
             copy_entry(src_path, dst_path, source, target);
           }
+        } else if (errno == ENOENT) {
+          missed_sources = 1;
         }
       }
       // move the pointer to the start of the next event in the buffer
       i += sizeof(struct inotify_event) + ev->len;
     }
+    expire_moves(fd, map, moves, 0);
+    if (echo_count > 0 && inotify_queued(fd) == 0) {
+      echo_forget();
+    }
   }
 
   log_info("Worker shutting down for %s -> %s", source, target);
+  expire_moves(fd, map, moves, 1);
+  echo_forget();
+  trash_stop();
+  free(moves);
   for (int i = 0; i < map->count; i++) {
-    inotify_rm_watch(fd, map->list[i].wd);
+    if (map->list[i].wd >= 0) {
+      inotify_rm_watch(fd, map->list[i].wd);
+    }
   }
   close(fd);
-  free(map);
+  watch_map_free(map);
+  return ret;
+}
+
+// -f: the registry is kept in this file and resumed on the next start
+static const char *state_path = NULL;
+
+// a path of a state line, with backslash, tab and newline escaped
+static void state_put_path(FILE *f, const char *path) {
+  for (const char *p = path; *p; p++) {
+    if (*p == '\\' || *p == '\t' || *p == '\n') {
+      fputc('\\', f);
+      fputc(*p == '\t' ? 't' : *p == '\n' ? 'n' : '\\', f);
+    } else {
+      fputc(*p, f);
+    }
+  }
+}
+
+// reads one escaped path of a state line up to the tab or the end of line;
+// returns where it stopped, NULL if the path is too long
+static const char *state_get_path(const char *p, char *out) {
+  size_t len = 0;
+  while (*p && *p != '\t' && *p != '\n') {
+    char c = *p++;
+    if (c == '\\' && *p) {
+      c = *p == 't' ? '\t' : *p == 'n' ? '\n' : *p;
+      p++;
+    }
+    if (len + 1 >= PATH_MAX) {
+      return NULL;
+    }
+    out[len++] = c;
+  }
+  out[len] = '\0';
+  return p;
+}
+
+// Writes the registry as "source<TAB>target" lines to state_path.tmp, syncs
+// it, renames it over state_path and syncs the directory, so a crash leaves
+// either the old or the new registry, never a torn one.
+static int state_save(void) {
+  if (!state_path) {
+    return 0;
+  }
+  log_debug("Saving %d backups to %s", backup_count, state_path);
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", state_path) >= (int)sizeof(tmp)) {
+    log_error("state file path too long: %s", state_path);
+    return -1;
+  }
+  FILE *f = fopen(tmp, "w");
+  if (!f) {
+    log_error("Cannot write state file %s: %s", tmp, strerror(errno));
+    return -1;
+  }
+  for (int i = 0; i < backup_count; i++) {
+    if (backups[i].kill_at_ms) {
+      continue;
+    }
+    state_put_path(f, backups[i].source);
+    fputc('\t', f);
+    state_put_path(f, backups[i].target);
+    fputc('\n', f);
+  }
+  int failed = fflush(f) != 0 || fsync(fileno(f)) < 0;
+  if (fclose(f) != 0) {
+    failed = 1;
+  }
+  if (failed || rename(tmp, state_path) < 0) {
+    log_error("Cannot save state file %s: %s", state_path, strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+  // the rename is only durable once the directory is
+  char dir[PATH_MAX];
+  strncpy(dir, state_path, sizeof(dir));
+  dir[sizeof(dir) - 1] = '\0';
+  char *slash = strrchr(dir, '/');
+  if (!slash) {
+    strcpy(dir, ".");
+  } else if (slash == dir) {
+    dir[1] = '\0';
+  } else {
+    *slash = '\0';
+  }
+  int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (dfd >= 0) {
+    fsync(dfd);
+    close(dfd);
+  }
   return 0;
 }
 
 static int find_backup(const char *source, const char *target) {
-  log_info("Searching for backup %s -> %s", source, target);
+  log_debug("Searching for backup %s -> %s", source, target);
   for (int i = 0; i < backup_count; i++) {
-    if (strcmp(backups[i].source, source) == 0 &&
+    // an ended backup is gone already while its worker stops
+    if (backups[i].kill_at_ms == 0 &&
+        strcmp(backups[i].source, source) == 0 &&
         strcmp(backups[i].target, target) == 0) {
-      log_info("Found backup index %d for %s -> %s", i, source, target);
+      log_debug("Found backup index %d for %s -> %s", i, source, target);
       return i;
     }
   }
   return -1;
 }
 
-static void reap_children(void) {
-  log_info("Reaping child processes");
+static void close_backup(struct Backup *b) {
+  if (b->req_fd >= 0) {
+    close(b->req_fd);
+  }
+  if (b->rep_fd >= 0) {
+    close(b->rep_fd);
+  }
+  if (b->pidfd >= 0) {
+    close(b->pidfd);
+  }
+  b->req_fd = -1;
+  b->rep_fd = -1;
+  b->pidfd = -1;
+}
+
+// drops backups[i] from the registry, its descriptors closed already
+static void forget_backup(int i) {
+  backups[i] = backups[backup_count - 1]; // fill the blank space in the middle
+                                          // (after remove) with the last elem
+  backup_count--; // we "forget" that last element exists, it will be
+                  // overwritte
+}
+
+// The worker of backups[i] exited with status. One that was ended or exited
+// cleanly, having seen its source go away, takes the backup with it; one that
+// failed is forked again once its backoff elapsed, and its first refresh
+// catches up with what it missed.
+static void worker_exited(int i, int status) {
+  struct Backup *b = &backups[i];
+  if (b->restoring) {
+    restore_answer(b);
+  }
+  close_backup(b);
+  b->pid = 0;
+  if (b->kill_at_ms) {
+    log_info("Worker for %s -> %s stopped", b->source, b->target);
+    forget_backup(i);
+    return;
+  }
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    log_info("Worker for %s -> %s finished", b->source, b->target);
+    forget_backup(i);
+    state_save();
+    return;
+  }
+  long long now = monotonic_ms();
+  if (now - b->started_ms >= RESTART_STABLE_MS) {
+    b->backoff_ms = RESTART_BACKOFF_MIN_MS;
+  }
+  b->restart_at_ms = now + b->backoff_ms;
+  log_error("Worker for %s -> %s died, restarting in %d ms", b->source,
+            b->target, b->backoff_ms);
+  b->backoff_ms = b->backoff_ms * 2 > RESTART_BACKOFF_MAX_MS
+                      ? RESTART_BACKOFF_MAX_MS
+                      : b->backoff_ms * 2;
+}
+
+// the pidfd of backups[i] became readable: its worker exited
+static void worker_pidfd_ready(int i) {
   int status;
   pid_t pid;
-  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-    for (int i = 0; i < backup_count; i++) {
-      if (backups[i].pid == pid) {
-        backups[i] =
-            backups[backup_count - 1]; // fill the blank space in the middle
-                                       // (after remove) with the last elem
-        backup_count--; // we "forget" that last element exists, it will be
-                        // overwritte
-        break;
-      }
+  do {
+    pid = waitpid(backups[i].pid, &status, WNOHANG);
+  } while (pid < 0 && errno == EINTR);
+  if (pid == backups[i].pid) {
+    worker_exited(i, status);
+  }
+}
+
+// workers without a pidfd are reaped here, between commands
+static void reap_children(void) {
+  log_debug("Reaping child processes");
+  // downwards, so what forget_backup moves in was looked at already
+  for (int i = backup_count - 1; i >= 0; i--) {
+    int status;
+    if (backups[i].pid > 0 && backups[i].pidfd < 0 &&
+        waitpid(backups[i].pid, &status, WNOHANG) == backups[i].pid) {
+      worker_exited(i, status);
     }
   }
 }
@@ -798,14 +2731,21 @@ static void stop_backup(const char *source, const char *target) {
     log_error("No such backup: %s -> %s", source, target);
     return;
   }
-  kill(backups[idx].pid, SIGTERM);
-  waitpid(backups[idx].pid, NULL, 0);
-  backups[idx] = backups[backup_count - 1]; // same logic as in function above
-  backup_count--;
+  // the worker is not waited for: next_command reaps it, and answers a
+  // restore it was running, once it exited; one waiting to be restarted is
+  // simply not restarted
+  struct Backup *b = &backups[idx];
+  if (b->pid > 0) {
+    kill(b->pid, SIGTERM);
+    b->kill_at_ms = monotonic_ms() + STOP_GRACE_MS;
+    return;
+  }
+  close_backup(b);
+  forget_backup(idx);
 }
 
 static int parse_args(const char *line, char **argv, int max_args) {
-  log_info("Parsing arguments: %s", line);
+  log_debug("Parsing arguments: %s", line);
   int argc = 0;
   int in_quote = 0;
   char quote = 0;
@@ -872,7 +2812,7 @@ static int parse_args(const char *line, char **argv, int max_args) {
 }
 
 static int canonical_path(const char *path, char *out) {
-  log_info("Resolving canonical path for %s", path);
+  log_debug("Resolving canonical path for %s", path);
   char *res = realpath(path, out);
   if (!res) {
     log_error("realpath failed for %s: %s", path, strerror(errno));
@@ -882,7 +2822,7 @@ static int canonical_path(const char *path, char *out) {
 }
 
 static int validate_source(const char *path, char *resolved) {
-  log_info("Validating source directory %s", path);
+  log_debug("Validating source directory %s", path);
   if (canonical_path(path, resolved) < 0) {
     return -1;
   }
@@ -899,7 +2839,7 @@ static int validate_source(const char *path, char *resolved) {
 }
 
 static int validate_target(const char *path, char *resolved) {
-  log_info("Validating target directory %s", path);
+  log_debug("Validating target directory %s", path);
   struct stat st;
   if (stat(path, &st) == 0) {
     if (!S_ISDIR(st.st_mode)) {
@@ -925,33 +2865,119 @@ static int validate_target(const char *path, char *resolved) {
   return 0;
 }
 
-static int add_backup(const char *source, const char *target) {
-  log_info("Adding backup %s -> %s", source, target);
-  if (backup_count >= MAX_BACKUPS) {
-    fprintf(stderr, "Too many backups\n");
+// forks the worker of b, which is backups[backup_count] for a new backup
+static int start_worker(struct Backup *b) {
+  int req[2], rep[2];
+  if (pipe(req) < 0) {
+    ERR("pipe");
+    return -1;
+  }
+  if (pipe(rep) < 0) {
+    ERR("pipe");
+    close(req[0]);
+    close(req[1]);
     return -1;
   }
   pid_t pid = fork();
   if (pid < 0) {
     log_error("fork failed: %s", strerror(errno));
+    close(req[0]);
+    close(req[1]);
+    close(rep[0]);
+    close(rep[1]);
     return -1;
   }
   if (pid == 0) {
-    int ret = run_worker(source, target);
+    for (int i = 0; i < backup_count; i++) {
+      close_backup(&backups[i]);
+    }
+    close(req[1]);
+    close(rep[0]);
+    log_start();
+    int ret = run_worker(b->source, b->target, req[0], rep[1]);
+    log_stop();
     _exit(ret);
   }
+  close(req[0]);
+  close(rep[1]);
+
+  b->pid = pid;
+  b->req_fd = req[1];
+  b->rep_fd = rep[0];
+  b->restoring = 0;
+  b->started_ms = monotonic_ms();
+  b->restart_at_ms = 0;
+  // its exit wakes up next_command; without pidfds it is reaped between
+  // commands
+  b->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+  if (b->pidfd < 0) {
+    log_error("pidfd_open failed: %s", strerror(errno));
+  }
+  return 0;
+}
 
-  struct Backup b;
-  strncpy(b.source, source, sizeof(b.source));
-  b.source[sizeof(b.source) - 1] = '\0';
-  strncpy(b.target, target, sizeof(b.target));
-  b.target[sizeof(b.target) - 1] = '\0';
-  b.pid = pid;
-  backups[backup_count++] = b;
-  log_info("Backup registered: %s -> %s pid=%d", source, target, pid);
+static int add_backup(const char *source, const char *target) {
+  log_info("Adding backup %s -> %s", source, target);
+  if (backup_count >= MAX_BACKUPS) {
+    fprintf(stderr, "Too many backups\n");
+    return -1;
+  }
+  struct Backup *b = &backups[backup_count];
+  strncpy(b->source, source, sizeof(b->source));
+  b->source[sizeof(b->source) - 1] = '\0';
+  strncpy(b->target, target, sizeof(b->target));
+  b->target[sizeof(b->target) - 1] = '\0';
+  b->backoff_ms = RESTART_BACKOFF_MIN_MS;
+  b->restarts = 0;
+  b->kill_at_ms = 0;
+  if (start_worker(b) < 0) {
+    return -1;
+  }
+  backup_count++;
+  log_info("Backup registered: %s -> %s pid=%d", source, target, b->pid);
   return 0;
 }
 
+// forks the failed workers whose backoff elapsed and kills the ended ones
+// that did not stop in time; returns how long until the next of those is
+// due, -1 if none waits
+static int tend_workers(void) {
+  long long now = monotonic_ms();
+  long long next = -1;
+  for (int i = 0; i < backup_count; i++) {
+    struct Backup *b = &backups[i];
+    if (b->kill_at_ms == LLONG_MAX) {
+      continue;
+    }
+    if (b->kill_at_ms) {
+      if (b->kill_at_ms <= now) {
+        log_error("Worker %d for %s -> %s did not stop, killing it", b->pid,
+                  b->source, b->target);
+        kill(b->pid, SIGKILL);
+        b->kill_at_ms = LLONG_MAX;
+      } else if (next < 0 || b->kill_at_ms - now < next) {
+        next = b->kill_at_ms - now;
+      }
+      continue;
+    }
+    if (b->pid > 0) {
+      continue;
+    }
+    if (b->restart_at_ms <= now) {
+      log_info("Restarting worker for %s -> %s", b->source, b->target);
+      b->restarts++;
+      if (start_worker(b) == 0) {
+        continue;
+      }
+      b->restart_at_ms = now + b->backoff_ms;
+    }
+    if (next < 0 || b->restart_at_ms - now < next) {
+      next = b->restart_at_ms - now;
+    }
+  }
+  return (int)next;
+}
+
 static void list_backups(void) {
   log_info("Listing backups");
   if (backup_count == 0) {
@@ -959,29 +2985,279 @@ static void list_backups(void) {
     return;
   }
   for (int i = 0; i < backup_count; i++) {
-    printf("[%d] %s -> %s\n", backups[i].pid, backups[i].source,
+    printf("[%d] %s -> %s", backups[i].pid, backups[i].source,
            backups[i].target);
+    if (backups[i].kill_at_ms) {
+      printf(" (stopping)");
+    } else if (backups[i].pid == 0) {
+      printf(" (restarting in %llds)",
+             (backups[i].restart_at_ms - monotonic_ms() + 999) / 1000);
+    }
+    if (backups[i].restarts > 0) {
+      printf(" (%d restarts)", backups[i].restarts);
+    }
+    printf("\n");
   }
 }
 
+// Starts a worker for every backup in the state file. Their targets already
+// hold a mirror, which the worker's initial refresh brings up to date by
+// copying only what fails the quick check and removing what is gone from the
+// source. A missing file is an empty registry; a backup whose source or target
+// is gone is reported and left out.
+static void state_resume(void) {
+  FILE *f = fopen(state_path, "r");
+  if (!f) {
+    if (errno != ENOENT) {
+      log_error("Cannot read state file %s: %s", state_path, strerror(errno));
+    }
+    return;
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  int resumed = 0;
+  while (getline(&line, &cap, f) > 0) {
+    char source[PATH_MAX], target[PATH_MAX];
+    const char *p = state_get_path(line, source);
+    if (!p || *p != '\t' || !state_get_path(p + 1, target) || !*source ||
+        !*target) {
+      log_error("Bad line in state file %s", state_path);
+      continue;
+    }
+    char src_real[PATH_MAX], dst_real[PATH_MAX];
+    struct stat st;
+    if (validate_source(source, src_real) < 0 ||
+        canonical_path(target, dst_real) < 0 || stat(dst_real, &st) < 0 ||
+        !S_ISDIR(st.st_mode) || path_is_prefix(src_real, dst_real) ||
+        find_backup(src_real, dst_real) >= 0) {
+      fprintf(stderr, "cannot resume backup %s -> %s\n", source, target);
+      continue;
+    }
+    if (add_backup(src_real, dst_real) == 0) {
+      resumed++;
+    }
+  }
+  free(line);
+  fclose(f);
+  log_info("Resumed %d backups from %s", resumed, state_path);
+}
+
 static void free_args(char **argv, int argc) {
   for (int i = 0; i < argc; i++) {
     free(argv[i]);
   }
 }
 
+// the daemon's own level and that of every running worker
+static void set_log_level(int level) {
+  atomic_store(&log_level, level);
+  union sigval value = {.sival_int = level};
+  for (int i = 0; i < backup_count; i++) {
+    if (backups[i].pid > 0) {
+      sigqueue(backups[i].pid, SIGUSR2, value);
+    }
+  }
+}
+
+// the daemon's recorder right away, the workers' from their writer threads
+static void dump_flight_recorders(void) {
+  fflush(stdout);
+  log_dump(STDERR_FILENO);
+  for (int i = 0; i < backup_count; i++) {
+    if (backups[i].pid > 0) {
+      kill(backups[i].pid, SIGUSR1);
+    }
+  }
+}
+
 static void stop_all(void) {
   log_info("Stopping all backups");
   for (int i = 0; i < backup_count; i++) {
-    kill(backups[i].pid, SIGTERM);
+    if (backups[i].pid > 0) {
+      kill(backups[i].pid, SIGTERM);
+    }
   }
   for (int i = 0; i < backup_count; i++) {
-    waitpid(backups[i].pid, NULL, 0);
+    if (backups[i].pid > 0) {
+      waitpid(backups[i].pid, NULL, 0);
+    }
+    close_backup(&backups[i]);
   }
   backup_count = 0;
 }
 
-int main(void) {
+// prints how a restore went; reply is NULL when the worker is gone before it
+// answered, the restore is then run right here
+static void restore_finish(const char *source, const char *target,
+                           struct RestoreReply *reply) {
+  struct RestoreReply local;
+  if (!reply) {
+    restore_copied = 0;
+    restore_skipped = 0;
+    local.ok = restore_tree(target, source) == 0;
+    local.copied = restore_copied;
+    local.skipped = restore_skipped;
+    reply = &local;
+  }
+  if (!reply->ok) {
+    fprintf(stderr, "restore failed\n");
+    log_error("Restore failed for %s from %s", source, target);
+  } else {
+    printf("restored %s from %s (%zu files copied, %zu unchanged)\n", source,
+           target, reply->copied, reply->skipped);
+    log_info("Restore succeeded for %s from %s", source, target);
+  }
+}
+
+// Hands the restore to the worker of the backup; the worker goes on
+// mirroring afterwards and its answer is picked up by next_command. -1 if the
+// worker is gone, the restore is then up to the caller.
+static int request_restore(struct Backup *b) {
+  log_info("Handing the restore of %s to worker %d", b->source, b->pid);
+  if (b->pid <= 0 || write(b->req_fd, "r", 1) != 1) {
+    return -1;
+  }
+  b->restoring = 1;
+  return 0;
+}
+
+// reads the answer of the worker b handed a restore to, once its reply pipe
+// is readable or the worker exited
+static void restore_answer(struct Backup *b) {
+  struct RestoreReply reply;
+  ssize_t n;
+  do {
+    n = read(b->rep_fd, &reply, sizeof(reply));
+  } while (n < 0 && errno == EINTR);
+  b->restoring = 0;
+  // the reply is smaller than PIPE_BUF, so it is never split
+  restore_finish(b->source, b->target,
+                 n == (ssize_t)sizeof(reply) ? &reply : NULL);
+}
+
+// what the operator typed and next_command did not hand out yet
+static char *input = NULL;
+static size_t input_len = 0;
+static size_t input_cap = 0;
+static size_t input_used = 0; // the line handed out last
+static int input_eof = 0;
+
+// Returns the next command line. While it waits for one, the answers of the
+// restores handed to workers are printed as they come, so a restore never
+// blocks the prompt. NULL on SIGINT/SIGTERM, or once stdin ended and every
+// restore was answered.
+static char *next_command(void) {
+  if (input_used > 0) {
+    memmove(input, input + input_used, input_len - input_used);
+    input_len -= input_used;
+    input_used = 0;
+  }
+
+  while (!stop_flag) {
+    char *nl = input_len ? memchr(input, '\n', input_len) : NULL;
+    if (nl) {
+      *nl = '\0';
+      input_used = (size_t)(nl - input) + 1;
+      return input;
+    }
+
+    struct pollfd pfd[2 * MAX_BACKUPS + 1];
+    // -1 for stdin, i for the restore reply of backups[i] and MAX_BACKUPS + i
+    // for the pidfd of its worker
+    int owner[2 * MAX_BACKUPS + 1];
+    nfds_t count = 0;
+    if (!input_eof) {
+      pfd[count] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+      owner[count++] = -1;
+    }
+    for (int i = 0; i < backup_count; i++) {
+      if (backups[i].restoring) {
+        pfd[count] = (struct pollfd){backups[i].rep_fd, POLLIN, 0};
+        owner[count++] = i;
+      }
+    }
+    if (count == 0) {
+      // a last command without a newline still counts
+      if (input_len > 0 && input_len < input_cap) {
+        input[input_len] = '\0';
+        input_used = input_len;
+        return input;
+      }
+      return NULL;
+    }
+    // workers are looked after for as long as the daemon takes commands
+    int timeout = -1;
+    if (!input_eof) {
+      timeout = tend_workers();
+      for (int i = 0; i < backup_count; i++) {
+        if (backups[i].pidfd >= 0) {
+          pfd[count] = (struct pollfd){backups[i].pidfd, POLLIN, 0};
+          owner[count++] = MAX_BACKUPS + i;
+        }
+      }
+    }
+
+    if (poll(pfd, count, timeout) < 0) {
+      if (errno != EINTR) {
+        log_error("poll failed: %s", strerror(errno));
+        return NULL;
+      }
+      continue;
+    }
+    for (nfds_t i = 0; i < count; i++) {
+      if (!pfd[i].revents) {
+        continue;
+      }
+      if (owner[i] >= MAX_BACKUPS) {
+        continue;
+      }
+      if (owner[i] >= 0) {
+        restore_answer(&backups[owner[i]]);
+        printf("> ");
+        fflush(stdout);
+        continue;
+      }
+      if (input_cap - input_len < 4096 + 1) {
+        size_t cap = input_cap ? input_cap * 2 : 8192;
+        char *tmp = realloc(input, cap);
+        if (!tmp) {
+          log_error("Failed to grow the input buffer");
+          return NULL;
+        }
+        input = tmp;
+        input_cap = cap;
+      }
+      ssize_t n = read(STDIN_FILENO, input + input_len, 4096);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        input_eof = 1;
+        continue;
+      }
+      input_len += (size_t)n;
+    }
+    // the pidfds come last and in order: downwards, what forget_backup moves
+    // in was looked at already
+    for (nfds_t i = count; i-- > 0 && owner[i] >= MAX_BACKUPS;) {
+      if (pfd[i].revents) {
+        worker_pidfd_ready(owner[i] - MAX_BACKUPS);
+      }
+    }
+  }
+  return NULL;
+}
+
+int main(int main_argc, char **main_argv) {
+  int opt;
+  while ((opt = getopt(main_argc, main_argv, "f:")) != -1) {
+    if (opt != 'f') {
+      fprintf(stderr, "usage: %s [-f state_file]\n", main_argv[0]);
+      return 1;
+    }
+    state_path = optarg;
+  }
+
   struct sigaction sa;
   memset(&sa, 0, sizeof(sa));
   sa.sa_handler = on_term;
@@ -993,26 +3269,24 @@ int main(void) {
     ERR("sigaction");
     return 1;
   }
+  // a worker that died before it read its restore request is seen as EPIPE
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
 
+  log_start();
+  if (state_path) {
+    state_resume();
+  }
   usage();
   log_info("Command interface ready");
 
-  char *line = NULL;
-  size_t linecap = 0;
-
   while (!stop_flag) {
     printf("> ");
     fflush(stdout);
 
-    ssize_t nread = getline(&line, &linecap, stdin);
-    if (nread < 0) {
-      if (feof(stdin)) {
-        break;
-      }
-      continue;
-    }
-    if (nread > 0 && line[nread - 1] == '\n') {
-      line[nread - 1] = '\0';
+    char *line = next_command();
+    if (!line) {
+      break;
     }
 
     char *argv[MAX_ARGS] = {0};
@@ -1047,6 +3321,17 @@ int main(void) {
         continue;
       }
       log_info("Validated source for add: %s", source);
+      // it would never reach the target, whose trash has that name
+      char trash[PATH_MAX];
+      struct stat trash_st;
+      if (snprintf(trash, sizeof(trash), "%s/%s", source, TRASH_NAME) <
+              (int)sizeof(trash) &&
+          lstat(trash, &trash_st) == 0) {
+        fprintf(stderr, "source holds %s, a name reserved for the trash\n",
+                trash);
+        free_args(argv, argc);
+        continue;
+      }
       int ok = 1;
       char targets[MAX_ARGS][PATH_MAX];
       int tcount = 0;
@@ -1087,6 +3372,7 @@ int main(void) {
       for (int i = 0; i < tcount; i++) {
         add_backup(source, targets[i]);
       }
+      state_save();
     } else if (strcmp(argv[0], "end") == 0) {
       log_info("End command received with %d arguments", argc);
       if (argc < 3) {
@@ -1107,6 +3393,7 @@ int main(void) {
         }
         stop_backup(source, target);
       }
+      state_save();
     } else if (strcmp(argv[0], "restore") == 0) {
       log_info("Restore command received with %d arguments", argc);
       if (argc != 3) {
@@ -1124,17 +3411,30 @@ int main(void) {
         free_args(argv, argc);
         continue;
       }
+      // a running backup keeps running: its worker does the restore and
+      // answers later
       int idx = find_backup(source, target);
-      if (idx >= 0) {
-        stop_backup(source, target);
+      if (idx >= 0 && backups[idx].restoring) {
+        fprintf(stderr, "restore already running: %s -> %s\n", source, target);
+      } else if (idx < 0 || request_restore(&backups[idx]) < 0) {
+        restore_finish(source, target, NULL);
       }
-      if (restore_entry(target, source, target, source) < 0) {
-        fprintf(stderr, "restore failed\n");
-        log_error("Restore failed for %s from %s", source, target);
-      } else {
-        printf("restored %s from %s\n", source, target);
-        log_info("Restore succeeded for %s from %s", source, target);
+    } else if (strcmp(argv[0], "log") == 0) {
+      int level = -1;
+      if (argc == 2 && strcmp(argv[1], "debug") == 0)
+        level = LOG_LVL_DEBUG;
+      else if (argc == 2 && strcmp(argv[1], "info") == 0)
+        level = LOG_LVL_INFO;
+      else if (argc == 2 && strcmp(argv[1], "error") == 0)
+        level = LOG_LVL_ERROR;
+      if (level < 0) {
+        usage();
+        free_args(argv, argc);
+        continue;
       }
+      set_log_level(level);
+    } else if (strcmp(argv[0], "dump") == 0) {
+      dump_flight_recorders();
     } else {
       log_info("Unknown command: %s", argv[0]);
       fprintf(stderr, "Unknown command\n");
@@ -1143,8 +3443,9 @@ int main(void) {
     free_args(argv, argc);
   }
 
-  free(line);
+  free(input);
   stop_all();
   reap_children();
+  log_stop();
   return 0;
 }
\ No newline at end of file
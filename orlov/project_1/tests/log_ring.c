@@ -0,0 +1,222 @@
+// The log rings, built against main.c itself so they are the real ones; run
+// with the sanitizers of the default build. Checks that:
+//  - a ring wrapped several times, with records of every size the wrap can
+//    leave a remainder or a pad entry for, dumps the newest records in order
+//    and about a whole ring of them;
+//  - records a stalled writer thread had no room for are counted and
+//    reported, and the ones kept come out whole;
+//  - a drained record reads as printf would have printed it.
+#define main sop_backup_main
+#include "../main.c"
+#undef main
+
+#include <stddef.h>
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,        \
+              #cond);                                                          \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+// everything written to fd, which is a file, NUL terminated
+static char *read_back(int fd) {
+  off_t size = lseek(fd, 0, SEEK_END);
+  CHECK(size >= 0);
+  char *buf = malloc((size_t)size + 1);
+  CHECK(buf && pread(fd, buf, (size_t)size, 0) == size);
+  buf[size] = '\0';
+  return buf;
+}
+
+static char *dumped(void) {
+  FILE *f = tmpfile();
+  CHECK(f);
+  log_dump(fileno(f));
+  char *out = read_back(fileno(f));
+  fclose(f);
+  return out;
+}
+
+// what log_drain writes to stderr
+static char *drained(void) {
+  FILE *f = tmpfile();
+  CHECK(f);
+  fflush(stderr);
+  int saved = dup(STDERR_FILENO);
+  CHECK(saved >= 0 && dup2(fileno(f), STDERR_FILENO) >= 0);
+  log_drain();
+  CHECK(dup2(saved, STDERR_FILENO) >= 0);
+  close(saved);
+  char *out = read_back(fileno(f));
+  fclose(f);
+  return out;
+}
+
+// 32, 40 and 48 byte entries, so the end of the ring is left with remainders
+// of 8 and 16 (skipped) as well as 24 to 40 (pad entries)
+static size_t record_size(size_t i) { return 32 + 8 * (i / 7 % 3); }
+
+static void record(size_t i) {
+  switch (i / 7 % 3) {
+  case 0:
+    log_debug("record %zu", i);
+    break;
+  case 1:
+    log_debug("record %zu of %d", i, 5);
+    break;
+  default:
+    log_debug("record %zu at %lld%%, %s", i, (long long)i * 3, "");
+    break;
+  }
+}
+
+static void wrap_and_dump(void) {
+  size_t per_wrap = LOG_RING_SIZE / 32, written = 0;
+  for (size_t i = 0; i < 5 * per_wrap; i++) {
+    record(i);
+    written += record_size(i);
+    struct LogRing *r = log_ring;
+    CHECK(r->head - r->oldest <= LOG_RING_SIZE);
+    CHECK(r->head - r->tail <= LOG_RING_SIZE);
+    // level is ERROR: drained and left out
+    if (i % 1000 == 0) {
+      char *out = drained();
+      CHECK(out[0] == '\0');
+      free(out);
+      CHECK(r->tail == r->head);
+    }
+    if (i % 4096 != 4095 && i != 5 * per_wrap - 1)
+      continue;
+
+    char *out = dumped();
+    CHECK(strncmp(out, "---- flight recorder, pid ", 26) == 0);
+    char *line = strchr(out, '\n') + 1;
+    size_t first = 0, next = 0, bytes = 0;
+    while (strcmp(line, "---- end ----\n") != 0) {
+      size_t n;
+      int hh, mm, ss;
+      long us;
+      CHECK(sscanf(line, "%d:%d:%d.%ld [DEBUG] record %zu", &hh, &mm, &ss,
+                   &us, &n) == 5);
+      if (bytes == 0)
+        first = n;
+      else
+        CHECK(n == next);
+      next = n + 1;
+      bytes += record_size(n);
+      line = strchr(line, '\n');
+      CHECK(line);
+      line++;
+    }
+    // the newest record, and all the ones before it that still fit
+    CHECK(next == i + 1);
+    CHECK(bytes <= LOG_RING_SIZE);
+    if (written <= LOG_RING_SIZE - 48)
+      CHECK(first == 0 && bytes == written);
+    else
+      CHECK(bytes > LOG_RING_SIZE - 2 * 48);
+    free(out);
+  }
+  free(drained());
+}
+
+static void stalled_writer(void) {
+  // nothing drains while the ring fills up twice over
+  atomic_store(&log_level, LOG_LVL_DEBUG);
+  size_t total = 2 * LOG_RING_SIZE / 32;
+  for (size_t i = 0; i < total; i++)
+    log_debug("record %zu", i);
+  unsigned long long dropped = atomic_load(&log_ring->dropped);
+  CHECK(dropped > 0 && dropped <= total - LOG_RING_SIZE / 32 + 1);
+
+  char *out = drained();
+  char *line = out;
+  size_t kept = 0;
+  for (;;) {
+    size_t n;
+    if (sscanf(line, "[DEBUG] record %zu\n", &n) != 1)
+      break;
+    CHECK(n == kept);
+    kept++;
+    line = strchr(line, '\n') + 1;
+  }
+  // the oldest are kept and the rest counted, nothing else is lost
+  CHECK(kept + dropped == total);
+  char want[64];
+  snprintf(want, sizeof(want), "[ERROR] %llu log records dropped\n", dropped);
+  CHECK(strcmp(line, want) == 0);
+  free(out);
+  CHECK(atomic_load(&log_ring->dropped) == 0);
+}
+
+// log_debug and printf given the same format and arguments
+#define CHECK_FORMAT(...)                                                      \
+  do {                                                                         \
+    char want[LOG_RECORD_MAX + 16];                                            \
+    int n = snprintf(want, sizeof(want), "[DEBUG] " __VA_ARGS__);              \
+    want[n] = '\n';                                                            \
+    want[n + 1] = '\0';                                                        \
+    log_debug(__VA_ARGS__);                                                    \
+    char *got = drained();                                                     \
+    if (strcmp(got, want) != 0)                                                \
+      fprintf(stderr, "got:  %swant: %s", got, want);                          \
+    CHECK(strcmp(got, want) == 0);                                             \
+    free(got);                                                                 \
+  } while (0)
+
+static void formatting(void) {
+  atomic_store(&log_level, LOG_LVL_DEBUG);
+  CHECK_FORMAT("no arguments");
+  CHECK_FORMAT("100%% done");
+  CHECK_FORMAT("%d %i %u %x %X %o %c", -5, 6, 7u, 255u, 255u, 8u, 'q');
+  CHECK_FORMAT("%ld %lu %lld %llu", -1L, 2UL, -3LL, 4ULL);
+  CHECK_FORMAT("%zu %zd %jd %td", (size_t)9, (ssize_t)-9, (intmax_t)-10,
+               (ptrdiff_t)11);
+  CHECK_FORMAT("%hd %hhu", (short)-12, (unsigned char)13);
+  CHECK_FORMAT("[%5d] [%-5d] [%05d] [%+d] [%.3d]", 1, 2, 3, 4, 5);
+  CHECK_FORMAT("%f %.2f %e %g %10.3f", 1.5, 2.25, 3e10, 0.0001, -4.125);
+  CHECK_FORMAT("%p", (void *)0x1234);
+  CHECK_FORMAT("%s and %s, %.2s, [%8s] [%-8s]", "one", "", "three", "four",
+               "five");
+  CHECK_FORMAT("%s=%d %s=%zu %s=%.1f", "a", 1, "bb", (size_t)2, "ccc", 3.5);
+  CHECK_FORMAT("%.3s|%d|%-12.20s|", "a longer argument", 42, "short");
+  char name[] = "changed after the call";
+  log_debug("copied: %s", name);
+  strcpy(name, "too late");
+  char *got = drained();
+  CHECK(strcmp(got, "[DEBUG] copied: changed after the call\n") == 0);
+  free(got);
+
+  // a long %s argument is cut at LOG_STR_MAX
+  char long_arg[LOG_STR_MAX + 100];
+  memset(long_arg, 'x', sizeof(long_arg) - 1);
+  long_arg[sizeof(long_arg) - 1] = '\0';
+  log_debug("[%s]", long_arg);
+  got = drained();
+  CHECK(strlen(got) == strlen("[DEBUG] []\n") + LOG_STR_MAX);
+  CHECK(strncmp(got + 9 + LOG_STR_MAX, "]\n", 2) == 0);
+  free(got);
+
+  // below the level: kept for dumps only
+  atomic_store(&log_level, LOG_LVL_INFO);
+  log_debug("quiet");
+  log_info("loud %d", 1);
+  got = drained();
+  CHECK(strcmp(got, "[INFO] loud 1\n") == 0);
+  free(got);
+  got = dumped();
+  CHECK(strstr(got, "[DEBUG] quiet\n") != NULL);
+  CHECK(strstr(got, "[INFO] loud 1\n") != NULL);
+  free(got);
+}
+
+int main(void) {
+  wrap_and_dump();
+  stalled_writer();
+  formatting();
+  printf("log_ring: ok\n");
+  return 0;
+}